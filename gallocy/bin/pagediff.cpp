@@ -0,0 +1,120 @@
+#include <stdint.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include "gallocy/utils/pagecodec.h"
+#include "gallocy/utils/pagediff.h"
+
+// Benchmark the page compare kernels and page diff codec over synthetic pages.
+//
+// Each page is dirtied at a fixed density, i.e., fraction of its bytes that
+// differ from its twin, so the cost of finding dirty lines and extracting runs
+// can be compared between kernels as pages go from clean to fully rewritten.
+// The encoded size of each diff, and the cost of encoding and decoding it,
+// is reported with and without compression.
+
+#define PAGES 256
+#define ROUNDS 200
+
+
+static const utils::PageDiffIsa ALL_ISAS[] = {
+  utils::PAGE_DIFF_SCALAR,
+  utils::PAGE_DIFF_SSE2,
+  utils::PAGE_DIFF_AVX2,
+  utils::PAGE_DIFF_AVX512,
+};
+
+static const double DENSITIES[] = { 0.0, 0.001, 0.01, 0.05, 0.25, 1.0 };
+
+
+int main(int argc, char *argv[]) {
+  uint8_t *pages = reinterpret_cast<uint8_t *>(aligned_alloc(PAGE_SZ, PAGES * PAGE_SZ));
+  uint8_t *twins = reinterpret_cast<uint8_t *>(aligned_alloc(PAGE_SZ, PAGES * PAGE_SZ));
+  uint8_t *scratch = reinterpret_cast<uint8_t *>(aligned_alloc(PAGE_SZ, PAGE_SZ));
+  uint8_t *encoded = new uint8_t[PAGE_CODEC_MAX_SZ];
+  utils::PageDiffRun *runs = new utils::PageDiffRun[PAGE_SZ / 2];
+
+  std::cout << "default kernel: " << utils::page_diff_kernel().name << std::endl;
+  std::cout << std::setw(8) << "kernel"
+            << std::setw(10) << "density"
+            << std::setw(14) << "lines ns/pg"
+            << std::setw(14) << "runs ns/pg"
+            << std::setw(12) << "runs/pg" << std::endl;
+
+  for (double density : DENSITIES) {
+    for (uint64_t i = 0; i < PAGES * PAGE_SZ; i++)
+      twins[i] = std::rand();
+    memcpy(pages, twins, PAGES * PAGE_SZ);
+    for (uint64_t i = 0; i < PAGES * PAGE_SZ; i++) {
+      if (std::rand() < density * RAND_MAX)
+        pages[i] = twins[i] + 1;
+    }
+
+    for (auto isa : ALL_ISAS) {
+      const utils::PageDiffKernel *kernel = utils::page_diff_kernel(isa);
+      if (kernel == nullptr)
+        continue;
+      // Keep the compiler from discarding the dirty line masks.
+      volatile uint64_t sink = 0;
+
+      auto start = std::chrono::steady_clock::now();
+      for (int r = 0; r < ROUNDS; r++) {
+        for (int p = 0; p < PAGES; p++)
+          sink += kernel->dirty_lines(pages + p * PAGE_SZ, twins + p * PAGE_SZ);
+      }
+      auto lines_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+
+      uint64_t total_runs = 0;
+      start = std::chrono::steady_clock::now();
+      for (int r = 0; r < ROUNDS; r++) {
+        for (int p = 0; p < PAGES; p++)
+          total_runs += utils::page_diff_runs(*kernel, pages + p * PAGE_SZ, twins + p * PAGE_SZ, runs, PAGE_SZ / 2);
+      }
+      auto runs_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+
+      std::cout << std::setw(8) << kernel->name
+                << std::setw(10) << density
+                << std::setw(14) << lines_ns / (ROUNDS * PAGES)
+                << std::setw(14) << runs_ns / (ROUNDS * PAGES)
+                << std::setw(12) << total_runs / (ROUNDS * PAGES) << std::endl;
+    }
+
+    for (double compress_density : { PAGE_CODEC_COMPRESS_DENSITY, 2.0 }) {
+      uint64_t encoded_bytes = 0;
+      uint64_t encode_ns = 0;
+      uint64_t decode_ns = 0;
+      for (int p = 0; p < PAGES; p++) {
+        auto start = std::chrono::steady_clock::now();
+        size_t len = utils::page_encode(pages + p * PAGE_SZ, twins + p * PAGE_SZ,
+                                        encoded, PAGE_CODEC_MAX_SZ, compress_density);
+        auto middle = std::chrono::steady_clock::now();
+        memcpy(scratch, twins + p * PAGE_SZ, PAGE_SZ);
+        auto decode_start = std::chrono::steady_clock::now();
+        if (!utils::page_decode(encoded, len, scratch))
+          std::cout << "failed to decode page " << p << std::endl;
+        auto end = std::chrono::steady_clock::now();
+        encoded_bytes += len;
+        encode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count();
+        decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - decode_start).count();
+      }
+      std::cout << std::setw(8) << (compress_density <= 1.0 ? "codec+lz" : "codec")
+                << std::setw(10) << density
+                << "  " << encoded_bytes / PAGES << " B/pg"
+                << ", encode " << encode_ns / PAGES << " ns/pg"
+                << ", decode " << decode_ns / PAGES << " ns/pg" << std::endl;
+    }
+  }
+
+  delete[] runs;
+  delete[] encoded;
+  free(scratch);
+  free(pages);
+  free(twins);
+  return 0;
+}
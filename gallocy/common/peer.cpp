@@ -13,6 +13,11 @@ const gallocy::string gallocy::common::Peer::get_string() const {
 }
 
 
+const gallocy::string gallocy::common::Peer::get_address() const {
+  return unparse_internet_address(internet_address_integer);
+}
+
+
 const uint64_t gallocy::common::Peer::get_canonical_id() const {
   // TODO(sholsapp): When we wish to run two peers on the same machine, we'll
   // need to adjust this so that we include the port as well.
@@ -1,4 +1,3 @@
-#include <map>
 #include <vector>
 
 #include "gallocy/consensus/client.h"
@@ -28,26 +27,27 @@ std::function<bool(const gallocy::http::Response &)> request_vote_callback = [](
 
 bool gallocy::consensus::GallocyClient::send_request_vote() {
   uint64_t candidate_term = gallocy_state->get_current_term();
-  uint64_t candidate_last_applied = gallocy_state->get_last_applied();
-  uint64_t candidate_commit_index = gallocy_state->get_commit_index();
+  uint64_t candidate_last_log_index = 0;
+  uint64_t candidate_last_log_term = 0;
+  gallocy_state->get_last_log(&candidate_last_log_index, &candidate_last_log_term);
 
   gallocy::json j = {
     { "term", candidate_term },
-    { "last_applied", candidate_last_applied },
-    { "commit_index", candidate_commit_index },
+    { "last_log_index", candidate_last_log_index },
+    { "last_log_term", candidate_last_log_term },
   };
 
   // TODO(sholsapp): How we handle this is busted and needs to be refactored so
   // that the cv is usable here. This is also blocking, which is probably bad?
   gallocy::vector<gallocy::http::Request> requests;
-  gallocy::map<gallocy::string, gallocy::string> headers;
-  headers["Content-Type"] = "application/json";
+  gallocy::http::Headers headers;
+  headers.set("Content-Type", "application/json");
   for (auto &peer : config.peer_list) {
     requests.push_back(gallocy::http::Request("POST", peer, "/raft/request_vote", j.dump(), headers));
   }
   // TODO(sholsapp): How we handle this is busted and needs to be refactored so
   // that the cv is usable here. This is also blocking, which is probably bad?
-  uint64_t votes = gallocy::http::CurlClient().multirequest(requests, request_vote_callback, nullptr, nullptr);
+  uint64_t votes = gallocy::http::ShmClient().multirequest(requests, request_vote_callback, nullptr, nullptr);
 
   LOG_INFO("Received votes from " << votes << "/" << config.peer_list.size() << " peers");
   return votes >= config.peer_list.size() / 2;
@@ -64,6 +64,21 @@ std::function<bool(const gallocy::http::Response &)> append_entries_callback = [
     if (supporter_term > local_term) {
       gallocy_state->set_state(gallocy::consensus::RaftState::FOLLOWER);
       gallocy_state->set_current_term(supporter_term);
+      return false;
+    }
+    if (gallocy_state->get_state() != gallocy::consensus::RaftState::LEADER)
+      return success;
+    // TRACK how much of the log the peer holds, or back up to find where
+    // its log and this one agree.
+    if (success) {
+      uint64_t match_index = response_json["match_index"];
+      if (match_index > gallocy_state->get_match_index(rsp.peer))
+        gallocy_state->set_match_index(rsp.peer, match_index);
+      gallocy_state->set_next_index(rsp.peer, match_index + 1);
+    } else {
+      uint64_t next_index = gallocy_state->get_next_index(rsp.peer);
+      if (next_index > 1)
+        gallocy_state->set_next_index(rsp.peer, next_index - 1);
     }
     return success;
   }
@@ -72,44 +87,46 @@ std::function<bool(const gallocy::http::Response &)> append_entries_callback = [
 
 
 bool gallocy::consensus::GallocyClient::send_append_entries() {
-  gallocy::vector<LogEntry> empty;
-  return send_append_entries(empty);
-}
-
-
-bool gallocy::consensus::GallocyClient::send_append_entries(const gallocy::vector<LogEntry> &entries) {
   uint64_t leader_term = gallocy_state->get_current_term();
-  // uint64_t leader_last_applied = gallocy_state->get_last_applied();
   uint64_t leader_commit_index = gallocy_state->get_commit_index();
-  uint64_t leader_prev_log_index = gallocy_state->get_log()->get_previous_log_index();
-  uint64_t leader_prev_log_term = gallocy_state->get_log()->get_previous_log_term();
-
-  gallocy::json j = {
-    { "entries", gallocy::json::array() },
-    { "leader_commit", leader_commit_index },
-    { "previous_log_index", leader_prev_log_index },
-    { "previous_log_term", leader_prev_log_term },
-    { "term", leader_term },
-  };
-
-  for (auto &entry : entries) {
-    j["entries"].push_back(entry.to_json());
-  }
-
-  // TODO(sholsapp): Append the log entry here.
 
+  // SEND each peer the entries from the next one it needs, which is all of
+  // them for a peer that has not answered this leader yet.
   gallocy::vector<gallocy::http::Request> requests;
-  gallocy::map<gallocy::string, gallocy::string> headers;
-  headers["Content-Type"] = "application/json";
-  for (auto &peer : config.peer_list)
+  gallocy::http::Headers headers;
+  headers.set("Content-Type", "application/json");
+  for (auto &peer : config.peer_list) {
+    uint64_t next_index = gallocy_state->get_next_index(peer);
+    uint64_t leader_prev_log_index = next_index > 0 ? next_index - 1 : 0;
+    uint64_t leader_prev_log_term = 0;
+    gallocy::vector<LogEntry> entries = gallocy_state->get_entries(&leader_prev_log_index, &leader_prev_log_term);
+    gallocy::json j = {
+      { "entries", gallocy::json::array() },
+      { "leader", config.address.c_str() },
+      { "leader_commit", leader_commit_index },
+      { "leader_port", config.port },
+      { "previous_log_index", leader_prev_log_index },
+      { "previous_log_term", leader_prev_log_term },
+      { "term", leader_term },
+    };
+    for (auto &entry : entries)
+      j["entries"].push_back(entry.to_json());
     requests.push_back(gallocy::http::Request("POST", peer, "/raft/append_entries", j.dump(), headers));
+  }
   // TODO(sholsapp): How we handle this is busted and needs to be refactored so
   // that the cv is usable here. This is also blocking, which is probably bad?
-  uint64_t votes = gallocy::http::CurlClient().multirequest(requests, append_entries_callback, nullptr, nullptr);
+  uint64_t votes = gallocy::http::ShmClient().multirequest(requests, append_entries_callback, nullptr, nullptr);
   LOG_DEBUG("Received " << votes << " for append entries");
 
-  // TODO(sholsapp): Commit and apply the log entry here.
+  // COMMIT what a majority now holds, which applies it on this node, and on
+  // the followers once the next request carries the new commit index.
+  gallocy_state->advance_commit_index();
+  return votes >= config.peer_list.size() / 2;
+}
 
-  // TODO(sholsapp): Return the response to the client.
-  return true;
+
+bool gallocy::consensus::GallocyClient::send_append_entries(const gallocy::vector<LogEntry> &entries) {
+  for (auto &entry : entries)
+    gallocy_state->append_command(entry.command);
+  return send_append_entries();
 }
@@ -1,3 +1,8 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <cerrno>
+#include <chrono>
 #include <ctime>
 #include <functional>
 #include <map>
@@ -14,8 +19,26 @@
 #include "gallocy/models.h"
 #include "gallocy/threads.h"
 #include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
 #include "gallocy/utils/stringutils.h"
 
+// What the completions of a shard's io_uring are for, in the low bits of
+// their user data, which is otherwise a pointer to the shard or connection.
+#define URING_TAG_MASK 3
+#define URING_RECV 0
+#define URING_ACCEPT 1
+#define URING_WAKEUP 2
+#define URING_CANCEL 3
+
+
+/**
+ * The time on a monotonic clock, in milliseconds.
+ */
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 
 /**
  * Die.
@@ -28,14 +51,52 @@ void gallocy::consensus::error_die(const char *sc) {
 }
 
 
+gallocy::http::Response *gallocy::consensus::GallocyServer::route(gallocy::http::Request *request) {
+  RouteArguments args;
+  gallocy::http::Response *response = nullptr;
+  const HandlerFunction *handler = routes.match(request->uri, &args);
+  if (handler) {
+    response = (this->**handler)(&args, request);
+  } else {
+    response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+    response->status_code = 404;
+    response->headers.set("Server", "Gallocy-Httpd");
+  }
+  gallocy::http::View request_id = request->headers.find("X-Request-Id");
+  if (request_id.data != nullptr) {
+    gallocy::http::View name = { "X-Request-Id", 12 };
+    response->headers.set(name, request_id);
+  }
+  return response;
+}
+
+
 gallocy::http::Response *gallocy::consensus::GallocyServer::route_admin(RouteArguments *args, gallocy::http::Request *request) {
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
   response->status_code = 200;
-  response->headers["Server"] = "Gallocy-Httpd";
-  response->headers["Content-Type"] = "application/json";
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
   response->body = "GOOD";
-  args->~RouteArguments();
-  internal_free(args);
+  return response;
+}
+
+
+gallocy::http::Response *gallocy::consensus::GallocyServer::route_admin_metrics(RouteArguments *args, gallocy::http::Request *request) {
+  gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+  response->status_code = 200;
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
+  response->body = utils::collect_metrics().dump();
+  return response;
+}
+
+
+gallocy::http::Response *gallocy::consensus::GallocyServer::route_admin_profile(RouteArguments *args, gallocy::http::Request *request) {
+  gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+  response->status_code = 200;
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
+  response->body = gallocy_profiler ? gallocy_profiler->report().dump() : gallocy::json::object().dump();
   return response;
 }
 
@@ -43,34 +104,41 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_admin(RouteArg
 gallocy::http::Response *gallocy::consensus::GallocyServer::route_request_vote(RouteArguments *args, gallocy::http::Request *request) {
   gallocy::common::Peer peer = request->peer;
   gallocy::json request_json = request->get_json();
-  uint64_t candidate_commit_index = request_json["commit_index"];
   uint64_t candidate_current_term = request_json["term"];
-  uint64_t candidate_last_applied = request_json["last_applied"];
+  uint64_t candidate_last_log_index = request_json["last_log_index"];
+  uint64_t candidate_last_log_term = request_json["last_log_term"];
   gallocy::common::Peer candidate_voted_for = peer;
-  uint64_t local_commit_index = gallocy_state->get_commit_index();
   uint64_t local_current_term = gallocy_state->get_current_term();
-  uint64_t local_last_applied = gallocy_state->get_last_applied();
-  gallocy::common::Peer local_voted_for = gallocy_state->get_voted_for();
   bool granted = false;
 
+  // FOLLOW a candidate's later term whether or not it gets this vote, which
+  // also frees this node's vote for the new term.
+  if (candidate_current_term > local_current_term) {
+    gallocy_state->set_state(gallocy::consensus::RaftState::FOLLOWER);
+    gallocy_state->set_current_term(candidate_current_term);
+    local_current_term = candidate_current_term;
+  }
+  gallocy::common::Peer local_voted_for = gallocy_state->get_voted_for();
+
   if (candidate_current_term < local_current_term) {
     granted = false;
   } else if (local_voted_for == gallocy::common::Peer()
       || local_voted_for == candidate_voted_for) {
-    if (candidate_last_applied >= local_last_applied
-        && candidate_commit_index >= local_commit_index) {
+    // REFUSE a candidate whose log is behind this one, so that a leader
+    // always holds every committed entry.
+    if (gallocy_state->is_log_up_to_date(candidate_last_log_index, candidate_last_log_term)) {
       LOG_INFO("Granting vote to "
           << candidate_voted_for.get_string()
           << " in term " << candidate_current_term);
 
-      gallocy_state->set_current_term(candidate_current_term);
       gallocy_state->set_voted_for(candidate_voted_for);
       gallocy_state->get_timer()->reset();
       granted = true;
     } else {
-      // TODO(sholsapp): Implement logic to reject candidates that don't have
-      // an up to date log.
-      LOG_ERROR("Handling of out-of-date log is unimplemented");
+      LOG_INFO("Refusing vote to "
+          << candidate_voted_for.get_string()
+          << " in term " << candidate_current_term
+          << " since its log is out of date");
     }
   }
   gallocy::json response_json = {
@@ -81,12 +149,10 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_request_vote(R
     { "vote_granted", granted },
   };
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
-  response->headers["Server"] = "Gallocy-Httpd";
-  response->headers["Content-Type"] = "application/json";
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
   response->status_code = 200;
   response->body = response_json.dump();
-  args->~RouteArguments();
-  internal_free(args);
   return response;
 }
 
@@ -99,7 +165,15 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_append_entries
   uint64_t leader_prev_log_index = request_json["previous_log_index"];
   uint64_t leader_prev_log_term = request_json["previous_log_term"];
   uint64_t leader_term = request_json["term"];
+  // KNOW where to forward proposals, if the leader said where it listens.
+  gallocy::common::Peer leader;
+  const gallocy::json::string_t *leader_address = request_json["leader"].get_ptr<const gallocy::json::string_t *>();
+  if (leader_address) {
+    uint64_t leader_port = request_json["leader_port"];
+    leader = gallocy::common::Peer(leader_address->c_str(), leader_port);
+  }
   uint64_t local_term = gallocy_state->get_current_term();
+  uint64_t match_index = 0;
   bool success = false;
 
   // Decode log entries from JSON payload
@@ -120,31 +194,54 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_append_entries
         << ")");
     success = false;
   } else {
-    if (leader_entries.size() > 0) {
-      LOG_INFO("Need to append " << leader_entries.size() << " new entries!");
-      // TODO(sholsapp): Use state object to append entries to the log, and
-      // report meaningful results on failure.
-    }
-    success = true;
     gallocy_state->set_current_term(leader_term);
     gallocy_state->set_state(gallocy::consensus::RaftState::FOLLOWER);
     gallocy_state->set_voted_for(peer);
+    gallocy_state->set_leader(leader);
     gallocy_state->get_timer()->reset();
+    success = gallocy_state->append_entries(leader_prev_log_index, leader_prev_log_term,
+                                            leader_entries, leader_commit_index, &match_index);
+    if (!success)
+      LOG_DEBUG("Rejecting entries after "
+          << leader_prev_log_index
+          << " from leader "
+          << leader.get_string()
+          << " because the logs disagree there");
   }
   gallocy::json response_json = {
     // TODO(sholsapp): This information should from from the socket, not the
     // payload, as it can be faked.
+    { "match_index", match_index },
     { "peer", gallocy_config->address.c_str() },
     { "term", gallocy_state->get_current_term() },
     { "success", success },
   };
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
-  response->headers["Server"] = "Gallocy-Httpd";
-  response->headers["Content-Type"] = "application/json";
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
+  response->status_code = 200;
+  response->body = response_json.dump();
+  return response;
+}
+
+
+gallocy::http::Response *gallocy::consensus::GallocyServer::route_propose(RouteArguments *args, gallocy::http::Request *request) {
+  gallocy::json request_json = request->get_json();
+  const gallocy::json::string_t *command = request_json["command"].get_ptr<const gallocy::json::string_t *>();
+  bool accepted = false;
+  if (command && gallocy_state->get_state() == gallocy::consensus::RaftState::LEADER) {
+    gallocy_state->append_command(gallocy::consensus::Command(gallocy::string(command->data(), command->size())));
+    accepted = true;
+  }
+  gallocy::json response_json = {
+    { "accepted", accepted },
+    { "term", gallocy_state->get_current_term() },
+  };
+  gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
   response->status_code = 200;
   response->body = response_json.dump();
-  args->~RouteArguments();
-  internal_free(args);
   return response;
 }
 
@@ -160,12 +257,10 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_request(RouteA
   gallocy_client->send_append_entries(entries);
 
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
-  response->headers["Server"] = "Gallocy-Httpd";
-  response->headers["Content-Type"] = "application/json";
+  response->headers.set("Server", "Gallocy-Httpd");
+  response->headers.set("Content-Type", "application/json");
   response->status_code = 200;
   response->body = "GOOD";
-  args->~RouteArguments();
-  internal_free(args);
   return response;
 }
 
@@ -179,13 +274,11 @@ gallocy::http::Response *gallocy::consensus::GallocyServer::route_request(RouteA
 //
 
 
-void *gallocy::consensus::GallocyServer::work() {
-  LOG_DEBUG("Starting HTTP server on " << address << ":" << port);
-
+int gallocy::consensus::GallocyServer::bind_socket() {
   struct sockaddr_in name;
   int optval = 1;
 
-  server_socket = socket(PF_INET, SOCK_STREAM, 0);
+  int server_socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (server_socket == -1) {
     gallocy::consensus::error_die("socket");
   }
@@ -194,6 +287,10 @@ void *gallocy::consensus::GallocyServer::work() {
   setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
 #else
   setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  // SHARE the port among the shards, which the kernel balances connections
+  // across.
+  if (shard_count > 1)
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
 #endif
 
   memset(&name, 0, sizeof(name));
@@ -206,63 +303,541 @@ void *gallocy::consensus::GallocyServer::work() {
     gallocy::consensus::error_die("bind");
   }
 
-  if (listen(server_socket, 5) < 0) {
+  if (listen(server_socket, SOMAXCONN) < 0) {
     gallocy::consensus::error_die("listen");
   }
 
-  int64_t client_sock = -1;
-  struct sockaddr_in client_name;
-  uint64_t client_name_len = sizeof(client_name);
-  pthread_t newthread;
+  return server_socket;
+}
 
-  while (alive) {
-    client_sock = accept(server_socket,
-        reinterpret_cast<struct sockaddr *>(&client_name),
-        reinterpret_cast<socklen_t *>(&client_name_len));
 
-    if (client_sock == -1) {
-      gallocy::consensus::error_die("accept");
+void *gallocy::consensus::GallocyServer::work() {
+  LOG_DEBUG("Starting HTTP server on " << address << ":" << port << " with " << shard_count << " shards");
+
+  // BIND every shard's socket before serving any of them.
+  shards = reinterpret_cast<struct ServerShard *>(internal_malloc(sizeof(struct ServerShard) * shard_count));
+  for (uint64_t i = 0; i < shard_count; i++) {
+    struct ServerShard *shard = new (&shards[i]) struct ServerShard;
+    shard->server = this;
+    shard->index = i;
+    shard->server_socket = bind_socket();
+    shard->resumed = nullptr;
+    shard->last_sweep = now_ms();
+    shard->accepted = 0;
+    shard->requests = 0;
+    shard->idle_closed = 0;
+    shard->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (shard->wakeup_fd == -1) {
+      gallocy::consensus::error_die("eventfd");
     }
 
-    struct RequestContext *ctx =
-      new (internal_malloc(sizeof(struct RequestContext))) struct RequestContext;
-    ctx->server = this;
-    ctx->client_socket = client_sock;
-    ctx->client_name = client_name;
+    // RUN on io_uring if the kernel has it, and fall back to epoll.
+    shard->uring = nullptr;
+    shard->epoll_fd = -1;
+    if (use_uring && gallocy::http::Uring::supported()) {
+      shard->uring = new (internal_malloc(sizeof(gallocy::http::Uring))) gallocy::http::Uring();
+      if (shard->uring->is_open())
+        continue;
+      shard->uring->~Uring();
+      internal_free(shard->uring);
+      shard->uring = nullptr;
+    }
+    shard->epoll_fd = epoll_create1(0);
+    if (shard->epoll_fd == -1) {
+      gallocy::consensus::error_die("epoll_create1");
+    }
+    // WATCH the listening socket and the wakeup, the only two without a
+    // connection.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->server_socket, &event) == -1) {
+      gallocy::consensus::error_die("epoll_ctl");
+    }
+    event.data.ptr = shard;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wakeup_fd, &event) == -1) {
+      gallocy::consensus::error_die("epoll_ctl");
+    }
+  }
+  metrics_name = "server " + gallocy::string(std::to_string(static_cast<uint16_t>(port)).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
 
-    if (get_pthread_create_impl()(&newthread, NULL, handle_entry, reinterpret_cast<void *>(ctx)) != 0) {
+  for (int i = 0; i < SERVER_WORKERS; i++) {
+    if (get_pthread_create_impl()(&workers[i], NULL, worker_entry, reinterpret_cast<void *>(this)) != 0) {
       perror("pthread_create1");
     }
+  }
+
+  // SERVE peers on this host over shared memory.
+  shm_listener = new (internal_malloc(sizeof(gallocy::http::ShmListener))) gallocy::http::ShmListener(
+    address, port, [this](const gallocy::string &raw) { return handle_raw(raw, "shm"); });
+  shm_listener->start();
+
+  // SERVE requests that arrive as datagrams, on the same port.
+  udp_listener = new (internal_malloc(sizeof(gallocy::http::UDPListener))) gallocy::http::UDPListener(
+    address, port, [this](const gallocy::string &raw) { return handle_raw(raw, "udp"); });
+  udp_listener->start();
+
+  // RUN the first shard's event loop on this thread, and every other's on
+  // a thread of its own.
+  for (uint64_t i = 1; i < shard_count; i++) {
+    if (get_pthread_create_impl()(&shards[i].thread, NULL, shard_entry, reinterpret_cast<void *>(&shards[i])) != 0) {
+      perror("pthread_create2");
+    }
+  }
+  run_shard(&shards[0]);
+  for (uint64_t i = 1; i < shard_count; i++) {
+    if (get_pthread_join_impl()(shards[i].thread, nullptr)) {
+      perror("pthread_join2");
+    }
+  }
 
-    // TODO(sholsapp): This shouldn't block, and we shouldn't just try to
-    // join this thread.
-    if (get_pthread_join_impl()(newthread, nullptr)) {
+  // STOP the workers once they have served every queued request.
+  ready_cv.notify_all();
+  for (int i = 0; i < SERVER_WORKERS; i++) {
+    if (get_pthread_join_impl()(workers[i], nullptr)) {
       perror("pthread_join1");
     }
   }
 
-  close(server_socket);
+  utils::unregister_metrics(metrics_name);
+  for (uint64_t i = 0; i < shard_count; i++) {
+    struct ServerShard *shard = &shards[i];
+    // STOP the ring first, as its receives may still point at connections.
+    if (shard->uring != nullptr) {
+      shard->uring->~Uring();
+      internal_free(shard->uring);
+    }
+    for (auto &it : shard->connections)
+      close_connection(it.second);
+    while (shard->resumed != nullptr) {
+      struct Connection *connection = shard->resumed;
+      shard->resumed = connection->next;
+      close_connection(connection);
+    }
+    close(shard->wakeup_fd);
+    if (shard->epoll_fd != -1)
+      close(shard->epoll_fd);
+    close(shard->server_socket);
+    shard->~ServerShard();
+  }
+  internal_free(shards);
+  shards = nullptr;
+
+  shm_listener->stop();
+  shm_listener->~ShmListener();
+  internal_free(shm_listener);
+  shm_listener = nullptr;
+
+  udp_listener->stop();
+  udp_listener->~UDPListener();
+  internal_free(udp_listener);
+  udp_listener = nullptr;
+
+  return nullptr;
+}
+
+
+/**
+ * Make a connection for a socket a shard accepted.
+ */
+static struct gallocy::consensus::Connection *make_connection(struct gallocy::consensus::ServerShard *shard,
+    int client_sock, const struct sockaddr_in &client_name) {
+  struct gallocy::consensus::Connection *connection =
+    new (internal_malloc(sizeof(struct gallocy::consensus::Connection))) struct gallocy::consensus::Connection;
+  connection->client_socket = client_sock;
+  connection->client_name = client_name;
+  connection->shard = shard;
+  connection->last_active = now_ms();
+  connection->continued = false;
+  connection->recv_end = CONNECTION_READING;
+  return connection;
+}
+
+
+void *gallocy::consensus::GallocyServer::shard_entry(void *arg) {
+  struct ServerShard *shard = reinterpret_cast<struct ServerShard *>(arg);
+  SyncHookGuard guard;
+  return shard->server->run_shard(shard);
+}
+
+
+void *gallocy::consensus::GallocyServer::run_shard(struct ServerShard *shard) {
+  if (shard->uring != nullptr)
+    return run_shard_uring(shard);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  struct epoll_event event;
+
+  while (alive) {
+    int n = epoll_wait(shard->epoll_fd, events, SERVER_MAX_EVENTS, SERVER_POLL_MS);
+    if (n == -1 && errno != EINTR) {
+      gallocy::consensus::error_die("epoll_wait");
+    }
+
+    for (int i = 0; i < n; i++) {
+      struct Connection *connection = reinterpret_cast<struct Connection *>(events[i].data.ptr);
+
+      // WATCH the kept alive connections the workers handed back. Adding a
+      // socket signals if it has something to read already.
+      if (events[i].data.ptr == shard) {
+        uint64_t count;
+        if (::read(shard->wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+          perror("read");
+        struct Connection *resumed = nullptr;
+        {
+          std::lock_guard<std::mutex> lock(shard->resumed_lock);
+          resumed = shard->resumed;
+          shard->resumed = nullptr;
+        }
+        while (resumed != nullptr) {
+          connection = resumed;
+          resumed = connection->next;
+          connection->last_active = now_ms();
+          event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+          event.data.ptr = connection;
+          if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, connection->client_socket, &event) == -1) {
+            perror("epoll_ctl");
+            close_connection(connection);
+            continue;
+          }
+          shard->connections[connection->client_socket] = connection;
+        }
+        continue;
+      }
+
+      // ACCEPT every pending connection, as the listening socket only
+      // signals once for all of them.
+      if (connection == nullptr) {
+        while (true) {
+          struct sockaddr_in client_name;
+          socklen_t client_name_len = sizeof(client_name);
+          int client_sock = accept4(shard->server_socket,
+              reinterpret_cast<struct sockaddr *>(&client_name), &client_name_len, SOCK_NONBLOCK);
+          if (client_sock == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+              perror("accept4");
+            if (errno != ECONNABORTED && errno != EINTR)
+              break;
+            continue;
+          }
+          connection = make_connection(shard, client_sock, client_name);
+          event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+          event.data.ptr = connection;
+          if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_sock, &event) == -1) {
+            perror("epoll_ctl");
+            close_connection(connection);
+            continue;
+          }
+          shard->connections[client_sock] = connection;
+          shard->accepted++;
+        }
+        continue;
+      }
+
+      // READ the connection dry, then hand it to a worker once it has sent a
+      // whole request, even if the client closed its end after sending it.
+      // The worker owns it from then on.
+      bool open = read_request(connection);
+      bool complete = request_complete(connection);
+      connection->last_active = now_ms();
+      if (open && !complete)
+        continue;
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, connection->client_socket, nullptr);
+      shard->connections.erase(connection->client_socket);
+      if (!complete) {
+        close_connection(connection);
+        continue;
+      }
+      queue_ready(connection);
+    }
+
+    // CLOSE the connections that sat idle for too long.
+    uint64_t now = now_ms();
+    if (now - shard->last_sweep >= SERVER_SWEEP_MS) {
+      shard->last_sweep = now;
+      for (auto it = shard->connections.begin(); it != shard->connections.end();) {
+        struct Connection *connection = it->second;
+        if (now - connection->last_active < idle_ms) {
+          ++it;
+          continue;
+        }
+        it = shard->connections.erase(it);
+        shard->idle_closed++;
+        close_connection(connection);
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+
+void *gallocy::consensus::GallocyServer::run_shard_uring(struct ServerShard *shard) {
+  gallocy::http::Uring *uring = shard->uring;
+  uint64_t shard_data = reinterpret_cast<uint64_t>(shard);
+  uring->accept_multishot(shard->server_socket, shard_data | URING_ACCEPT);
+  uring->read(shard->wakeup_fd, &shard->wakeup_count, sizeof(shard->wakeup_count), shard_data | URING_WAKEUP);
+
+  while (alive) {
+    int submitted = uring->submit_and_wait(SERVER_POLL_MS);
+    if (submitted < 0) {
+      errno = -submitted;
+      gallocy::consensus::error_die("io_uring_enter");
+    }
+
+    struct io_uring_cqe *cqe;
+    for (; (cqe = uring->peek()) != nullptr; uring->seen()) {
+      uint64_t user_data = cqe->user_data;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+
+      // ACCEPT a connection, and start receiving from it.
+      if ((user_data & URING_TAG_MASK) == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+          struct sockaddr_in client_name;
+          socklen_t client_name_len = sizeof(client_name);
+          memset(&client_name, 0, sizeof(client_name));
+          getpeername(cqe->res, reinterpret_cast<struct sockaddr *>(&client_name), &client_name_len);
+          struct Connection *connection = make_connection(shard, cqe->res, client_name);
+          shard->connections[connection->client_socket] = connection;
+          shard->accepted++;
+          uring->recv_multishot(connection->client_socket, reinterpret_cast<uint64_t>(connection));
+        } else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+          errno = -cqe->res;
+          perror("accept");
+        }
+        if (!more)
+          uring->accept_multishot(shard->server_socket, shard_data | URING_ACCEPT);
+        continue;
+      }
+
+      // RECEIVE from the kept alive connections the workers handed back.
+      if ((user_data & URING_TAG_MASK) == URING_WAKEUP) {
+        struct Connection *resumed = nullptr;
+        {
+          std::lock_guard<std::mutex> lock(shard->resumed_lock);
+          resumed = shard->resumed;
+          shard->resumed = nullptr;
+        }
+        while (resumed != nullptr) {
+          struct Connection *connection = resumed;
+          resumed = connection->next;
+          connection->last_active = now_ms();
+          connection->recv_end = CONNECTION_READING;
+          shard->connections[connection->client_socket] = connection;
+          uring->recv_multishot(connection->client_socket, reinterpret_cast<uint64_t>(connection));
+        }
+        uring->read(shard->wakeup_fd, &shard->wakeup_count, sizeof(shard->wakeup_count), shard_data | URING_WAKEUP);
+        continue;
+      }
+
+      if ((user_data & URING_TAG_MASK) == URING_CANCEL)
+        continue;
+
+      // READ what arrived, and stop receiving once the connection sent a
+      // whole request.
+      struct Connection *connection = reinterpret_cast<struct Connection *>(user_data);
+      if (cqe->res > 0) {
+        connection->reader.append(uring->buffer(cqe), cqe->res);
+        uring->recycle(cqe);
+        connection->last_active = now_ms();
+        if (connection->recv_end == CONNECTION_READING && request_complete(connection)) {
+          connection->recv_end = CONNECTION_HANDOFF;
+          uring->cancel(user_data, user_data | URING_CANCEL);
+        }
+      }
+      if (more)
+        continue;
+
+      // RECEIVE again if the receive ended only because the ring ran out of
+      // buffers, and otherwise let go of the connection. A connection holding
+      // a whole request is served however its receive ended, even if the
+      // client closed its end after sending the request.
+      if (connection->recv_end == CONNECTION_READING && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+        uring->recv_multishot(connection->client_socket, user_data);
+        continue;
+      }
+      shard->connections.erase(connection->client_socket);
+      if (connection->recv_end == CONNECTION_HANDOFF)
+        queue_ready(connection);
+      else
+        close_connection(connection);
+    }
+
+    // CLOSE the connections that sat idle for too long, once their receives
+    // end.
+    uint64_t now = now_ms();
+    if (now - shard->last_sweep >= SERVER_SWEEP_MS) {
+      shard->last_sweep = now;
+      for (auto &it : shard->connections) {
+        struct Connection *connection = it.second;
+        if (connection->recv_end != CONNECTION_READING || now - connection->last_active < idle_ms)
+          continue;
+        connection->recv_end = CONNECTION_CLOSING;
+        shard->idle_closed++;
+        uint64_t connection_data = reinterpret_cast<uint64_t>(connection);
+        uring->cancel(connection_data, connection_data | URING_CANCEL);
+      }
+    }
+  }
 
   return nullptr;
 }
 
 
-void *gallocy::consensus::GallocyServer::handle_entry(void *arg) {
-  struct RequestContext *ctx = reinterpret_cast<struct RequestContext *>(arg);
-  void *ret = ctx->server->handle(ctx->client_socket, ctx->client_name);
-  ctx->~RequestContext();
-  internal_free(ctx);
-  return ret;
+void gallocy::consensus::GallocyServer::queue_ready(struct Connection *connection) {
+  {
+    std::lock_guard<std::mutex> lock(ready_lock);
+    connection->next = nullptr;
+    if (ready_tail != nullptr)
+      ready_tail->next = connection;
+    else
+      ready_head = connection;
+    ready_tail = connection;
+  }
+  ready_cv.notify_one();
 }
 
 
-void *gallocy::consensus::GallocyServer::handle(int client_socket, struct sockaddr_in client_name) {
-  gallocy::http::Request *request = get_request(client_socket);
-  gallocy::http::Response *response = routes.match(request->uri)(request);
+void gallocy::consensus::GallocyServer::resume(struct Connection *connection) {
+  struct ServerShard *shard = connection->shard;
+  {
+    std::lock_guard<std::mutex> lock(shard->resumed_lock);
+    connection->next = shard->resumed;
+    shard->resumed = connection;
+  }
+  uint64_t one = 1;
+  if (::write(shard->wakeup_fd, &one, sizeof(one)) == -1)
+    perror("write");
+}
+
 
-  if (send(client_socket, response->str().c_str(), response->size(), 0) == -1) {
-    gallocy::consensus::error_die("send");
+void gallocy::consensus::GallocyServer::close_connection(struct Connection *connection) {
+  shutdown(connection->client_socket, SHUT_RDWR);
+  close(connection->client_socket);
+  connection->~Connection();
+  internal_free(connection);
+}
+
+
+gallocy::json gallocy::consensus::GallocyServer::get_metrics() {
+  gallocy::json metrics = gallocy::json::array();
+  for (uint64_t i = 0; i < shard_count; i++) {
+    gallocy::json shard = {
+      { "accepted", shards[i].accepted.load() },
+      { "requests", shards[i].requests.load() },
+      { "idle_closed", shards[i].idle_closed.load() },
+      { "backend", shards[i].uring != nullptr ? "io_uring" : "epoll" },
+    };
+    metrics.push_back(shard);
   }
+  gallocy::json server_metrics = { { "shards", metrics } };
+  return server_metrics;
+}
+
+
+void *gallocy::consensus::GallocyServer::worker_entry(void *arg) {
+  GallocyServer *server = reinterpret_cast<GallocyServer *>(arg);
+  SyncHookGuard guard;
+  return server->serve();
+}
+
+
+void *gallocy::consensus::GallocyServer::serve() {
+  while (true) {
+    struct Connection *connection = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(ready_lock);
+      ready_cv.wait(lock, [this] { return ready_head != nullptr || !alive; });
+      if (ready_head == nullptr)
+        return nullptr;
+      connection = ready_head;
+      ready_head = connection->next;
+      if (ready_head == nullptr)
+        ready_tail = nullptr;
+    }
+    handle(connection);
+  }
+}
+
+
+void *gallocy::consensus::GallocyServer::handle(struct Connection *connection) {
+  int client_socket = connection->client_socket;
+
+  // ANSWER every whole request the client pipelined, in order.
+  do {
+    // PARSE the request where it is in the connection's buffer, which it
+    // refers to until it is freed.
+    gallocy::http::Request *request =
+      new (internal_malloc(sizeof(gallocy::http::Request))) gallocy::http::Request(
+        connection->reader.data(), connection->reader.length());
+    uint64_t rejected = connection->reader.rejected();
+    connection->continued = false;
+    connection->shard->requests++;
+
+    // KEEP HTTP/1.1 connections alive unless asked not to, and HTTP/1.0 ones
+    // only if asked to.
+    gallocy::http::View connection_header = request->headers.find("Connection");
+    bool keep_alive = alive && (request->protocol == "HTTP/1.1"
+      ? !connection_header.iequals("close") : connection_header.iequals("keep-alive"));
+
+    // REFUSE a request that is not HTTP, or that the reader rejected, and
+    // close the connection, as whatever follows it cannot be framed.
+    gallocy::http::Response *response = nullptr;
+    if (request->method.empty() || rejected != 0) {
+      response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+      response->status_code = rejected != 0 ? rejected : 400;
+      keep_alive = false;
+    } else {
+      response = route(request);
+    }
+    response->protocol = "HTTP/1.1";
+    response->headers.set("Connection", keep_alive ? "keep-alive" : "close");
+
+    // SEND the head from the connection's buffer and the body from the
+    // response, together.
+    connection->head.clear();
+    response->write_head(&connection->head);
+    struct iovec iov[2] = {
+      { const_cast<char *>(connection->head.data()), connection->head.length() },
+      { const_cast<char *>(response->body.data()), response->body.length() },
+    };
+    if (!gallocy::http::send_all(client_socket, iov, 2))
+      keep_alive = false;
+
+    LOG_INFO(request->method
+      << " "
+      << request->uri
+      << " - "
+      << "HTTP " << response->status_code
+      << " - "
+      << inet_ntoa(connection->client_name.sin_addr)
+      << " "
+      << request->headers.get("User-Agent"));
+
+    // Teardown
+    request->~Request();
+    internal_free(request);
+    response->~Response();
+    internal_free(response);
+    connection->reader.consume();
+
+    if (!keep_alive) {
+      close_connection(connection);
+      return nullptr;
+    }
+  } while (request_complete(connection));
+
+  resume(connection);
+
+  return nullptr;
+}
+
+
+gallocy::string gallocy::consensus::GallocyServer::handle_raw(const gallocy::string &raw, const char *via) {
+  gallocy::http::Request *request = new (internal_malloc(sizeof(gallocy::http::Request))) gallocy::http::Request(raw);
+  gallocy::http::Response *response = route(request);
+  gallocy::string http = response->str();
 
   LOG_INFO(request->method
     << " "
@@ -270,9 +845,7 @@ void *gallocy::consensus::GallocyServer::handle(int client_socket, struct sockad
     << " - "
     << "HTTP " << response->status_code
     << " - "
-    << inet_ntoa(client_name.sin_addr)
-    << " "
-    << request->headers["User-Agent"]);
+    << via);
 
   // Teardown
   request->~Request();
@@ -280,23 +853,25 @@ void *gallocy::consensus::GallocyServer::handle(int client_socket, struct sockad
   response->~Response();
   internal_free(response);
 
-  shutdown(client_socket, SHUT_RDWR);
-  close(client_socket);
+  return http;
+}
 
-  return nullptr;
+
+bool gallocy::consensus::GallocyServer::read_request(struct Connection *connection) {
+  return connection->reader.fill(connection->client_socket);
 }
 
 
-gallocy::http::Request *gallocy::consensus::GallocyServer::get_request(int client_socket) {
-  gallocy::stringstream request;
-  int n;
-  char buf[512] = {0};
-  n = recv(client_socket, buf, 16, 0);
-  request << buf;
-  while (n > 0) {
-    memset(buf, 0, 512);
-    n = recv(client_socket, buf, 512, MSG_DONTWAIT);
-    request << buf;
+bool gallocy::consensus::GallocyServer::request_complete(struct Connection *connection) {
+  if (connection->reader.frame())
+    return true;
+
+  // ASK for the body if the client waits to be asked, as cURL does for
+  // larger bodies.
+  if (!connection->continued && connection->reader.expects_continue()) {
+    const char *interim = "HTTP/1.1 100 Continue\r\n\r\n";
+    send(connection->client_socket, interim, strlen(interim), MSG_NOSIGNAL);
+    connection->continued = true;
   }
-  return new (internal_malloc(sizeof(gallocy::http::Request))) gallocy::http::Request(request.str());
+  return false;
 }
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <vector>
+
 #include "gallocy/allocators/internal.h"
 #include "gallocy/consensus/log.h"
 #include "gallocy/consensus/state.h"
@@ -30,6 +33,8 @@ void gallocy::consensus::GallocyState::set_current_term(uint64_t value) {
                 << " to "
                 << value
                 << ". This is a logic error.");
+    if (value > current_term)
+        leader = gallocy::common::Peer();
     current_term = value;
     voted_for = gallocy::common::Peer();
 }
@@ -54,8 +59,23 @@ uint64_t gallocy::consensus::GallocyState::get_commit_index() {
 
 
 void gallocy::consensus::GallocyState::set_commit_index(uint64_t value) {
-    std::lock_guard<std::mutex> lock(access_lock);
-    commit_index = value;
+    std::lock_guard<std::mutex> notify(notify_lock);
+    gallocy::vector<Command> committed;
+    gallocy::vector<CommandListener> listeners;
+    {
+        std::lock_guard<std::mutex> lock(access_lock);
+        commit_index = std::min<uint64_t>(value, log->log.size());
+        // COLLECT the entries that committed, in order, to apply them without
+        // the lock held.
+        for (; last_applied < commit_index; last_applied++) {
+            log->log[last_applied].committed = true;
+            committed.push_back(log->log[last_applied].command);
+        }
+        listeners = command_listeners;
+    }
+    for (auto &command : committed)
+        for (auto &listener : listeners)
+            listener(command);
 }
 
 
@@ -99,6 +119,113 @@ gallocy::consensus::GallocyLog *gallocy::consensus::GallocyState::get_log() {
 }
 
 
+uint64_t gallocy::consensus::GallocyState::append_command(const gallocy::consensus::Command &command) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    return log->append_entry(gallocy::consensus::LogEntry(command, current_term));
+}
+
+
+gallocy::vector<gallocy::consensus::LogEntry> gallocy::consensus::GallocyState::get_entries(uint64_t *previous_log_index,
+                                                                                          uint64_t *previous_log_term) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    *previous_log_index = std::min<uint64_t>(*previous_log_index, log->log.size());
+    *previous_log_term = *previous_log_index > 0 ? log->log[*previous_log_index - 1].term : 0;
+    return gallocy::vector<LogEntry>(log->log.begin() + *previous_log_index, log->log.end());
+}
+
+
+void gallocy::consensus::GallocyState::get_last_log(uint64_t *last_log_index, uint64_t *last_log_term) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    *last_log_index = log->log.size();
+    *last_log_term = log->log.empty() ? 0 : log->log.back().term;
+}
+
+
+bool gallocy::consensus::GallocyState::is_log_up_to_date(uint64_t last_log_index, uint64_t last_log_term) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    uint64_t local_last_log_term = log->log.empty() ? 0 : log->log.back().term;
+    if (last_log_term != local_last_log_term)
+        return last_log_term > local_last_log_term;
+    return last_log_index >= log->log.size();
+}
+
+
+bool gallocy::consensus::GallocyState::append_entries(uint64_t previous_log_index, uint64_t previous_log_term,
+                                                      const gallocy::vector<LogEntry> &entries, uint64_t leader_commit,
+                                                      uint64_t *match_index) {
+    uint64_t commit;
+    {
+        std::lock_guard<std::mutex> lock(access_lock);
+        // REJECT entries that do not follow on from this log, so that the
+        // leader backs up and sends earlier ones.
+        if (previous_log_index > log->log.size())
+            return false;
+        if (previous_log_index > 0 && log->log[previous_log_index - 1].term != previous_log_term)
+            return false;
+        for (uint64_t i = 0; i < entries.size(); i++) {
+            uint64_t index = previous_log_index + i;
+            if (index < log->log.size()) {
+                if (log->log[index].term == entries[i].term)
+                    continue;
+                if (index < commit_index) {
+                    LOG_ERROR("Refusing to drop committed entry " << index + 1
+                            << " for the leader's. This is a logic error.");
+                    return false;
+                }
+                log->log.erase(log->log.begin() + index, log->log.end());
+            }
+            log->log.push_back(entries[i]);
+            log->log.back().committed = false;
+        }
+        *match_index = previous_log_index + entries.size();
+        commit = std::min(leader_commit, *match_index);
+        if (commit <= commit_index)
+            return true;
+    }
+    set_commit_index(commit);
+    return true;
+}
+
+
+uint64_t gallocy::consensus::GallocyState::advance_commit_index() {
+    uint64_t commit;
+    {
+        std::lock_guard<std::mutex> lock(access_lock);
+        if (state != RaftState::LEADER)
+            return commit_index;
+        // COUNT this node, which holds every entry in its log, and each peer
+        // that holds the entry.
+        uint64_t majority = (config.peer_list.size() + 1) / 2 + 1;
+        for (commit = log->log.size(); commit > commit_index; commit--) {
+            if (log->log[commit - 1].term != current_term)
+                break;
+            uint64_t replicas = 1;
+            for (auto &peer : config.peer_list)
+                if (match_index[peer] >= commit)
+                    replicas++;
+            if (replicas >= majority)
+                break;
+        }
+        if (commit <= commit_index || log->log[commit - 1].term != current_term)
+            return commit_index;
+    }
+    set_commit_index(commit);
+    return commit;
+}
+
+
+gallocy::common::Peer gallocy::consensus::GallocyState::get_leader() {
+    std::lock_guard<std::mutex> lock(access_lock);
+    return leader;
+}
+
+
+void gallocy::consensus::GallocyState::set_leader(gallocy::common::Peer value) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    leader = value;
+}
+
+
 gallocy::consensus::Timer *gallocy::consensus::GallocyState::get_timer() {
     return timer;
 }
@@ -121,8 +248,9 @@ gallocy::consensus::RaftState gallocy::consensus::GallocyState::get_state() {
 
 
 void gallocy::consensus::GallocyState::initialize_leader_state() {
+    leader = gallocy::common::Peer(config.address, config.port);
     for (auto peer : config.peer_list) {
-        next_index[peer] = commit_index + 1;
+        next_index[peer] = log->log.size() + 1;
         match_index[peer] = 0;
     }
 }
@@ -151,8 +279,10 @@ void gallocy::consensus::GallocyState::set_state(gallocy::consensus::RaftState n
                 << ")");
 
     if (new_state == gallocy::consensus::RaftState::LEADER) {
-        // We're the leader now
-        initialize_leader_state();
+        // We're the leader now, and keep what we learned of the peers' logs
+        // from one heartbeat to the next.
+        if (state != gallocy::consensus::RaftState::LEADER)
+            initialize_leader_state();
         timer->set_step(LEADER_STEP_TIME);
         timer->set_jitter(LEADER_JITTER_TIME);
     } else {
@@ -163,3 +293,48 @@ void gallocy::consensus::GallocyState::set_state(gallocy::consensus::RaftState n
     }
     state = new_state;
 }
+
+
+void gallocy::consensus::GallocyState::sort_membership() {
+    std::sort(membership.begin(), membership.end(),
+              [](const gallocy::common::Peer &lhs, const gallocy::common::Peer &rhs) {
+        if (lhs.get_canonical_id() != rhs.get_canonical_id())
+            return lhs.get_canonical_id() < rhs.get_canonical_id();
+        return lhs.get_port() < rhs.get_port();
+    });
+}
+
+
+gallocy::vector<gallocy::common::Peer> gallocy::consensus::GallocyState::get_membership() {
+    std::lock_guard<std::mutex> lock(access_lock);
+    return membership;
+}
+
+
+void gallocy::consensus::GallocyState::set_membership(const gallocy::vector<gallocy::common::Peer> &value) {
+    std::lock_guard<std::mutex> notify(notify_lock);
+    gallocy::vector<gallocy::common::Peer> members;
+    gallocy::vector<MembershipListener> listeners;
+    {
+        std::lock_guard<std::mutex> lock(access_lock);
+        membership = value;
+        sort_membership();
+        members = membership;
+        listeners = membership_listeners;
+    }
+    LOG_INFO("Changing membership to " << members.size() << " members");
+    for (auto &listener : listeners)
+        listener(members);
+}
+
+
+void gallocy::consensus::GallocyState::add_membership_listener(MembershipListener listener) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    membership_listeners.push_back(listener);
+}
+
+
+void gallocy::consensus::GallocyState::add_command_listener(CommandListener listener) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    command_listeners.push_back(listener);
+}
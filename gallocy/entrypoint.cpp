@@ -4,23 +4,115 @@
 #include <chrono>
 #include <iostream>
 #include <thread>
+#include <vector>
 
 #include "gallocy/consensus/client.h"
 #include "gallocy/consensus/machine.h"
 #include "gallocy/consensus/server.h"
 #include "gallocy/consensus/state.h"
 #include "gallocy/entrypoint.h"
+#include "gallocy/heaplayers/source.h"
+#include "gallocy/http/client.h"
+#include "gallocy/http/request.h"
+#include "gallocy/http/response.h"
+#include "gallocy/libgallocy.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/directory.h"
+#include "gallocy/memory/lease.h"
+#include "gallocy/memory/lock.h"
+#include "gallocy/memory/prefetch.h"
+#include "gallocy/memory/profiler.h"
+#include "gallocy/memory/release.h"
+#include "gallocy/memory/transfer.h"
 #include "gallocy/models.h"
 #include "gallocy/threads.h"
 #include "gallocy/utils/config.h"
 #include "gallocy/utils/constants.h"
 #include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
 
 GallocyConfig *gallocy_config = nullptr;
 gallocy::consensus::GallocyClient *gallocy_client = nullptr;
 gallocy::consensus::GallocyMachine *gallocy_machine = nullptr;
 gallocy::consensus::GallocyServer *gallocy_server = nullptr;
 gallocy::consensus::GallocyState *gallocy_state = nullptr;
+gallocy::memory::PageTransferServer *gallocy_page_server = nullptr;
+gallocy::memory::PageDirectory *gallocy_page_directory = nullptr;
+gallocy::memory::MRSWCoherence *gallocy_coherence = nullptr;
+gallocy::memory::LazyReleaseCoherence *gallocy_release_coherence = nullptr;
+gallocy::memory::DistributedLockManager *gallocy_lock_manager = nullptr;
+gallocy::memory::PagePrefetcher *gallocy_prefetcher = nullptr;
+gallocy::memory::ChunkLeases *gallocy_chunk_leases = nullptr;
+gallocy::memory::FalseSharingProfiler *gallocy_profiler = nullptr;
+
+// The application heap's pages shared across the cluster, which are every
+// page after the bootstrap chunks each node allocates from privately.
+#define SHARED_HEAP_OFFSET (LEASE_BOOTSTRAP_CHUNKS * LEASE_CHUNK_SZ)
+#define SHARED_HEAP_PAGES ((ZONE_SZ - SHARED_HEAP_OFFSET) / PAGE_SZ)
+
+
+/**
+ * Get the start of the application heap's shared pages.
+ */
+static void *get_shared_heap() {
+  return reinterpret_cast<uint8_t *>(get_heap_location(PURPOSE_APPLICATION_HEAP)) + SHARED_HEAP_OFFSET;
+}
+
+
+/**
+ * Get the page transfer address of every member.
+ */
+static gallocy::vector<gallocy::common::Peer> get_page_peers(const gallocy::vector<gallocy::common::Peer> &members) {
+  gallocy::vector<gallocy::common::Peer> page_peers;
+  for (auto &member : members)
+    page_peers.push_back(gallocy::common::Peer(member.get_address(), gallocy_config->page_port));
+  return page_peers;
+}
+
+
+/**
+ * Propose a command to the Raft log.
+ *
+ * The leader appends the command to its log, and a follower forwards it to
+ * the leader. Either way, the command is applied once it commits.
+ */
+static bool propose_command(const gallocy::string &command) {
+  if (gallocy_state->get_state() == gallocy::consensus::RaftState::LEADER) {
+    gallocy_state->append_command(gallocy::consensus::Command(command));
+    return true;
+  }
+  gallocy::common::Peer leader = gallocy_state->get_leader();
+  if (leader == gallocy::common::Peer())
+    return false;
+  gallocy::json j = {
+    { "command", command.c_str() },
+  };
+  gallocy::http::Headers headers;
+  headers.set("Content-Type", "application/json");
+  gallocy::http::Response *rsp = gallocy::http::ShmClient().request(
+      gallocy::http::Request("POST", leader, "/raft/propose", j.dump(), headers));
+  bool accepted = false;
+  if (rsp->status_code == 200) {
+    gallocy::json response_json = gallocy::json::parse(rsp->body.c_str());
+    accepted = response_json["accepted"];
+  }
+  rsp->~Response();
+  internal_free(rsp);
+  return accepted;
+}
+
+
+/**
+ * Record the application's allocations in the false sharing profiler.
+ */
+static void profile_allocation(void *arg, void *ptr, size_t sz, void *site) {
+  gallocy::memory::FalseSharingProfiler *profiler = reinterpret_cast<gallocy::memory::FalseSharingProfiler *>(arg);
+  if (site)
+    profiler->record_allocation(ptr, sz, site);
+  else
+    profiler->record_free(ptr);
+}
+
 
 int initialize_gallocy_framework(const char* config_path) {
   void *start;
@@ -120,6 +212,35 @@ int initialize_gallocy_framework(const char* config_path) {
   //
   gallocy_config = load_config(config_path);
   //
+  // Fail early if pages would be transferred on a Raft port.
+  //
+  bool page_port_taken = gallocy_config->page_port == gallocy_config->port;
+  for (auto &peer : gallocy_config->peer_list)
+    page_port_taken |= gallocy_config->page_port == peer.get_port();
+  if (page_port_taken) {
+    LOG_ERROR("The page port " << gallocy_config->page_port << " is a Raft port, set \"page_port\"");
+    abort();
+  }
+  //
+  // Fail early if the application heap would be shared without leases, as
+  // nodes that share it must only ever allocate from chunks the log
+  // committed to them.
+  //
+  if (!gallocy_config->heap_backing.empty() && !gallocy_config->chunk_leases) {
+    LOG_ERROR("The application heap can only be backed by " << gallocy_config->heap_backing
+        << " with \"chunk_leases\" set");
+    abort();
+  }
+  //
+  // Fail early if the application heap would be kept coherent without
+  // leases, as nodes would otherwise allocate the same objects from the
+  // same pages.
+  //
+  if (gallocy_config->coherence != COHERENCY_NONE && !gallocy_config->chunk_leases) {
+    LOG_ERROR("The application heap can only be kept coherent with \"chunk_leases\" set");
+    abort();
+  }
+  //
   // Create the state object.
   //
   gallocy_state = new (internal_malloc(sizeof(gallocy::consensus::GallocyState))) gallocy::consensus::GallocyState(*gallocy_config);
@@ -139,6 +260,123 @@ int initialize_gallocy_framework(const char* config_path) {
   gallocy_server = new (internal_malloc(sizeof(gallocy::consensus::GallocyServer))) gallocy::consensus::GallocyServer(*gallocy_config);
   gallocy_server->start();
   //
+  // Start the page transfer server over the application heap's shared pages.
+  //
+  gallocy_page_server = new (internal_malloc(sizeof(gallocy::memory::PageTransferServer)))
+    gallocy::memory::PageTransferServer(gallocy_config->address, gallocy_config->page_port,
+                                        get_shared_heap(), SHARED_HEAP_PAGES);
+  //
+  // Home the page directory across the committed membership, and rebuild it
+  // whenever the membership changes.
+  //
+  gallocy::vector<gallocy::common::Peer> page_peers = get_page_peers(gallocy_state->get_membership());
+  gallocy::common::Peer page_self(gallocy_config->address, gallocy_config->page_port);
+  uint32_t self = 0;
+  while (self < page_peers.size() && page_peers[self] != page_self)
+    self++;
+  if (self == page_peers.size()) {
+    LOG_ERROR("This node, " << page_self.get_string() << ", is not a member of the cluster");
+    abort();
+  }
+  gallocy_page_directory = new (internal_malloc(sizeof(gallocy::memory::PageDirectory)))
+    gallocy::memory::PageDirectory(self, page_peers);
+  gallocy_page_server->set_handler(PAGE_TRANSFER_DIRECTORY, gallocy_page_directory);
+  gallocy_state->add_membership_listener([](const gallocy::vector<gallocy::common::Peer> &members) {
+    gallocy_page_directory->rebuild(get_page_peers(members));
+  });
+  //
+  // Allocate the application heap only from chunks this node leases, and
+  // lease them ahead of demand, if configured. Nodes on one host that back
+  // the heap with the same file share the pages of every chunk.
+  //
+  if (gallocy_config->chunk_leases) {
+    gallocy::common::Peer raft_self(gallocy_config->address, gallocy_config->port);
+    gallocy_chunk_leases = new (internal_malloc(sizeof(gallocy::memory::ChunkLeases)))
+      gallocy::memory::ChunkLeases((raft_self.get_canonical_id() << 16) | raft_self.get_port(), propose_command);
+    gallocy_state->add_command_listener([](const gallocy::consensus::Command &command) {
+      gallocy_chunk_leases->apply(command.command);
+    });
+    if (!gallocy_config->heap_backing.empty()
+        && !HL::SourceMmapHeap<PURPOSE_APPLICATION_HEAP>::set_backing(gallocy_config->heap_backing.c_str(),
+                                                                      LEASE_BOOTSTRAP_CHUNKS * LEASE_CHUNK_SZ)) {
+      LOG_ERROR("Failed to back the application heap with " << gallocy_config->heap_backing);
+      abort();
+    }
+    HL::SourceMmapHeap<PURPOSE_APPLICATION_HEAP>::set_chunk_source(gallocy::memory::ChunkLeases::chunk_source,
+                                                                   gallocy_chunk_leases);
+    gallocy_chunk_leases->start();
+  }
+  //
+  // Place the application's objects by thread, or pack them by node.
+  //
+  custom_set_placement(gallocy_config->placement);
+  utils::register_metrics("placement", []() {
+    gallocy::json metrics = {
+      { "domains_in_use", custom_get_placement_domains() },
+      { "overflows", custom_get_placement_overflows() },
+    };
+    return metrics;
+  });
+  //
+  // Keep the application heap's shared pages coherent across the cluster, if
+  // configured. The bootstrap chunks hold each node's own early allocations,
+  // so they are left alone.
+  //
+  // MRSW finds owners through the directory and ends sync epochs at the
+  // application's releases. LRC homes pages by address and hands write
+  // notices on with the tokens of the application's mutexes.
+  //
+  if (gallocy_config->coherence != COHERENCY_NONE) {
+    // MAP the zone, which happens at the heap's first allocation, so that the
+    // protocol can protect it.
+    custom_free(custom_malloc(1));
+    gallocy_profiler = new (internal_malloc(sizeof(gallocy::memory::FalseSharingProfiler)))
+      gallocy::memory::FalseSharingProfiler(self, get_shared_heap(), SHARED_HEAP_PAGES);
+  }
+  if (gallocy_config->coherence == COHERENCY_MRSW) {
+    gallocy_coherence = new (internal_malloc(sizeof(gallocy::memory::MRSWCoherence)))
+      gallocy::memory::MRSWCoherence(self, page_peers, get_shared_heap(), SHARED_HEAP_PAGES, 0, PAGE_SZ,
+                                     gallocy_config->prefetch_window);
+    gallocy_coherence->set_directory(gallocy_page_directory);
+    gallocy_coherence->set_profiler(gallocy_profiler);
+    gallocy_page_server->set_coherence(gallocy_coherence);
+    gallocy_coherence->intercept_synchronization();
+    //
+    // Read ahead of each thread's strided read faults, unless prefetching
+    // is turned off.
+    //
+    if (gallocy_config->prefetch_window > 0) {
+      gallocy_prefetcher = new (internal_malloc(sizeof(gallocy::memory::PagePrefetcher)))
+        gallocy::memory::PagePrefetcher(SHARED_HEAP_PAGES, "prefetch coherence",
+                                        [](uint64_t *page_numbers, size_t count) {
+                                          return gallocy_coherence->prefetch(page_numbers, count);
+                                        });
+      gallocy_coherence->set_prefetcher(gallocy_prefetcher);
+      gallocy_prefetcher->start();
+    }
+  } else if (gallocy_config->coherence == COHERENCY_LRC) {
+    gallocy_release_coherence = new (internal_malloc(sizeof(gallocy::memory::LazyReleaseCoherence)))
+      gallocy::memory::LazyReleaseCoherence(self, page_peers, get_shared_heap(), SHARED_HEAP_PAGES, PAGE_SZ,
+                                            gallocy_config->prefetch_window);
+    gallocy_lock_manager = new (internal_malloc(sizeof(gallocy::memory::DistributedLockManager)))
+      gallocy::memory::DistributedLockManager(self, page_peers, *gallocy_release_coherence);
+    gallocy_release_coherence->set_profiler(gallocy_profiler);
+    gallocy_page_server->set_coherence(gallocy_release_coherence);
+    gallocy_page_server->set_handler(PAGE_TRANSFER_LOCK, gallocy_lock_manager);
+    gallocy_lock_manager->intercept_synchronization();
+    gallocy_lock_manager->start();
+  }
+  //
+  // Profile false sharing from the protocol's transfers, attributing written
+  // bytes to the allocations this node makes if the profile is to be dumped.
+  //
+  if (gallocy_profiler && !gallocy_config->profile_path.empty()) {
+    custom_set_allocation_hook(profile_allocation, gallocy_profiler);
+  } else if (!gallocy_config->profile_path.empty()) {
+    LOG_WARNING("Not profiling false sharing, since the application heap has no coherence protocol");
+  }
+  gallocy_page_server->start();
+  //
   // Yield to the application.
   //
   return 0;
@@ -146,6 +384,22 @@ int initialize_gallocy_framework(const char* config_path) {
 
 
 int teardown_gallocy_framework() {
+  if (gallocy_coherence || gallocy_lock_manager)
+    set_sync_hooks(nullptr, nullptr, nullptr);
+  if (gallocy_lock_manager)
+    gallocy_lock_manager->stop();
+  if (gallocy_prefetcher)
+    gallocy_prefetcher->stop();
+  if (gallocy_profiler && !gallocy_config->profile_path.empty()) {
+    custom_set_allocation_hook(nullptr, nullptr);
+    gallocy_profiler->dump(gallocy_config->profile_path.c_str());
+  }
+  if (gallocy_chunk_leases) {
+    gallocy_chunk_leases->stop();
+    gallocy_chunk_leases->return_unused(0);
+  }
+  HL::SourceMmapHeap<PURPOSE_APPLICATION_HEAP>::reset_backing();
+  gallocy_page_server->stop();
   gallocy_server->stop();
   gallocy_machine->stop();
   // TODO(sholsapp): Destroy the SQLite objects.
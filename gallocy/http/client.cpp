@@ -1,33 +1,139 @@
+#include <curl/curl.h>
+#include <poll.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
-#include <future>
 #include <mutex>
-#include <thread>
 #include <map>
 #include <vector>
 
 #include "gallocy/allocators/internal.h"
 #include "gallocy/http/client.h"
+#include "gallocy/http/parser.h"
 #include "gallocy/http/request.h"
 #include "gallocy/http/response.h"
+#include "connection.h"  // NOLINT
 #include "restclient.h"  // NOLINT
 
 
+/**
+ * A cURL connection kept alive for reuse, and when it was last used.
+ */
+struct PooledConnection {
+  RestClient::Connection *connection;
+  uint64_t last_used;
+};
+
+
+static std::mutex pool_lock;
+
+
+/**
+ * Get the idle connections to each peer, by base URL.
+ */
+static gallocy::map<gallocy::string, gallocy::vector<PooledConnection> > &get_pool() {
+  static gallocy::map<gallocy::string, gallocy::vector<PooledConnection> > pool;
+  return pool;
+}
+
+
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static void destroy_connection(RestClient::Connection *connection) {
+  connection->~Connection();
+  internal_free(connection);
+}
+
+
+/**
+ * Take an idle connection to a peer, or make a new one.
+ *
+ * Connections idle for \ref CLIENT_IDLE_MS are dropped first, as the server
+ * may be about to close them.
+ */
+static RestClient::Connection *checkout_connection(const gallocy::string &base_url) {
+  uint64_t now = now_ms();
+  RestClient::Connection *connection = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(pool_lock);
+    for (auto &it : get_pool()) {
+      gallocy::vector<PooledConnection> &idle = it.second;
+      for (auto pooled = idle.begin(); pooled != idle.end();) {
+        if (now - pooled->last_used < CLIENT_IDLE_MS) {
+          ++pooled;
+          continue;
+        }
+        destroy_connection(pooled->connection);
+        pooled = idle.erase(pooled);
+      }
+    }
+    gallocy::vector<PooledConnection> &idle = get_pool()[base_url];
+    if (!idle.empty()) {
+      connection = idle.back().connection;
+      idle.pop_back();
+    }
+  }
+  if (connection == nullptr) {
+    connection = new (internal_malloc(sizeof(RestClient::Connection))) RestClient::Connection(base_url.c_str());
+    // SET every option, as the connection does not initialize them itself.
+    connection->SetTimeout(CLIENT_TIMEOUT_MS);
+    connection->FollowRedirects(false);
+  }
+  return connection;
+}
+
+
+/**
+ * Return a connection that is still good to its peer's idle connections.
+ */
+static void checkin_connection(const gallocy::string &base_url, RestClient::Connection *connection) {
+  {
+    std::lock_guard<std::mutex> lock(pool_lock);
+    gallocy::vector<PooledConnection> &idle = get_pool()[base_url];
+    if (idle.size() < CLIENT_POOL_SZ) {
+      idle.push_back({ connection, now_ms() });
+      return;
+    }
+  }
+  destroy_connection(connection);
+}
+
+
 gallocy::http::Response *gallocy::http::CurlClient::request(const gallocy::http::Request &request) {
+  gallocy::string base_url = "http://" + request.peer.get_string();
+  RestClient::Connection *connection = checkout_connection(base_url);
+  RestClient::HeaderFields headers;
   RestClient::Response restclient_response;
   if (request.method.compare("GET") == 0) {
-    restclient_response = RestClient::get(request.get_url().c_str());
+    connection->SetHeaders(headers);
+    restclient_response = connection->get(request.uri.c_str());
   } else if (request.method.compare("POST") == 0) {
     // TODO(sholsapp): We assume that any POST request is a JSON request, for
     // now. This should be changed to accept any type of POST request.
-    restclient_response = RestClient::post(request.get_url().c_str(), "application/json", request.raw_body.c_str());
+    headers["Content-Type"] = "application/json";
+    connection->SetHeaders(headers);
+    restclient_response = connection->post(request.uri.c_str(), request.raw_body.c_str());
   } else {
     abort();
   }
 
+  // KEEP the connection alive for the next request to the peer, unless the
+  // request failed.
+  if (restclient_response.code >= 100)
+    checkin_connection(base_url, connection);
+  else
+    destroy_connection(connection);
+
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
   response->status_code = restclient_response.code;
   for (auto header : restclient_response.headers) {
-    response->headers[header.first] = header.second;
+    response->headers.set(header.first.c_str(), header.second.c_str());
   }
   response->body = restclient_response.body.c_str();
   response->peer = request.peer;
@@ -36,177 +142,644 @@ gallocy::http::Response *gallocy::http::CurlClient::request(const gallocy::http:
 }
 
 
-uint64_t gallocy::http::CurlClient::multirequest(const gallocy::vector<gallocy::http::Request> requests,
-                                  std::function<bool(const gallocy::http::Response &)> callback,
-                                  std::condition_variable *cv,
-                                  std::mutex *cv_m) {
-  int rsp_count = 0;
-  int peer_count = requests.size();
-  int peer_majority = peer_count / 2;
+/**
+ * A request of a round of \ref gallocy::http::CurlClient::multirequest, on a
+ * cURL easy handle that is kept for its peer between rounds.
+ */
+struct Transfer {
+  CURL *easy;
+  gallocy::string base_url;
+  gallocy::common::Peer peer;
+  /**
+   * The head and the body of the response, as they arrive.
+   */
+  gallocy::string head;
+  gallocy::string body;
+  /**
+   * The round the transfer was started for, and the round's callback, which
+   * is still called if the response arrives after the round returned.
+   */
+  uint64_t round;
+  std::function<bool(const gallocy::http::Response &)> callback;
+};
+
+
+/**
+ * The long lived cURL multi handle every round runs on.
+ *
+ * The multi handle's connection cache keeps a connection to each peer alive
+ * from one round to the next, and the idle transfers for each peer are kept
+ * so that their easy handles are set up once.
+ */
+struct MultiEngine {
+  MultiEngine() :
+    multi(curl_multi_init()),
+    json_headers(nullptr),
+    round(0) {
+      json_headers = curl_slist_append(json_headers, "Content-Type: application/json");
+      // DISABLE ``Expect: 100-continue``, which costs a round trip.
+      json_headers = curl_slist_append(json_headers, "Expect:");
+  }
+  CURLM *multi;
+  struct curl_slist *json_headers;
+  /**
+   * The current round. Transfers of earlier rounds that are still running
+   * when a round starts are driven with it, and call their own round's
+   * callback when they finish.
+   */
+  uint64_t round;
+  gallocy::map<gallocy::string, gallocy::vector<Transfer *> > idle;
+  /**
+   * Serializes rounds, as a multi handle may only be used by one thread at a
+   * time.
+   */
+  std::mutex lock;
+};
+
+
+static MultiEngine &get_engine() {
+  static MultiEngine engine;
+  return engine;
+}
 
-  // TODO(sholsapp): Move these to a caller and take them by parameter. The
-  // caller can use these to continue operation when a majority of requests are
-  // complete.
-  std::condition_variable rsp_have_majority;
-  std::mutex rsp_count_lock;
 
-  std::vector<std::future<uint64_t>> futures;
+static size_t write_body(char *data, size_t size, size_t count, void *userdata) {
+  static_cast<gallocy::string *>(userdata)->append(data, size * count);
+  return size * count;
+}
 
-  for (auto &request : requests) {
-    std::future<uint64_t> future =
-      std::async(std::launch::async, [&request, &peer_majority, &rsp_count, &rsp_count_lock, &rsp_have_majority, &callback]() {
-        gallocy::http::Response *rsp = gallocy::http::CurlClient().request(request);
-        uint64_t status_code = rsp->status_code;
-
-        // CHECK if we have a majority of repsonses and signal if ready.
-        {
-          std::unique_lock<std::mutex> lk(rsp_count_lock);
-          // CHECK if the callback received the expected response.
-          if (callback(*rsp))
-            rsp_count++;
-          if (rsp_count >= peer_majority)
-            rsp_have_majority.notify_all();
-        }
 
-        // FREE the response since we're done with it.
-        rsp->~Response();
-        internal_free(rsp);
+static size_t write_head(char *data, size_t size, size_t count, void *userdata) {
+  gallocy::string *head = static_cast<gallocy::string *>(userdata);
+  // KEEP only the last head, if there was an interim response.
+  if (size * count >= 5 && memcmp(data, "HTTP/", 5) == 0)
+    head->clear();
+  head->append(data, size * count);
+  return size * count;
+}
+
+
+static void destroy_transfer(Transfer *transfer) {
+  curl_easy_cleanup(transfer->easy);
+  transfer->~Transfer();
+  internal_free(transfer);
+}
 
-        // RETURN the HTTP status code.
-        return static_cast<uint64_t>(status_code);
-      });
-    futures.push_back(std::move(future));
+
+/**
+ * Take an idle transfer to a peer, or make a new one.
+ */
+static Transfer *checkout_transfer(MultiEngine *engine, const gallocy::http::Request &request) {
+  gallocy::string base_url = "http://" + request.peer.get_string();
+  gallocy::vector<Transfer *> &idle = engine->idle[base_url];
+  Transfer *transfer = nullptr;
+  if (!idle.empty()) {
+    transfer = idle.back();
+    idle.pop_back();
+  } else {
+    transfer = new (internal_malloc(sizeof(Transfer))) Transfer();
+    transfer->easy = curl_easy_init();
+    transfer->base_url = base_url;
+    CURL *easy = transfer->easy;
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(CLIENT_TIMEOUT_MS));  // NOLINT(runtime/int)
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 0L);
+#if LIBCURL_VERSION_NUM >= 0x074100
+    // DROP connections that sat idle long enough for the server to close them.
+    curl_easy_setopt(easy, CURLOPT_MAXAGE_CONN, static_cast<long>(CLIENT_IDLE_MS / 1000));  // NOLINT(runtime/int)
+#endif
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer->body);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, write_head);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer->head);
   }
+  transfer->peer = request.peer;
+  transfer->callback = nullptr;
+  transfer->head.clear();
+  transfer->body.clear();
+  return transfer;
+}
 
-  {
-    // LOG_DEBUG("Waiting for majority of threads to respond");
-    std::unique_lock<std::mutex> lk(rsp_count_lock);
-    while (rsp_count < peer_majority) {
-      // TODO(sholsapp): What should time out be such that it doesn't interfere
-      // with the leader timeout?
-      std::cv_status status = rsp_have_majority.wait_for(lk, std::chrono::milliseconds(50));
-      if (status == std::cv_status::timeout) {
-        // LOG_DEBUG("Failed to get majority at " << rsp_count << " of " << peer_count << "!");
-        return rsp_count;
-      } else if (status == std::cv_status::no_timeout) {
-        // LOG_DEBUG("Has majority at " << rsp_count << " of " << peer_count << "!");
+
+/**
+ * Return a transfer that finished to its peer's idle transfers.
+ */
+static void checkin_transfer(MultiEngine *engine, Transfer *transfer, bool ok) {
+  transfer->callback = nullptr;
+  gallocy::vector<Transfer *> &idle = engine->idle[transfer->base_url];
+  if (ok && idle.size() < CLIENT_POOL_SZ)
+    idle.push_back(transfer);
+  else
+    destroy_transfer(transfer);
+}
+
+
+/**
+ * Start a request's transfer on the engine's multi handle, in a round.
+ */
+static void start_transfer(MultiEngine *engine, const gallocy::http::Request &request, uint64_t round,
+                           const std::function<bool(const gallocy::http::Response &)> &callback) {
+  Transfer *transfer = checkout_transfer(engine, request);
+  transfer->round = round;
+  transfer->callback = callback;
+  CURL *easy = transfer->easy;
+  gallocy::string url = transfer->base_url + request.uri;
+  curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+  if (request.method.compare("GET") == 0) {
+    curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, nullptr);
+  } else if (request.method.compare("POST") == 0) {
+    // TODO(sholsapp): We assume that any POST request is a JSON request, for
+    // now. This should be changed to accept any type of POST request.
+    gallocy::http::View body = request.get_body();
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.length));  // NOLINT(runtime/int)
+    curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, body.data);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, engine->json_headers);
+  } else {
+    abort();
+  }
+  curl_multi_add_handle(engine->multi, easy);
+}
+
+
+uint64_t gallocy::http::CurlClient::multirequest(const gallocy::vector<gallocy::http::Request> requests,
+                                  std::function<bool(const gallocy::http::Response &)> callback,
+                                  std::condition_variable *cv,
+                                  std::mutex *cv_m) {
+  // A majority of the cluster, counting this peer, which does not send itself
+  // requests.
+  uint64_t quorum = (requests.size() + 1) / 2;
+  uint64_t answered = 0;
+  uint64_t successes = 0;
+
+  MultiEngine *engine = &get_engine();
+  std::lock_guard<std::mutex> lock(engine->lock);
+  uint64_t round = ++engine->round;
+  uint64_t deadline = now_ms() + CLIENT_ROUND_MS;
+
+  // START the network transfers first, and keep the requests that may need
+  // no network for between polls of them.
+  gallocy::vector<const gallocy::http::Request *> direct;
+  for (auto &request : requests) {
+    if (prefers_direct(request))
+      direct.push_back(&request);
+    else
+      start_transfer(engine, request, round, callback);
+  }
+  uint64_t next_direct = 0;
+
+  // DRIVE the transfers until every request was sent and a majority
+  // succeeded, everyone answered, or the round ran out of time.
+  while (answered < requests.size()) {
+    int running = 0;
+    curl_multi_perform(engine->multi, &running);
+
+    CURLMsg *message;
+    int queued = 0;
+    while ((message = curl_multi_info_read(engine->multi, &queued)) != nullptr) {
+      if (message->msg != CURLMSG_DONE)
+        continue;
+      Transfer *transfer = nullptr;
+      curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char **>(&transfer));
+      bool ok = message->data.result == CURLE_OK;
+      curl_multi_remove_handle(engine->multi, message->easy_handle);
+      // A transfer that failed has no status to report.
+      gallocy::http::Response response;
+      response.status_code = 0;
+      if (ok) {
+        long status_code = 0;  // NOLINT(runtime/int)
+        curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &status_code);
+        response.from_buffer(transfer->head);
+        response.status_code = status_code;
+        response.body.swap(transfer->body);
+      }
+      response.peer = transfer->peer;
+      // CALL back the round of a transfer that finished after its round
+      // returned, without counting it in this one.
+      if (transfer->round == round) {
+        answered++;
+        if (callback(response))
+          successes++;
+      } else if (transfer->callback) {
+        transfer->callback(response);
       }
+      checkin_transfer(engine, transfer, ok);
     }
-  }
 
-  for (auto &f : futures) {
-    std::future_status status;
-    status = f.wait_for(std::chrono::nanoseconds(150));
-    if (status == std::future_status::deferred) {
-      // no-op
-    } else if (status == std::future_status::timeout) {
-      // TODO(sholsapp): What should we do here? Are these just zombie threads
-      // at this point that never get cleaned up?
-      // LOG_WARNING("Need to keep waiting... this thread won't be cleaned up!");
-    } else if (status == std::future_status::ready) {
-      f.get();
-      // LOG_DEBUG("Cleaning up an std::future: " << f.get());
+    if (answered == requests.size())
+      break;
+    uint64_t now = now_ms();
+    if (now >= deadline)
+      break;
+
+    // ANSWER one request that needs no network, or start its transfer if it
+    // needs one after all, and go back to the network transfers.
+    if (next_direct < direct.size()) {
+      const gallocy::http::Request *request = direct[next_direct++];
+      gallocy::http::Response *response = request_direct(*request);
+      if (response) {
+        answered++;
+        if (callback(*response))
+          successes++;
+        response->~Response();
+        internal_free(response);
+      } else {
+        start_transfer(engine, *request, round, callback);
+      }
+      continue;
     }
+    // STOP waiting once a majority succeeded, as every request was sent.
+    if (successes >= quorum)
+      break;
+    curl_multi_wait(engine->multi, nullptr, 0, deadline - now, nullptr);
+  }
+
+  if (cv && successes >= quorum) {
+    std::lock_guard<std::mutex> cv_lock(*cv_m);
+    cv->notify_all();
   }
 
-  return rsp_count;
+  return successes;
 }
 
 
-gallocy::http::Response *gallocy::http::UDPClient::request(const gallocy::http::Request &request) {
-  UDPTransport udp(request.peer, 0);
-  uint8_t attempts = 0;
+gallocy::http::Response *gallocy::http::CurlClient::request_direct(const gallocy::http::Request &request) {
+  return nullptr;
+}
+
+
+bool gallocy::http::CurlClient::prefers_direct(const gallocy::http::Request &request) {
+  return false;
+}
+
+
+gallocy::http::Response *gallocy::http::ShmClient::request(const gallocy::http::Request &request) {
+  gallocy::http::Response *response = request_direct(request);
+  if (response)
+    return response;
+  return CurlClient::request(request);
+}
+
+
+bool gallocy::http::ShmClient::prefers_direct(const gallocy::http::Request &request) {
+  return is_local_address(request.peer);
+}
+
+
+gallocy::http::Response *gallocy::http::ShmClient::request_direct(const gallocy::http::Request &request) {
+  if (!is_local_address(request.peer))
+    return nullptr;
+  ShmTransport shm(request.peer);
+  if (!shm.is_open())
+    return nullptr;
   gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
-  // TODO(rverdon): Need to have an error message in the response if the 3 attempts failed. What should it be?
+  shm.write(request.build_request());
+  gallocy::string http = shm.read();
+  // A request the listener gave up on has no status to report.
+  response->status_code = 0;
+  if (http.length() > 0)
+    response->from_buffer(http);
+  response->peer = request.peer;
+  return response;
+}
 
-  while (attempts < retry_limit) {
-    udp.write(request.build_request());
 
-    gallocy::string http = udp.read();
-    if (http.length() > 0) {
-      response->from_buffer(http);
-      response->peer = request.peer;
-      break;
-    }
+/**
+ * An estimate of the round trip time to a peer, after RFC 6298, in
+ * microseconds.
+ */
+struct RttEstimate {
+  RttEstimate() :
+    srtt(0),
+    rttvar(0),
+    rto(UDP_RTO_INITIAL_MS * 1000),
+    sampled(false) {}
+  int64_t srtt;
+  int64_t rttvar;
+  /**
+   * How long to wait for a response before sending the request again.
+   */
+  int64_t rto;
+  bool sampled;
+};
+
+
+/**
+ * Update the estimate of the round trip time to a peer.
+ *
+ * \param estimate The estimate.
+ * \param rtt The round trip time of a request that was only sent once.
+ */
+static void rtt_sample(RttEstimate *estimate, int64_t rtt) {
+  if (!estimate->sampled) {
+    estimate->srtt = rtt;
+    estimate->rttvar = rtt / 2;
+    estimate->sampled = true;
+  } else {
+    int64_t error = estimate->srtt - rtt;
+    estimate->rttvar += ((error < 0 ? -error : error) - estimate->rttvar) / 4;
+    estimate->srtt += (rtt - estimate->srtt) / 8;
+  }
+  estimate->rto = std::min<int64_t>(std::max<int64_t>(estimate->srtt + 4 * estimate->rttvar,
+    UDP_RTO_MIN_MS * 1000), UDP_RTO_MAX_MS * 1000);
+}
 
-    attempts++;
+
+/**
+ * A request of a round of \ref gallocy::http::UDPClient, waiting for its
+ * response.
+ */
+struct Datagram {
+  gallocy::string http;
+  uint64_t id;
+  struct sockaddr_in addr;
+  RttEstimate *estimate;
+  /**
+   * When the request was last sent, and when it is sent again.
+   */
+  uint64_t sent_us;
+  uint64_t deadline_us;
+  uint8_t attempts;
+  bool done;
+  /**
+   * The response, and when it arrived, once \ref Datagram::arrived is set by
+   * whichever round received it.
+   */
+  gallocy::string response;
+  uint64_t arrived_us;
+  bool arrived;
+};
+
+
+/**
+ * The UDP socket every request of this node is sent on.
+ *
+ * Requests are tagged with an ``X-Request-Id`` header that is unique to the
+ * node, and responses are matched to requests by it, so a response that
+ * arrives after its request was answered or given up on is dropped.
+ *
+ * Many rounds can be outstanding at once. Each registers its requests in
+ * \ref DatagramEngine::pending, and one round at a time receives from the
+ * socket on behalf of all of them, handing each response to the request it
+ * answers and waking the rounds that wait.
+ */
+struct DatagramEngine {
+  DatagramEngine() :
+    sock(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)),
+    next_id(0),
+    receiving(false) {
+      if (sock == -1)
+        perror("udpclient socket");
   }
-  return response;
+  int sock;
+  uint64_t next_id;
+  /**
+   * The round trip time estimates, by peer.
+   */
+  gallocy::map<gallocy::string, RttEstimate> estimates;
+  /**
+   * The requests waiting for their responses, by identifier.
+   */
+  gallocy::map<uint64_t, Datagram *> pending;
+  /**
+   * Guards everything here but the buffer, which only the receiving round
+   * uses.
+   */
+  std::mutex lock;
+  /**
+   * Signaled when the receiving round hands out responses and stops
+   * receiving.
+   */
+  std::condition_variable received;
+  /**
+   * True while a round receives from the socket.
+   */
+  bool receiving;
+  char buf[UDP_BUFSIZE];
+};
+
+
+static DatagramEngine &get_datagram_engine() {
+  static DatagramEngine engine;
+  return engine;
 }
 
 
-uint64_t gallocy::http::UDPClient::multirequest(const gallocy::vector<gallocy::http::Request> requests,
-                                  std::function<bool(const gallocy::http::Response &)> callback,
-                                  std::condition_variable *cv,
-                                  std::mutex *cv_m) {
-  int rsp_count = 0;
-  int peer_count = requests.size();
-  int peer_majority = peer_count / 2;
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-  // TODO(sholsapp): Move these to a caller and take them by parameter. The
-  // caller can use these to continue operation when a majority of requests are
-  // complete.
-  std::condition_variable rsp_have_majority;
-  std::mutex rsp_count_lock;
 
-  std::vector<std::future<uint64_t>> futures;
+static void send_datagram(DatagramEngine *engine, Datagram *datagram, uint64_t now) {
+  if (sendto(engine->sock, datagram->http.data(), datagram->http.length(), 0,
+             reinterpret_cast<struct sockaddr *>(&datagram->addr), sizeof(datagram->addr)) == -1)
+    perror("udpclient sendto");
+  datagram->sent_us = now;
+  datagram->deadline_us = now + datagram->estimate->rto;
+  datagram->attempts++;
+}
 
-  for (auto &request : requests) {
-    std::future<uint64_t> future =
-      std::async(std::launch::async, [&request, &peer_majority, &rsp_count, &rsp_count_lock, &rsp_have_majority, &callback]() {
-        gallocy::http::Response *rsp = gallocy::http::UDPClient().request(request);
-        uint64_t status_code = rsp->status_code;
-
-        // CHECK if we have a majority of repsonses and signal if ready.
-        {
-          std::unique_lock<std::mutex> lk(rsp_count_lock);
-          // CHECK if the callback received the expected response.
-          if (callback(*rsp))
-            rsp_count++;
-          if (rsp_count >= peer_majority)
-            rsp_have_majority.notify_all();
-        }
 
-        // FREE the response since we're done with it.
-        rsp->~Response();
-        internal_free(rsp);
+/**
+ * Receive every response that arrived on the node's UDP socket, and hand each
+ * to the pending request it answers, whichever round the request is in.
+ *
+ * Called without the engine's lock held, by the one round that is receiving.
+ */
+static void receive_datagrams(DatagramEngine *engine) {
+  struct sockaddr_in src_addr;
+  socklen_t src_addr_len = sizeof(src_addr);
+  ssize_t length;
+  while ((length = recvfrom(engine->sock, engine->buf, UDP_BUFSIZE, 0,
+                            reinterpret_cast<struct sockaddr *>(&src_addr), &src_addr_len)) > 0) {
+    uint64_t now = now_us();
+    src_addr_len = sizeof(src_addr);
+    gallocy::http::MessageHead head;
+    if (gallocy::http::parse_head(engine->buf, length, &head) != HTTP_PARSE_OK)
+      continue;
+    gallocy::http::View id = head.find("X-Request-Id");
+    uint64_t response_id = 0;
+    for (uint64_t i = 0; i < id.length && id.data[i] >= '0' && id.data[i] <= '9'; i++)
+      response_id = response_id * 10 + (id.data[i] - '0');
+
+    std::lock_guard<std::mutex> lock(engine->lock);
+    auto it = engine->pending.find(response_id);
+    if (it == engine->pending.end())
+      continue;
+    Datagram *datagram = it->second;
+    if (datagram->arrived
+        || datagram->addr.sin_port != src_addr.sin_port
+        || datagram->addr.sin_addr.s_addr != src_addr.sin_addr.s_addr)
+      continue;
+    datagram->response.assign(engine->buf, length);
+    datagram->arrived_us = now;
+    datagram->arrived = true;
+  }
+}
+
 
-        // RETURN the HTTP status code.
-        return static_cast<uint64_t>(status_code);
-      });
-    futures.push_back(std::move(future));
+/**
+ * Send requests on the node's UDP socket and wait for their responses.
+ *
+ * Every request is outstanding at once. A request that is not answered
+ * within its peer's retransmit timeout is sent again, and the timeout is
+ * doubled, up to a number of attempts. Rounds from many threads run at
+ * once, see \ref DatagramEngine.
+ *
+ * \param requests The requests.
+ * \param count The number of requests.
+ * \param attempts The most times to send each request.
+ * \param quorum Return once this many responses were accepted.
+ * \param on_response Called with the index of each request and its raw
+ * response, or a view of nothing once it ran out of attempts. Returns if the
+ * response is accepted.
+ * \return The number of responses accepted.
+ */
+static uint64_t datagram_round(const gallocy::http::Request *requests, uint64_t count, uint8_t attempts,
+                               uint64_t quorum, std::function<bool(uint64_t, gallocy::http::View)> on_response) {
+  DatagramEngine *engine = &get_datagram_engine();
+  std::unique_lock<std::mutex> lock(engine->lock);
+
+  gallocy::vector<Datagram> datagrams(count);
+  uint64_t now = now_us();
+  for (uint64_t i = 0; i < count; i++) {
+    Datagram *datagram = &datagrams[i];
+    datagram->id = ++engine->next_id;
+    datagram->http = requests[i].build_request();
+    // TAG the request after its request line.
+    gallocy::stringstream tag;
+    tag << "X-Request-Id: " << datagram->id << "\r\n";
+    datagram->http.insert(datagram->http.find("\r\n") + 2, tag.str());
+    datagram->addr = requests[i].peer.get_socket();
+    datagram->estimate = &engine->estimates[requests[i].peer.get_string()];
+    datagram->attempts = 0;
+    datagram->done = false;
+    datagram->arrived = false;
+    engine->pending[datagram->id] = datagram;
+    send_datagram(engine, datagram, now);
   }
 
-  {
-    // LOG_DEBUG("Waiting for majority of threads to respond");
-    std::unique_lock<std::mutex> lk(rsp_count_lock);
-    while (rsp_count < peer_majority) {
-      // TODO(sholsapp): What should time out be such that it doesn't interfere
-      // with the leader timeout?
-      std::cv_status status = rsp_have_majority.wait_for(lk, std::chrono::milliseconds(50));
-      if (status == std::cv_status::timeout) {
-        // LOG_DEBUG("Failed to get majority at " << rsp_count << " of " << peer_count << "!");
-        return rsp_count;
-      } else if (status == std::cv_status::no_timeout) {
-        // LOG_DEBUG("Has majority at " << rsp_count << " of " << peer_count << "!");
+  uint64_t answered = 0;
+  uint64_t successes = 0;
+  while (successes < quorum && answered < count) {
+    // ANSWER the requests whose responses arrived, without the lock held, as
+    // the callback may take a while.
+    gallocy::vector<uint64_t> arrived;
+    for (uint64_t i = 0; i < count; i++) {
+      Datagram *datagram = &datagrams[i];
+      if (datagram->done || !datagram->arrived)
+        continue;
+      datagram->done = true;
+      answered++;
+      // SAMPLE only requests sent once, as a response to one sent again
+      // could be to either.
+      if (datagram->attempts == 1)
+        rtt_sample(datagram->estimate, datagram->arrived_us - datagram->sent_us);
+      arrived.push_back(i);
+    }
+    if (!arrived.empty()) {
+      lock.unlock();
+      for (auto i : arrived) {
+        gallocy::http::View http = { datagrams[i].response.data(), datagrams[i].response.length() };
+        if (on_response(i, http))
+          successes++;
       }
+      lock.lock();
+      continue;
+    }
+
+    // RESEND the requests whose timeout passed, or give up on them.
+    now = now_us();
+    uint64_t wait_us = UDP_RTO_MAX_MS * 1000;
+    gallocy::vector<uint64_t> expired;
+    for (uint64_t i = 0; i < count; i++) {
+      Datagram *datagram = &datagrams[i];
+      if (datagram->done)
+        continue;
+      if (now >= datagram->deadline_us) {
+        if (datagram->attempts >= attempts) {
+          datagram->done = true;
+          answered++;
+          expired.push_back(i);
+          continue;
+        }
+        // BACK OFF, as the peer or the network is slower than estimated.
+        datagram->estimate->rto = std::min<int64_t>(2 * datagram->estimate->rto, UDP_RTO_MAX_MS * 1000);
+        send_datagram(engine, datagram, now);
+      }
+      wait_us = std::min(wait_us, datagram->deadline_us - now);
+    }
+    if (!expired.empty()) {
+      lock.unlock();
+      for (auto i : expired) {
+        gallocy::http::View nothing = { nullptr, 0 };
+        if (on_response(i, nothing))
+          successes++;
+      }
+      lock.lock();
+      continue;
     }
-  }
 
-  for (auto &f : futures) {
-    std::future_status status;
-    status = f.wait_for(std::chrono::nanoseconds(150));
-    if (status == std::future_status::deferred) {
-      // no-op
-    } else if (status == std::future_status::timeout) {
-      // TODO(sholsapp): What should we do here? Are these just zombie threads
-      // at this point that never get cleaned up?
-      // LOG_WARNING("Need to keep waiting... this thread won't be cleaned up!");
-    } else if (status == std::future_status::ready) {
-      f.get();
-      // LOG_DEBUG("Cleaning up an std::future: " << f.get());
+    // RECEIVE for every round, unless another round already is, in which
+    // case wait for it to hand out what it received.
+    if (engine->receiving) {
+      engine->received.wait_for(lock, std::chrono::microseconds(wait_us));
+      continue;
     }
+    engine->receiving = true;
+    lock.unlock();
+    struct pollfd pfd = { engine->sock, POLLIN, 0 };
+    if (poll(&pfd, 1, (wait_us + 999) / 1000) > 0)
+      receive_datagrams(engine);
+    lock.lock();
+    engine->receiving = false;
+    engine->received.notify_all();
+  }
+
+  for (uint64_t i = 0; i < count; i++)
+    engine->pending.erase(datagrams[i].id);
+  return successes;
+}
+
+
+gallocy::http::Response *gallocy::http::UDPClient::request(const gallocy::http::Request &request) {
+  gallocy::http::Response *response = new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
+  // TODO(rverdon): Need to have an error message in the response if the 3 attempts failed. What should it be?
+  datagram_round(&request, 1, retry_limit, 1, [response, &request](uint64_t i, gallocy::http::View http) {
+    if (http.data == nullptr)
+      return false;
+    response->from_buffer(http.str());
+    response->peer = request.peer;
+    return true;
+  });
+  return response;
+}
+
+
+uint64_t gallocy::http::UDPClient::multirequest(const gallocy::vector<gallocy::http::Request> requests,
+                                  std::function<bool(const gallocy::http::Response &)> callback,
+                                  std::condition_variable *cv,
+                                  std::mutex *cv_m) {
+  // A majority of the cluster, counting this peer, which does not send itself
+  // requests.
+  uint64_t quorum = (requests.size() + 1) / 2;
+  uint64_t successes = datagram_round(requests.data(), requests.size(), retry_limit, quorum,
+    [&requests, &callback](uint64_t i, gallocy::http::View http) {
+      // A request that ran out of attempts has no status to report.
+      gallocy::http::Response response;
+      response.status_code = 0;
+      if (http.data != nullptr)
+        response.from_buffer(http.str());
+      response.peer = requests[i].peer;
+      return callback(response);
+    });
+
+  if (cv && successes >= quorum) {
+    std::lock_guard<std::mutex> cv_lock(*cv_m);
+    cv->notify_all();
   }
 
-  return rsp_count;
+  return successes;
 }
@@ -0,0 +1,91 @@
+#include <string.h>
+#include <strings.h>
+
+#include "gallocy/http/headers.h"
+
+
+bool gallocy::http::View::equals(const char *s) const {
+  return strlen(s) == length && memcmp(data, s, length) == 0;
+}
+
+
+bool gallocy::http::View::iequals(const char *s) const {
+  return strlen(s) == length && strncasecmp(data, s, length) == 0;
+}
+
+
+bool gallocy::http::View::iequals(View other) const {
+  return other.length == length && strncasecmp(data, other.data, length) == 0;
+}
+
+
+bool gallocy::http::Headers::set(View name, View value) {
+  if (borrowed != nullptr)
+    own();
+  uint64_t i = 0;
+  while (i < count && !this->name(i).iequals(name))
+    i++;
+  if (i == count) {
+    if (count == HTTP_MAX_HEADERS)
+      return false;
+    fields[i].name_offset = buffer.length();
+    fields[i].name_length = name.length;
+    buffer.append(name.data, name.length);
+    count++;
+  } else if (value.length <= fields[i].value_length) {
+    // OVERWRITE a value in place if the new one fits.
+    buffer.replace(fields[i].value_offset, value.length, value.data, value.length);
+    fields[i].value_length = value.length;
+    return true;
+  }
+  fields[i].value_offset = buffer.length();
+  fields[i].value_length = value.length;
+  buffer.append(value.data, value.length);
+  return true;
+}
+
+
+bool gallocy::http::Headers::borrow(const char *base, View name, View value) {
+  // COPY instead if these headers are already somewhere else.
+  if (count > 0 && borrowed != base)
+    return set(name, value);
+  uint64_t i = 0;
+  while (i < count && !this->name(i).iequals(name))
+    i++;
+  if (i == count) {
+    if (count == HTTP_MAX_HEADERS)
+      return false;
+    fields[i].name_offset = name.data - base;
+    fields[i].name_length = name.length;
+    count++;
+  }
+  fields[i].value_offset = value.data - base;
+  fields[i].value_length = value.length;
+  borrowed = base;
+  return true;
+}
+
+
+void gallocy::http::Headers::own() {
+  gallocy::string copy;
+  for (uint64_t i = 0; i < count; i++) {
+    View name = this->name(i);
+    View value = this->value(i);
+    fields[i].name_offset = copy.length();
+    copy.append(name.data, name.length);
+    fields[i].value_offset = copy.length();
+    copy.append(value.data, value.length);
+  }
+  buffer.swap(copy);
+  borrowed = nullptr;
+}
+
+
+gallocy::http::View gallocy::http::Headers::find(const char *name) const {
+  for (uint64_t i = 0; i < count; i++) {
+    if (this->name(i).iequals(name))
+      return value(i);
+  }
+  View nothing = { nullptr, 0 };
+  return nothing;
+}
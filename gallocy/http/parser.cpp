@@ -0,0 +1,150 @@
+#include "gallocy/http/parser.h"
+
+
+/**
+ * Where the parser is in the head of a message.
+ */
+enum ParseState {
+  START_0,
+  START_1,
+  START_2,
+  START_LF,
+  LINE,
+  NAME,
+  VALUE_SPACE,
+  VALUE,
+  LINE_LF,
+  END_LF,
+};
+
+
+gallocy::http::View gallocy::http::MessageHead::find(const char *name) const {
+  for (uint64_t i = 0; i < header_count; i++) {
+    if (headers[i].name.iequals(name))
+      return headers[i].value;
+  }
+  View nothing = { nullptr, 0 };
+  return nothing;
+}
+
+
+uint64_t gallocy::http::MessageHead::content_length(uint64_t fallback) const {
+  View value = find("Content-Length");
+  if (value.data == nullptr)
+    return fallback;
+  if (value.length == 0)
+    return HTTP_CONTENT_LENGTH_INVALID;
+  uint64_t length = 0;
+  for (uint64_t i = 0; i < value.length; i++) {
+    if (value.data[i] < '0' || value.data[i] > '9')
+      return HTTP_CONTENT_LENGTH_INVALID;
+    uint64_t digit = value.data[i] - '0';
+    // CHECK the length fits before growing it, so that a long value cannot
+    // wrap around to a small one.
+    if (length > (HTTP_CONTENT_LENGTH_INVALID - 1 - digit) / 10)
+      return HTTP_CONTENT_LENGTH_INVALID;
+    length = length * 10 + digit;
+  }
+  return length;
+}
+
+
+int gallocy::http::parse_head(const char *data, uint64_t length, MessageHead *head) {
+  ParseState state = START_0;
+  uint64_t mark = 0;
+  uint64_t value_end = 0;
+  head->header_count = 0;
+  head->length = 0;
+  for (int i = 0; i < 3; i++) {
+    head->start[i].data = data;
+    head->start[i].length = 0;
+  }
+
+  for (uint64_t i = 0; i < length; i++) {
+    char c = data[i];
+    switch (state) {
+      // SPLIT the first line on its first two spaces, as a response's reason
+      // may have spaces of its own.
+      case START_0:
+        if (c == ' ') {
+          if (i == 0)
+            return HTTP_PARSE_ERROR;
+          head->start[0].length = i;
+          head->start[1].data = data + i + 1;
+          mark = i + 1;
+          state = START_1;
+        } else if (c == '\r' || c == '\n') {
+          return HTTP_PARSE_ERROR;
+        }
+        break;
+      case START_1:
+        if (c == ' ' || c == '\r' || c == '\n') {
+          head->start[1].length = i - mark;
+          head->start[2].data = data + i + 1;
+          mark = i + 1;
+          state = c == ' ' ? START_2 : c == '\r' ? START_LF : LINE;
+        }
+        break;
+      case START_2:
+        if (c == '\r' || c == '\n') {
+          head->start[2].length = i - mark;
+          state = c == '\r' ? START_LF : LINE;
+        }
+        break;
+      case START_LF:
+      case LINE_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        state = LINE;
+        break;
+      // START a header, or end the head at a blank line.
+      case LINE:
+        if (c == '\r') {
+          state = END_LF;
+        } else if (c == '\n') {
+          head->length = i + 1;
+          return HTTP_PARSE_OK;
+        } else if (c == ' ' || c == '\t' || c == ':') {
+          return HTTP_PARSE_ERROR;
+        } else {
+          if (head->header_count == HTTP_MAX_HEADERS)
+            return HTTP_PARSE_ERROR;
+          head->headers[head->header_count].name.data = data + i;
+          mark = i;
+          state = NAME;
+        }
+        break;
+      case NAME:
+        if (c == ':') {
+          head->headers[head->header_count].name.length = i - mark;
+          state = VALUE_SPACE;
+        } else if (c == '\r' || c == '\n') {
+          return HTTP_PARSE_ERROR;
+        }
+        break;
+      // TRIM the whitespace before and after the value.
+      case VALUE_SPACE:
+        if (c == ' ' || c == '\t')
+          break;
+        mark = value_end = i;
+        state = VALUE;
+        // FALLTHROUGH, as the value starts here, or is empty.
+      case VALUE:
+        if (c == '\r' || c == '\n') {
+          HeaderView *header = &head->headers[head->header_count++];
+          header->value.data = data + mark;
+          header->value.length = value_end - mark;
+          state = c == '\r' ? LINE_LF : LINE;
+        } else if (c != ' ' && c != '\t') {
+          value_end = i + 1;
+        }
+        break;
+      case END_LF:
+        if (c != '\n')
+          return HTTP_PARSE_ERROR;
+        head->length = i + 1;
+        return HTTP_PARSE_OK;
+    }
+  }
+  return HTTP_PARSE_INCOMPLETE;
+}
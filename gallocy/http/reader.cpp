@@ -0,0 +1,152 @@
+#include <string.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/http/parser.h"
+#include "gallocy/http/reader.h"
+
+
+gallocy::http::RequestReader::RequestReader() :
+  buffer(reinterpret_cast<char *>(internal_malloc(READER_BUFSIZE))),
+  capacity(READER_BUFSIZE),
+  start(0),
+  end(0),
+  scanned(0),
+  head_length(0),
+  content_length(0),
+  continue_expected(false),
+  rejected_status(0) {}
+
+
+gallocy::http::RequestReader::~RequestReader() {
+  internal_free(buffer);
+}
+
+
+bool gallocy::http::RequestReader::fill(int socket) {
+  while (true) {
+    // READ the rest of a request whose head arrived in one go, if it is big.
+    uint64_t wanted = READER_BUFSIZE / 4;
+    if (head_length > 0 && length() > buffered() + wanted)
+      wanted = length() - buffered();
+    reserve(wanted);
+    ssize_t n = recv(socket, buffer + end, capacity - end, 0);
+    if (n > 0) {
+      end += n;
+      if (head_length == 0)
+        frame();
+      // STOP reading a request that will not be served.
+      if (rejected_status != 0)
+        return true;
+    } else if (n == 0) {
+      return false;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+
+void gallocy::http::RequestReader::append(const char *data, uint64_t length) {
+  reserve(length);
+  memcpy(buffer + end, data, length);
+  end += length;
+}
+
+
+bool gallocy::http::RequestReader::frame() {
+  if (rejected_status != 0)
+    return true;
+  if (head_length == 0) {
+    // SEARCH only the bytes that arrived since the last search, and the few
+    // before them that could start the blank line.
+    uint64_t from = scanned > 3 ? scanned - 3 : 0;
+    const char *blank = reinterpret_cast<const char *>(
+      memmem(buffer + start + from, buffered() - from, "\r\n\r\n", 4));
+    if (blank == nullptr) {
+      scanned = buffered();
+      if (scanned > READER_MAX_HEAD) {
+        rejected_status = 413;
+        return true;
+      }
+      return false;
+    }
+    head_length = blank - (buffer + start) + 4;
+    if (head_length > READER_MAX_HEAD) {
+      rejected_status = 413;
+      return true;
+    }
+    parse_head();
+    if (rejected_status != 0)
+      return true;
+  }
+  return buffered() >= length();
+}
+
+
+void gallocy::http::RequestReader::parse_head() {
+  MessageHead head;
+  // LEAVE a head that is not HTTP to whoever parses the request, with no
+  // body.
+  if (gallocy::http::parse_head(buffer + start, head_length, &head) != HTTP_PARSE_OK)
+    return;
+  content_length = head.content_length(0);
+  // REJECT a body that cannot be buffered before making room for it.
+  if (content_length == HTTP_CONTENT_LENGTH_INVALID) {
+    rejected_status = 400;
+    content_length = 0;
+    return;
+  }
+  if (content_length > READER_MAX_BODY) {
+    rejected_status = 413;
+    content_length = 0;
+    return;
+  }
+  continue_expected = head.find("Expect").iequals("100-continue");
+}
+
+
+void gallocy::http::RequestReader::consume() {
+  start += length();
+  scanned = 0;
+  head_length = 0;
+  content_length = 0;
+  continue_expected = false;
+  rejected_status = 0;
+  if (start < end)
+    return;
+  start = end = 0;
+  if (capacity > READER_MAX_RETAINED) {
+    internal_free(buffer);
+    buffer = reinterpret_cast<char *>(internal_malloc(READER_BUFSIZE));
+    capacity = READER_BUFSIZE;
+  }
+}
+
+
+void gallocy::http::RequestReader::reserve(uint64_t free_bytes) {
+  if (capacity - end >= free_bytes)
+    return;
+  // MOVE the buffered bytes to the front, over the requests consumed.
+  if (capacity - (end - start) >= free_bytes) {
+    memmove(buffer, buffer + start, end - start);
+    end -= start;
+    start = 0;
+    return;
+  }
+  // GROW the buffer, copying only the buffered bytes.
+  uint64_t grown = capacity * 2;
+  if (grown < end - start + free_bytes)
+    grown = end - start + free_bytes;
+  char *bigger = reinterpret_cast<char *>(internal_malloc(grown));
+  memcpy(bigger, buffer + start, end - start);
+  internal_free(buffer);
+  buffer = bigger;
+  capacity = grown;
+  end -= start;
+  start = 0;
+}
@@ -2,42 +2,47 @@
 #include <vector>
 
 #include "gallocy/common/peer.h"
+#include "gallocy/http/parser.h"
 #include "gallocy/http/request.h"
 #include "gallocy/utils/stringutils.h"
 
 
 gallocy::http::Request::Request(gallocy::string raw) {
-  // Parse the raw request into lines
-  gallocy::vector<gallocy::string> lines;
-  utils::split(raw, '\n', lines);
-
-  // Parse the first line into the request line parts
-  gallocy::vector<gallocy::string> request_line;
-  utils::split(lines[0], ' ', request_line);
-  method = utils::trim(request_line[0]);
-  uri = utils::trim(request_line[1]);
-  protocol = utils::trim(request_line[2]);
-
-  // Track the line each parser leaves off.
-  uint64_t line_idx = 1;
-
-  // Parse the headers
-  for (auto it = std::begin(lines) + 1; it != std::end(lines); ++it) {
-    if ((*it).compare("\r") == 0 || (*it).compare("") == 0)
-      break;
-    gallocy::vector<gallocy::string> header_parts;
-    utils::split(*it, ':', header_parts);
-    headers[utils::trim(header_parts[0])] = utils::trim(header_parts[1]);
-    line_idx++;
-  }
-  // Skip the '\r' character that indicated end of request head
-  line_idx++;
+  parse(raw.data(), raw.length(), false);
+}
+
+
+gallocy::http::Request::Request(const char *data, uint64_t length) {
+  parse(data, length, true);
+}
+
 
-  for (auto it = std::begin(lines) + line_idx; it != std::end(lines); ++it) {
-    if ((*it).compare("\r") == 0 || (*it).compare("") == 0)
-      break;
-    raw_body = utils::trim(*it);
+void gallocy::http::Request::parse(const char *data, uint64_t length, bool borrow) {
+  MessageHead head;
+  if (parse_head(data, length, &head) != HTTP_PARSE_OK)
+    return;
+  method = head.start[0].str();
+  uri = head.start[1].str();
+  protocol = head.start[2].str();
+
+  // A request has a body only if it says how long it is.
+  uint64_t body_length = head.content_length(0);
+  if (body_length > length - head.length)
+    body_length = length - head.length;
+
+  if (borrow) {
+    for (uint64_t i = 0; i < head.header_count; i++)
+      headers.borrow(data, head.headers[i].name, head.headers[i].value);
+    body.data = data + head.length;
+    body.length = body_length;
+    return;
   }
+
+  // COPY the headers into one buffer, rather than one string each.
+  headers.reserve(head.length);
+  for (uint64_t i = 0; i < head.header_count; i++)
+    headers.set(head.headers[i].name, head.headers[i].value);
+  raw_body.assign(data + head.length, body_length);
 }
 
 
@@ -49,13 +54,12 @@ gallocy::http::Request::Request(gallocy::string method, const gallocy::common::P
 
 
 gallocy::http::Request::Request(gallocy::string method, const gallocy::common::Peer &peer, gallocy::string uri,
-                 gallocy::string body, Headers headers) {
+                 gallocy::string body, const Headers &headers) {
   this->method = method;
   this->peer = peer;
   this->uri = uri;
   this->raw_body = body;
-  for (auto &it : headers)
-    this->headers[it.first] = it.second;
+  this->headers = headers;
 }
 
 
@@ -66,14 +70,22 @@ gallocy::http::Request::Request(gallocy::string method, const gallocy::common::P
  */
 gallocy::json &gallocy::http::Request::get_json() {
   if (json == gallocy::json(nullptr)
-      && headers.count("Content-Type")
-      && headers["Content-Type"] == "application/json") {
-    json = gallocy::json::parse(raw_body.c_str());
+      && headers.find("Content-Type").equals("application/json")) {
+    View text = get_body();
+    json = gallocy::json::parse(gallocy::json::string_t(text.data, text.length));
   }
   return json;
 }
 
 
+gallocy::http::View gallocy::http::Request::get_body() const {
+  if (body.data != nullptr)
+    return body;
+  View owned = { raw_body.data(), raw_body.length() };
+  return owned;
+}
+
+
 /**
  * The request parameters if present.
  *
@@ -114,9 +126,9 @@ gallocy::string gallocy::http::Request::build_request() const {
     s << "POST " << uri << " HTTP/1.1\r\n"
       << "Host: " << peer.get_string() << "\r\n"
       << "Content-Type: " << content_type << "\r\n"
-      << "Content-Length: " << raw_body.length() << "\r\n"
-      << "\r\n"
-      << raw_body.c_str();
+      << "Content-Length: " << get_body().length << "\r\n"
+      << "\r\n";
+    s.write(get_body().data, get_body().length);
   } else {
     abort();
   }
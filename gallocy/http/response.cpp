@@ -1,65 +1,86 @@
-#include <string>
-#include <vector>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 
+#include "gallocy/http/parser.h"
 #include "gallocy/http/response.h"
-#include "gallocy/utils/stringutils.h"
 
 
 /**
  * Create a response.
  */
 gallocy::http::Response::Response() {
-  protocol = "HTTP/1.0";
+  protocol = "HTTP/1.1";
 }
 
 void gallocy::http::Response::from_buffer(gallocy::string raw) {
-  // Parse the raw response into lines
-  gallocy::vector<gallocy::string> lines;
-  utils::split(raw, '\n', lines);
+  MessageHead head;
+  if (parse_head(raw.data(), raw.length(), &head) != HTTP_PARSE_OK)
+    return;
+  protocol = head.start[0].str();
+  status_code = strtoull(head.start[1].str().c_str(), nullptr, 10);
 
-  // Parse the first line into the response line parts
-  gallocy::vector<gallocy::string> response_line;
-  utils::split(lines[0], ' ', response_line);
-  protocol = utils::trim(response_line[0]);
-  status_code = std::stoi(utils::trim(response_line[1]));
+  headers.reserve(head.length);
+  for (uint64_t i = 0; i < head.header_count; i++)
+    headers.set(head.headers[i].name, head.headers[i].value);
+
+  uint64_t body_length = head.content_length(raw.length() - head.length);
+  if (body_length > raw.length() - head.length)
+    body_length = raw.length() - head.length;
+  body.assign(raw.data() + head.length, body_length);
+}
 
-  // Track the line each parser leaves off.
-  uint64_t line_idx = 1;
 
-  // Parse the headers
-  for (auto it = std::begin(lines) + 1; it != std::end(lines); ++it) {
-    if ((*it).compare("\r") == 0 || (*it).compare("") == 0)
-      break;
-    gallocy::vector<gallocy::string> header_parts;
-    utils::split(*it, ':', header_parts);
-    headers[utils::trim(header_parts[0])] = utils::trim(header_parts[1]);
-    line_idx++;
+/**
+ * The reason phrase of a status code.
+ */
+static const char *reason(uint64_t status_code) {
+  switch (status_code) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 500: return "Internal Server Error";
+    default: return "OK";
   }
-  // Skip the '\r' character that indicated end of request head
-  line_idx++;
+}
 
-  for (auto it = std::begin(lines) + line_idx; it != std::end(lines); ++it) {
-    if ((*it).compare("\r") == 0 || (*it).compare("") == 0)
-      break;
-    body = utils::trim(*it);
+
+void gallocy::http::Response::write_head(gallocy::string *out) {
+  char number[24];
+  out->append(protocol);
+  out->append(number, snprintf(number, sizeof(number), " %" PRIu64 " ", status_code));
+  out->append(reason(status_code));
+  out->append("\r\n");
+  if (!headers.has("Content-Length")) {
+    out->append("Content-Length: ");
+    out->append(number, snprintf(number, sizeof(number), "%zu", body.length()));
+    out->append("\r\n");
+  }
+  for (uint64_t i = 0; i < headers.size(); i++) {
+    out->append(headers.name(i).data, headers.name(i).length);
+    out->append(": ");
+    out->append(headers.value(i).data, headers.value(i).length);
+    out->append("\r\n");
   }
+  out->append("\r\n");
 }
+
+
 /**
  * The response as a string.
  *
  * The rseponse as a string, which is appropriate for sending over the wire to
- * an HTTP client.
+ * an HTTP client. The body is framed by its ``Content-Length``, so that the
+ * connection can carry another response after it.
  *
  * :returns: The response as a string.
  */
 gallocy::string gallocy::http::Response::str() {
-  gallocy::stringstream out;
-  out << protocol << " " << status_code << " " << "OK" << "\r\n";
-  for (auto it : headers) {
-    out << it.first << ": " << it.second << "\r\n";
-  }
-  out << "\r\n" << body << "\r\n\r\n";
-  return out.str();
+  gallocy::string out;
+  write_head(&out);
+  out.append(body);
+  return out;
 }
 
 
@@ -72,7 +93,9 @@ gallocy::string gallocy::http::Response::str() {
  * :returns: The size of the response in bytes.
  */
 uint64_t gallocy::http::Response::size() {
-  return str().size();
+  gallocy::string head;
+  write_head(&head);
+  return head.length() + body.length();
 }
 
 /**
@@ -1,5 +1,30 @@
 #include "gallocy/http/transport.h"
 
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+
+// The phases of a shared memory channel.
+#define SHM_FREE 0
+#define SHM_CLAIMED 1
+#define SHM_READY 2
+#define SHM_SERVING 3
+#define SHM_DONE 4
+#define SHM_ABANDONED 5
+#define SHM_TICKET_MASK 0xffffff
+
 
 gallocy::http::TCPTransport::TCPTransport(gallocy::common::Peer dst_peer, uint16_t listen_port) {
     // CREATE the socket
@@ -52,16 +77,11 @@ gallocy::string gallocy::http::TCPTransport::read() {
     return http;
 }
 
-void gallocy::http::TCPTransport::write(gallocy::string http) {
-    uint32_t total_sent = 0;
-    uint32_t sent = 0;
-
-    while (total_sent != http.length()) {
-        if ((sent = send(sock, http.substr(total_sent).c_str(), http.length() - total_sent, 0)) < 0) {
-            perror("tcptransport send failed");
-            exit(1);
-        }
-        total_sent += sent;
+void gallocy::http::TCPTransport::write(const gallocy::string &http) {
+    struct iovec iov = { const_cast<char *>(http.data()), http.length() };
+    if (!send_all(sock, &iov, 1)) {
+        perror("tcptransport send failed");
+        exit(1);
     }
 }
 
@@ -116,13 +136,13 @@ gallocy::string gallocy::http::UDPTransport::read() {
     return http;
 }
 
-void gallocy::http::UDPTransport::write(gallocy::string http) {
-    uint32_t total_sent = 0;
-    uint32_t sent = 0;
+void gallocy::http::UDPTransport::write(const gallocy::string &http) {
+    uint64_t total_sent = 0;
+    ssize_t sent = 0;
     struct sockaddr_in dst_addr = peer.get_socket();
 
     while (total_sent != http.length()) {
-        if ((sent = sendto(sock, http.substr(total_sent).c_str(), http.length() - total_sent, 0,
+        if ((sent = sendto(sock, http.data() + total_sent, http.length() - total_sent, 0,
                         reinterpret_cast<struct sockaddr*>(std::addressof(dst_addr)), sizeof(dst_addr))) < 0) {
             perror("udptransport sendto failed");
             exit(1);
@@ -135,3 +155,429 @@ gallocy::http::UDPTransport::~UDPTransport() {
     // CLEANUP
     close(sock);
 }
+
+
+static uint32_t shm_state(uint32_t ticket, uint32_t phase) {
+    return (ticket << 8) | phase;
+}
+
+static uint32_t shm_ticket(uint32_t state) {
+    return state >> 8;
+}
+
+static uint32_t shm_phase(uint32_t state) {
+    return state & 0xff;
+}
+
+/**
+ * Sleep until a word no longer holds a value, or until a timeout.
+ *
+ * \return 0 when woken, or -1 with ``errno`` set.
+ */
+static int futex_wait(std::atomic<uint32_t> *word, uint32_t expected, uint64_t timeout_ms) {
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected,
+                   std::addressof(timeout), nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Copy bytes into a ring, sleeping while it is full.
+ *
+ * \return False if the reader made no room for \ref SHM_TIMEOUT_MS.
+ */
+static bool ring_write(gallocy::http::ShmRing *ring, const void *buf, uint64_t len) {
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(buf);
+    while (len > 0) {
+        uint32_t head = ring->head.load();
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t space = SHM_RING_SZ - (tail - head);
+        if (space == 0) {
+            // ANNOUNCE the wait before checking again, so the reader either
+            // sees the flag or we see its progress.
+            ring->writer_waiting.store(1);
+            int ret = 0;
+            if (ring->head.load() == head)
+                ret = futex_wait(std::addressof(ring->head), head, SHM_TIMEOUT_MS);
+            ring->writer_waiting.store(0);
+            if (ret == -1 && errno == ETIMEDOUT)
+                return false;
+            continue;
+        }
+        uint32_t n = std::min(static_cast<uint64_t>(space), len);
+        uint32_t offset = tail & (SHM_RING_SZ - 1);
+        uint32_t first = std::min(n, SHM_RING_SZ - offset);
+        memcpy(ring->data + offset, data, first);
+        memcpy(ring->data, data + first, n - first);
+        ring->tail.store(tail + n);
+        if (ring->reader_waiting.load())
+            futex_wake(std::addressof(ring->tail));
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Copy bytes out of a ring, sleeping while it is empty.
+ *
+ * \return False if the writer wrote nothing for \ref SHM_TIMEOUT_MS.
+ */
+static bool ring_read(gallocy::http::ShmRing *ring, void *buf, uint64_t len) {
+    uint8_t *data = reinterpret_cast<uint8_t *>(buf);
+    while (len > 0) {
+        uint32_t tail = ring->tail.load();
+        uint32_t head = ring->head.load(std::memory_order_relaxed);
+        uint32_t available = tail - head;
+        if (available == 0) {
+            ring->reader_waiting.store(1);
+            int ret = 0;
+            if (ring->tail.load() == tail)
+                ret = futex_wait(std::addressof(ring->tail), tail, SHM_TIMEOUT_MS);
+            ring->reader_waiting.store(0);
+            if (ret == -1 && errno == ETIMEDOUT)
+                return false;
+            continue;
+        }
+        uint32_t n = std::min(static_cast<uint64_t>(available), len);
+        uint32_t offset = head & (SHM_RING_SZ - 1);
+        uint32_t first = std::min(n, SHM_RING_SZ - offset);
+        memcpy(data, ring->data + offset, first);
+        memcpy(data + first, ring->data, n - first);
+        ring->head.store(head + n);
+        if (ring->writer_waiting.load())
+            futex_wake(std::addressof(ring->head));
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void ring_reset(gallocy::http::ShmRing *ring) {
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->reader_waiting.store(0);
+    ring->writer_waiting.store(0);
+}
+
+gallocy::http::ShmTransport::ShmTransport(gallocy::common::Peer dst_peer) :
+    client(true), failed(false), announced(false), complete(false), ticket(0),
+    segment(nullptr), channel(nullptr), inbox(nullptr), outbox(nullptr) {
+    gallocy::string name = shm_segment_name(dst_peer);
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd == -1)
+        return;
+
+    // MAP the segment, if the listener has sized it yet.
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, std::addressof(st)) == 0 && static_cast<uint64_t>(st.st_size) >= sizeof(ShmSegment))
+        mapping = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return;
+    segment = reinterpret_cast<ShmSegment *>(mapping);
+
+    // SKIP a segment that is not ready yet, or whose listener died.
+    if (__atomic_load_n(std::addressof(segment->magic), __ATOMIC_ACQUIRE) != SHM_MAGIC
+            || (kill(segment->pid, 0) == -1 && errno == ESRCH))
+        return;
+
+    // CLAIM a free channel.
+    ticket = segment->tickets.fetch_add(1) & SHM_TICKET_MASK;
+    for (uint32_t i = 0; i < SHM_CHANNELS; i++) {
+        ShmChannel *candidate = std::addressof(segment->channels[i]);
+        uint32_t state = candidate->state.load();
+        if (shm_phase(state) != SHM_FREE)
+            continue;
+        if (candidate->state.compare_exchange_strong(state, shm_state(ticket, SHM_CLAIMED))) {
+            channel = candidate;
+            break;
+        }
+    }
+    if (channel == nullptr)
+        return;
+
+    ring_reset(std::addressof(channel->request));
+    ring_reset(std::addressof(channel->response));
+    inbox = std::addressof(channel->response);
+    outbox = std::addressof(channel->request);
+}
+
+gallocy::http::ShmTransport::ShmTransport(ShmSegment *segment, uint32_t channel, uint32_t ticket) :
+    client(false), failed(false), announced(true), complete(false), ticket(ticket),
+    segment(segment), channel(std::addressof(segment->channels[channel])) {
+    inbox = std::addressof(this->channel->request);
+    outbox = std::addressof(this->channel->response);
+}
+
+gallocy::string gallocy::http::ShmTransport::read() {
+    gallocy::string http;
+    uint32_t length = 0;
+
+    if (channel == nullptr || failed)
+        return http;
+
+    // READ the length, then the message, as the writer streams it in.
+    if (!ring_read(inbox, std::addressof(length), sizeof(length))) {
+        failed = true;
+        return http;
+    }
+    http.resize(length);
+    if (!ring_read(inbox, std::addressof(http[0]), length)) {
+        failed = true;
+        return gallocy::string();
+    }
+    complete = client;
+
+    return http;
+}
+
+void gallocy::http::ShmTransport::write(const gallocy::string &http) {
+    uint32_t length = http.length();
+
+    if (channel == nullptr || failed)
+        return;
+
+    // HAND the request to the listener before writing it, so that it can
+    // drain a request larger than the ring.
+    if (!announced) {
+        channel->state.store(shm_state(ticket, SHM_READY));
+        segment->doorbell.fetch_add(1);
+        futex_wake(std::addressof(segment->doorbell));
+        announced = true;
+    }
+
+    if (!ring_write(outbox, std::addressof(length), sizeof(length))
+            || !ring_write(outbox, http.c_str(), length))
+        failed = true;
+}
+
+gallocy::http::ShmTransport::~ShmTransport() {
+    if (channel != nullptr && !client) {
+        // FINISH the request, unless the client gave up on it, in which case
+        // only we can free the channel.
+        uint32_t state = shm_state(ticket, SHM_SERVING);
+        if (!channel->state.compare_exchange_strong(state, shm_state(ticket, failed ? SHM_FREE : SHM_DONE)))
+            channel->state.store(shm_state(ticket, SHM_FREE));
+        futex_wake(std::addressof(channel->state));
+    } else if (channel != nullptr) {
+        // WAIT for the listener to finish a request we read the response of.
+        uint32_t state = shm_state(ticket, SHM_SERVING);
+        while (complete && channel->state.load() == state) {
+            if (futex_wait(std::addressof(channel->state), state, SHM_TIMEOUT_MS) == -1 && errno == ETIMEDOUT)
+                break;
+        }
+        // FREE the channel, or leave it for the listener to free if it is
+        // still serving it. A channel that moved on to another ticket is not
+        // ours anymore.
+        while (true) {
+            state = channel->state.load();
+            if (shm_ticket(state) != ticket)
+                break;
+            uint32_t phase = shm_phase(state);
+            uint32_t next = phase == SHM_SERVING ? SHM_ABANDONED : SHM_FREE;
+            if (phase == SHM_FREE || phase == SHM_ABANDONED
+                    || channel->state.compare_exchange_strong(state, shm_state(ticket, next)))
+                break;
+        }
+    }
+    if (client && segment != nullptr)
+        munmap(segment, sizeof(ShmSegment));
+}
+
+gallocy::http::ShmListener::ShmListener(const gallocy::string &address, uint16_t port, HandlerFunction handler) :
+    name(shm_segment_name(gallocy::common::Peer(address, port))), handler(handler), segment(nullptr) {
+    // REMOVE the segment of a listener that died without removing it.
+    shm_unlink(name.c_str());
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        perror("shmlistener shm_open");
+        return;
+    }
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, sizeof(ShmSegment)) == 0)
+        mapping = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("shmlistener mmap");
+        shm_unlink(name.c_str());
+        return;
+    }
+
+    // PUBLISH the segment once the rest of it is in place.
+    segment = reinterpret_cast<ShmSegment *>(mapping);
+    segment->pid = getpid();
+    __atomic_store_n(std::addressof(segment->magic), SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+gallocy::http::ShmListener::~ShmListener() {
+    if (segment != nullptr) {
+        munmap(segment, sizeof(ShmSegment));
+        shm_unlink(name.c_str());
+    }
+}
+
+void *gallocy::http::ShmListener::work() {
+    if (segment == nullptr)
+        return nullptr;
+
+    while (alive) {
+        uint32_t doorbell = segment->doorbell.load();
+        bool served = false;
+        for (uint32_t i = 0; i < SHM_CHANNELS; i++) {
+            ShmChannel *channel = std::addressof(segment->channels[i]);
+            uint32_t state = channel->state.load();
+            if (shm_phase(state) != SHM_READY)
+                continue;
+            if (channel->state.compare_exchange_strong(state, shm_state(shm_ticket(state), SHM_SERVING))) {
+                serve(i, shm_ticket(state));
+                served = true;
+            }
+        }
+        // SLEEP until a client rings, unless one did while we served.
+        if (!served)
+            futex_wait(std::addressof(segment->doorbell), doorbell, SHM_POLL_MS);
+    }
+
+    return nullptr;
+}
+
+void gallocy::http::ShmListener::serve(uint32_t channel, uint32_t ticket) {
+    ShmTransport transport(segment, channel, ticket);
+    gallocy::string request = transport.read();
+    if (transport.failed)
+        return;
+    transport.write(handler(request));
+}
+
+gallocy::http::UDPListener::UDPListener(const gallocy::string &address, uint16_t port, HandlerFunction handler) :
+    handler(handler), sock(-1) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("udplistener socket");
+        return;
+    }
+    struct sockaddr_in listen_addr = gallocy::common::Peer(address, port).get_socket();
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(std::addressof(listen_addr)), sizeof(listen_addr)) == -1) {
+        perror("udplistener bind");
+        close(fd);
+        return;
+    }
+    sock = fd;
+}
+
+gallocy::http::UDPListener::~UDPListener() {
+    if (sock != -1)
+        close(sock);
+}
+
+void *gallocy::http::UDPListener::work() {
+    if (sock == -1)
+        return nullptr;
+
+    while (alive) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        if (poll(std::addressof(pfd), 1, UDP_POLL_MS) <= 0)
+            continue;
+        struct sockaddr_in src_addr;
+        socklen_t src_addr_len = sizeof(src_addr);
+        ssize_t length = recvfrom(sock, buf, UDP_BUFSIZE, 0,
+            reinterpret_cast<struct sockaddr *>(std::addressof(src_addr)), std::addressof(src_addr_len));
+        if (length <= 0)
+            continue;
+        gallocy::string response = handler(gallocy::string(buf, length));
+        if (sendto(sock, response.data(), response.length(), 0,
+                   reinterpret_cast<struct sockaddr *>(std::addressof(src_addr)), src_addr_len) == -1)
+            perror("udplistener sendto");
+    }
+
+    return nullptr;
+}
+
+gallocy::string gallocy::http::shm_segment_name(const gallocy::common::Peer &peer) {
+    struct sockaddr_in peer_sockaddr = peer.get_socket();
+    char address[INET_ADDRSTRLEN] = {0};
+    inet_ntop(AF_INET, std::addressof(peer_sockaddr.sin_addr), address, sizeof(address));
+    gallocy::stringstream name;
+    name << "/gallocy-shm-" << address << "-" << peer.get_port();
+    return name.str();
+}
+
+bool gallocy::http::is_local_address(const gallocy::common::Peer &peer) {
+    in_addr_t internet_address = peer.get_socket().sin_addr.s_addr;
+    if (internet_address == htonl(INADDR_ANY))
+        return false;
+    if ((ntohl(internet_address) >> 24) == IN_LOOPBACKNET)
+        return true;
+
+    // CHECK the addresses of the host's interfaces.
+    struct ifaddrs *interfaces = nullptr;
+    bool local = false;
+    if (getifaddrs(std::addressof(interfaces)) == -1)
+        return false;
+    for (struct ifaddrs *it = interfaces; it != nullptr; it = it->ifa_next) {
+        if (it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET)
+            continue;
+        if (reinterpret_cast<struct sockaddr_in *>(it->ifa_addr)->sin_addr.s_addr == internet_address) {
+            local = true;
+            break;
+        }
+    }
+    freeifaddrs(interfaces);
+    return local;
+}
+
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+bool gallocy::http::send_all(int socket, struct iovec *iov, int count, uint64_t timeout_ms) {
+    struct msghdr message;
+    memset(std::addressof(message), 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(socket, std::addressof(message), MSG_NOSIGNAL);
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // GIVE up on a receiver that has not drained the socket in time,
+            // rather than holding the caller's thread.
+            uint64_t now = now_ms();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            struct pollfd writable = { socket, POLLOUT, 0 };
+            poll(std::addressof(writable), 1, std::min<uint64_t>(TCP_POLL_MS, deadline - now));
+            continue;
+        } else if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent == -1) {
+            perror("sendmsg");
+            return false;
+        }
+        // SKIP the buffers that were sent whole, and the part of the next
+        // that was.
+        while (message.msg_iovlen > 0 && static_cast<size_t>(sent) >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = reinterpret_cast<char *>(message.msg_iov->iov_base) + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,251 @@
+#include "gallocy/http/uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gallocy/allocators/internal.h"
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                       void *arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+bool gallocy::http::Uring::supported() {
+  struct utsname name;
+  if (uname(&name) == -1)
+    return false;
+  int major = 0;
+  int minor = 0;
+  if (sscanf(name.release, "%d.%d", &major, &minor) != 2)
+    return false;
+  return major > 6 || (major == 6 && minor >= 0);
+}
+
+
+gallocy::http::Uring::Uring() :
+  fd(-1),
+  rings(MAP_FAILED),
+  rings_size(0),
+  sqes(reinterpret_cast<struct io_uring_sqe *>(MAP_FAILED)),
+  queued(0),
+  buf_ring_allocation(nullptr),
+  buf_ring(nullptr),
+  buffers(nullptr),
+  buf_tail(0) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = uring_setup(URING_ENTRIES, &params);
+  if (ring_fd == -1) {
+    perror("io_uring_setup");
+    return;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(ring_fd);
+    return;
+  }
+
+  // MAP the submission and completion rings, which the kernel lays out in
+  // one mapping, and the submission queue entries.
+  uint64_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uint64_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  rings_size = sq_size > cq_size ? sq_size : cq_size;
+  rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  void *sqes_mapping = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (rings == MAP_FAILED || sqes_mapping == MAP_FAILED) {
+    perror("io_uring mmap");
+    if (rings != MAP_FAILED)
+      munmap(rings, rings_size);
+    if (sqes_mapping != MAP_FAILED)
+      munmap(sqes_mapping, params.sq_entries * sizeof(struct io_uring_sqe));
+    rings = MAP_FAILED;
+    close(ring_fd);
+    return;
+  }
+  char *base = reinterpret_cast<char *>(rings);
+  sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+  sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+  sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  sqes = reinterpret_cast<struct io_uring_sqe *>(sqes_mapping);
+  cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+  cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+
+  // REGISTER the buffers receives read into, from the internal heap. The
+  // ring of them must be page aligned.
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  buf_ring_allocation = internal_malloc(buf_ring_size + page_size);
+  buffers = reinterpret_cast<char *>(internal_malloc(URING_BUFFERS * URING_BUFSIZE));
+  buf_ring = reinterpret_cast<struct io_uring_buf_ring *>(
+    (reinterpret_cast<uintptr_t>(buf_ring_allocation) + page_size - 1) & ~(page_size - 1));
+  memset(buf_ring, 0, buf_ring_size);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BGID;
+  if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    perror("io_uring_register");
+    close(ring_fd);
+    return;
+  }
+  for (uint16_t bid = 0; bid < URING_BUFFERS; bid++)
+    provide(bid);
+
+  fd = ring_fd;
+}
+
+
+gallocy::http::Uring::~Uring() {
+  if (fd != -1) {
+    // CANCEL everything still running, so that the kernel is done with the
+    // buffers before they are freed.
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+    submit_and_wait(100);
+    close(fd);
+  }
+  if (rings != MAP_FAILED) {
+    munmap(rings, rings_size);
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+  }
+  if (buf_ring_allocation != nullptr)
+    internal_free(buf_ring_allocation);
+  if (buffers != nullptr)
+    internal_free(buffers);
+}
+
+
+struct io_uring_sqe *gallocy::http::Uring::get_sqe() {
+  unsigned tail = *sq_tail;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+    // SUBMIT what is queued to make room, without waiting.
+    uring_enter(fd, queued, 0, 0, nullptr, 0);
+    queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  }
+  struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[tail & sq_mask] = tail & sq_mask;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+  return sqe;
+}
+
+
+void gallocy::http::Uring::provide(uint16_t bid) {
+  // INDEX the ring itself rather than its ``bufs``, which the kernel's header
+  // places after an empty struct in C++, eight bytes too far.
+  struct io_uring_buf *bufs = reinterpret_cast<struct io_uring_buf *>(buf_ring);
+  struct io_uring_buf *buf = &bufs[buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = reinterpret_cast<uint64_t>(buffers + bid * URING_BUFSIZE);
+  buf->len = URING_BUFSIZE;
+  buf->bid = bid;
+  buf_tail++;
+  __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+
+void gallocy::http::Uring::accept_multishot(int socket, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = user_data;
+}
+
+
+void gallocy::http::Uring::recv_multishot(int socket, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = user_data;
+}
+
+
+void gallocy::http::Uring::read(int read_fd, void *buf, uint32_t length, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = read_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = length;
+  sqe->user_data = user_data;
+}
+
+
+void gallocy::http::Uring::cancel(uint64_t target, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+
+int gallocy::http::Uring::submit_and_wait(uint64_t timeout_ms) {
+  struct __kernel_timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = reinterpret_cast<uint64_t>(&timeout);
+  int submitted = uring_enter(fd, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  int error = errno;
+  // KEEP count of what the kernel did not take, which is submitted next time.
+  queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (submitted == -1)
+    return error == ETIME || error == EINTR ? 0 : -error;
+  return submitted;
+}
+
+
+struct io_uring_cqe *gallocy::http::Uring::peek() {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return nullptr;
+  return &cqes[head & cq_mask];
+}
+
+
+void gallocy::http::Uring::seen() {
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+const char *gallocy::http::Uring::buffer(const struct io_uring_cqe *cqe) const {
+  return buffers + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFSIZE;
+}
+
+
+void gallocy::http::Uring::recycle(const struct io_uring_cqe *cqe) {
+  provide(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
@@ -55,7 +55,7 @@ class Peer {
     port = port;
   }
   /**
-   * Get the peer's internet address as a string in dot notation.
+   * Get the peer's internet address and port as a string in dot notation.
    *
    * \warning Always prefer \ref Peer::get_canonical_id when implementing
    * internal logic that depends on a unique identifier for the peer.
@@ -63,6 +63,13 @@ class Peer {
    * \return The internet address string.
    */
   const gallocy::string get_string() const;
+  /**
+   * Get the peer's internet address as a string in dot notation, without
+   * its port.
+   *
+   * \return The internet address string.
+   */
+  const gallocy::string get_address() const;
   /**
    * Get the peer's socket.
    *
@@ -39,10 +39,11 @@ class GallocyClient {
   /**
    * Make an "append entries" request.
    *
-   * This method is useful for creating "heart beat" messages which, per the
-   * Raft protocol, is an "append entries" request with no entries. For
-   * actually appending entries to the log, see \ref
-   * GallocyClient::send_append_entries(const gallocy::vector<Command> &entries).
+   * Each peer is sent the log entries from the next one it needs, so that a
+   * peer whose log is up to date gets a "heart beat" message, which per the
+   * Raft protocol is an "append entries" request with no entries. The
+   * entries that a majority then holds are committed, see \ref
+   * GallocyState::advance_commit_index.
    *
    * This method makes many requests internally, which is required to make a
    * single "append entries" request.
@@ -51,14 +52,11 @@ class GallocyClient {
    */
   bool send_append_entries();
   /**
-   * Make an "append entries" request.
-   *
-   * This method is useful for creating messages which append entries to the
-   * log and should not be used for "heart beat" messages. See \ref
-   * GallocyClient::send_append_entries() for sending "heart beat" messages.
+   * Append entries to the log in the current term, and make an "append
+   * entries" request to replicate them, see \ref
+   * GallocyClient::send_append_entries().
    *
-   * This method makes many requests internally, which is required to make a
-   * single "append entries" request.
+   * \return True if the success criteria is met.
    */
   bool send_append_entries(const gallocy::vector<LogEntry> &entries);
 
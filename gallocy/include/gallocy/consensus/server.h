@@ -11,27 +11,57 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <vector>
 
+#include "gallocy/http/reader.h"
 #include "gallocy/http/request.h"
 #include "gallocy/http/response.h"
 #include "gallocy/http/router.h"
+#include "gallocy/http/transport.h"
+#include "gallocy/http/uring.h"
 #include "gallocy/utils/config.h"
 #include "gallocy/worker.h"
 
+// The number of threads that run route handlers.
+#define SERVER_WORKERS 4
+// The most events the main event loop takes from epoll at once.
+#define SERVER_MAX_EVENTS 256
+// How long the main event loop waits for events before checking if it is
+// alive.
+#define SERVER_POLL_MS 100
+// How long a kept alive connection may sit idle before it is closed, and how
+// often each event loop looks for idle connections.
+#define SERVER_IDLE_MS 5000
+#define SERVER_SWEEP_MS 250
+// What an io_uring event loop does with a connection once its multishot
+// receive ends.
+#define CONNECTION_READING 0
+#define CONNECTION_HANDOFF 1
+#define CONNECTION_CLOSING 2
+
 namespace gallocy {
 
 namespace consensus {
 
+struct Connection;
+struct ServerShard;
+
 
 void error_die(const char *);
 
 
 class GallocyServer : public ThreadedDaemon {
  public:
-  using RouteArguments = gallocy::vector<gallocy::string>;
-  using HandlerFunction = std::function<gallocy::http::Response *(RouteArguments *, gallocy::http::Request *)>;
+  /**
+   * A route handler, which is called directly rather than through a
+   * ``std::function``.
+   */
+  using HandlerFunction = gallocy::http::Response *(GallocyServer::*)(RouteArguments *, gallocy::http::Request *);
   /**
    * Construct a HTTP server.
    *
@@ -44,64 +74,190 @@ class GallocyServer : public ThreadedDaemon {
     config(config),
     address(config.address),
     port(config.port),
-    server_socket(-1) {
-      routes.register_handler("/admin",
-        [this](RouteArguments *args, gallocy::http::Request *request) { return route_admin(args, request); });
-      routes.register_handler("/raft/request_vote",
-        [this](RouteArguments *args, gallocy::http::Request *request) { return route_request_vote(args, request); });
-      routes.register_handler("/raft/append_entries",
-        [this](RouteArguments *args, gallocy::http::Request *request) { return route_append_entries(args, request); });
-      routes.register_handler("/raft/request",
-        [this](RouteArguments *args, gallocy::http::Request *request) { return route_request(args, request); });
+    shard_count(config.server_shards > 0 ? config.server_shards : 1),
+    shards(nullptr),
+    shm_listener(nullptr),
+    udp_listener(nullptr),
+    ready_head(nullptr),
+    ready_tail(nullptr),
+    idle_ms(SERVER_IDLE_MS),
+    use_uring(true) {
+      routes.register_handler("/admin", &GallocyServer::route_admin);
+      routes.register_handler("/admin/metrics", &GallocyServer::route_admin_metrics);
+      routes.register_handler("/admin/profile", &GallocyServer::route_admin_profile);
+      routes.register_handler("/raft/request_vote", &GallocyServer::route_request_vote);
+      routes.register_handler("/raft/append_entries", &GallocyServer::route_append_entries);
+      routes.register_handler("/raft/propose", &GallocyServer::route_propose);
+      routes.register_handler("/raft/request", &GallocyServer::route_request);
   }
   GallocyServer(const GallocyServer &) = delete;
   GallocyServer &operator=(const GallocyServer &) = delete;
   ~GallocyServer() {
   }
   /**
-   * Read an HTTP request from a socket.
+   * Bind a listening socket to the server's address and port.
+   *
+   * \return The socket, which is non-blocking and shares its port with the
+   * other shards' if there are any.
+   */
+  int bind_socket();
+  /**
+   * A static helper for running a shard's event loop.
    *
-   * \param client_socket The client's socket id.
-   * \param request The string stream to write the request into.
-   * \return The request object.
+   * \param arg The shard.
+   * \return A null pointer.
+   */
+  static void *shard_entry(void *arg);
+  /**
+   * The event loop of a shard.
+   *
+   * Waits on an edge triggered epoll set of the shard's listening socket and
+   * every non-blocking connection it accepted, reads requests as they
+   * arrive, and queues each connection with a whole request for the workers.
+   *
+   * Runs \ref GallocyServer::run_shard_uring instead if the shard has an
+   * io_uring.
+   *
+   * \param shard The shard.
+   * \return A null pointer.
    */
-  gallocy::http::Request *get_request(int client_socket);
+  void *run_shard(struct ServerShard *shard);
   /**
-   * A static helper for handling requests.
+   * The event loop of a shard, on io_uring.
    *
-   * This static helper is for use with pthreads and extracts a
-   * :class:`RequestContext` pointer from the void pointer argument. When the
-   * request is done being handled, the :class:``RequestContext`` should be
-   * freed.
+   * Does what the epoll event loop does, but with a multishot accept on the
+   * listening socket and a multishot receive on each connection, which read
+   * into the ring's buffers. Every operation the loop queues while handling a
+   * batch of completions is submitted at once with the wait for the next
+   * batch, so the loop makes one system call per batch rather than one per
+   * accept and read.
    *
-   * \param arg A heap``RequestContext`` argument.
+   * A connection's receive is cancelled before the connection is handed to a
+   * worker or closed, and the connection stays the loop's until the receive
+   * ends, so that the ring never reads for a connection it does not own.
+   *
+   * \param shard The shard.
    * \return A null pointer.
    */
-  static void *handle_entry(void *arg);
+  void *run_shard_uring(struct ServerShard *shard);
+  /**
+   * Get the server's metrics.
+   *
+   * \return A JSON object with the connections accepted and the requests
+   * read by each shard.
+   */
+  gallocy::json get_metrics();
+  /**
+   * Read what a connection has sent so far.
+   *
+   * Reads until the socket would block, as the socket is edge triggered,
+   * straight into the connection's \ref gallocy::http::RequestReader.
+   *
+   * \param connection The connection.
+   * \return False if the connection was closed or failed.
+   */
+  bool read_request(struct Connection *connection);
+  /**
+   * Check if a connection has sent a whole request.
+   *
+   * Asks for the body of a request that expects ``100-continue``.
+   *
+   * \param connection The connection.
+   * \return True once the request's head and its ``Content-Length`` of
+   * body have arrived, and then the request is at the front of the
+   * connection's reader.
+   */
+  bool request_complete(struct Connection *connection);
+  /**
+   * Queue a connection with a whole request for the workers.
+   *
+   * \param connection The connection, which the workers own from then on.
+   */
+  void queue_ready(struct Connection *connection);
+  /**
+   * Hand a kept alive connection back to its shard's event loop.
+   *
+   * \param connection A connection with no whole request left to serve.
+   */
+  void resume(struct Connection *connection);
+  /**
+   * Close a connection and free it.
+   *
+   * \param connection The connection.
+   */
+  void close_connection(struct Connection *connection);
+  /**
+   * A static helper for running a worker.
+   *
+   * This static helper is for use with pthreads and extracts the server from
+   * the void pointer argument.
+   *
+   * \param arg The server.
+   * \return A null pointer.
+   */
+  static void *worker_entry(void *arg);
+  /**
+   * The work loop of a worker.
+   *
+   * Handles the connections the event loop queues until the server stops.
+   *
+   * \return A null pointer.
+   */
+  void *serve();
   /**
    * Handle a HTTP request.
    *
-   * The handling of the HTTP request is done in a threaded context. Access to
-   * the server resources is available, but must be synchronized.
+   * The handling of the HTTP request is done by one of the server's workers.
+   * Access to the server resources is available, but must be synchronized.
    *
    * The route handler of the HTTP request is done by matching the HTTP request's
-   * URI against the map of registered routes. The route handler will be called
-   * with the URI arguments and the request object itself. The route handler is
-   * responsible for managing memory for all parameters passed to it.
+   * URI against the registered routes, see \ref GallocyServer::route. The
+   * route handler will be called with the URI arguments and the request object
+   * itself.
+   *
+   * Requests are HTTP/1.1 and kept alive unless they ask otherwise. Every
+   * whole request the client pipelined on the connection is answered in
+   * order, and then the connection is handed back to its shard to wait for
+   * more, see \ref GallocyServer::resume. A connection that is not kept
+   * alive is closed and freed once its response is sent.
    *
-   * \param client_socket The client's socket id.
+   * \param connection A connection that sent a whole request.
    * \return A null pointer.
    */
-  void *handle(int client_socket, struct sockaddr_in client_name);
+  void *handle(struct Connection *connection);
+  /**
+   * Handle a HTTP request that arrived without a connection.
+   *
+   * Routes the request like \ref GallocyServer::handle, but the request
+   * arrived through the server's \ref gallocy::http::ShmListener, from a peer
+   * on this host, or its \ref gallocy::http::UDPListener.
+   *
+   * \param raw The raw HTTP request.
+   * \param via How the request arrived, for the log.
+   * \return The raw HTTP response.
+   */
+  gallocy::string handle_raw(const gallocy::string &raw, const char *via);
   /**
    * The primary work loop.
    *
-   * Starting the HTTP server binds to the socket, begins listening on the bound
-   * socket, then enters the HTTP server's main event loop. The HTTP server's
-   * main event loop listens while alive for incoming connections and creates a
-   * handler thread for each established connection.
+   * Starting the HTTP server binds a socket for each of its shards, begins
+   * listening on the bound sockets, starts \ref SERVER_WORKERS workers, then
+   * runs each shard's event loop, see \ref GallocyServer::run_shard, so that
+   * requests are served concurrently without a thread per connection.
+   *
+   * With more than one shard, each shard's socket is bound with
+   * ``SO_REUSEPORT`` and runs its event loop on a thread of its own, and the
+   * kernel spreads new connections across them.
+   *
+   * Each shard runs on io_uring if \ref use_uring is set and the kernel has
+   * everything it needs, see \ref gallocy::http::Uring::supported, and on
+   * epoll otherwise.
    *
-   * To stop the HTTP server set `alive` to false.
+   * Peers on this host are served by a \ref gallocy::http::ShmListener
+   * instead, which runs for as long as the main event loop.
+   *
+   * To stop the HTTP server set `alive` to false, which the event loops
+   * notice within \ref SERVER_POLL_MS.
    */
   void *work();
   /**
@@ -110,6 +266,19 @@ class GallocyServer : public ThreadedDaemon {
    * See \ref RoutingTable for additional details.
    */
   RoutingTable<HandlerFunction> routes;
+  /**
+   * Call the handler for a request's route.
+   *
+   * The route's arguments are in a buffer on the stack, so routing a request
+   * allocates nothing.
+   *
+   * \param request The request.
+   * A request's ``X-Request-Id`` header is echoed in its response, so that
+   * clients that multiplex requests can match responses to them.
+   *
+   * \return The handler's response, or a 404 response if no route matches.
+   */
+  gallocy::http::Response *route(gallocy::http::Request *request);
   /**
    * Handle a request for /admin.
    *
@@ -117,6 +286,26 @@ class GallocyServer : public ThreadedDaemon {
    * \param request The request itself.
    */
   gallocy::http::Response *route_admin(RouteArguments *args, gallocy::http::Request *request);
+  /**
+   * Handle a request for /admin/metrics.
+   *
+   * Responds with the metrics of every registered source, see \ref
+   * utils::collect_metrics.
+   *
+   * \param args The route arguments.
+   * \param request The request itself.
+   */
+  gallocy::http::Response *route_admin_metrics(RouteArguments *args, gallocy::http::Request *request);
+  /**
+   * Handle a request for /admin/profile.
+   *
+   * Responds with the false sharing profiler's report, see \ref
+   * gallocy::memory::FalseSharingProfiler::report.
+   *
+   * \param args The route arguments.
+   * \param request The request itself.
+   */
+  gallocy::http::Response *route_admin_profile(RouteArguments *args, gallocy::http::Request *request);
   /**
    * Handle a request for /raft/request_vote.
    *
@@ -131,6 +320,17 @@ class GallocyServer : public ThreadedDaemon {
    * \param request The request itself.
    */
   gallocy::http::Response *route_append_entries(RouteArguments *args, gallocy::http::Request *request);
+  /**
+   * Handle a request for /raft/propose.
+   *
+   * Appends the command to the log if this node leads, so that followers
+   * can forward their proposals to the leader. The response says whether
+   * the command was accepted.
+   *
+   * \param args The route arguments.
+   * \param request The request itself.
+   */
+  gallocy::http::Response *route_propose(RouteArguments *args, gallocy::http::Request *request);
   /**
    * Handle a request for /raft/request.
    *
@@ -148,21 +348,106 @@ class GallocyServer : public ThreadedDaemon {
   GallocyConfig &config;
   gallocy::string address;
   int16_t port;
-  int64_t server_socket;
+  uint64_t shard_count;
+  struct ServerShard *shards;
+  gallocy::string metrics_name;
+  gallocy::http::ShmListener *shm_listener;
+  gallocy::http::UDPListener *udp_listener;
+  /**
+   * The connections with a whole request, waiting for a worker, in order.
+   */
+  struct Connection *ready_head;
+  struct Connection *ready_tail;
+  std::mutex ready_lock;
+  std::condition_variable ready_cv;
+  pthread_t workers[SERVER_WORKERS];
+
+ public:
+  /**
+   * How long a kept alive connection may sit idle before it is closed.
+   */
+  uint64_t idle_ms;
+  /**
+   * Run the shards' event loops on io_uring where the kernel supports it,
+   * see \ref gallocy::http::Uring::supported, and on epoll otherwise. Read
+   * when the server starts.
+   */
+  bool use_uring;
 };
 
 
 /**
- * A simple class to bundle server and socket together.
- *
- * This abstraction is for use with pthreads, which consumes a void pointer as
- * its only argument.
+ * A listening socket and the event loop that serves it.
  */
-struct RequestContext {
+struct ServerShard {
  public:
   GallocyServer *server;
+  uint64_t index;
+  int server_socket;
+  /**
+   * The shard's io_uring, or a null pointer if it runs on epoll, in which
+   * case it has an epoll set.
+   */
+  gallocy::http::Uring *uring;
+  int epoll_fd;
+  pthread_t thread;
+  /**
+   * The connections still sending their request, by socket. Only touched by
+   * the shard's event loop.
+   */
+  gallocy::map<int, struct Connection *> connections;
+  /**
+   * Wakes the event loop when workers hand back kept alive connections.
+   */
+  int wakeup_fd;
+  /**
+   * Where an io_uring event loop reads the wakeup's count.
+   */
+  uint64_t wakeup_count;
+  struct Connection *resumed;
+  std::mutex resumed_lock;
+  uint64_t last_sweep;
+  std::atomic<uint64_t> accepted;
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> idle_closed;
+};
+
+
+/**
+ * A client connection and what it has sent so far.
+ */
+struct Connection {
+ public:
   int client_socket;
   struct sockaddr_in client_name;
+  struct ServerShard *shard;
+  /**
+   * What the client sent that is not answered yet, which is reused for
+   * each of its requests.
+   */
+  gallocy::http::RequestReader reader;
+  /**
+   * The head of the response being sent, which is reused for each of its
+   * responses.
+   */
+  gallocy::string head;
+  /**
+   * When the connection last sent anything, in milliseconds.
+   */
+  uint64_t last_active;
+  /**
+   * True once the client was asked for a body it held back.
+   */
+  bool continued;
+  /**
+   * What an io_uring event loop does once the connection's receive ends,
+   * see \ref CONNECTION_READING.
+   */
+  int recv_end;
+  /**
+   * The next connection waiting for a worker, or for its shard.
+   */
+  struct Connection *next;
 };
 
 }  // namespace consensus
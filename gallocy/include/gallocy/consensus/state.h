@@ -2,8 +2,10 @@
 #define GALLOCY_CONSENSUS_STATE_H_
 
 #include <condition_variable>
+#include <functional>
 #include <map>
 #include <mutex>
+#include <vector>
 
 #include "gallocy/allocators/internal.h"
 #include "gallocy/common/peer.h"
@@ -38,6 +40,18 @@ enum RaftState {
 const gallocy::string raft_state_to_string(RaftState state);
 
 
+/**
+ * A callback for changes to the committed membership.
+ */
+typedef std::function<void(const gallocy::vector<gallocy::common::Peer> &)> MembershipListener;
+
+
+/**
+ * A callback for commands applied to the state machine.
+ */
+typedef std::function<void(const Command &)> CommandListener;
+
+
 /**
  * State to implement the Raft consensus protocol.
  *
@@ -60,6 +74,9 @@ class GallocyState {
     log = new (internal_malloc(sizeof(gallocy::consensus::GallocyLog)))
       gallocy::consensus::GallocyLog();
     state = RaftState::FOLLOWER;
+    membership = config.peer_list;
+    membership.push_back(gallocy::common::Peer(config.address, config.port));
+    sort_membership();
   }
   ~GallocyState() {
     timer->~Timer();
@@ -93,7 +110,10 @@ class GallocyState {
    */
   uint64_t get_commit_index();
   /**
-   * Set the commit index.
+   * Set the commit index, the number of log entries known to be committed,
+   * and apply the entries that committed since the last were applied.
+   *
+   * The index never passes the end of the log.
    */
   void set_commit_index(uint64_t value);
   /**
@@ -124,6 +144,86 @@ class GallocyState {
    * Get the state machine log.
    */
   gallocy::consensus::GallocyLog *get_log();
+  /**
+   * Append a command to the log in the current term.
+   *
+   * The command is applied by \ref GallocyState::set_commit_index once it
+   * commits, and not before.
+   *
+   * \param command The command.
+   * \return The index of the command's entry.
+   */
+  uint64_t append_command(const Command &command);
+  /**
+   * Get the entries that follow a log index, to send to a peer.
+   *
+   * Log indexes here count entries, like the commit index, so index 0 is
+   * before the first entry.
+   *
+   * \param previous_log_index The index the entries follow, which is
+   * clamped to the end of the log.
+   * \param previous_log_term Set to the term of the entry at the index, or
+   * 0 if the index is 0.
+   * \return The entries, which may be empty.
+   */
+  gallocy::vector<LogEntry> get_entries(uint64_t *previous_log_index, uint64_t *previous_log_term);
+  /**
+   * Get the index and term of the last entry in the log, for a candidate to
+   * send with its vote requests.
+   *
+   * \param last_log_index Set to the number of entries in the log.
+   * \param last_log_term Set to the term of the last entry, or 0 if the log
+   * is empty.
+   */
+  void get_last_log(uint64_t *last_log_index, uint64_t *last_log_term);
+  /**
+   * Check if a candidate's log is at least as up to date as this one, which
+   * is when its last entry has a later term, or the same term and an index
+   * no smaller.
+   *
+   * \param last_log_index The index of the candidate's last entry.
+   * \param last_log_term The term of the candidate's last entry.
+   * \return True if a vote may be granted to the candidate.
+   */
+  bool is_log_up_to_date(uint64_t last_log_index, uint64_t last_log_term);
+  /**
+   * Append a leader's entries to the log, as a follower.
+   *
+   * The entries are rejected unless the log holds the entry they follow in
+   * the same term. Entries that conflict with the leader's, and the entries
+   * after them, are dropped first. The commit index then follows the
+   * leader's, but no further than the entries it sent, so that committed
+   * entries are applied on followers too.
+   *
+   * \param previous_log_index The index the entries follow.
+   * \param previous_log_term The term of the entry at that index.
+   * \param entries The entries.
+   * \param leader_commit The leader's commit index.
+   * \param match_index Set to the index of the last entry known to match
+   * the leader's log, if the entries are accepted.
+   * \return True if the entries were accepted.
+   */
+  bool append_entries(uint64_t previous_log_index, uint64_t previous_log_term,
+                      const gallocy::vector<LogEntry> &entries, uint64_t leader_commit,
+                      uint64_t *match_index);
+  /**
+   * Commit the entries that a majority of the cluster holds, as a leader.
+   *
+   * Only an entry from the current term is committed by counting replicas,
+   * which commits the entries before it too.
+   *
+   * \return The commit index.
+   */
+  uint64_t advance_commit_index();
+  /**
+   * Get the leader of the current term, as last heard from, or an empty
+   * peer if none is known.
+   */
+  gallocy::common::Peer get_leader();
+  /**
+   * Set the leader of the current term.
+   */
+  void set_leader(gallocy::common::Peer value);
   /**
    * Get the timer.
    */
@@ -146,6 +246,32 @@ class GallocyState {
    * Set the current state of this node.
    */
   void set_state(RaftState new_state);
+  /**
+   * Get the committed membership, which includes this node.
+   *
+   * Every node lists the members in the same order, so a member's index in
+   * the list can identify it.
+   */
+  gallocy::vector<gallocy::common::Peer> get_membership();
+  /**
+   * Set the committed membership, when a membership change is applied, and
+   * notify every membership listener.
+   */
+  void set_membership(const gallocy::vector<gallocy::common::Peer> &value);
+  /**
+   * Add a callback for changes to the committed membership.
+   *
+   * Listeners are called without the state's lock held, in the order the
+   * changes were applied.
+   */
+  void add_membership_listener(MembershipListener listener);
+  /**
+   * Add a callback for commands applied to the state machine.
+   *
+   * Listeners are called without the state's lock held, and ignore commands
+   * that are not theirs.
+   */
+  void add_command_listener(CommandListener listener);
 
  private:
   /**
@@ -171,6 +297,10 @@ class GallocyState {
    * Index of highest log entry applied to state machine.
    */
   uint64_t last_applied;
+  /**
+   * The leader of the current term, which proposals are forwarded to.
+   */
+  gallocy::common::Peer leader;
   /**
    * Mapping of peer to next log entry to send to the peer.
    */
@@ -196,6 +326,20 @@ class GallocyState {
   std::mutex timed_out_mutex;
   GallocyConfig &config;
   RaftState state;
+  /**
+   * The members, as of the last applied membership change.
+   */
+  gallocy::vector<gallocy::common::Peer> membership;
+  gallocy::vector<MembershipListener> membership_listeners;
+  gallocy::vector<CommandListener> command_listeners;
+  /**
+   * Serializes notifying listeners, so they see changes in order.
+   */
+  std::mutex notify_lock;
+  /**
+   * Sort the members by address and port.
+   */
+  void sort_membership();
   /**
    * Set up leader state.
    */
@@ -5,6 +5,14 @@
 #include "gallocy/consensus/machine.h"
 #include "gallocy/consensus/server.h"
 #include "gallocy/consensus/state.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/directory.h"
+#include "gallocy/memory/lease.h"
+#include "gallocy/memory/lock.h"
+#include "gallocy/memory/prefetch.h"
+#include "gallocy/memory/profiler.h"
+#include "gallocy/memory/release.h"
+#include "gallocy/memory/transfer.h"
 #include "gallocy/utils/config.h"
 
 /**
@@ -18,6 +26,11 @@
  *   - Replace application pthread interface.
  *   - Instantiate server.
  *   - Instantiate client.
+ *   - Instantiate page transfer server.
+ *   - Instantiate page directory.
+ *   - Lease application heap chunks.
+ *   - Instantiate the application heap's coherence protocol, if configured.
+ *   - Instantiate false sharing profiler, with the coherence protocol.
  *
  * This should be called *before* the main function in the application.
  * After initialization, an application can begin executing application
@@ -32,6 +45,9 @@ int initialize_gallocy_framework(const char* config_path);
  *
  *   - Destroy server.
  *   - Destroy client.
+ *   - Return unused application heap chunks.
+ *   - Destroy page transfer server.
+ *   - Dump the false sharing profile, if configured.
  *
  * This should be called *after* the main function in the application exits.
  */
@@ -57,6 +73,51 @@ extern gallocy::consensus::GallocyState *gallocy_state;
  */
 extern gallocy::consensus::GallocyClient *gallocy_client;
 
+/**
+ * The global handle to the page transfer server.
+ */
+extern gallocy::memory::PageTransferServer *gallocy_page_server;
+
+/**
+ * The global handle to the page directory.
+ */
+extern gallocy::memory::PageDirectory *gallocy_page_directory;
+
+/**
+ * The global handle to the application heap's MRSW coherence protocol, or
+ * ``nullptr`` if the heap is not kept coherent by it.
+ */
+extern gallocy::memory::MRSWCoherence *gallocy_coherence;
+
+/**
+ * The global handle to the application heap's release consistency protocol,
+ * or ``nullptr`` if the heap is not kept coherent by it.
+ */
+extern gallocy::memory::LazyReleaseCoherence *gallocy_release_coherence;
+
+/**
+ * The global handle to the lock manager for the application's mutexes, which
+ * runs with the release consistency protocol, or ``nullptr``.
+ */
+extern gallocy::memory::DistributedLockManager *gallocy_lock_manager;
+
+/**
+ * The global handle to the prefetcher that reads ahead of the MRSW coherence
+ * protocol's read faults, or ``nullptr``.
+ */
+extern gallocy::memory::PagePrefetcher *gallocy_prefetcher;
+
+/**
+ * The global handle to the application heap's chunk leases.
+ */
+extern gallocy::memory::ChunkLeases *gallocy_chunk_leases;
+
+/**
+ * The global handle to the false sharing profiler, or ``nullptr`` if the
+ * heap is not kept coherent.
+ */
+extern gallocy::memory::FalseSharingProfiler *gallocy_profiler;
+
 /**
  * The global handle to the configuration.
  */
@@ -0,0 +1,185 @@
+#ifndef GALLOCY_HEAPLAYERS_AFFINITYHEAP_H_
+#define GALLOCY_HEAPLAYERS_AFFINITYHEAP_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gallocy/utils/logging.h"
+
+// Placement policies. A zeroed heap places by thread.
+#define PLACEMENT_THREAD 0
+#define PLACEMENT_NODE 1
+
+namespace HL {
+
+/**
+ * Place each thread's objects in spans of their own.
+ *
+ * Under the DSM a page is the unit of coherence, so two threads, or two
+ * nodes, writing different objects on one page pass the page back and forth.
+ * This heap keeps a separate heap per placement domain, and each thread
+ * allocates from its own domain, so objects allocated by different threads
+ * never share a page. Freed objects go back to the domain they came from.
+ *
+ * Placing by thread costs density, since every thread holds partly used
+ * spans. Placing by node puts every thread in one domain, which packs
+ * objects as tightly as a single heap; nodes still never share pages, since
+ * each allocates from its own leased chunks.
+ *
+ * A thread holds its domain until it exits, when the domain, and the partly
+ * used spans in it, go to the next thread that needs one. A thread that
+ * finds every domain held falls back to the first domain, which it shares,
+ * and is counted, see \ref AffinityHeap::get_overflows, until one frees up.
+ *
+ * \tparam Super A heap over a \ref SpanHeap, which records each span's
+ * domain.
+ * \tparam Domains The number of domains, the first of which is for placing
+ * by node and for threads that find no other domain free.
+ */
+template <class Super, int Domains>
+class AffinityHeap {
+ public:
+  inline void *malloc(size_t sz) {
+    int domain = get_thread_domain();
+    // SET the domain on every allocation, since the heap may be used before
+    // its constructor has run.
+    heaps[domain].set_domain(domain);
+    return heaps[domain].malloc(sz);
+  }
+
+  inline void free(void *ptr) {
+    if (!ptr)
+      return;
+    heaps[Super::get_domain(ptr)].free(ptr);
+  }
+
+  inline static size_t getSize(void *ptr) {
+    return Super::getSize(ptr);
+  }
+
+  inline void __reset() {
+    for (int domain = 0; domain < Domains; domain++)
+      heaps[domain].__reset();
+  }
+
+  /**
+   * Set the placement policy, one of ``PLACEMENT_*``.
+   */
+  inline void set_placement(int value) {
+    placement = value;
+  }
+
+  inline int get_placement() {
+    return placement;
+  }
+
+  /**
+   * Get the number of domains held by threads.
+   */
+  inline static uint64_t get_domains_in_use() {
+    uint64_t count = 0;
+    // THE first domain is never held.
+    for (int word = 0; word < DOMAIN_WORDS; word++)
+      count += __builtin_popcountll(in_use[word]);
+    return count - 1;
+  }
+
+  /**
+   * Get the number of threads that found every domain held and fell back to
+   * sharing the first.
+   */
+  inline static uint64_t get_overflows() {
+    return overflows;
+  }
+
+ private:
+  enum { DOMAIN_WORDS = (Domains + 63) / 64 };
+
+  inline int get_thread_domain() {
+    if (placement == PLACEMENT_NODE)
+      return 0;
+    // RETRY a thread that fell back on every allocation, so that it gets a
+    // domain of its own as soon as one frees up.
+    if (thread_domain == 0)
+      thread_domain = claim_domain();
+    return thread_domain;
+  }
+
+  /**
+   * Take the lowest free domain for the calling thread, and release it when
+   * the thread exits.
+   *
+   * \return The domain, or 0 if every domain is held.
+   */
+  static int claim_domain() {
+    pthread_once(&key_once, create_key);
+    for (int word = 0; word < DOMAIN_WORDS; word++) {
+      uint64_t used = in_use[word];
+      while (~used) {
+        int domain = word * 64 + __builtin_ctzll(~used);
+        if (domain >= Domains)
+          break;
+        if (__sync_bool_compare_and_swap(&in_use[word], used, used | (1ULL << (domain % 64)))) {
+          // RELEASE the domain through a key rather than a thread_local
+          // destructor, since a low key's value is stored without allocating.
+          pthread_setspecific(key, reinterpret_cast<void *>(static_cast<intptr_t>(domain)));
+          return domain;
+        }
+        used = in_use[word];
+      }
+    }
+    if (!thread_overflowed) {
+      thread_overflowed = true;
+      if (__sync_fetch_and_add(&overflows, 1) == 0)
+        LOG_WARNING("Every one of " << Domains - 1 << " placement domains is held, "
+                    << "so threads will share pages until one exits");
+    }
+    return 0;
+  }
+
+  static void create_key() {
+    pthread_key_create(&key, release_domain);
+  }
+
+  /**
+   * Release an exiting thread's domain for the next thread.
+   */
+  static void release_domain(void *value) {
+    int domain = static_cast<int>(reinterpret_cast<intptr_t>(value));
+    thread_domain = 0;
+    __sync_fetch_and_and(&in_use[domain / 64], ~(1ULL << (domain % 64)));
+  }
+
+  Super heaps[Domains];
+  volatile int placement;
+  static __thread int thread_domain;
+  static __thread bool thread_overflowed;
+  static uint64_t in_use[DOMAIN_WORDS];
+  static uint64_t overflows;
+  static pthread_key_t key;
+  static pthread_once_t key_once;
+};
+
+template <class Super, int Domains>
+__thread int AffinityHeap<Super, Domains>::thread_domain = 0;
+
+template <class Super, int Domains>
+__thread bool AffinityHeap<Super, Domains>::thread_overflowed = false;
+
+// THE first domain is marked held, so no thread claims it.
+template <class Super, int Domains>
+uint64_t AffinityHeap<Super, Domains>::in_use[DOMAIN_WORDS] = { 1 };
+
+template <class Super, int Domains>
+uint64_t AffinityHeap<Super, Domains>::overflows = 0;
+
+template <class Super, int Domains>
+pthread_key_t AffinityHeap<Super, Domains>::key;
+
+template <class Super, int Domains>
+pthread_once_t AffinityHeap<Super, Domains>::key_once = PTHREAD_ONCE_INIT;
+
+}  // namespace HL
+
+#endif  // GALLOCY_HEAPLAYERS_AFFINITYHEAP_H_
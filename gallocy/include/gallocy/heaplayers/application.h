@@ -2,11 +2,13 @@
 #define GALLOCY_HEAPLAYERS_APPLICATION_H_
 
 // NOTE: Order matters because forward declarations do not exist.
+#include "heaplayers/affinityheap.h"
 #include "heaplayers/firstfitheap.h"
 #include "heaplayers/lockedheap.h"
 #include "heaplayers/pagetableheap.h"
 #include "heaplayers/sizeheap.h"
 #include "heaplayers/source.h"
+#include "heaplayers/spanheap.h"
 #include "heaplayers/spinlock.h"
 #include "heaplayers/stdlibheap.h"
 #include "heaplayers/zoneheap.h"
@@ -14,18 +16,27 @@
 // TODO(sholsapp): FIX ME: 16 = size of ZoneHeap header.
 #define DEFAULT_ZONE_SZ 16384 - 16
 
+// Arenas of exactly four pages, after the 24 byte ZoneHeap arena header.
+#define SPAN_ZONE_SZ (4 * PAGE_SZ - 24)
+
+// The number of placement domains, one per thread up to this many less one.
+#define AFFINITY_DOMAINS 64
+
 /**
- * Shared application memory.
+ * Shared application memory, whose threads each allocate from spans of pages
+ * of their own.
  */
 typedef
   HL::LockedHeap<
   HL::SpinLockType,
     HL::StdlibHeap<
-    HL::FirstFitHeap<
-      HL::SizeHeap<
-        HL::ZoneHeap<
-          HL::SourceMmapHeap<PURPOSE_APPLICATION_HEAP>,
-          DEFAULT_ZONE_SZ> > > > >
+    HL::AffinityHeap<
+      HL::FirstFitHeap<
+        HL::SizeHeap<
+          HL::ZoneHeap<
+            HL::SpanHeap<HL::SourceMmapHeap<PURPOSE_APPLICATION_HEAP> >,
+            SPAN_ZONE_SZ> > >,
+      AFFINITY_DOMAINS> > >
   ApplicationHeapType;
 
 #endif  // GALLOCY_HEAPLAYERS_APPLICATION_H_
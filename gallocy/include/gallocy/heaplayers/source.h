@@ -1,7 +1,11 @@
 #ifndef GALLOCY_HEAPLAYERS_SOURCE_H_
 #define GALLOCY_HEAPLAYERS_SOURCE_H_
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <iostream>
 
@@ -12,6 +16,17 @@
 
 namespace HL {
 
+/**
+ * Hand out part of a heap's zone.
+ *
+ * \param arg The source's argument.
+ * \param sz The least number of bytes needed.
+ * \param offset Set to the offset in the zone of the bytes handed out.
+ * \param length Set to the number of bytes handed out.
+ * \return True if bytes were handed out.
+ */
+typedef bool (*ChunkSourceFunction)(void *arg, size_t sz, uint64_t *offset, size_t *length);
+
 template <uint64_t Purpose>
 class SourceMmapHeap {
  public:
@@ -26,7 +41,22 @@ class SourceMmapHeap {
       next = reinterpret_cast<char *>(zone);
       bytes_left = ZONE_SZ;
     }
-    if (bytes_left > sz) {
+    if (backing_fd != -1 && !backed)
+      back_zone();
+    if (chunk_source && (!sourced || bytes_left < sz)) {
+      // TAKE the next chunk from the source, and abandon what is left of
+      // this one, or of the start of the zone.
+      uint64_t offset = 0;
+      size_t length = 0;
+      if (!chunk_source(chunk_source_arg, sz, &offset, &length) || offset + length > ZONE_SZ) {
+        std::cout << "---ENOMEM---" << std::endl;
+        abort();
+      }
+      next = reinterpret_cast<char *>(zone) + offset;
+      bytes_left = length;
+      sourced = true;
+    }
+    if (bytes_left >= sz) {
       mem = reinterpret_cast<void *>(next);
       next = next + sz;
       bytes_left -= sz;
@@ -57,14 +87,122 @@ class SourceMmapHeap {
     zone = NULL;
     next = NULL;
     bytes_left = 0;
+    sourced = false;
+    backed = false;
+  }
+
+  /**
+   * Hand out the zone a chunk at a time from a source, instead of from the
+   * start of the zone onward.
+   *
+   * Whatever was allocated before the source was set stays at the start of
+   * the zone, which the source must never hand out.
+   */
+  static void set_chunk_source(ChunkSourceFunction source, void *arg) {
+    chunk_source_arg = arg;
+    chunk_source = source;
+  }
+
+  /**
+   * Back the zone, past a private prefix, with a file that other processes on
+   * the host map at the same address, so that they share its pages.
+   *
+   * Every process must give the same file and prefix. The prefix holds what
+   * each process allocates before it has a chunk source, and the chunk
+   * source must hand each process parts of the rest that no other process
+   * is handed. The zone is backed at its next allocation.
+   *
+   * \param name The name of a shared memory object, e.g., "/gallocy", or the
+   * path of a file on a shared memory file system, e.g.,
+   * "/dev/shm/gallocy".
+   * \param prefix The length of the private prefix, a multiple of a page.
+   * \return False if the file could not be opened.
+   */
+  static bool set_backing(const char *name, uint64_t prefix) {
+    int fd;
+    // A NAME with a directory in it is a path rather than an object's name.
+    if (strchr(name + 1, '/'))
+      fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    else
+      fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+      perror("open");
+      return false;
+    }
+    if (ftruncate(fd, ZONE_SZ) == -1) {
+      perror("ftruncate");
+      close(fd);
+      return false;
+    }
+    reset_backing();
+    backing_prefix = prefix;
+    backing_fd = fd;
+    return true;
+  }
+
+  /**
+   * Stop backing zones that are not backed yet, and close the backing file.
+   *
+   * A zone that is already backed keeps sharing the file's pages until it is
+   * unmapped.
+   */
+  static void reset_backing() {
+    if (backing_fd != -1)
+      close(backing_fd);
+    backing_fd = -1;
+    backing_prefix = 0;
+  }
+
+  /**
+   * Get the start of the zone, or ``NULL`` before the first allocation.
+   */
+  inline void *get_zone() {
+    return zone;
   }
 
  private:
+  inline void back_zone() {
+    backed = true;
+    uint64_t used = next - reinterpret_cast<char *>(zone);
+    if (used > backing_prefix) {
+      std::cout << "---EBACKING---" << std::endl;
+      abort();
+    }
+    if (mmap(reinterpret_cast<char *>(zone) + backing_prefix, ZONE_SZ - backing_prefix,
+             MMAP_PROT, MAP_SHARED | MAP_FIXED, backing_fd, backing_prefix) == MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+    // KEEP what is allocated before there is a chunk source in the prefix.
+    if (!sourced)
+      bytes_left = backing_prefix - used;
+  }
+
   void *zone;
   char *next;
   uint64_t bytes_left;
+  // True once the current bytes came from the chunk source.
+  bool sourced;
+  // True once the zone is backed by the backing file.
+  bool backed;
+  static ChunkSourceFunction chunk_source;
+  static void *chunk_source_arg;
+  static int backing_fd;
+  static uint64_t backing_prefix;
 };
 
+template <uint64_t Purpose>
+ChunkSourceFunction SourceMmapHeap<Purpose>::chunk_source = NULL;
+
+template <uint64_t Purpose>
+void *SourceMmapHeap<Purpose>::chunk_source_arg = NULL;
+
+template <uint64_t Purpose>
+int SourceMmapHeap<Purpose>::backing_fd = -1;
+
+template <uint64_t Purpose>
+uint64_t SourceMmapHeap<Purpose>::backing_prefix = 0;
+
 }  // namespace HL
 
 #endif  // GALLOCY_HEAPLAYERS_SOURCE_H_
@@ -0,0 +1,76 @@
+#ifndef GALLOCY_HEAPLAYERS_SPANHEAP_H_
+#define GALLOCY_HEAPLAYERS_SPANHEAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gallocy/utils/constants.h"
+
+namespace HL {
+
+/**
+ * Hand out whole pages from one source shared by every span heap of a type,
+ * and remember which placement domain each page went to.
+ */
+template <class Source>
+class SpanHeap {
+ public:
+  inline void *malloc(size_t sz) {
+    size_t span = (sz + PAGE_SZ - 1) & ~static_cast<size_t>(PAGE_SZ - 1);
+    char *ptr = reinterpret_cast<char *>(source().malloc(span));
+    uint64_t misalign = reinterpret_cast<uint64_t>(ptr) & (PAGE_SZ - 1);
+    while (misalign) {
+      // SKIP to the next page, which only happens if something else took
+      // part of a page from the source.
+      source().malloc(PAGE_SZ - misalign);
+      ptr = reinterpret_cast<char *>(source().malloc(span));
+      misalign = reinterpret_cast<uint64_t>(ptr) & (PAGE_SZ - 1);
+    }
+    uint64_t first = (ptr - reinterpret_cast<char *>(source().get_zone())) / PAGE_SZ;
+    for (uint64_t page = first; page < first + span / PAGE_SZ && page < ZONE_SZ / PAGE_SZ; page++)
+      domains[page] = domain;
+    return ptr;
+  }
+
+  inline void free(void *ptr) {
+    return;
+  }
+
+  inline void __reset() {
+    source().__reset();
+  }
+
+  /**
+   * Set the domain this heap's spans go to.
+   */
+  inline void set_domain(uint8_t value) {
+    domain = value;
+  }
+
+  /**
+   * Get the domain of the span an object is in.
+   */
+  inline static uint8_t get_domain(void *ptr) {
+    char *zone = reinterpret_cast<char *>(source().get_zone());
+    char *object = reinterpret_cast<char *>(ptr);
+    if (zone == NULL || object < zone || object >= zone + ZONE_SZ)
+      return 0;
+    return domains[(object - zone) / PAGE_SZ];
+  }
+
+ private:
+  inline static Source &source() {
+    static Source instance;
+    return instance;
+  }
+
+  uint8_t domain;
+  static uint8_t domains[ZONE_SZ / PAGE_SZ];
+};
+
+template <class Source>
+uint8_t SpanHeap<Source>::domains[ZONE_SZ / PAGE_SZ];
+
+}  // namespace HL
+
+#endif  // GALLOCY_HEAPLAYERS_SPANHEAP_H_
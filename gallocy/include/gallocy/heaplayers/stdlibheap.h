@@ -28,7 +28,11 @@ class StdlibHeap : public Super {
     if (ptr == NULL) {
       return Super::malloc(sz);
     }
+    // COPY no more than the new object holds, as the old object may be
+    // bigger than was asked for.
     size_t min_size = Super::getSize(ptr);
+    if (min_size > sz)
+      min_size = sz;
     void* buf = Super::malloc(sz);
     if (buf != NULL) {
       memcpy(buf, ptr, min_size);
@@ -41,6 +41,9 @@ class ZoneHeap : public Super {
     }
     if (currentArena != NULL)
       Super::free(currentArena);
+    sizeRemaining = 0;
+    currentArena = NULL;
+    pastArenas = NULL;
     Super::__reset();
   }
 
@@ -72,7 +75,7 @@ class ZoneHeap : public Super {
       }
       currentArena->arenaSpace = reinterpret_cast<char *>(currentArena + 1);
       currentArena->nextArena = NULL;
-      sizeRemaining = ChunkSize;
+      sizeRemaining = allocSize;
     }
     // Bump the pointer and update the amount of memory remaining.
     sizeRemaining -= sz;
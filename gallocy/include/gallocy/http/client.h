@@ -9,6 +9,22 @@
 #include "gallocy/http/response.h"
 #include "gallocy/http/transport.h"
 
+// How long a kept alive connection to a peer may sit idle before it is
+// dropped, which must be shorter than the server's idle timeout, and how many
+// are kept for each peer.
+#define CLIENT_IDLE_MS 2000
+#define CLIENT_POOL_SZ 8
+// How long a request may take before it fails.
+#define CLIENT_TIMEOUT_MS 10000
+// How long a round of requests waits for a majority of its peers.
+#define CLIENT_ROUND_MS 250
+// The bounds of how long a request over UDP waits for its response before
+// being sent again, which is estimated from the round trip times to its peer,
+// and how long it waits before the first estimate.
+#define UDP_RTO_MIN_MS 10
+#define UDP_RTO_MAX_MS 1000
+#define UDP_RTO_INITIAL_MS 100
+
 namespace gallocy {
 
 namespace http {
@@ -50,6 +66,9 @@ class AbstractClient {
 
 /**
  * A request client that uses restclient-cpp (and cURL) under the hood.
+ *
+ * Connections to each peer are kept alive and reused across requests and
+ * threads, so that heartbeats do not each pay for connection setup.
  */
 class CurlClient : public AbstractClient {
  public:
@@ -59,15 +78,84 @@ class CurlClient : public AbstractClient {
   Response *request(const Request &request);
   /**
    * See \ref AbstractClient::multirequest.
+   *
+   * The requests run concurrently on one long lived cURL multi handle,
+   * driven by the calling thread, so no thread is spawned for them and the
+   * connection to each peer is reused from round to round. The callback is
+   * called as each response arrives, and the round returns as soon as it
+   * succeeds for a majority of the cluster, which is half of the peers,
+   * rounded up, as this peer does not send itself requests. A round that
+   * does not get a majority returns after \ref CLIENT_ROUND_MS. Transfers
+   * still running when their round returns are driven by later rounds, and
+   * their responses are still handed to their round's callback, which must
+   * therefore outlive the round.
+   *
+   * The network transfers are started first. Requests that may need no
+   * network, see \ref CurlClient::prefers_direct, are then performed one at
+   * a time between polls of the transfers. Every one of them is performed,
+   * even once the round succeeded, unless the round runs out of time.
+   *
+   * Rounds from different threads take turns.
+   *
+   * \return The number of responses the callback accepted.
    */
   uint64_t multirequest(const gallocy::vector<Request> requests,
                         std::function<bool(const Response &)> callback,
                         std::condition_variable *cv,
                         std::mutex *cv_m);
+
+ protected:
+  /**
+   * Perform a request without cURL, if possible.
+   *
+   * \param request The request object which to send.
+   * \return A response, or a null pointer if the request must go through
+   * cURL.
+   */
+  virtual Response *request_direct(const Request &request);
+  /**
+   * Check if a request may be performed without cURL, without performing
+   * it.
+   *
+   * \param request The request object which to send.
+   * \return True if \ref CurlClient::request_direct should be tried first.
+   */
+  virtual bool prefers_direct(const Request &request);
+};
+
+/**
+ * A request client that uses ShmTransport for peers on this host.
+ *
+ * Requests to a peer whose address is local, and whose listener serves a
+ * shared memory segment, skip the network stack. Requests to any other peer,
+ * or to a local peer whose segment has no free channel, fall back to cURL.
+ */
+class ShmClient : public CurlClient {
+ public:
+  /**
+   * See \ref AbstractClient::request.
+   */
+  Response *request(const Request &request);
+
+ protected:
+  /**
+   * Perform a request over shared memory, if the peer is on this host.
+   */
+  Response *request_direct(const Request &request);
+  /**
+   * True if the peer is on this host.
+   */
+  bool prefers_direct(const Request &request);
 };
 
 /**
- * A request client that uses UDPTransport under the hood.
+ * A request client that sends each request as a UDP datagram.
+ *
+ * Every request this node sends goes out on one shared socket, tagged with a
+ * ``X-Request-Id`` header, and many can be outstanding at once. A request
+ * that is not answered in time is sent again, after a timeout estimated from
+ * the round trip times to its peer, see \ref UDP_RTO_MIN_MS. Peers answer
+ * with a \ref UDPListener.
  */
 class UDPClient : public AbstractClient {
  public:
@@ -77,13 +165,24 @@ class UDPClient : public AbstractClient {
   Response *request(const Request &request);
   /**
    * See \ref AbstractClient::multirequest.
+   *
+   * Every request is outstanding at once, and the round returns as soon as
+   * the callback accepted responses from a majority of the cluster, like
+   * \ref CurlClient::multirequest, or once every request was answered or
+   * ran out of attempts.
+   *
+   * Rounds from different threads are outstanding at once, and do not wait
+   * for each other.
+   *
+   * \return The number of responses the callback accepted.
    */
   uint64_t multirequest(const gallocy::vector<Request> requests,
                         std::function<bool(const Response &)> callback,
                         std::condition_variable *cv,
                         std::mutex *cv_m);
   /**
-   * Number of times the transport client will send and wait for data from a peer.
+   * Number of times the client will send a request and wait for its
+   * response.
    */
   uint8_t retry_limit = 3;
 };
@@ -0,0 +1,146 @@
+#ifndef GALLOCY_HTTP_HEADERS_H_
+#define GALLOCY_HTTP_HEADERS_H_
+
+#include <stdint.h>
+
+#include "gallocy/allocators/internal.h"
+
+// The most headers a HTTP message may have.
+#define HTTP_MAX_HEADERS 32
+
+namespace gallocy {
+
+namespace http {
+
+/**
+ * A run of bytes in someone else's buffer.
+ */
+struct View {
+  const char *data;
+  uint64_t length;
+  /**
+   * Check if the bytes are a string.
+   */
+  bool equals(const char *s) const;
+  /**
+   * Check if the bytes are a string, ignoring case.
+   */
+  bool iequals(const char *s) const;
+  bool iequals(View other) const;
+  /**
+   * Copy the bytes.
+   */
+  gallocy::string str() const { return gallocy::string(data, length); }
+};
+
+
+/**
+ * The headers of a HTTP message.
+ *
+ * Names and values are stored back to back in one buffer, and where each one
+ * is in a fixed array, so that neither parsing nor setting a header
+ * allocates per header. Names are looked up ignoring case, as HTTP asks.
+ *
+ * Headers parsed from a buffer that outlives them may instead be \ref borrow
+ * "borrowed" from it, and are only copied if a header is then set.
+ */
+class Headers {
+ public:
+  Headers() : borrowed(nullptr), count(0) {}
+  /**
+   * Set a header, replacing any header of the same name.
+   *
+   * \param name The header's name.
+   * \param value The header's value.
+   * \return False if the message already has \ref HTTP_MAX_HEADERS headers.
+   */
+  bool set(View name, View value);
+  bool set(const gallocy::string &name, const gallocy::string &value) {
+    View name_view = { name.c_str(), name.length() };
+    View value_view = { value.c_str(), value.length() };
+    return set(name_view, value_view);
+  }
+  /**
+   * Refer to a header where it is in someone else's buffer, replacing any
+   * header of the same name.
+   *
+   * \param base The buffer, which every borrowed header must be in, and
+   * which must outlive these headers.
+   * \param name The header's name.
+   * \param value The header's value.
+   * \return False if the message already has \ref HTTP_MAX_HEADERS headers.
+   */
+  bool borrow(const char *base, View name, View value);
+  /**
+   * Find a header's value.
+   *
+   * \param name The header's name.
+   * \return The header's value, which is valid until the next header is set,
+   * or a view of nothing if there is no such header.
+   */
+  View find(const char *name) const;
+  /**
+   * Check if there is a header.
+   */
+  bool has(const char *name) const { return find(name).data != nullptr; }
+  /**
+   * Get a copy of a header's value.
+   *
+   * \return The value, or an empty string if there is no such header.
+   */
+  gallocy::string get(const char *name) const { return find(name).str(); }
+  /**
+   * Make room for a number of bytes of names and values.
+   */
+  void reserve(uint64_t bytes) { buffer.reserve(bytes); }
+  /**
+   * Get the number of headers.
+   */
+  uint64_t size() const { return count; }
+  /**
+   * Get the name of the i-th header, in the order they were set.
+   */
+  View name(uint64_t i) const {
+    View view = { data() + fields[i].name_offset, fields[i].name_length };
+    return view;
+  }
+  /**
+   * Get the value of the i-th header, in the order they were set.
+   */
+  View value(uint64_t i) const {
+    View view = { data() + fields[i].value_offset, fields[i].value_length };
+    return view;
+  }
+
+ private:
+  /**
+   * Get the buffer the headers are in.
+   */
+  const char *data() const { return borrowed != nullptr ? borrowed : buffer.data(); }
+  /**
+   * Copy borrowed headers into the buffer.
+   */
+  void own();
+  /**
+   * Where a header's name and value are in the buffer.
+   */
+  struct Field {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+  };
+  gallocy::string buffer;
+  /**
+   * The buffer that borrowed headers are in, or null if they are in ours.
+   */
+  const char *borrowed;
+  Field fields[HTTP_MAX_HEADERS];
+  uint64_t count;
+};
+
+}  // namespace http
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_HTTP_HEADERS_H_
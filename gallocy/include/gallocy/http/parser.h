@@ -0,0 +1,85 @@
+#ifndef GALLOCY_HTTP_PARSER_H_
+#define GALLOCY_HTTP_PARSER_H_
+
+#include <stdint.h>
+
+#include "gallocy/http/headers.h"
+
+// What parsing the head of a HTTP message found.
+#define HTTP_PARSE_OK 0
+#define HTTP_PARSE_INCOMPLETE 1
+#define HTTP_PARSE_ERROR 2
+// The length of a body whose ``Content-Length`` is not a number, or too big
+// to be one.
+#define HTTP_CONTENT_LENGTH_INVALID UINT64_MAX
+
+namespace gallocy {
+
+namespace http {
+
+/**
+ * A header of a HTTP message, in the buffer the message was parsed from.
+ */
+struct HeaderView {
+  View name;
+  View value;
+};
+
+
+/**
+ * The head of a HTTP message, in the buffer it was parsed from.
+ */
+struct MessageHead {
+  /**
+   * The three parts of the first line: the method, the URI and the protocol
+   * of a request, or the protocol, the status code and the reason of a
+   * response.
+   */
+  View start[3];
+  HeaderView headers[HTTP_MAX_HEADERS];
+  uint64_t header_count;
+  /**
+   * The length of the head, with its blank line.
+   */
+  uint64_t length;
+  /**
+   * Find a header's value, ignoring the case of its name.
+   *
+   * \param name The header's name.
+   * \return The header's value, or a view of nothing if there is no such
+   * header.
+   */
+  View find(const char *name) const;
+  /**
+   * Get the length of the body that follows the head.
+   *
+   * \param fallback The length if there is no ``Content-Length``.
+   * \return The length, or \ref HTTP_CONTENT_LENGTH_INVALID if the
+   * ``Content-Length`` is not made of digits or overflows.
+   */
+  uint64_t content_length(uint64_t fallback) const;
+};
+
+
+/**
+ * Parse the head of a HTTP request or response.
+ *
+ * The head is parsed in one pass over its bytes, and every part of it is a
+ * view into the buffer, so nothing is copied or allocated. A header's value
+ * is everything after the first ``:`` of its line, less the whitespace
+ * around it, so values such as ``Host: 127.0.0.1:8080`` keep their colons.
+ *
+ * \param data The message.
+ * \param length The number of bytes of the message there are so far.
+ * \param head The parsed head.
+ * \return \ref HTTP_PARSE_OK once the whole head was parsed, \ref
+ * HTTP_PARSE_INCOMPLETE if more of it is needed, or \ref HTTP_PARSE_ERROR if
+ * it is not HTTP.
+ */
+int parse_head(const char *data, uint64_t length, MessageHead *head);
+
+}  // namespace http
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_HTTP_PARSER_H_
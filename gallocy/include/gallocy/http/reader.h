@@ -0,0 +1,140 @@
+#ifndef GALLOCY_HTTP_READER_H_
+#define GALLOCY_HTTP_READER_H_
+
+#include <stdint.h>
+
+// The size of a reader's buffer, a quarter of which it makes free before
+// each read from its socket.
+#define READER_BUFSIZE 4096
+// A reader's buffer grows for big requests, and is shrunk back once empty if
+// it grew past this.
+#define READER_MAX_RETAINED (64 * READER_BUFSIZE)
+// The biggest head and body of a request a reader accepts. A bigger request
+// is rejected rather than buffered.
+#define READER_MAX_HEAD (16 * READER_BUFSIZE)
+#define READER_MAX_BODY (1024 * READER_BUFSIZE)
+
+namespace gallocy {
+
+namespace http {
+
+/**
+ * An incremental reader of the HTTP requests a connection sends.
+ *
+ * Bytes are read straight from the socket into a buffer that the reader
+ * keeps for the life of the connection. The head of the request at the
+ * front of the buffer is scanned once as its bytes arrive, and its
+ * ``Content-Length`` says how much body to wait for, so a request is whole
+ * exactly when its body is, however the body was split across reads. Any
+ * bytes after it are the next, pipelined, request.
+ *
+ * Nothing is copied out of the buffer: a whole request is at \ref data for
+ * \ref length bytes until it is \ref consume "consumed".
+ *
+ * A request whose head is longer than \ref READER_MAX_HEAD, whose
+ * ``Content-Length`` is not a number, or whose body is longer than \ref
+ * READER_MAX_BODY is \ref rejected "rejected" as soon as that is known, and
+ * nothing more is read for it.
+ */
+class RequestReader {
+ public:
+  RequestReader();
+  ~RequestReader();
+  RequestReader(const RequestReader &) = delete;
+  RequestReader &operator=(const RequestReader &) = delete;
+  /**
+   * Read everything a non-blocking socket has to read.
+   *
+   * Once the head of a request is known the buffer is grown to hold the
+   * whole request, so that its body is read in place.
+   *
+   * \param socket A non-blocking socket.
+   * \return False if the peer closed the socket or it failed. Either way,
+   * the bytes read before then are still buffered.
+   */
+  bool fill(int socket);
+  /**
+   * Append bytes that arrived some other way.
+   *
+   * \param data The bytes.
+   * \param length The number of bytes.
+   */
+  void append(const char *data, uint64_t length);
+  /**
+   * Check if the request at the front of the buffer is whole.
+   *
+   * Scans only the bytes that arrived since the last check.
+   *
+   * \return True once the request's head and its ``Content-Length`` of body
+   * have arrived, or once the request is \ref rejected "rejected".
+   */
+  bool frame();
+  /**
+   * Drop the whole request at the front of the buffer.
+   */
+  void consume();
+  /**
+   * Get the request at the front of the buffer.
+   */
+  const char *data() const { return buffer + start; }
+  /**
+   * Get the length of the whole request, once framed.
+   */
+  uint64_t length() const { return head_length + content_length; }
+  /**
+   * Get the number of bytes buffered, including any pipelined requests.
+   */
+  uint64_t buffered() const { return end - start; }
+  /**
+   * Get the size of the buffer.
+   */
+  uint64_t get_capacity() const { return capacity; }
+  /**
+   * True if the request's head asks the server to ``100-continue``.
+   */
+  bool expects_continue() const { return continue_expected; }
+  /**
+   * Get the status code to reject the request at the front of the buffer
+   * with, 400 if its ``Content-Length`` is not a number and 413 if it is too
+   * big, or zero if it is not rejected.
+   */
+  uint64_t rejected() const { return rejected_status; }
+
+ private:
+  /**
+   * Make room for at least some bytes after the buffered ones.
+   *
+   * \param free_bytes The number of bytes.
+   */
+  void reserve(uint64_t free_bytes);
+  /**
+   * Find the headers the framing depends on in the request's head.
+   */
+  void parse_head();
+
+  char *buffer;
+  uint64_t capacity;
+  /**
+   * The buffered bytes are from here to ``end``.
+   */
+  uint64_t start;
+  uint64_t end;
+  /**
+   * How many bytes of the request were searched for the end of its head.
+   */
+  uint64_t scanned;
+  /**
+   * The length of the request's head with its blank line, or zero until it
+   * has arrived.
+   */
+  uint64_t head_length;
+  uint64_t content_length;
+  bool continue_expected;
+  uint64_t rejected_status;
+};
+
+}  // namespace http
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_HTTP_READER_H_
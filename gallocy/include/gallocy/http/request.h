@@ -5,6 +5,7 @@
 
 #include "gallocy/allocators/internal.h"
 #include "gallocy/common/peer.h"
+#include "gallocy/http/headers.h"
 
 namespace gallocy {
 
@@ -15,12 +16,6 @@ namespace http {
  */
 class Request {
  public:
-  /**
-   * HTTP header type.
-   */
-  typedef gallocy::map<
-    gallocy::string, gallocy::string>
-    Headers;
   /**
    * HTTP parameter type.
    */
@@ -36,6 +31,20 @@ class Request {
    * \param raw The raw request.
    */
   explicit Request(gallocy::string raw);
+  /**
+   * Create a request.
+   *
+   * This constructor is suitable for creating a request object from bytes
+   * still in a receive buffer, which are parsed where they are, see \ref
+   * parse_head. A request that is not HTTP has no method.
+   *
+   * The request's headers and body are not copied, so the bytes must stay
+   * in the buffer until the request is freed.
+   *
+   * \param data The raw request.
+   * \param length The length of the raw request, with its body.
+   */
+  Request(const char *data, uint64_t length);
   /**
    * Create a request.
    *
@@ -60,7 +69,7 @@ class Request {
    * \param headers Any headers to include.
    */
   Request(gallocy::string method, const gallocy::common::Peer &peer, gallocy::string uri,
-          gallocy::string body, Headers headers);
+          gallocy::string body, const Headers &headers);
 
   // Request(const Request &) = delete;
   // Request &operator=(const Request &) = delete;
@@ -70,6 +79,11 @@ class Request {
   Parameters &get_params();
   gallocy::common::Peer peer;
   gallocy::json &get_json();
+  /**
+   * Get the request's body, where it is in the buffer the request was parsed
+   * from, if it was, or else in \ref raw_body.
+   */
+  View get_body() const;
   gallocy::string method;
   gallocy::string protocol;
   gallocy::string raw_body;
@@ -89,7 +103,19 @@ class Request {
   gallocy::string build_request() const;
 
  private:
-  gallocy::string raw;
+  /**
+   * Parse a raw request into this request.
+   *
+   * \param borrow Refer to the headers and body where they are in the raw
+   * request, rather than copying them.
+   */
+  void parse(const char *data, uint64_t length, bool borrow);
+
+  /**
+   * The body, if it was borrowed.
+   */
+  View body = { nullptr, 0 };
+
   gallocy::json json;
   Parameters params;
 };
@@ -1,10 +1,9 @@
 #ifndef GALLOCY_HTTP_RESPONSE_H_
 #define GALLOCY_HTTP_RESPONSE_H_
 
-#include <map>
-
 #include "gallocy/allocators/internal.h"
 #include "gallocy/common/peer.h"
+#include "gallocy/http/headers.h"
 
 namespace gallocy {
 
@@ -15,11 +14,6 @@ namespace http {
  */
 class Response {
  public:
-  // Types
-  typedef gallocy::map<
-    gallocy::string, gallocy::string>
-    Headers;
-
   // Constructors
   Response();
   Response(const Response&) = delete;
@@ -29,9 +23,22 @@ class Response {
    * Updates all of the response fields. Useful when you have  a raw
    * string that was read off the wire, e.g., in a client implementation.
    *
+   * The head is parsed where it is, see \ref parse_head, and the body is
+   * its ``Content-Length`` of bytes, or the rest of the string.
+   *
    * \param raw The raw response.
    */
   void from_buffer(gallocy::string raw);
+  /**
+   * Append the status line and headers to a buffer.
+   *
+   * The body is left where it is, so that it can be sent after the head
+   * without being copied, see \ref send_all. The buffer can be reused for
+   * response after response.
+   *
+   * \param out The buffer.
+   */
+  void write_head(gallocy::string *out);
 
   // Members
   Headers headers;
@@ -1,161 +1,252 @@
 #ifndef GALLOCY_HTTP_ROUTER_H_
 #define GALLOCY_HTTP_ROUTER_H_
 
-#include <map>
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
 #include <vector>
 
-#include "gallocy/http/request.h"
-#include "gallocy/http/response.h"
-#include "gallocy/utils/objutils.h"
-#include "gallocy/utils/stringutils.h"
+#include "gallocy/allocators/internal.h"
+#include "gallocy/http/headers.h"
 
+// The most variables a route may have.
+#define ROUTE_MAX_ARGUMENTS 8
+// No node, in a routing table's trie.
+#define ROUTE_NO_NODE UINT32_MAX
 
-template <typename HandlerFunction = int>
-class RoutingTable {
- public:
+
+/**
+ * The values a path gave a route's variables.
+ *
+ * This is a fixed buffer the caller of \ref RoutingTable::match owns, and
+ * each value is a view into the matched path, so matching copies and
+ * allocates nothing.
+ */
+struct RouteArguments {
+  gallocy::http::View values[ROUTE_MAX_ARGUMENTS];
+  uint64_t count;
   /**
-   * Internal data structure to maintain a route tree.
+   * Get the number of values.
    */
-  class Node {
-   public:
-    Node() {
-      size_t s = sizeof(gallocy::map<gallocy::string, Node *>);
-      routes = new (internal_malloc(s)) gallocy::map<gallocy::string, Node *>();
-    }
-    ~Node() {
-      internal_free(routes);
-    }
-    HandlerFunction func;
-    gallocy::string dynamic;
-    gallocy::map<gallocy::string, Node *> *routes;
-  };
+  uint64_t size() const { return count; }
+  /**
+   * Get the i-th value, in the order the variables are in the route.
+   */
+  gallocy::http::View at(uint64_t i) const { return values[i]; }
+};
+
 
+/**
+ * A table of the handlers for a server's routes.
+ *
+ * Routes are compiled when they are registered into a trie over their path
+ * segments, whose nodes are stored in one array and whose segments are
+ * stored back to back in one buffer. Matching a path walks the trie one
+ * segment at a time without splitting the path or allocating, and hands back
+ * the handler itself, so a handler of a concrete type, such as a function or
+ * a member function pointer, is called directly.
+ *
+ * \tparam HandlerFunction The type of a handler, which must be default
+ * constructible.
+ */
+template <typename HandlerFunction>
+class RoutingTable {
  public:
   RoutingTable() {
-    table = new (internal_malloc(sizeof(Node))) Node();
+    nodes.push_back(Node());
   }
-  ~RoutingTable() {
-    internal_free(table);
+  /**
+   * Register a handler.
+   *
+   * A route is a *theoretical* HTTP URI string that may have variables. A
+   * route can look like any of the following:
+   *
+   *   /foo
+   *   /foo/<param>
+   *   /foo/<param>/bar
+   *   /foo/<param>/bar/<param>
+   *
+   * Where the strings surrounded by `<` and `>` characters are variables and
+   * will match any other string not containing the `/` character.
+   *
+   * \param route The route to register.
+   * \param handler The handler that should be associated with this route.
+   * \return False if the route has more than \ref ROUTE_MAX_ARGUMENTS
+   * variables.
+   */
+  bool register_handler(const gallocy::string &route, HandlerFunction handler);
+  /**
+   * Get the handler for a URI path.
+   *
+   * A path is a *realized* HTTP URI string, meaning all parts of the
+   * registered route from \ref register_handler are materialized. A path can
+   * look like one of the following:
+   *
+   *   /foo
+   *   /foo/arg1
+   *   /foo/arg1/bar
+   *   /foo/arg1/bar/arg2
+   *
+   * A segment of the path matches a route's segment of the same name before
+   * it matches a variable. Any query string is ignored.
+   *
+   * \param path The path to look up the handler for.
+   * \param length The length of the path.
+   * \param args Set to the values of the route's variables, which are valid
+   * for as long as the path is.
+   * \return The handler, or a null pointer if no route matches the path.
+   */
+  const HandlerFunction *match(const char *path, uint64_t length, RouteArguments *args) const;
+  const HandlerFunction *match(const gallocy::string &path, RouteArguments *args) const {
+    return match(path.data(), path.length(), args);
   }
-  std::function<gallocy::http::Response *(gallocy::http::Request *)> match(gallocy::string path);
-  void dump_table();
-  void register_handler(gallocy::string route, HandlerFunction func);
+  /**
+   * Dump the routing table to standard output.
+   *
+   * Useful for debugging only and shouldn't be used for any other purpose.
+   */
+  void dump_table() const;
 
  private:
-  Node *table;
+  /**
+   * A node of the trie, which is reached by a segment of a path.
+   */
+  struct Node {
+    Node() :
+      segment_offset(0),
+      segment_length(0),
+      first_child(ROUTE_NO_NODE),
+      next_sibling(ROUTE_NO_NODE),
+      variable(ROUTE_NO_NODE),
+      has_handler(false),
+      handler() {}
+    /**
+     * Where the segment that reaches this node is in ``segments``.
+     */
+    uint32_t segment_offset;
+    uint32_t segment_length;
+    /**
+     * The nodes reached by named segments are a list of siblings.
+     */
+    uint32_t first_child;
+    uint32_t next_sibling;
+    /**
+     * The node reached by a variable, if any.
+     */
+    uint32_t variable;
+    bool has_handler;
+    HandlerFunction handler;
+  };
+  /**
+   * Find the child of a node that a named segment reaches.
+   *
+   * \return The child, or \ref ROUTE_NO_NODE.
+   */
+  uint32_t find_child(uint32_t node, const char *segment, uint64_t length) const;
+
+  gallocy::vector<Node> nodes;
+  gallocy::string segments;
 };
 
 
-/**
- * Help get map values from a pointer to a map.
- */
-template<typename K, typename V>
-V _get_item(gallocy::map<K, V> *Map, K key) {
-  auto it = Map->find(key);
-  if (it != Map->end())
-    return it->second;
-  else
-    return nullptr;
+template <typename HandlerFunction>
+uint32_t RoutingTable<HandlerFunction>::find_child(uint32_t node, const char *segment, uint64_t length) const {
+  for (uint32_t child = nodes[node].first_child; child != ROUTE_NO_NODE; child = nodes[child].next_sibling) {
+    const Node &candidate = nodes[child];
+    if (candidate.segment_length == length
+        && memcmp(segments.data() + candidate.segment_offset, segment, length) == 0)
+      return child;
+  }
+  return ROUTE_NO_NODE;
 }
 
 
-/**
- * Dump the routing table to standard output.
- *
- * Useful for debugging only and shouldn't be used for any other purpose.
- */
 template <typename HandlerFunction>
-void RoutingTable<HandlerFunction>::dump_table() {
-  gallocy::vector<Node *> queue;
-  queue.push_back(table);
-  while (queue.size() > 0) {
-    Node *tmp = queue.at(0);
-    std::cout << "Dynamic key: " << tmp->dynamic << std::endl;
-    std::cout << "Handler: " << &tmp->func << std::endl;
-    std::cout << "Table size: " << tmp->routes->size() << std::endl;;
-    for (typename gallocy::map<gallocy::string, RoutingTable<HandlerFunction>::Node *>::iterator it
-        = tmp->routes->begin(); it != tmp->routes->end(); ++it) {
-      std::cout << "  " << it->first << std::endl;
-      gallocy::string key = it->first;
-      Node *next = it->second;
-      queue.push_back(next);
+bool RoutingTable<HandlerFunction>::register_handler(const gallocy::string &route, HandlerFunction handler) {
+  uint64_t variables = 0;
+  uint32_t node = 0;
+  uint64_t i = route.length() > 0 && route[0] == '/' ? 1 : 0;
+  while (i < route.length()) {
+    uint64_t slash = route.find('/', i);
+    if (slash == gallocy::string::npos)
+      slash = route.length();
+    const char *segment = route.data() + i;
+    uint64_t length = slash - i;
+    uint32_t next;
+    if (length >= 2 && segment[0] == '<' && segment[length - 1] == '>') {
+      if (++variables > ROUTE_MAX_ARGUMENTS)
+        return false;
+      next = nodes[node].variable;
+      if (next == ROUTE_NO_NODE) {
+        next = nodes.size();
+        nodes.push_back(Node());
+        nodes[node].variable = next;
+      }
+    } else {
+      next = find_child(node, segment, length);
+      if (next == ROUTE_NO_NODE) {
+        next = nodes.size();
+        Node child;
+        child.segment_offset = segments.length();
+        child.segment_length = length;
+        child.next_sibling = nodes[node].first_child;
+        segments.append(segment, length);
+        nodes.push_back(child);
+        nodes[node].first_child = next;
+      }
     }
-    queue.erase(queue.begin());
+    node = next;
+    i = slash + 1;
   }
+  nodes[node].has_handler = true;
+  nodes[node].handler = handler;
+  return true;
 }
 
-/**
- * Register a handler.
- *
- * A route is a *theoretical* HTTP URI string that may have variables. A route
- * can look like any of the following:
- *
- *   /foo
- *   /foo/<param>
- *   /foo/<param>/bar
- *   /foo/<param>/bar/<param>
- *
- *  Where the strings surrounded by `<` and `>` characters are variables and
- *  will match any other string not containing special characters (including
- *  the `/` character).
- *
- * :param route: The route to register..
- * :param handler: The handler that should be associated with this route.
- */
+
 template <typename HandlerFunction>
-inline void RoutingTable<HandlerFunction>::register_handler(gallocy::string route, HandlerFunction handler) {
-  gallocy::vector<gallocy::string> route_parts;
-  utils::split(route, '/', route_parts);
-  Node *tmp = table;
-  for (auto part = std::begin(route_parts) + 1; part != std::end(route_parts); ++part) {
-    if (utils::startswith(*part, "<") && utils::endswith(*part, ">"))
-      tmp->dynamic = *part;
-    if (!tmp->routes->count(*part))
-      tmp->routes->insert(std::make_pair(*part, new (internal_malloc(sizeof(Node))) Node()));
-    tmp = _get_item<gallocy::string, Node *>(tmp->routes, *part);
+const HandlerFunction *RoutingTable<HandlerFunction>::match(const char *path, uint64_t length, RouteArguments *args) const {
+  const char *query = static_cast<const char *>(memchr(path, '?', length));
+  if (query)
+    length = query - path;
+  args->count = 0;
+  uint32_t node = 0;
+  uint64_t i = length > 0 && path[0] == '/' ? 1 : 0;
+  while (i < length) {
+    const char *segment = path + i;
+    const char *slash = static_cast<const char *>(memchr(segment, '/', length - i));
+    uint64_t segment_length = slash ? slash - segment : length - i;
+    uint32_t next = find_child(node, segment, segment_length);
+    if (next == ROUTE_NO_NODE) {
+      // FALL BACK to the variable, if there is one.
+      next = nodes[node].variable;
+      if (next == ROUTE_NO_NODE)
+        return nullptr;
+      gallocy::http::View value = { segment, segment_length };
+      args->values[args->count++] = value;
+    }
+    node = next;
+    i += segment_length + 1;
   }
-  tmp->func = handler;
+  if (!nodes[node].has_handler)
+    return nullptr;
+  return &nodes[node].handler;
 }
 
 
-
-/**
- * Get the handler for a URI path.
- *
- * A path is a *realized* HTTP URI string, meaning all parts of the registered
- * route from :meth:`register_handler` are materialized. A path can look like
- * one of the following:
- *
- *   /foo
- *   /foo/arg1
- *   /foo/arg1/bar
- *   /foo/arg1/bar/arg2
- *
- * :param path: The path to look up the handler for.
- */
 template <typename HandlerFunction>
-inline std::function<gallocy::http::Response *(gallocy::http::Request *)> RoutingTable<HandlerFunction>::match(gallocy::string path) {
-  gallocy::vector<gallocy::string> *args =
-    new (internal_malloc(sizeof(gallocy::vector<gallocy::string>))) gallocy::vector<gallocy::string>();
-  gallocy::vector<gallocy::string> path_parts;
-  utils::split(path, '/', path_parts);
-  Node *tmp = table;
-  for (auto it = std::begin(path_parts) + 1; it != std::end(path_parts); ++it) {
-    tmp = _get_item<gallocy::string, Node *>(tmp->routes, *it);
-    // If this is the last element in the iterator, we're done searching for
-    // the handler function, so break.
-    if (std::distance(it, std::end(path_parts)) == 1)
-      break;
-    // If we encounter a dynamic route, save the path item as an argument to
-    // the handler function, advance the iterator past the dyanmic argument,
-    // and continue.
-    if (tmp->dynamic.compare("") != 0) {
-      tmp = _get_item<gallocy::string, Node *>(tmp->routes, tmp->dynamic);
-      std::advance(it, 1);
-      args->push_back(*it);
-    }
+void RoutingTable<HandlerFunction>::dump_table() const {
+  for (uint32_t i = 0; i < nodes.size(); i++) {
+    const Node &node = nodes[i];
+    std::cout << "Node " << i << ": "
+      << gallocy::string(segments.data() + node.segment_offset, node.segment_length)
+      << (node.has_handler ? " (handler)" : "") << std::endl;
+    for (uint32_t child = node.first_child; child != ROUTE_NO_NODE; child = nodes[child].next_sibling)
+      std::cout << "  -> " << child << std::endl;
+    if (node.variable != ROUTE_NO_NODE)
+      std::cout << "  -> " << node.variable << " (variable)" << std::endl;
   }
-  return std::bind(tmp->func, args, std::placeholders::_1);
 }
 
 #endif  // GALLOCY_HTTP_ROUTER_H_
@@ -5,13 +5,38 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <atomic>
+#include <functional>
+
+#include "gallocy/utils/logging.h"
 #include "gallocy/utils/stringutils.h"
 #include "gallocy/common/peer.h"
+#include "gallocy/worker.h"
 
 #define UDP_TIMEOUT_100_MS 100000  // 100 Milliseconds
 #define UDP_BUFSIZE 65507  // Largest IPV4 packet (65,535) - UDP header (8) - IPv4 Header(20)
 #define TCP_BUFSIZE 2000
+// How long a sender waits for a full socket buffer to drain before checking
+// again.
+#define TCP_POLL_MS 100
+// How long a sender waits for the whole of a message to be sent before giving
+// up on a receiver that does not read it.
+#define TCP_SEND_TIMEOUT_MS 5000
+// The number of requests a shared memory segment serves at once, and the
+// size of each of their rings, which must be a power of two.
+#define SHM_CHANNELS 16
+#define SHM_RING_SZ 16384
+#define SHM_MAGIC 0x67736d31
+// How long either side of a shared memory channel waits for the other to make
+// progress before giving up on it.
+#define SHM_TIMEOUT_MS 1000
+// How long a listener sleeps on its doorbell before checking if it is alive.
+#define SHM_POLL_MS 100
+// How long a datagram listener waits for a request before checking if it is
+// alive.
+#define UDP_POLL_MS 100
 
 namespace gallocy {
 
@@ -38,7 +63,7 @@ class AbstractTransport {
    *
    * \param http The HTTP to be written to the transport layer.
    */
-  virtual void write(gallocy::string http) = 0;
+  virtual void write(const gallocy::string &http) = 0;
 };
 
 
@@ -58,7 +83,7 @@ class TCPTransport: public AbstractTransport {
    *
    * \param http The HTTP to be written to the transport layer.
    */
-  void write(gallocy::string http);
+  void write(const gallocy::string &http);
 
 
   TCPTransport(gallocy::common::Peer dst_peer, uint16_t listen_port);
@@ -92,7 +117,7 @@ class UDPTransport: public AbstractTransport {
    *
    * \param http The HTTP to be written to the transport layer.
    */
-  void write(gallocy::string http);
+  void write(const gallocy::string &http);
 
   UDPTransport(gallocy::common::Peer dst_peer, uint16_t listen_port);
   ~UDPTransport();
@@ -109,6 +134,261 @@ class UDPTransport: public AbstractTransport {
 };
 
 
+/**
+ * One direction of a shared memory channel.
+ *
+ * A single producer, single consumer ring of bytes. The producer only moves
+ * ``tail`` and the consumer only moves ``head``, both as free running
+ * counters, and each side sleeps on the other's counter with a futex when
+ * the ring is full or empty.
+ */
+struct ShmRing {
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  /**
+   * True while a side sleeps on the ring, so that the other only makes a
+   * system call to wake it when it must.
+   */
+  std::atomic<uint32_t> reader_waiting;
+  std::atomic<uint32_t> writer_waiting;
+  uint8_t data[SHM_RING_SZ];
+};
+
+
+/**
+ * A request and its response in a shared memory segment.
+ */
+struct ShmChannel {
+  /**
+   * The channel's phase, in the low byte, and the ticket of the request that
+   * holds it, above, so that a client that gave up on a request can never
+   * free the channel out from under the next one.
+   */
+  std::atomic<uint32_t> state;
+  ShmRing request;
+  ShmRing response;
+};
+
+
+/**
+ * The shared memory segment a \ref ShmListener serves.
+ */
+struct ShmSegment {
+  uint32_t magic;
+  /**
+   * The listener's process, so that clients skip the segment of a listener
+   * that died without removing it.
+   */
+  pid_t pid;
+  /**
+   * Bumped by clients with a request ready, and slept on by the listener.
+   */
+  std::atomic<uint32_t> doorbell;
+  std::atomic<uint32_t> tickets;
+  ShmChannel channels[SHM_CHANNELS];
+};
+
+
+/**
+ * A request client that uses shared memory rings as its transport.
+ *
+ * Peers on the same host skip the network stack entirely: the listener of a
+ * peer keeps a shared memory segment named for its address and port, a
+ * client claims one of its channels for each request, and the request and
+ * its response are streamed through the channel's two rings. A message is
+ * framed by its length, so it may be larger than a ring.
+ */
+class ShmTransport: public AbstractTransport {
+ public:
+  /**
+   * Read from the transport layer.
+   *
+   * \return HTTP data, or an empty string if the other side gave up.
+   */
+  gallocy::string read();
+  /**
+   * Write to the transport layer.
+   *
+   * \param http The HTTP to be written to the transport layer.
+   */
+  void write(const gallocy::string &http);
+  /**
+   * Claim a channel of a peer's segment, as a client.
+   *
+   * \param dst_peer The peer to send the request to.
+   */
+  explicit ShmTransport(gallocy::common::Peer dst_peer);
+  /**
+   * Serve a channel a client has readied, as a listener.
+   *
+   * \param segment The listener's segment.
+   * \param channel The index of the channel.
+   * \param ticket The ticket of the request on the channel.
+   */
+  ShmTransport(ShmSegment *segment, uint32_t channel, uint32_t ticket);
+  ~ShmTransport();
+  ShmTransport(const ShmTransport &) = delete;
+  ShmTransport &operator=(const ShmTransport &) = delete;
+  /**
+   * Check if the transport holds a channel.
+   *
+   * \return False if the peer has no live segment or no free channel.
+   */
+  bool is_open() const {
+    return channel != nullptr;
+  }
+
+  /**
+   * True if the segment was mapped by this transport, as a client.
+   */
+  bool client;
+  /**
+   * True once a side gave up waiting on the other.
+   */
+  bool failed;
+  /**
+   * True once a client's request was handed to the listener.
+   */
+  bool announced;
+  /**
+   * True once a client read its whole response.
+   */
+  bool complete;
+  uint32_t ticket;
+  ShmSegment *segment;
+  ShmChannel *channel;
+  ShmRing *inbox;
+  ShmRing *outbox;
+};
+
+
+/**
+ * Serve the shared memory segment of a peer.
+ *
+ * The listener creates the segment its clients find by the peer's address
+ * and port, and removes it when destroyed. Once started, it sleeps on the
+ * segment's doorbell and serves the requests clients ready, one at a time.
+ */
+class ShmListener : public ThreadedDaemon {
+ public:
+  /**
+   * Get the raw HTTP response to a raw HTTP request.
+   */
+  using HandlerFunction = std::function<gallocy::string(const gallocy::string &)>;
+  /**
+   * Create a segment, but do not start serving it.
+   *
+   * \param address The peer's internet address.
+   * \param port The peer's port.
+   * \param handler The function that answers each request.
+   */
+  ShmListener(const gallocy::string &address, uint16_t port, HandlerFunction handler);
+  ~ShmListener();
+  ShmListener(const ShmListener &) = delete;
+  ShmListener &operator=(const ShmListener &) = delete;
+  /**
+   * Serve requests until stopped.
+   */
+  void *work();
+  /**
+   * Check if the segment was created.
+   */
+  bool is_open() const {
+    return segment != nullptr;
+  }
+
+ private:
+  /**
+   * Serve one readied channel.
+   */
+  void serve(uint32_t channel, uint32_t ticket);
+
+  gallocy::string name;
+  HandlerFunction handler;
+  ShmSegment *segment;
+};
+
+
+/**
+ * Serve requests that arrive as datagrams.
+ *
+ * Each request is one UDP datagram, and is answered with one datagram sent
+ * back to where it came from. Clients tell their responses apart by the
+ * ``X-Request-Id`` header, which the handler is expected to echo, so many
+ * clients can share one socket. A client may resend a request it got no
+ * answer to, so handlers may see a request more than once.
+ */
+class UDPListener : public ThreadedDaemon {
+ public:
+  /**
+   * Get the raw HTTP response to a raw HTTP request.
+   */
+  using HandlerFunction = std::function<gallocy::string(const gallocy::string &)>;
+  /**
+   * Bind a socket, but do not start serving it.
+   *
+   * \param address The internet address to bind.
+   * \param port The UDP port to bind.
+   * \param handler The function that answers each request.
+   */
+  UDPListener(const gallocy::string &address, uint16_t port, HandlerFunction handler);
+  ~UDPListener();
+  UDPListener(const UDPListener &) = delete;
+  UDPListener &operator=(const UDPListener &) = delete;
+  /**
+   * Serve requests until stopped.
+   */
+  void *work();
+  /**
+   * Check if the socket was bound.
+   */
+  bool is_open() const {
+    return sock != -1;
+  }
+
+ private:
+  HandlerFunction handler;
+  int sock;
+  char buf[UDP_BUFSIZE];
+};
+
+
+/**
+ * Get the name of a peer's shared memory segment.
+ *
+ * \param peer The peer.
+ * \return The segment's name.
+ */
+gallocy::string shm_segment_name(const gallocy::common::Peer &peer);
+
+
+/**
+ * Check if a peer's address belongs to this host.
+ *
+ * \param peer The peer.
+ * \return True for loopback addresses and those of the host's interfaces.
+ */
+bool is_local_address(const gallocy::common::Peer &peer);
+
+
+/**
+ * Send some buffers, in order, as one stream of bytes.
+ *
+ * The buffers are handed to ``sendmsg`` together, so that, e.g., a
+ * response's head and body need not be copied into one string. A partial
+ * send advances the buffers in place, waiting whenever a non-blocking
+ * socket's buffer is full, but for no longer than ``timeout_ms`` in all.
+ *
+ * \param socket A connected socket.
+ * \param iov The buffers, which are changed.
+ * \param count The number of buffers.
+ * \param timeout_ms How long sending the buffers may take.
+ * \return False if the socket failed or the buffers were not sent in time,
+ * in which case the socket should be closed.
+ */
+bool send_all(int socket, struct iovec *iov, int count, uint64_t timeout_ms = TCP_SEND_TIMEOUT_MS);
+
+
 /**
  * A request client that uses a raw RDP transport protocol.
  */
@@ -126,7 +406,7 @@ class RDPTransport: public AbstractTransport {
    *
    * \param http The HTTP to be written to the transport layer.
    */
-  virtual void write(gallocy::string http) = 0;
+  virtual void write(const gallocy::string &http) = 0;
 };
 
 }  // namespace http
@@ -0,0 +1,166 @@
+#ifndef GALLOCY_HTTP_URING_H_
+#define GALLOCY_HTTP_URING_H_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+// The number of submission queue entries of a ring.
+#define URING_ENTRIES 256
+// The number and size of the buffers a ring's multishot receives read into.
+// The number must be a power of two.
+#define URING_BUFFERS 64
+#define URING_BUFSIZE 4096
+// The group a ring's buffers are provided as.
+#define URING_BGID 0
+
+namespace gallocy {
+
+namespace http {
+
+/**
+ * An io_uring instance and the buffers its receives read into.
+ *
+ * This is a thin layer over the io_uring system calls for event loops that
+ * accept connections and read from them, with no dependency on liburing.
+ * Operations are queued as submission queue entries and are all submitted at
+ * once, with the wait for their completions, by \ref submit_and_wait, so an
+ * event loop makes one system call per batch of events.
+ *
+ * Accepts and receives are multishot: one submission keeps completing for
+ * each connection accepted, or each read, until it fails or is cancelled.
+ * Receives read into a ring of \ref URING_BUFFERS buffers from the internal
+ * heap that are registered with the kernel, which picks one as data arrives,
+ * so no buffer is tied up by a connection waiting to send. A ring is used by
+ * one thread at a time.
+ */
+class Uring {
+ public:
+  /**
+   * Set up a ring and register its buffers.
+   *
+   * Check \ref is_open before using it.
+   */
+  Uring();
+  ~Uring();
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+  /**
+   * Check if the kernel has everything a ring uses.
+   *
+   * Multishot receives need Linux 6.0. Without them, callers should fall back
+   * to epoll.
+   */
+  static bool supported();
+  /**
+   * Check if the ring was set up.
+   */
+  bool is_open() const {
+    return fd != -1;
+  }
+  /**
+   * Queue a multishot accept of non-blocking connections.
+   *
+   * \param socket A listening socket.
+   * \param user_data Passed back with each completion.
+   */
+  void accept_multishot(int socket, uint64_t user_data);
+  /**
+   * Queue a multishot receive into the ring's buffers.
+   *
+   * Each completion's flags hold the buffer it read into, see \ref buffer.
+   *
+   * \param socket A connected socket.
+   * \param user_data Passed back with each completion.
+   */
+  void recv_multishot(int socket, uint64_t user_data);
+  /**
+   * Queue a read into a buffer of the caller's.
+   */
+  void read(int fd, void *buf, uint32_t length, uint64_t user_data);
+  /**
+   * Queue the cancellation of an operation.
+   *
+   * The operation completes once more, without ``IORING_CQE_F_MORE``.
+   *
+   * \param target The user data of the operation.
+   * \param user_data Passed back with the cancellation's own completion.
+   */
+  void cancel(uint64_t target, uint64_t user_data);
+  /**
+   * Submit every queued operation and wait for a completion.
+   *
+   * \param timeout_ms How long to wait.
+   * \return The number of operations submitted, or a negative ``errno``.
+   */
+  int submit_and_wait(uint64_t timeout_ms);
+  /**
+   * Get the next completion, if any.
+   *
+   * \return The completion, which is valid until \ref seen, or a null
+   * pointer.
+   */
+  struct io_uring_cqe *peek();
+  /**
+   * Mark the completion from \ref peek as handled.
+   */
+  void seen();
+  /**
+   * Get the buffer a receive's completion read into.
+   *
+   * \param cqe The completion.
+   * \return The buffer, which must be \ref recycle "recycled" once read.
+   */
+  const char *buffer(const struct io_uring_cqe *cqe) const;
+  /**
+   * Give a receive's buffer back to the kernel.
+   *
+   * \param cqe The completion that read into it.
+   */
+  void recycle(const struct io_uring_cqe *cqe);
+
+ private:
+  /**
+   * Get a free submission queue entry, submitting the queued ones if there
+   * are none.
+   */
+  struct io_uring_sqe *get_sqe();
+  /**
+   * Hand a buffer to the kernel to read into.
+   */
+  void provide(uint16_t bid);
+
+  int fd;
+  /**
+   * The submission and completion rings, which share one mapping.
+   */
+  void *rings;
+  uint64_t rings_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  /**
+   * The number of entries queued since the last submission.
+   */
+  unsigned queued;
+  /**
+   * The ring of buffers the kernel picks from, which must be page aligned,
+   * and the buffers themselves.
+   */
+  void *buf_ring_allocation;
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  uint16_t buf_tail;
+};
+
+}  // namespace http
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_HTTP_URING_H_
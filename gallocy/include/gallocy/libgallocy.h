@@ -12,6 +12,17 @@ extern volatile int anyThreadCreated;
 extern ApplicationHeapType heap;
 
 
+/**
+ * Observe an application heap allocation, or a free when ``site`` is null.
+ *
+ * \param arg The hook's argument.
+ * \param ptr The allocation.
+ * \param sz The allocation's size.
+ * \param site The address the allocation returned to.
+ */
+typedef void (*AllocationHook)(void *arg, void *ptr, size_t sz, void *site);
+
+
 extern "C" {
   void __reset_memory_allocator();
   void* custom_malloc(size_t sz);
@@ -19,6 +30,14 @@ extern "C" {
   void* custom_realloc(void *ptr, size_t sz);
   // This is an OSX thing, but is useful for testing.
   size_t custom_malloc_usable_size(void *ptr);
+  // Set the application heap's placement policy, one of PLACEMENT_*.
+  void custom_set_placement(int placement);
+  // Get the number of placement domains held by threads.
+  uint64_t custom_get_placement_domains();
+  // Get the number of threads that found no placement domain free.
+  uint64_t custom_get_placement_overflows();
+  // Observe every application heap allocation and free, or stop if null.
+  void custom_set_allocation_hook(AllocationHook hook, void *arg);
 #ifdef __APPLE__
   void custom_malloc_lock();
   void custom_malloc_unlock();
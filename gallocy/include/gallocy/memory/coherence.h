@@ -0,0 +1,348 @@
+#ifndef GALLOCY_MEMORY_COHERENCE_H_
+#define GALLOCY_MEMORY_COHERENCE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/transfer.h"
+
+// The values of ApplicationMemory::coherency_model.
+#define COHERENCY_NONE 0
+#define COHERENCY_MRSW 1
+#define COHERENCY_LRC 2
+
+// The values of ApplicationMemory::permissions.
+#define PAGE_PERM_NONE 0
+#define PAGE_PERM_READ 1
+#define PAGE_PERM_WRITE 2
+
+// Copysets are bitmasks of node identifiers.
+#define COHERENCE_MAX_NODES 64
+
+// A region's coherence granularity is a power of two number of bytes. Less
+// than a page splits pages into blocks, and more than a page groups pages
+// into units that move together, at most as many as one request carries.
+#define COHERENCE_MIN_GRANULARITY 64
+#define COHERENCE_MAX_GRANULARITY (PAGE_TRANSFER_MAX_PAGES * PAGE_SZ)
+#define PAGE_SZ_LOG2 12
+
+namespace gallocy {
+
+namespace memory {
+
+class FalseSharingProfiler;
+class PageDirectory;
+class PagePrefetcher;
+
+/**
+ * Get the base two logarithm of a coherence granularity.
+ *
+ * \param granularity The granularity in bytes.
+ * \return The logarithm, or -1 if the granularity is not a power of two
+ * between \ref COHERENCE_MIN_GRANULARITY and \ref COHERENCE_MAX_GRANULARITY.
+ */
+inline int granularity_log2(uint64_t granularity) {
+  if (granularity < COHERENCE_MIN_GRANULARITY || granularity > COHERENCE_MAX_GRANULARITY
+      || (granularity & (granularity - 1)))
+    return -1;
+  return __builtin_ctzll(granularity);
+}
+
+/**
+ * The coherence state of one page on one node.
+ */
+struct CoherencePage {
+  /**
+   * The node thought to own the page, which is this node if it does.
+   * Requests sent to a node that no longer owns the page are refused with a
+   * hint of who it thinks the owner is, and are retried there.
+   */
+  uint32_t owner;
+  /**
+   * One of ``PAGE_PERM_*``.
+   */
+  uint8_t permissions;
+  /**
+   * True while the page is being fetched or handed to another node.
+   */
+  uint8_t busy;
+  /**
+   * True if an invalidation arrived while the page was being fetched, so
+   * the copy that arrives is dropped rather than read.
+   */
+  uint8_t invalidated;
+  /**
+   * True if a read-only copy was prefetched and is still protected, so that
+   * its first touch is seen.
+   */
+  uint8_t prefetched;
+  /**
+   * The base two logarithm of the number of pages in the page's unit.
+   */
+  uint8_t unit_log2;
+  /**
+   * The nodes with read-only copies, which is only kept by the owner.
+   */
+  uint64_t copyset;
+};
+
+/**
+ * A multiple-reader, single-writer coherence protocol.
+ *
+ * Every page has one owner that can write it. Any number of other nodes may
+ * hold read-only copies:
+ *
+ *   - A read fault fetches a read-only copy from the owner, which also drops
+ *     to read-only so that its next write faults.
+ *     Missing units after it in the prefetch window that have the same
+ *     owner are read in the same round trip. With a \ref PagePrefetcher,
+ *     units further along each thread's stride are read ahead of it too.
+ *   - A write fault takes ownership, and the page, from the owner, which
+ *     hands over its copyset with the page. The new owner, or an owner
+ *     upgrading its own read-only copy, owes every reader an invalidation.
+ *
+ * Invalidations are not sent as they are owed. They are batched per reader
+ * and sent, one message per reader, when the writer ends its sync epoch with
+ * \ref MRSWCoherence::sync. Until then readers may keep reading the page's
+ * old contents, which is all a program that synchronizes through locks and
+ * barriers can observe.
+ *
+ * Pages are protected to match their permissions, so accesses to pages
+ * without the right permission fault into \ref MRSWCoherence::fault. Pages
+ * are filled through a second, always writable, mapping of the region, so
+ * the application never sees a page that is only partly filled. The region
+ * must therefore be a shared mapping.
+ *
+ * Without a directory, a request for a page that has moved follows the chain
+ * of hints from the node this node last saw own it. With a \ref
+ * PageDirectory, the page's home is asked for its owner instead, and is told
+ * of every new owner and reader.
+ *
+ * The unit of coherence is a run of pages, a single page by default. Bulk
+ * data can use units of up to \ref COHERENCE_MAX_GRANULARITY bytes, whose
+ * pages are faulted, transferred, and invalidated together, which cuts the
+ * per-page overhead. Every page of a unit has the same state, and the
+ * directory tracks a unit by its first page.
+ */
+class MRSWCoherence : public PageCoherence {
+ public:
+  /**
+   * Create a coherence protocol over a region and protect the region.
+   *
+   * \param self This node's identifier, which is its index in ``nodes``.
+   * \param nodes The page transfer address of every node.
+   * \param base The start of the region.
+   * \param pages The number of pages in the region.
+   * \param initial_owner The node that owns every page to begin with.
+   * \param granularity The size of the region's coherence unit in bytes, a
+   * power of two of at least a page.
+   * \param prefetch_window The number of pages after a read faulting unit
+   * to read with it when they are missing and have the same owner.
+   */
+  MRSWCoherence(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes,
+                void *base, uint64_t pages, uint32_t initial_owner = 0, uint64_t granularity = PAGE_SZ,
+                uint64_t prefetch_window = 0);
+  ~MRSWCoherence();
+  MRSWCoherence(const MRSWCoherence &) = delete;
+  MRSWCoherence &operator=(const MRSWCoherence &) = delete;
+  /**
+   * Handle a page fault in the region.
+   *
+   * \param address The faulting address.
+   * \param write True if the fault was a write.
+   * \return True if the page now has the needed permission.
+   */
+  bool fault(void *address, bool write);
+  /**
+   * Get a read-only copy of a page.
+   */
+  bool read_fault(uint64_t page);
+  /**
+   * Get ownership of a page.
+   */
+  bool write_fault(uint64_t page);
+  /**
+   * End the sync epoch by sending every owed invalidation.
+   *
+   * When this returns, every reader that was owed an invalidation has
+   * dropped its copy.
+   */
+  void sync();
+  /**
+   * End sync epochs at the application's releases, by running \ref sync
+   * whenever a thread releases a synchronization object in the region or
+   * joins a thread.
+   *
+   * Objects outside the region are not shared with other nodes, so their
+   * releases publish nothing. The protocol's own locking suspends the hooks,
+   * so it never runs \ref sync under its own lock.
+   */
+  void intercept_synchronization();
+  /**
+   * Check if an address is in the region.
+   */
+  bool contains(const void *address) const {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(address);
+    return p >= base && p < base + pages * PAGE_SZ;
+  }
+  /**
+   * Find owners through a directory, which must outlive the protocol.
+   */
+  void set_directory(PageDirectory *directory);
+  /**
+   * Sample ownership transfers into a profiler, which must outlive the
+   * protocol.
+   */
+  void set_profiler(FalseSharingProfiler *profiler);
+  /**
+   * Set the number of pages after a read faulting unit to read with it.
+   */
+  void set_prefetch_window(uint64_t window);
+  /**
+   * Tell a prefetcher of every read fault, and of the first touch of every
+   * unit it prefetched with \ref MRSWCoherence::prefetch. The prefetcher
+   * must outlive the protocol.
+   */
+  void set_prefetcher(PagePrefetcher *prefetcher);
+  /**
+   * Read units that are missing ahead of a fault, as a \ref PagePrefetcher
+   * fetch function.
+   *
+   * Each run of units thought to be at one owner is read in one round trip,
+   * from that owner only, and units that are present or moving are skipped.
+   * The copies stay protected until they are first touched.
+   *
+   * \param page_numbers Page numbers in ascending order, which are compacted
+   * in place to the first pages of the units that were read.
+   * \param count The number of page numbers.
+   * \return The number of units read.
+   */
+  size_t prefetch(uint64_t *page_numbers, size_t count);
+  /**
+   * Set the coherence granularity of part of the region, e.g., of one
+   * allocation.
+   *
+   * Every node must set the same granularity before the part is shared, and
+   * every page of each unit must have the same owner.
+   *
+   * \param address The start of the part, aligned to the granularity.
+   * \param length The length of the part, a multiple of the granularity.
+   * \param granularity The size of the coherence unit in bytes, a power of
+   * two of at least a page.
+   * \return False if the granularity or the part is invalid.
+   */
+  bool set_granularity(void *address, size_t length, uint64_t granularity);
+  /**
+   * Get the size of the coherence unit a page is in, in bytes.
+   */
+  uint64_t get_granularity(uint64_t page);
+  uint16_t prepare(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, uint32_t *hint,
+                   uint64_t *readers);
+  void complete(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, bool sent);
+  /**
+   * Get this node's permissions on a page, one of ``PAGE_PERM_*``.
+   */
+  uint8_t get_permissions(uint64_t page);
+  /**
+   * Get the node this node thinks owns a page.
+   */
+  uint32_t get_owner(uint64_t page);
+  /**
+   * Get the protocol's metrics.
+   *
+   * \return A JSON object of the protocol's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of read faults that fetched a page.
+   */
+  uint64_t read_faults;
+  /**
+   * The number of write faults that took ownership from another node.
+   */
+  uint64_t write_faults;
+  /**
+   * The number of pages read along with a faulting unit, or ahead of one by
+   * the prefetcher.
+   */
+  uint64_t pages_prefetched;
+  /**
+   * The number of invalidation messages sent.
+   */
+  uint64_t invalidation_messages;
+  /**
+   * The number of page invalidations sent.
+   */
+  uint64_t pages_invalidated;
+  /**
+   * The number of sync epochs ended.
+   */
+  uint64_t epochs;
+
+ private:
+  /**
+   * Request a unit from its owner, following hints, until it is served.
+   *
+   * \param first The unit's first page.
+   * \param count The number of pages in the unit, and in any units read with
+   * it.
+   * \param served Set to the node that served the unit.
+   * \param readers If not ``nullptr``, set for OWN to the readers the old
+   * owner handed over.
+   * \param follow False to ask only the node thought to own the unit, and
+   * fail quietly if it does not serve it.
+   */
+  bool request(uint16_t op, uint64_t first, uint64_t count, std::unique_lock<std::mutex> &lock, uint32_t *served,
+               uint64_t *readers, bool follow = true);
+  /**
+   * Mark busy the units after a unit that can be read with it, up to the
+   * prefetch window. Must hold ``access_lock``.
+   *
+   * \return The number of pages marked.
+   */
+  uint64_t gather_window(uint64_t first, uint64_t count);
+  /**
+   * Find the unit a page is in. Must hold ``access_lock``.
+   */
+  void unit(uint64_t page, uint64_t *first, uint64_t *count);
+  /**
+   * Owe every reader in a copyset, except one node, an invalidation. Must
+   * hold ``access_lock``.
+   */
+  void owe_invalidations(uint64_t page, uint64_t copyset, uint32_t except);
+  void protect(uint64_t page, uint8_t permissions, uint64_t count = 1);
+
+  uint32_t self;
+  uint32_t node_count;
+  uint8_t *base;
+  /**
+   * The writable alias of the region that pages are filled through.
+   */
+  uint8_t *fill;
+  uint64_t pages;
+  uint64_t prefetch_window;
+  CoherencePage *state;
+  /**
+   * A bitmap per node of the pages it is owed invalidations for.
+   */
+  uint64_t *owed[COHERENCE_MAX_NODES];
+  PageTransferClient *clients[COHERENCE_MAX_NODES];
+  PageDirectory *directory;
+  FalseSharingProfiler *profiler;
+  PagePrefetcher *prefetcher;
+  gallocy::string metrics_name;
+  bool intercepting;
+  std::mutex access_lock;
+  std::condition_variable busy_cv;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_COHERENCE_H_
@@ -0,0 +1,220 @@
+#ifndef GALLOCY_MEMORY_DIRECTORY_H_
+#define GALLOCY_MEMORY_DIRECTORY_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/transfer.h"
+
+// A DIRECTORY message is a \ref DirectoryMessage. A LOOKUP is answered with a
+// \ref DirectoryEntry, and an update with an empty message. A MIGRATE is
+// followed by \ref DirectoryRecord entries for the receiver to keep.
+//
+// A node that is not a page's home refuses requests for it with \ref
+// PAGE_TRANSFER_ENOTOWNER, which only happens while nodes disagree on the
+// membership.
+#define DIRECTORY_LOOKUP 1
+#define DIRECTORY_SET_OWNER 2
+#define DIRECTORY_ADD_COPY 3
+#define DIRECTORY_MIGRATE 4
+
+// Pages are hashed into this many buckets, and each bucket has one home.
+#define DIRECTORY_BUCKETS 4096
+
+// Not a member.
+#define DIRECTORY_NO_NODE UINT32_MAX
+
+// The bits of DirectoryEntry::flags.
+#define DIRECTORY_OWNER_SET 1
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * What a page's home knows about it.
+ */
+struct DirectoryEntry {
+  /**
+   * The node that owns the page.
+   */
+  uint32_t owner;
+  /**
+   * ``DIRECTORY_*`` bits. \ref DIRECTORY_OWNER_SET is set once the owner was
+   * set rather than assumed to be the initial owner.
+   */
+  uint32_t flags;
+  /**
+   * The nodes that may have read-only copies.
+   */
+  uint64_t copyset;
+};
+
+/**
+ * A page's directory entry, as migrated to its new home.
+ */
+struct DirectoryRecord {
+  uint64_t page;
+  DirectoryEntry entry;
+};
+
+/**
+ * A DIRECTORY request.
+ */
+struct DirectoryMessage {
+  uint8_t kind;
+  uint8_t reserved[3];
+  /**
+   * The node to set as the owner or add to the copyset.
+   */
+  uint32_t node;
+  uint64_t page;
+};
+
+/**
+ * A home-based page directory.
+ *
+ * Every page has a home node, picked by hashing the page number, which keeps
+ * the page's current owner and copyset. Finding a page's owner costs at most
+ * one round trip to its home, however many times the page has moved, and no
+ * node has to answer for every page.
+ *
+ * Homes are picked per bucket of pages by rendezvous hashing over the
+ * members' addresses, so every node with the same membership picks the same
+ * homes, and a change in membership only moves the buckets whose home joined
+ * or left. The directory is rebuilt with \ref PageDirectory::rebuild when the
+ * committed membership changes, and entries whose home moved are migrated to
+ * their new home.
+ *
+ * Nodes are identified by their index in the membership, like everywhere
+ * else, and entries are renumbered when the membership changes.
+ */
+class PageDirectory : public PageCoherence {
+ public:
+  /**
+   * Create a directory.
+   *
+   * \param self This node's identifier, which is its index in ``nodes``.
+   * \param nodes The page transfer address of every member.
+   * \param initial_owner The node that owns every page to begin with.
+   */
+  PageDirectory(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes, uint32_t initial_owner = 0);
+  ~PageDirectory();
+  PageDirectory(const PageDirectory &) = delete;
+  PageDirectory &operator=(const PageDirectory &) = delete;
+  /**
+   * Rebuild the directory for a new membership, and migrate every entry
+   * whose home moved.
+   *
+   * \param nodes The page transfer address of every member, which this node
+   * may have left.
+   */
+  void rebuild(const gallocy::vector<gallocy::common::Peer> &nodes);
+  /**
+   * Get a page's home.
+   */
+  uint32_t get_home(uint64_t page);
+  /**
+   * Get this node's identifier, which is \ref DIRECTORY_NO_NODE if it is not
+   * a member.
+   */
+  uint32_t get_self();
+  /**
+   * Look up a page's owner and copyset at its home.
+   *
+   * \param page The page number.
+   * \param entry Set to the page's entry.
+   * \return True if the home answered.
+   */
+  bool lookup(uint64_t page, DirectoryEntry *entry);
+  /**
+   * Tell a page's home that a node owns it, which clears its copyset.
+   */
+  bool set_owner(uint64_t page, uint32_t node);
+  /**
+   * Tell a page's home that a node has a read-only copy.
+   */
+  bool add_copy(uint64_t page, uint32_t node);
+  uint16_t prepare(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, uint32_t *hint,
+                   uint64_t *readers) {
+    return PAGE_TRANSFER_EINVAL;
+  }
+  void complete(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, bool sent) {}
+  uint16_t exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                    size_t *reply_length, size_t capacity);
+  /**
+   * Get the directory's metrics.
+   *
+   * \return A JSON object of the directory's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of lookups answered by this node as the home.
+   */
+  uint64_t local_lookups;
+  /**
+   * The number of lookups sent to another home.
+   */
+  uint64_t remote_lookups;
+  /**
+   * The number of updates sent to another home.
+   */
+  uint64_t remote_updates;
+  /**
+   * The number of entries migrated to a new home.
+   */
+  uint64_t migrated;
+  /**
+   * The number of times the directory was rebuilt.
+   */
+  uint64_t rebuilds;
+
+ private:
+  /**
+   * Apply a request to an entry this node is the home of. Must hold
+   * ``access_lock``.
+   */
+  uint16_t apply(const DirectoryMessage &request, DirectoryEntry *reply);
+  /**
+   * Send a request to a page's home, or apply it here if this node is the
+   * home.
+   */
+  bool send(uint8_t kind, uint64_t page, uint32_t node, DirectoryEntry *reply);
+  /**
+   * Get the client for a member. Must hold ``access_lock``.
+   */
+  PageTransferClient *get_client(uint32_t node);
+  /**
+   * Pick the home of every bucket. Must hold ``access_lock``.
+   */
+  void assign_homes();
+
+  gallocy::common::Peer self_peer;
+  uint32_t self;
+  uint32_t initial_owner;
+  gallocy::vector<gallocy::common::Peer> members;
+  uint32_t homes[DIRECTORY_BUCKETS];
+  /**
+   * The entries of pages homed here that differ from the initial state.
+   */
+  gallocy::map<uint64_t, DirectoryEntry> entries;
+  /**
+   * A client per peer, keyed by its address and port, and kept across
+   * membership changes so that requests in flight never lose theirs.
+   */
+  gallocy::map<uint64_t, PageTransferClient *> clients;
+  gallocy::string metrics_name;
+  std::mutex access_lock;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_DIRECTORY_H_
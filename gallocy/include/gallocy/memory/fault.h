@@ -0,0 +1,55 @@
+#ifndef GALLOCY_MEMORY_FAULT_H_
+#define GALLOCY_MEMORY_FAULT_H_
+
+#include <stdint.h>
+
+// The most regions that can have a fault handler at once.
+#define FAULT_MAX_REGIONS 8
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * A page fault handler.
+ *
+ * A handler runs in the faulting thread, inside a SIGSEGV handler, and should
+ * change the protection of the faulting page so that the access succeeds when
+ * it is retried.
+ *
+ * \param arg The argument the region was registered with.
+ * \param address The faulting address.
+ * \param write True if the faulting access was a write. Where the kernel does
+ * not say, every fault is reported as a read, so a handler should treat a
+ * read fault on a readable page as a write.
+ * \return True if the access should be retried, false to let the fault
+ * through to the previous SIGSEGV handler.
+ */
+typedef bool (*FaultHandler)(void *arg, void *address, bool write);
+
+/**
+ * Handle page faults in a region.
+ *
+ * The first region registered installs a SIGSEGV handler. Faults outside of
+ * every region go to whatever handler was installed before it.
+ *
+ * \param base The start of the region.
+ * \param length The length of the region.
+ * \param handler The handler to call for faults in the region.
+ * \param arg The argument to pass to the handler.
+ * \return True if the region was registered, false if there is no room.
+ */
+bool register_fault_region(void *base, uint64_t length, FaultHandler handler, void *arg);
+
+/**
+ * Stop handling page faults in a region.
+ *
+ * \param base The start of the region.
+ */
+void unregister_fault_region(void *base);
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_FAULT_H_
@@ -0,0 +1,223 @@
+#ifndef GALLOCY_MEMORY_LEASE_H_
+#define GALLOCY_MEMORY_LEASE_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/utils/constants.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/worker.h"
+
+// The application heap is leased in chunks of this many bytes.
+#define LEASE_CHUNK_SZ (1024 * 1024)
+#define LEASE_CHUNKS (ZONE_SZ / LEASE_CHUNK_SZ)
+
+// The chunks at the start of the heap are never leased, and hold what each
+// node allocates before it has leases.
+#define LEASE_BOOTSTRAP_CHUNKS 1
+
+// Chunks are leased this many at a time, when fewer than the low water mark
+// are left unused, and unused chunks beyond the high water mark are returned.
+#define LEASE_BATCH 4
+#define LEASE_LOW_WATER 2
+#define LEASE_HIGH_WATER 12
+
+// How often the lease worker checks its supply.
+#define LEASE_POLL_MS 50
+// How long an allocation waits for a lease to be committed.
+#define LEASE_TIMEOUT_MS 5000
+// How long a proposed lease may go uncommitted before it is proposed again,
+// e.g., because the leader that took it lost its term.
+#define LEASE_PENDING_MS 1000
+
+// A chunk nobody leases.
+#define LEASE_FREE UINT64_MAX
+
+// The values of ChunkLeases::usage.
+#define CHUNK_UNUSED 0
+#define CHUNK_USED 1
+#define CHUNK_RETURNING 2
+
+// The commands that change leases, which are committed through the Raft log:
+//
+//   chunk-lease <node> <count> <contiguous>
+//   chunk-return <node> <chunk> [<chunk> ...]
+#define LEASE_COMMAND "chunk-lease"
+#define RETURN_COMMAND "chunk-return"
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * A lease this node proposed that has not been granted yet.
+ */
+struct PendingLease {
+  size_t count;
+  /**
+   * When the lease is given up on, and may be proposed again.
+   */
+  std::chrono::steady_clock::time_point deadline;
+};
+
+/**
+ * Leases of the application heap's chunks.
+ *
+ * Every node maps the application heap at the same address, so no two nodes
+ * may hand out the same bytes. The heap is split into chunks, and each node
+ * allocates only from chunks it leases, without talking to anyone.
+ *
+ * Leases change only through commands committed to the Raft log, which every
+ * node applies in the same order with \ref ChunkLeases::apply, so every node
+ * agrees on who leases what. A lease command grants the lowest free chunks,
+ * so applying it needs nothing but the table.
+ *
+ * A proposal may never commit, e.g., if its leader loses its term before
+ * replicating it, so a lease that is not granted within \ref
+ * LEASE_PENDING_MS is given up on and proposed again. If the first proposal
+ * commits after all, the surplus chunks are returned like any others.
+ *
+ * The lease worker keeps a few unused chunks leased ahead of demand, so
+ * allocations rarely wait on the log, and returns unused chunks beyond the
+ * high water mark, so a node that scales down gives its chunks back.
+ */
+class ChunkLeases : public ThreadedDaemon {
+ public:
+  /**
+   * Propose a command to the Raft log.
+   *
+   * The command is applied once it commits, maybe after this returns.
+   *
+   * \return False if the command could not be proposed.
+   */
+  typedef std::function<bool(const gallocy::string &command)> Proposer;
+  /**
+   * Create an empty lease table.
+   *
+   * \param self This node's identifier.
+   * \param propose Proposes commands to the Raft log.
+   */
+  ChunkLeases(uint64_t self, Proposer propose);
+  ~ChunkLeases();
+  ChunkLeases(const ChunkLeases &) = delete;
+  ChunkLeases &operator=(const ChunkLeases &) = delete;
+  /**
+   * Apply a committed command.
+   *
+   * \param command The command.
+   * \return True if the command was a lease command.
+   */
+  bool apply(const gallocy::string &command);
+  /**
+   * Hand out unused leased chunks, leasing more if needed.
+   *
+   * \param size The least number of bytes needed, which may be more than a
+   * chunk.
+   * \param offset Set to the offset in the heap of the first chunk.
+   * \param length Set to the number of bytes handed out.
+   * \return False if the heap is out of chunks or no lease committed in
+   * time.
+   */
+  bool allocate(size_t size, uint64_t *offset, size_t *length);
+  /**
+   * Return unused chunks beyond a number to keep.
+   *
+   * \param keep The number of unused chunks to keep.
+   * \return The number of chunks proposed for return.
+   */
+  size_t return_unused(size_t keep);
+  /**
+   * Get the node leasing a chunk, or \ref LEASE_FREE.
+   */
+  uint64_t get_owner(uint64_t chunk);
+  /**
+   * Get the number of chunks this node leases.
+   */
+  size_t get_leased();
+  /**
+   * Get the number of chunks this node leases but has not handed out.
+   */
+  size_t get_unused();
+  /**
+   * Hand a heap chunks from a lease table.
+   *
+   * This is a ``HL::ChunkSourceFunction`` whose argument is the table.
+   */
+  static bool chunk_source(void *arg, size_t size, uint64_t *offset, size_t *length);
+  void *work();
+  /**
+   * Get the table's metrics.
+   *
+   * \return A JSON object of the table's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of lease commands proposed.
+   */
+  uint64_t lease_requests;
+  /**
+   * The number of chunks leased to this node.
+   */
+  uint64_t chunks_leased;
+  /**
+   * The number of chunks this node returned.
+   */
+  uint64_t chunks_returned;
+  /**
+   * The number of allocations that waited for a lease.
+   */
+  uint64_t waits;
+
+ private:
+  /**
+   * Propose a lease, unless enough chunks are already on their way.
+   */
+  void request(size_t count, bool contiguous, std::unique_lock<std::mutex> &lock);
+  /**
+   * Give up on the pending leases whose deadlines passed. Must hold
+   * ``access_lock``.
+   */
+  void expire_pending();
+  /**
+   * Find a run of unused chunks this node leases, or the end of the heap.
+   * Must hold ``access_lock``.
+   */
+  uint64_t find_unused(size_t count);
+  /**
+   * Check if the table has a run of free chunks. Must hold ``access_lock``.
+   */
+  bool has_free(size_t count);
+  /**
+   * Count the unused chunks this node leases. Must hold ``access_lock``.
+   */
+  size_t count_unused();
+
+  uint64_t self;
+  Proposer propose;
+  uint64_t owners[LEASE_CHUNKS];
+  /**
+   * One of ``CHUNK_*`` for every chunk this node leases.
+   */
+  uint8_t usage[LEASE_CHUNKS];
+  /**
+   * The leases proposed that have not been granted yet, oldest first, and
+   * the number of chunks they ask for.
+   */
+  gallocy::vector<PendingLease> pending_leases;
+  size_t pending;
+  gallocy::string metrics_name;
+  std::mutex access_lock;
+  std::condition_variable granted_cv;
+  std::condition_variable demand_cv;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_LEASE_H_
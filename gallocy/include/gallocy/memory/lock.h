@@ -0,0 +1,294 @@
+#ifndef GALLOCY_MEMORY_LOCK_H_
+#define GALLOCY_MEMORY_LOCK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/release.h"
+#include "gallocy/memory/transfer.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+#include "gallocy/worker.h"
+
+// A LOCK message is a \ref LockMessage followed by the requester's vector
+// clock for a REQUEST or FORWARD, or by encoded write notices for a GRANT.
+#define LOCK_REQUEST 1
+#define LOCK_FORWARD 2
+#define LOCK_GRANT 3
+
+// No node.
+#define LOCK_NO_NODE UINT32_MAX
+
+// How long the sender waits for messages before checking if it is alive.
+#define LOCK_POLL_MS 100
+// How long a lock's transfers are counted before its rate is recorded.
+#define LOCK_RATE_WINDOW_NS 1000000000ULL
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * The header of a LOCK message.
+ */
+struct LockMessage {
+  uint8_t kind;
+  uint8_t reserved[3];
+  /**
+   * The node that wants the lock.
+   */
+  uint32_t requester;
+  /**
+   * The lock's offset into the region.
+   */
+  uint64_t id;
+};
+
+/**
+ * One node's state for a lock.
+ */
+struct DistributedLock {
+  /**
+   * The node-local mutex that application threads really lock.
+   */
+  pthread_mutex_t shadow;
+  /**
+   * True if this node has the lock's token, without which no thread on this
+   * node may hold the lock.
+   */
+  bool token;
+  /**
+   * True while a thread on this node holds the lock.
+   */
+  bool held;
+  /**
+   * True while a thread on this node waits for the token.
+   */
+  bool requested;
+  /**
+   * True while this node's request for the token is on its way, which a
+   * failed trylock leaves behind without waiting.
+   */
+  bool asked;
+  /**
+   * The node to hand the token to when the lock is next free, and its vector
+   * clock.
+   */
+  uint32_t next;
+  uint32_t next_clock[COHERENCE_MAX_NODES];
+  /**
+   * The node that granted the token with more write notices than fit.
+   */
+  uint32_t more_from;
+  /**
+   * When the current transfer rate window started, and the transfers in it.
+   */
+  uint64_t window_start;
+  uint64_t window_transfers;
+};
+
+/**
+ * A message waiting to be sent.
+ */
+struct LockOutgoing {
+  uint32_t node;
+  LockMessage header;
+  uint32_t clock[COHERENCE_MAX_NODES];
+  /**
+   * For a GRANT, the node with write notices that did not fit when the
+   * token was granted here, which are pulled before it is granted on.
+   */
+  uint32_t more_from;
+};
+
+/**
+ * A distributed lock manager for mutexes in a release consistent region.
+ *
+ * Each lock has a token, and only the node with the token may hold the lock.
+ * A node keeps the token after its threads unlock, so while no other node
+ * asks for the lock its threads lock and unlock it with no network traffic.
+ *
+ * A node that wants the token asks the lock's manager, which is picked by
+ * hashing the lock. The manager remembers the last node to ask and forwards
+ * the request to it, so requests queue up across nodes, and each node hands
+ * the token on when its threads are done. The token is granted along with
+ * the write notices the next node has not seen, so the data the lock
+ * protects is coherent when the next node acquires it. A trylock never
+ * waits for the token: it fails unless the token is here, and asks for the
+ * token so a later try may succeed. A token that arrives with no thread
+ * waiting for it is handed on as soon as another node asks.
+ *
+ * A mutex in the region is never really locked, since other nodes can see
+ * its bytes. Instead it is backed by a node-local shadow mutex, and so is any
+ * condition variable in the region. Waiting on a condition variable releases
+ * the token, but only threads on the same node can signal it.
+ */
+class DistributedLockManager : public PageCoherence, public ThreadedDaemon {
+ public:
+  /**
+   * Create, but do not start, a lock manager.
+   *
+   * The manager must be set as the page transfer server's \ref
+   * PAGE_TRANSFER_LOCK handler.
+   *
+   * \param self This node's identifier, which is its index in ``nodes``.
+   * \param nodes The page transfer address of every node.
+   * \param coherence The region's release consistency protocol.
+   */
+  DistributedLockManager(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes,
+                         LazyReleaseCoherence &coherence);
+  ~DistributedLockManager();
+  DistributedLockManager(const DistributedLockManager &) = delete;
+  DistributedLockManager &operator=(const DistributedLockManager &) = delete;
+  /**
+   * Acquire a lock once its shadow mutex is held, waiting for its token if
+   * another node has it, then acquire the write notices that came with it.
+   *
+   * \param mutex The mutex in the region.
+   */
+  void lock(void *mutex);
+  /**
+   * Acquire a lock once its shadow mutex is held, but only if this node has
+   * its token. Otherwise ask for the token without waiting, so that a later
+   * try may find it here.
+   *
+   * \param mutex The mutex in the region.
+   * \return False if this node does not have the token.
+   */
+  bool try_lock(void *mutex);
+  /**
+   * Release the data a lock protects, then release the lock, handing its
+   * token on if another node asked for it.
+   *
+   * \param mutex The mutex in the region.
+   */
+  void unlock(void *mutex);
+  /**
+   * Get the shadow of a mutex or condition variable in the region.
+   *
+   * \param object The mutex or condition variable.
+   * \param kind \ref SYNC_MUTEX or \ref SYNC_COND.
+   * \return The shadow, or ``object`` if it is not in the region.
+   */
+  void *translate(void *object, int kind);
+  /**
+   * Run the lock manager and release consistency protocol at the
+   * application's synchronization points.
+   */
+  void intercept_synchronization();
+  /**
+   * Get the node that manages a lock.
+   */
+  uint32_t get_manager(uint64_t id) const {
+    return ((id >> 3) * 0x9E3779B97F4A7C15ULL >> 32) % node_count;
+  }
+  /**
+   * Check if this node has a lock's token.
+   */
+  bool has_token(void *mutex);
+  /**
+   * The worker loop, which sends queued messages.
+   */
+  void *work();
+  uint16_t prepare(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, uint32_t *hint,
+                   uint64_t *readers) {
+    return PAGE_TRANSFER_EINVAL;
+  }
+  void complete(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, bool sent) {}
+  uint16_t exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                    size_t *reply_length, size_t capacity);
+  /**
+   * Get the lock manager's metrics.
+   *
+   * \return A JSON object of the manager's counters and histograms.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of acquires that already had the token.
+   */
+  uint64_t local_acquires;
+  /**
+   * The number of acquires that waited for the token.
+   */
+  uint64_t remote_acquires;
+  /**
+   * The number of tokens handed to other nodes.
+   */
+  uint64_t transfers_out;
+  /**
+   * The number of requests forwarded by this node as a manager.
+   */
+  uint64_t forwards;
+  /**
+   * The time from a thread holding a lock's shadow to holding the lock, in
+   * nanoseconds.
+   */
+  utils::Histogram acquire_latency;
+  /**
+   * The rate each lock's token left this node at, in transfers per second
+   * over windows of \ref LOCK_RATE_WINDOW_NS.
+   */
+  utils::Histogram transfer_rate;
+
+ private:
+  /**
+   * Get a lock's state, creating it if needed. Must hold ``access_lock``.
+   */
+  DistributedLock &get_lock(uint64_t id);
+  /**
+   * Queue a message for the worker. Must hold ``access_lock``.
+   */
+  void send(uint32_t node, uint8_t kind, uint32_t requester, uint64_t id, const uint32_t *clock);
+  /**
+   * Serve a request as the lock's manager. Must hold ``access_lock``.
+   */
+  void handle_request(uint64_t id, uint32_t requester, const uint32_t *clock);
+  /**
+   * Serve a request as the last node to ask for the lock. Must hold
+   * ``access_lock``.
+   */
+  void handle_forward(uint64_t id, uint32_t requester, const uint32_t *clock);
+  /**
+   * Hand a free lock's token to the next node. Must hold ``access_lock``.
+   */
+  void hand_off(uint64_t id, DistributedLock &state);
+  /**
+   * Ask a lock's manager for its token. Must hold ``access_lock``.
+   */
+  void ask(uint64_t id, DistributedLock &state);
+
+  uint32_t self;
+  uint32_t node_count;
+  LazyReleaseCoherence &coherence;
+  PageTransferClient *clients[COHERENCE_MAX_NODES];
+  gallocy::map<uint64_t, DistributedLock> locks;
+  gallocy::map<uint64_t, pthread_cond_t> conds;
+  /**
+   * The last node to ask for each lock this node manages.
+   */
+  gallocy::map<uint64_t, uint32_t> tails;
+  gallocy::vector<LockOutgoing> outbox;
+  /**
+   * The buffer messages are built in.
+   */
+  uint8_t *message;
+  gallocy::string metrics_name;
+  bool intercepting;
+  std::mutex access_lock;
+  std::condition_variable token_cv;
+  std::condition_variable outbox_cv;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_LOCK_H_
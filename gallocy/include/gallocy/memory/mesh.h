@@ -0,0 +1,233 @@
+#ifndef GALLOCY_MEMORY_MESH_H_
+#define GALLOCY_MEMORY_MESH_H_
+
+#include <stdint.h>
+
+#include <mutex>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/utils/constants.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/worker.h"
+
+// Objects are rounded up to a power of two size class from the smallest to
+// the largest object, and each span is one page of one size class.
+#define MESH_MIN_OBJECT 16
+#define MESH_MAX_OBJECT 2048
+#define MESH_SIZE_CLASSES 8
+#define MESH_SLOTS (PAGE_SZ / MESH_MIN_OBJECT)
+// Marks the end of a list of pages.
+#define MESH_NO_PAGE 0xffffffff
+// Only spans at most half full are meshed, and each span is tried against at
+// most this many others per pass, which bounds a pass's work.
+#define MESH_MAX_PROBES 64
+// The scavenger meshes when more than this fraction of resident bytes is
+// free.
+#define MESH_DEFAULT_THRESHOLD 0.5
+// How long the scavenger sleeps between passes.
+#define MESH_POLL_MS 100
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * The objects on one physical page of a \ref MeshHeap.
+ */
+struct MeshSpan {
+  /**
+   * True while the page holds objects.
+   */
+  uint8_t in_use;
+  /**
+   * True while the page is on its size class's list of pages with room.
+   */
+  uint8_t partial;
+  uint8_t size_class;
+  uint16_t live;
+  /**
+   * The occupied slots.
+   */
+  uint64_t bitmap[MESH_SLOTS / 64];
+  /**
+   * The first of the virtual pages mapped onto this page.
+   */
+  uint32_t first_virtual;
+  /**
+   * The neighbours on the size class's list of pages with room.
+   */
+  uint32_t prev;
+  uint32_t next;
+};
+
+/**
+ * A heap of small objects that compacts itself by meshing.
+ *
+ * A long-running program leaves many spans only a little full, each of which
+ * holds a whole page. When two spans of a size class have no occupied slots
+ * in common, the objects of one are copied into the free slots of the other,
+ * at the same offsets, and the virtual page of the first is remapped onto the
+ * physical page of the second. Both virtual pages then share one physical
+ * page, the other physical page is returned to the kernel, and no pointer
+ * moves.
+ *
+ * Remapping a virtual page onto another physical page needs the heap to be a
+ * file, so the heap is a memfd mapped shared. A meshed span's virtual pages
+ * are write protected while their objects are copied, and a thread that
+ * writes one meanwhile waits in a fault handler until the span is remapped.
+ *
+ * The heap is its own scavenger: once started, it meshes whenever the
+ * fraction of resident bytes that are free is above its threshold.
+ */
+class MeshHeap : public ThreadedDaemon {
+ public:
+  /**
+   * Create, but do not start the scavenger of, a heap.
+   *
+   * The heap's metrics are registered under ``mesh`` and its memfd.
+   *
+   * \param pages The most pages the heap can hold.
+   * \param threshold The fraction of resident bytes that must be free for
+   * the scavenger to mesh.
+   */
+  explicit MeshHeap(uint64_t pages, double threshold = MESH_DEFAULT_THRESHOLD);
+  ~MeshHeap();
+  MeshHeap(const MeshHeap &) = delete;
+  MeshHeap &operator=(const MeshHeap &) = delete;
+  /**
+   * Allocate an object.
+   *
+   * \param sz The object's size, at most \ref MESH_MAX_OBJECT.
+   * \return The object, or ``nullptr`` if it is too big or the heap is full.
+   */
+  void *malloc(size_t sz);
+  /**
+   * Free an object.
+   */
+  void free(void *ptr);
+  /**
+   * Get the usable size of an object.
+   */
+  size_t getSize(void *ptr);
+  /**
+   * Mesh every pair of spans that can be meshed.
+   *
+   * \return The number of physical pages returned to the kernel.
+   */
+  uint64_t mesh();
+  /**
+   * Mesh if the heap is fragmented past its threshold.
+   *
+   * \return The number of physical pages returned to the kernel.
+   */
+  uint64_t scavenge();
+  /**
+   * The scavenger loop.
+   */
+  void *work();
+  /**
+   * Wait for a span being meshed to be remapped, in a fault handler.
+   */
+  bool fault(void *address, bool write);
+  /**
+   * Check if an address is in the heap.
+   */
+  bool contains(const void *address) const {
+    return reinterpret_cast<const uint8_t *>(address) >= base
+      && reinterpret_cast<const uint8_t *>(address) < base + pages * PAGE_SZ;
+  }
+  /**
+   * Get the number of physical pages that hold objects.
+   */
+  uint64_t get_resident_pages();
+  /**
+   * Get the fraction of resident bytes that are free.
+   */
+  double get_fragmentation();
+  /**
+   * Get the heap's metrics.
+   *
+   * \return A JSON object of the heap's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of spans meshed into others.
+   */
+  uint64_t meshed;
+  /**
+   * The number of scavenger passes that meshed.
+   */
+  uint64_t passes;
+
+ private:
+  /**
+   * Take a fresh span for a size class. Must hold ``access_lock``.
+   *
+   * \return The span's physical page, or \ref MESH_NO_PAGE if the heap is
+   * full.
+   */
+  uint32_t new_span(uint8_t size_class);
+  /**
+   * Return an empty span's physical page to the kernel, and its virtual
+   * pages to the heap. Must hold ``access_lock``.
+   */
+  void release_span(uint32_t page);
+  /**
+   * Copy a span's objects into another's and remap its virtual pages onto
+   * the other's physical page. Must hold ``access_lock``.
+   */
+  void merge(uint32_t into, uint32_t from);
+  /**
+   * Map a virtual page onto a physical page. Must hold ``access_lock``.
+   */
+  void map(uint32_t virtual_page, uint32_t physical_page);
+  void push_partial(uint32_t page);
+  void remove_partial(uint32_t page);
+  uint64_t object_size(uint8_t size_class) const {
+    return static_cast<uint64_t>(MESH_MIN_OBJECT) << size_class;
+  }
+
+  int fd;
+  uint8_t *base;
+  uint64_t pages;
+  double threshold;
+  /**
+   * The spans, by physical page.
+   */
+  MeshSpan *spans;
+  /**
+   * The physical page each virtual page is mapped onto.
+   */
+  uint32_t *physical;
+  /**
+   * The next virtual page mapped onto the same physical page, by virtual
+   * page.
+   */
+  uint32_t *aliases;
+  /**
+   * Stacks of the virtual and physical pages freed so far.
+   */
+  uint32_t *free_virtual;
+  uint32_t *free_physical;
+  uint64_t free_virtual_count;
+  uint64_t free_physical_count;
+  /**
+   * The pages from here on have never been used, and each virtual page is
+   * still mapped onto the physical page of the same number.
+   */
+  uint64_t fresh;
+  /**
+   * The first span of each size class with room.
+   */
+  uint32_t partial[MESH_SIZE_CLASSES];
+  uint64_t live_bytes;
+  uint64_t resident_pages;
+  gallocy::string metrics_name;
+  std::mutex access_lock;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_MESH_H_
@@ -0,0 +1,213 @@
+#ifndef GALLOCY_MEMORY_PREFETCH_H_
+#define GALLOCY_MEMORY_PREFETCH_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/memory/transfer.h"
+#include "gallocy/worker.h"
+
+// The number of access streams tracked. Threads are mapped onto streams by a
+// hash of their identifier, so two threads rarely share one.
+#define PREFETCH_STREAMS 64
+// A stride is trusted after this many consecutive misses repeat it.
+#define PREFETCH_CONFIRM 2
+// The bounds on how many pages ahead of a stream are prefetched.
+#define PREFETCH_MIN_DEGREE 1
+#define PREFETCH_MAX_DEGREE 16
+#define PREFETCH_DEFAULT_DEGREE 4
+// Accuracy is measured, and the degree adjusted, once per this many issued
+// prefetches.
+#define PREFETCH_EPOCH 32
+// The degree doubles above the high accuracy and halves below the low one.
+#define PREFETCH_HIGH_ACCURACY 0.75
+#define PREFETCH_LOW_ACCURACY 0.40
+// The most prefetches waiting to be issued.
+#define PREFETCH_QUEUE_SZ 256
+// How long the worker sleeps before checking if it is alive.
+#define PREFETCH_POLL_MS 100
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * The access pattern of one thread's faults.
+ */
+struct PrefetchStream {
+  uint64_t thread;
+  uint64_t last_page;
+  int64_t stride;
+  uint64_t confidence;
+};
+
+/**
+ * A stride detecting page prefetcher.
+ *
+ * The prefetcher sits on a page fault path and learns from it. In front of
+ * a \ref PageTransferClient, for regions whose pages are fetched without a
+ * coherence protocol, it handles the faults itself. Behind \ref
+ * MRSWCoherence, which runs the application heap's faults, it is told of
+ * them and reads the pages it predicts through the protocol. Each thread's
+ * faults are tracked as a stream, and once a stream's faults repeat a
+ * stride, sequential or not, the next pages along it are fetched
+ * asynchronously by the prefetcher's worker, ahead of the faulting thread.
+ *
+ * Prefetched pages must stay protected until they are first touched so that
+ * the touch still reaches the fault path. That first touch is what tells
+ * the prefetcher a prefetch was useful, and what keeps the stream moving
+ * once its misses stop. The fraction of prefetched pages that are touched is
+ * the prefetcher's accuracy, and the number of pages prefetched ahead of a
+ * stream rises and falls with it.
+ */
+class PagePrefetcher : public ThreadedDaemon {
+ public:
+  /**
+   * Fetch pages that are not already present.
+   *
+   * \param page_numbers Page numbers in ascending order, which are compacted
+   * in place to the page numbers that were fetched.
+   * \param count The number of page numbers.
+   * \return The number of pages fetched.
+   */
+  typedef std::function<size_t(uint64_t *page_numbers, size_t count)> FetchFunction;
+  /**
+   * Create, but do not start, a prefetcher in front of a client.
+   *
+   * The prefetcher's metrics are registered under ``prefetch`` and the peer's
+   * address.
+   *
+   * \param client The client to fetch pages with.
+   */
+  explicit PagePrefetcher(PageTransferClient &client);
+  /**
+   * Create, but do not start, a prefetcher that fetches pages with a
+   * function, e.g., through a coherence protocol.
+   *
+   * \param pages The number of pages in the region.
+   * \param name The name the prefetcher's metrics are registered under.
+   * \param fetch The function to prefetch pages with.
+   */
+  PagePrefetcher(uint64_t pages, const gallocy::string &name, FetchFunction fetch);
+  ~PagePrefetcher();
+  PagePrefetcher(const PagePrefetcher &) = delete;
+  PagePrefetcher &operator=(const PagePrefetcher &) = delete;
+  /**
+   * Handle the first touch of a page.
+   *
+   * A page that was not prefetched is fetched synchronously through the
+   * client, see \ref PagePrefetcher::touch.
+   *
+   * \param page The touched page number.
+   * \return True if the page is present.
+   */
+  bool fault(uint64_t page);
+  /**
+   * Record the first touch of a page, which the caller fetches itself if it
+   * was not prefetched.
+   *
+   * The calling thread's stream is updated and, if it has a stride, the
+   * pages ahead of it are queued for the worker.
+   *
+   * \param page The touched page number.
+   * \return True if the page was prefetched.
+   */
+  bool touch(uint64_t page);
+  /**
+   * Forget that a page was prefetched, because its copy was dropped before
+   * it was touched.
+   *
+   * The page's next touch is then a miss, rather than a useful prefetch.
+   *
+   * \param page The dropped page number.
+   */
+  void invalidate(uint64_t page);
+  /**
+   * The worker loop, which issues queued prefetches in batches.
+   */
+  void *work();
+  /**
+   * Get the fraction of issued prefetches that were touched.
+   */
+  double get_accuracy();
+  /**
+   * Get the number of pages prefetched ahead of a stream.
+   */
+  uint64_t get_degree();
+  /**
+   * Get the prefetcher's metrics.
+   *
+   * \return A JSON object of the prefetcher's counters and accuracy.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of pages prefetched.
+   */
+  uint64_t issued;
+  /**
+   * The number of prefetched pages that were touched.
+   */
+  uint64_t useful;
+  /**
+   * The number of pages touched while their prefetch was still queued.
+   */
+  uint64_t late;
+  /**
+   * The number of prefetched pages dropped before they were touched.
+   */
+  uint64_t dropped;
+
+ private:
+  /**
+   * Queue the pages ahead of a stream. Must hold ``access_lock``.
+   */
+  void predict(PrefetchStream *stream, uint64_t page);
+  /**
+   * Adjust the degree at the end of an epoch. Must hold ``access_lock``.
+   */
+  void throttle();
+  bool test_bit(uint64_t *bits, uint64_t page) {
+    return bits[page / 64] & (1ULL << (page % 64));
+  }
+  void set_bit(uint64_t *bits, uint64_t page, bool value) {
+    if (value)
+      bits[page / 64] |= 1ULL << (page % 64);
+    else
+      bits[page / 64] &= ~(1ULL << (page % 64));
+  }
+
+  /**
+   * The client that faults are fetched with, or ``nullptr`` if faults are
+   * only touches.
+   */
+  PageTransferClient *client;
+  FetchFunction fetch;
+  gallocy::string metrics_name;
+  uint64_t pages;
+  uint64_t degree;
+  uint64_t epoch_issued;
+  uint64_t epoch_useful;
+  PrefetchStream streams[PREFETCH_STREAMS];
+  /**
+   * Pages prefetched but not yet touched.
+   */
+  uint64_t *prefetched;
+  /**
+   * Pages queued or being fetched.
+   */
+  uint64_t *in_flight;
+  uint64_t queue[PREFETCH_QUEUE_SZ];
+  uint64_t queue_length;
+  std::mutex access_lock;
+  std::condition_variable queue_cv;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_PREFETCH_H_
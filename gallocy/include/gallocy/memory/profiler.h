@@ -0,0 +1,218 @@
+#ifndef GALLOCY_MEMORY_PROFILER_H_
+#define GALLOCY_MEMORY_PROFILER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/utils/constants.h"
+
+// Pages are profiled from their first sampled transfer, up to this many.
+#define PROFILER_MAX_PAGES 1024
+
+// A report lists at most this many pages, most transferred first, and at
+// most this many written runs and allocations per node per page.
+#define PROFILER_REPORT_PAGES 64
+#define PROFILER_REPORT_RUNS 16
+#define PROFILER_REPORT_ALLOCATIONS 8
+
+// The values of a page's "sharing" in a report.
+#define PROFILER_SHARING_NONE "none"
+#define PROFILER_SHARING_FALSE "false"
+#define PROFILER_SHARING_TRUE "true"
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * An allocation made on this node.
+ */
+struct ProfiledAllocation {
+  uint64_t size;
+  /**
+   * The address of the code that made the allocation.
+   */
+  uint64_t site;
+  /**
+   * The thread that made the allocation.
+   */
+  uint64_t thread;
+};
+
+/**
+ * The bytes of a page that one node was seen writing.
+ */
+struct ProfiledWrites {
+  uint64_t bytes[PAGE_SZ / 64];
+  /**
+   * The number of samples that saw the node write the page.
+   */
+  uint64_t samples;
+};
+
+/**
+ * What the profiler knows about one page.
+ */
+struct ProfiledPage {
+  /**
+   * The number of ownership transfers seen to or from this node.
+   */
+  uint64_t transfers;
+  /**
+   * The page's contents when it last changed hands here, to diff the next
+   * contents against, or ``nullptr``.
+   */
+  uint8_t *twin;
+  gallocy::map<uint32_t, ProfiledWrites> writers;
+};
+
+/**
+ * A page-level false sharing profiler.
+ *
+ * A page that several nodes write bounces between them even when they write
+ * different objects on it. The profiler samples the page's ownership
+ * transfers, diffs its contents against what they were at the last transfer
+ * to find the bytes each node wrote, and attributes the written bytes to the
+ * allocations that hold them.
+ *
+ * A page written by several nodes at disjoint offsets is falsely shared, and
+ * is fixed by moving its objects apart. A page whose writers overlap is truly
+ * shared.
+ *
+ * Allocations are only known to the node that made them, so each node's
+ * report attributes the bytes in its own allocations.
+ */
+class FalseSharingProfiler {
+ public:
+  /**
+   * Create a profiler over a region.
+   *
+   * \param self This node's identifier.
+   * \param base The start of the region.
+   * \param pages The number of pages in the region.
+   */
+  FalseSharingProfiler(uint32_t self, void *base, uint64_t pages);
+  ~FalseSharingProfiler();
+  FalseSharingProfiler(const FalseSharingProfiler &) = delete;
+  FalseSharingProfiler &operator=(const FalseSharingProfiler &) = delete;
+  /**
+   * Record an allocation in the region.
+   *
+   * \param ptr The allocation.
+   * \param size The allocation's size.
+   * \param site The address of the code that made the allocation.
+   */
+  void record_allocation(const void *ptr, size_t size, const void *site);
+  /**
+   * Forget a freed allocation.
+   */
+  void record_free(const void *ptr);
+  /**
+   * Record that a node wrote a page, as the difference between its contents
+   * before and after.
+   *
+   * \param node The node that wrote the page.
+   * \param page The page.
+   * \param before The page's contents before the node wrote it.
+   * \param after The page's contents after.
+   */
+  void record_writes(uint32_t node, uint64_t page, const void *before, const void *after);
+  /**
+   * Record that this node took ownership of a page, and attribute what
+   * changed since the page was last handed off to the node it came from.
+   *
+   * \param page The page.
+   * \param node The node the page came from.
+   * \param contents The page's contents as received.
+   */
+  void acquired(uint64_t page, uint32_t node, const void *contents);
+  /**
+   * Record that this node handed ownership of a page to another node, and
+   * attribute what changed since this node took the page to itself.
+   *
+   * \param page The page.
+   * \param node The node the page went to.
+   * \param contents The page's contents as sent.
+   */
+  void handed_off(uint64_t page, uint32_t node, const void *contents);
+  /**
+   * Forget every profiled page, but not the allocations.
+   */
+  void reset();
+  /**
+   * Report the profiled pages.
+   *
+   * \return A JSON object with this node's identifier, the number of falsely
+   * shared pages, and the most transferred pages, each with its writers, the
+   * runs they wrote, and the allocations that hold them.
+   */
+  gallocy::json report();
+  /**
+   * Write the report to a file.
+   *
+   * \param path The file's path.
+   * \return False if the file could not be written.
+   */
+  bool dump(const char *path);
+  /**
+   * Get the profiler's metrics.
+   *
+   * \return A JSON object of the profiler's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of ownership transfers sampled.
+   */
+  uint64_t transfers;
+  /**
+   * The number of page diffs recorded.
+   */
+  uint64_t samples;
+  /**
+   * The number of transfers not sampled because too many pages were
+   * profiled.
+   */
+  uint64_t dropped;
+
+ private:
+  /**
+   * Get a page's profile, making one if there is room. Must hold
+   * ``access_lock``.
+   */
+  ProfiledPage *get_page(uint64_t page);
+  /**
+   * Diff a page against its twin, record the changes as a node's, and make
+   * the contents the new twin. Must hold ``access_lock``.
+   */
+  void retwin(ProfiledPage *profile, uint32_t node, const void *contents);
+  /**
+   * Mark the bytes that changed between two versions of a page as a node's.
+   * Must hold ``access_lock``.
+   */
+  void mark(ProfiledPage *profile, uint32_t node, const void *before, const void *after);
+  /**
+   * Report the allocations that overlap a run of a page. Must hold
+   * ``access_lock``.
+   */
+  gallocy::json attribute(uint64_t offset, uint64_t length);
+
+  uint32_t self;
+  uint8_t *base;
+  uint64_t pages;
+  /**
+   * The allocations made on this node, by offset into the region.
+   */
+  gallocy::map<uint64_t, ProfiledAllocation> allocations;
+  gallocy::map<uint64_t, ProfiledPage> profiles;
+  gallocy::string metrics_name;
+  std::mutex access_lock;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_PROFILER_H_
@@ -0,0 +1,412 @@
+#ifndef GALLOCY_MEMORY_RELEASE_H_
+#define GALLOCY_MEMORY_RELEASE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/transfer.h"
+
+// A NOTICES request's message is the requester's vector clock, one uint32_t
+// per node. The reply's message starts with a byte that is 1 when there were
+// more write notices than fit, followed by write intervals, each encoded as
+// varints:
+//
+//   node, sequence number, page count, first page, page deltas...
+//
+// A DIFF request's message is a sequence of encoded page diffs, each preceded
+// by its page number and length as varints. The reply's message is empty.
+//
+// A BLOCKS request's message is a page number as a varint, followed by the
+// requester's version of each of the page's blocks, one uint32_t each. The
+// reply's message is a uint64_t mask of the blocks whose versions differ,
+// followed by the version and contents of each of those blocks in order.
+#define RELEASE_NOTICES_MORE 1
+#define RELEASE_MAX_BLOCKS (PAGE_SZ / COHERENCE_MIN_GRANULARITY)
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * The release consistency state of one page on one node.
+ */
+struct ReleasePage {
+  /**
+   * One of ``PAGE_PERM_*``.
+   */
+  uint8_t permissions;
+  /**
+   * True if the page was written since the last release.
+   */
+  uint8_t dirty;
+  /**
+   * True while the page is being fetched from its home.
+   */
+  uint8_t busy;
+  /**
+   * True if a write notice for the page was applied while it was being
+   * fetched, so the copy that arrives is dropped rather than read.
+   */
+  uint8_t invalidated;
+  /**
+   * The base two logarithm of the page's coherence granularity in bytes.
+   */
+  uint8_t granularity_log2;
+  /**
+   * The page's contents when it was first written since the last release,
+   * which is only kept by nodes that are not the page's home, and by the
+   * home of a page split into blocks.
+   */
+  uint8_t *twin;
+  /**
+   * The version of each of the page's blocks, bumped by the home whenever a
+   * block changes, or ``nullptr`` if the page is not split into blocks.
+   */
+  uint32_t *versions;
+};
+
+/**
+ * The pages a node wrote between two of its releases.
+ */
+struct WriteInterval {
+  uint32_t node;
+  uint32_t sequence;
+  gallocy::vector<uint32_t> pages;
+};
+
+/**
+ * A home-based lazy release consistency protocol.
+ *
+ * Every page has a home node whose copy is always up to date. Any number of
+ * nodes may write a page at once:
+ *
+ *   - A write fault twins the page, and a release sends the diff between the
+ *     page and its twin to the page's home, where it is merged. Diffs only
+ *     carry the bytes that changed, so writers of different parts of a page
+ *     do not overwrite each other.
+ *   - A release also records a write interval, the write notice for every
+ *     page written since the last release.
+ *   - Write notices travel with synchronization. An acquire that is handed
+ *     notices it has not seen invalidates those pages, and the next access to
+ *     one fetches it from its home.
+ *
+ * Which node last released a lock is the lock's business, so notices are
+ * pulled from a node with \ref LazyReleaseCoherence::acquire_from, or are
+ * carried by a lock's own messages with \ref
+ * LazyReleaseCoherence::encode_notices and \ref
+ * LazyReleaseCoherence::receive_notices, and are applied at the next \ref
+ * LazyReleaseCoherence::acquire.
+ *
+ * The granularity of coherence is a page by default. Finer granularity
+ * splits pages into versioned blocks, and a fault on an invalidated page
+ * only fetches the blocks that changed at the home since this node's copy
+ * was fetched, which suits small objects written by different nodes. Coarser
+ * granularity groups pages into units with one home, and a fault fetches
+ * every invalidated page of the unit at once, which suits bulk data.
+ *
+ * Pages are filled, and diffs merged, through a second, always writable,
+ * mapping of the region, so the application never sees a page that is only
+ * partly filled and never writes one unnoticed. The region must therefore be
+ * a shared mapping.
+ */
+class LazyReleaseCoherence : public PageCoherence {
+ public:
+  /**
+   * Create a release consistency protocol over a region and protect the
+   * region.
+   *
+   * Every node's copy of the region is assumed to be the same to begin with.
+   *
+   * \param self This node's identifier, which is its index in ``nodes``.
+   * \param nodes The page transfer address of every node.
+   * \param base The start of the region.
+   * \param pages The number of pages in the region.
+   * \param granularity The region's coherence granularity in bytes, a power
+   * of two from \ref COHERENCE_MIN_GRANULARITY to \ref
+   * COHERENCE_MAX_GRANULARITY.
+   * \param prefetch_window The number of pages after a faulting unit to
+   * fetch with it when they are invalidated and have the same home.
+   */
+  LazyReleaseCoherence(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes,
+                       void *base, uint64_t pages, uint64_t granularity = PAGE_SZ, uint64_t prefetch_window = 0);
+  ~LazyReleaseCoherence();
+  LazyReleaseCoherence(const LazyReleaseCoherence &) = delete;
+  LazyReleaseCoherence &operator=(const LazyReleaseCoherence &) = delete;
+  /**
+   * Handle a page fault in the region.
+   *
+   * \param address The faulting address.
+   * \param write True if the fault was a write.
+   * \return True if the page now has the needed permission.
+   */
+  bool fault(void *address, bool write);
+  /**
+   * Send the diffs of every page written since the last release to their
+   * homes and record a write interval for them.
+   */
+  void release();
+  /**
+   * Invalidate every page named by write notices received since the last
+   * acquire.
+   *
+   * Pages this node has also written are released first, so that its own
+   * writes are merged at their homes before its copies are dropped.
+   */
+  void acquire();
+  /**
+   * Acquire from a node, e.g., the last node to release a lock, by pulling
+   * every write notice it has that this node has not seen.
+   *
+   * \param node The node to acquire from.
+   * \return True if the node's notices were applied.
+   */
+  bool acquire_from(uint32_t node);
+  /**
+   * Encode the write notices that a node with a vector clock has not seen.
+   *
+   * The clock also tells this node which intervals the node has seen, and
+   * intervals that every node has seen are dropped from the log.
+   *
+   * \param node The node whose vector clock it is.
+   * \param clock The node's vector clock.
+   * \param out The buffer to encode into.
+   * \param cap The capacity of ``out``.
+   * \return The encoded length.
+   */
+  size_t encode_notices(uint32_t node, const uint32_t *clock, uint8_t *out, size_t cap);
+  /**
+   * Receive encoded write notices to apply at the next acquire.
+   *
+   * \param in The encoded notices.
+   * \param len The length of the encoded notices.
+   * \param more Set to true if the sender had more notices than it sent.
+   * \return True if the notices were well formed.
+   */
+  bool receive_notices(const uint8_t *in, size_t len, bool *more);
+  /**
+   * Copy this node's vector clock, the newest interval it has seen from each
+   * node.
+   */
+  void get_clock(uint32_t *clock);
+  /**
+   * Run \ref acquire and \ref release at the application's synchronization
+   * points.
+   */
+  void intercept_synchronization();
+  /**
+   * Record the bytes of every diff merged here into a profiler, which must
+   * outlive the protocol.
+   */
+  void set_profiler(FalseSharingProfiler *profiler);
+  /**
+   * Set the coherence granularity of part of the region, e.g., of one
+   * allocation.
+   *
+   * Every node must set the same granularity before the part is shared,
+   * since it decides the homes of the part's pages.
+   *
+   * \param address The start of the part, aligned to the granularity and to
+   * a page.
+   * \param length The length of the part, a multiple of the granularity and
+   * of a page.
+   * \param granularity The granularity in bytes, a power of two from \ref
+   * COHERENCE_MIN_GRANULARITY to \ref COHERENCE_MAX_GRANULARITY.
+   * \return False if the granularity or the part is invalid.
+   */
+  bool set_granularity(void *address, size_t length, uint64_t granularity);
+  /**
+   * Get a page's coherence granularity in bytes.
+   */
+  uint64_t get_granularity(uint64_t page);
+  uint16_t prepare(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, uint32_t *hint,
+                   uint64_t *readers) {
+    return PAGE_TRANSFER_EINVAL;
+  }
+  void complete(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count, bool sent) {}
+  uint16_t exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                    size_t *reply_length, size_t capacity);
+  /**
+   * Check if an address is in the region.
+   */
+  bool contains(const void *address) const {
+    return reinterpret_cast<const uint8_t *>(address) >= base
+      && reinterpret_cast<const uint8_t *>(address) < base + pages * PAGE_SZ;
+  }
+  /**
+   * Get an address's offset into the region, which names the same place on
+   * every node.
+   */
+  uint64_t get_offset(const void *address) const {
+    return reinterpret_cast<const uint8_t *>(address) - base;
+  }
+  /**
+   * Get the number of nodes.
+   */
+  uint32_t get_node_count() const {
+    return node_count;
+  }
+  /**
+   * Get the node whose copy of a page is always up to date, which is the
+   * same for every page of a unit.
+   */
+  uint32_t get_home(uint64_t page) const {
+    if (state[page].granularity_log2 > PAGE_SZ_LOG2)
+      return (page >> (state[page].granularity_log2 - PAGE_SZ_LOG2)) % node_count;
+    return page % node_count;
+  }
+  /**
+   * Get this node's permissions on a page, one of ``PAGE_PERM_*``.
+   */
+  uint8_t get_permissions(uint64_t page);
+  /**
+   * Get the protocol's metrics.
+   *
+   * \return A JSON object of the protocol's counters.
+   */
+  gallocy::json get_metrics();
+  /**
+   * The number of faults that fetched a page from its home.
+   */
+  uint64_t read_faults;
+  /**
+   * The number of faults that twinned a page.
+   */
+  uint64_t write_faults;
+  /**
+   * The number of write intervals recorded by this node.
+   */
+  uint64_t intervals;
+  /**
+   * The number of page diffs sent to homes.
+   */
+  uint64_t diffs_sent;
+  /**
+   * The number of bytes of page diffs sent to homes.
+   */
+  uint64_t diff_bytes;
+  /**
+   * The number of DIFF messages sent to homes.
+   */
+  uint64_t diff_messages;
+  /**
+   * The number of pages invalidated by write notices.
+   */
+  uint64_t pages_invalidated;
+  /**
+   * The number of blocks fetched from homes.
+   */
+  uint64_t blocks_fetched;
+  /**
+   * The number of blocks left in place by fetches, since they were up to
+   * date.
+   */
+  uint64_t blocks_skipped;
+  /**
+   * The number of pages fetched along with a faulting unit.
+   */
+  uint64_t pages_prefetched;
+
+ private:
+  /**
+   * Fetch a page, every other invalidated page of its unit, and the
+   * invalidated pages in the prefetch window with the same home, from its
+   * home. Must hold ``lock``, which is dropped while the pages are fetched.
+   */
+  bool fetch(uint64_t page, std::unique_lock<std::mutex> &lock);
+  /**
+   * Fetch the blocks of a page that changed at its home. Must hold ``lock``,
+   * which is dropped while the blocks are fetched.
+   */
+  bool fetch_blocks(uint64_t page, std::unique_lock<std::mutex> &lock);
+  /**
+   * Bump the version of every block of a page that differs between two of
+   * its contents. Must hold ``access_lock``.
+   */
+  void bump_versions(uint64_t page, const uint8_t *before, const uint8_t *after);
+  /**
+   * Serve a BLOCKS request. Must hold ``access_lock``.
+   */
+  uint16_t serve_blocks(uint8_t *message, size_t length, size_t *reply_length, size_t capacity);
+  /**
+   * Send the diffs of pages against their twins to the pages' homes, in as
+   * few messages as fit.
+   */
+  void send_diffs(const gallocy::vector<uint64_t> &twinned, const gallocy::vector<uint8_t *> &twins);
+  /**
+   * Record a node's vector clock, and drop the intervals that every node has
+   * seen from ``log``. Must hold ``access_lock``.
+   */
+  void trim(uint32_t node, const uint32_t *clock);
+  void protect(uint64_t page, uint8_t permissions, uint64_t count = 1);
+
+  uint32_t self;
+  uint32_t node_count;
+  uint8_t *base;
+  /**
+   * The writable alias of the region that pages are filled and diffs merged
+   * through.
+   */
+  uint8_t *fill;
+  uint64_t pages;
+  uint64_t prefetch_window;
+  ReleasePage *state;
+  PageTransferClient *clients[COHERENCE_MAX_NODES];
+  /**
+   * The newest interval this node has seen from each node.
+   */
+  uint32_t clock[COHERENCE_MAX_NODES];
+  /**
+   * Every interval this node has seen and some other node may not have, in
+   * the order it saw them, which is in sequence order for each node.
+   */
+  gallocy::vector<WriteInterval> log;
+  /**
+   * The newest vector clock each node has sent this node.
+   */
+  uint32_t seen[COHERENCE_MAX_NODES][COHERENCE_MAX_NODES];
+  /**
+   * The newest interval from each node that every node has seen, which is
+   * no longer in ``log``.
+   */
+  uint32_t covered[COHERENCE_MAX_NODES];
+  /**
+   * The intervals received since the last acquire.
+   */
+  gallocy::vector<WriteInterval> pending;
+  /**
+   * The pages written since the last release.
+   */
+  gallocy::vector<uint64_t> dirty;
+  /**
+   * Mirrors whether ``dirty`` and ``pending`` are empty, so that a release or
+   * acquire with nothing to do does not take ``access_lock``.
+   */
+  std::atomic<uint64_t> dirty_count;
+  std::atomic<uint64_t> pending_count;
+  /**
+   * The buffer diffs are encoded into.
+   */
+  uint8_t *message;
+  FalseSharingProfiler *profiler;
+  gallocy::string metrics_name;
+  bool intercepting;
+  /**
+   * Serializes releases, which drop ``access_lock`` while they send diffs.
+   */
+  std::mutex release_lock;
+  std::mutex access_lock;
+  std::condition_variable busy_cv;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_RELEASE_H_
@@ -0,0 +1,446 @@
+#ifndef GALLOCY_MEMORY_TRANSFER_H_
+#define GALLOCY_MEMORY_TRANSFER_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <mutex>
+
+#include "gallocy/allocators/internal.h"
+#include "gallocy/common/peer.h"
+#include "gallocy/utils/constants.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/worker.h"
+
+// A page transfer message starts with a \ref PageTransferHeader followed by
+// ``run_count`` \ref PageTransferRun entries. A FETCH is answered with a
+// header followed by the pages of every run, in order. A PUSH carries the
+// pages of every run after its runs and is answered with a bare header.
+//
+// READ and OWN are answered like a FETCH, and INVALIDATE like a PUSH without
+// pages, but all three are only served when the server has a \ref
+// PageCoherence protocol to consult. An OWN reply's pages are followed by
+// ``length`` bytes, a 64 bit mask of the nodes the new owner must
+// invalidate when it next ends a sync epoch.
+//
+// DIFF, NOTICES, LOCK, DIRECTORY, and BLOCKS carry no runs. Instead a message
+// of ``length`` bytes follows the header of both the request and the reply, and
+// what it means is up to the protocol that handles the op.
+//
+// Messages use the native byte order, since every node in a cluster maps the
+// same heap at the same address and so runs the same architecture.
+#define PAGE_TRANSFER_MAGIC 0x47505446
+#define PAGE_TRANSFER_FETCH 1
+#define PAGE_TRANSFER_PUSH 2
+#define PAGE_TRANSFER_READ 3
+#define PAGE_TRANSFER_OWN 4
+#define PAGE_TRANSFER_INVALIDATE 5
+#define PAGE_TRANSFER_DIFF 6
+#define PAGE_TRANSFER_NOTICES 7
+#define PAGE_TRANSFER_LOCK 8
+#define PAGE_TRANSFER_DIRECTORY 9
+#define PAGE_TRANSFER_BLOCKS 10
+#define PAGE_TRANSFER_MAX_OP PAGE_TRANSFER_BLOCKS
+
+#define PAGE_TRANSFER_OK 0
+#define PAGE_TRANSFER_EINVAL 1
+#define PAGE_TRANSFER_ENOTOWNER 2
+
+// The most pages moved in one round trip, which is 1 MiB of pages.
+#define PAGE_TRANSFER_MAX_PAGES 256
+// The most runs in one message. Each run and the header take one iovec, so
+// this keeps a message well under IOV_MAX.
+#define PAGE_TRANSFER_MAX_RUNS 256
+// The longest message, which fits the encoded diffs of a full
+// batch of pages.
+#define PAGE_TRANSFER_MAX_MESSAGE (PAGE_TRANSFER_MAX_PAGES * PAGE_SZ)
+
+// The number of pages after a faulting page that are fetched with it when
+// they are not already present.
+#define PAGE_PREFETCH_WINDOW_DEFAULT 8
+
+// How long the server waits for activity before checking if it is alive.
+#define PAGE_TRANSFER_POLL_MS 100
+// How long the server waits for the rest of a request once it has started to
+// arrive, or for a reply to drain, before it closes the connection.
+#define PAGE_TRANSFER_IO_TIMEOUT_MS 1000
+// How long a client waits for a peer to start replying. The server serves one
+// request at a time, so a reply may wait behind other peers' requests.
+#define PAGE_TRANSFER_REPLY_TIMEOUT_MS (4 * PAGE_TRANSFER_IO_TIMEOUT_MS)
+// The most connections the server keeps open.
+#define PAGE_TRANSFER_MAX_CONNECTIONS 64
+
+namespace gallocy {
+
+namespace memory {
+
+/**
+ * The header of every page transfer request and reply.
+ */
+struct PageTransferHeader {
+  uint32_t magic;
+  uint16_t op;
+  uint16_t status;
+  /**
+   * The sending node in a request. The node to ask instead in a reply with
+   * \ref PAGE_TRANSFER_ENOTOWNER.
+   */
+  uint32_t node;
+  uint32_t run_count;
+  uint32_t page_count;
+  /**
+   * The length of the message that follows a DIFF, NOTICES, LOCK, or
+   * DIRECTORY header, or the pages of an OWN reply.
+   */
+  uint32_t length;
+};
+
+/**
+ * A run of ``count`` pages starting at page number ``page``.
+ *
+ * Page numbers are relative to the start of the region being transferred.
+ */
+struct PageTransferRun {
+  uint32_t page;
+  uint32_t count;
+};
+
+/**
+ * Coalesce sorted page numbers into runs.
+ *
+ * \param page_numbers Page numbers in ascending order. Repeated page numbers
+ * are coalesced.
+ * \param count The number of page numbers.
+ * \param runs The runs to fill in, which must have room for ``count`` runs.
+ * \return The number of runs.
+ */
+size_t page_transfer_runs(const uint64_t *page_numbers, size_t count, PageTransferRun *runs);
+
+/**
+ * A coherence protocol that decides how READ, OWN, and INVALIDATE requests
+ * are served.
+ */
+class PageCoherence {
+ public:
+  virtual ~PageCoherence() {}
+  /**
+   * Prepare to serve a request.
+   *
+   * For READ and OWN, the pages must be readable when this returns, since
+   * they are sent straight out of the region next.
+   *
+   * \param op The request's operation.
+   * \param node The requesting node.
+   * \param runs The requested runs.
+   * \param run_count The number of requested runs.
+   * \param hint The node to ask instead when the request is refused.
+   * \param readers Set, for OWN, to the nodes with copies of the pages that
+   * the requester must invalidate once it owns them.
+   * \return A ``PAGE_TRANSFER_*`` status for the reply.
+   */
+  virtual uint16_t prepare(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count,
+                           uint32_t *hint, uint64_t *readers) = 0;
+  /**
+   * Finish serving a request once its reply has been sent.
+   *
+   * \param op The request's operation.
+   * \param node The requesting node.
+   * \param runs The requested runs.
+   * \param run_count The number of requested runs.
+   * \param sent True if the reply was sent.
+   */
+  virtual void complete(uint16_t op, uint32_t node, const PageTransferRun *runs, size_t run_count,
+                        bool sent) = 0;
+  /**
+   * Serve a DIFF, NOTICES, LOCK, DIRECTORY, or BLOCKS request.
+   *
+   * The reply is written over the request's message, so the request must be
+   * consumed before the reply is written.
+   *
+   * \param op The request's operation.
+   * \param node The requesting node.
+   * \param message The request's message, then the reply's.
+   * \param length The length of the request's message.
+   * \param reply_length Set to the length of the reply's message.
+   * \param capacity The capacity of ``message``.
+   * \return A ``PAGE_TRANSFER_*`` status for the reply.
+   */
+  virtual uint16_t exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                            size_t *reply_length, size_t capacity) {
+    return PAGE_TRANSFER_EINVAL;
+  }
+};
+
+/**
+ * Serve pages of a region to peers.
+ *
+ * The server reads pages straight out of, and writes pushed pages straight
+ * into, the region with ``writev`` and ``readv``, so a page is never copied
+ * through an intermediate buffer. Connections are persistent so a faulting
+ * peer does not pay for a handshake on every miss.
+ */
+class PageTransferServer : public ThreadedDaemon {
+ public:
+  /**
+   * Create, but do not start, a page transfer server.
+   *
+   * \param address The address to listen on.
+   * \param port The port to listen on.
+   * \param base The start of the region to serve.
+   * \param pages The number of pages in the region.
+   */
+  PageTransferServer(const gallocy::string &address, uint16_t port, void *base, uint64_t pages)
+    : address(address),
+      port(port),
+      base(reinterpret_cast<uint8_t *>(base)),
+      pages(pages),
+      server_socket(-1),
+      message(nullptr) {
+    for (int op = 0; op <= PAGE_TRANSFER_MAX_OP; op++)
+      handlers[op] = nullptr;
+  }
+  PageTransferServer(const PageTransferServer &) = delete;
+  PageTransferServer &operator=(const PageTransferServer &) = delete;
+  /**
+   * Bind and listen, then start serving.
+   *
+   * Peers may connect as soon as this returns, since their connections wait
+   * in the listen backlog until the work loop accepts them.
+   */
+  void start();
+  /**
+   * The primary work loop.
+   *
+   * Polls the listening socket and every open connection, serving one
+   * request at a time until `alive` is false.
+   * Connections are non-blocking, so a peer that stops mid request holds the
+   * server up for at most \ref PAGE_TRANSFER_IO_TIMEOUT_MS.
+   */
+  void *work();
+  /**
+   * Serve one request from a connection.
+   *
+   * \param client_socket The connection's socket.
+   * \return False if the connection was closed or the request was malformed,
+   * in which case the connection should be closed.
+   */
+  bool handle(int client_socket);
+  /**
+   * Set the coherence protocol that serves READ, OWN, INVALIDATE, DIFF,
+   * NOTICES, and BLOCKS requests.
+   */
+  void set_coherence(PageCoherence *protocol) {
+    for (int op = PAGE_TRANSFER_READ; op <= PAGE_TRANSFER_NOTICES; op++)
+      handlers[op] = protocol;
+    handlers[PAGE_TRANSFER_BLOCKS] = protocol;
+  }
+  /**
+   * Set the protocol that serves one op.
+   */
+  void set_handler(uint16_t op, PageCoherence *protocol) {
+    handlers[op] = protocol;
+  }
+
+ private:
+  gallocy::string address;
+  uint16_t port;
+  uint8_t *base;
+  uint64_t pages;
+  int server_socket;
+  /**
+   * The buffer messages are read into and replied from.
+   */
+  uint8_t *message;
+  /**
+   * The protocol that serves each op, which is unset for FETCH and PUSH.
+   */
+  PageCoherence *handlers[PAGE_TRANSFER_MAX_OP + 1];
+};
+
+/**
+ * Move pages of a region to and from a peer.
+ *
+ * The client tracks which pages of the region are present locally. Pages are
+ * fetched and pushed in batches, so a batch of pages costs one round trip,
+ * and are read straight into, and written straight out of, the region.
+ *
+ * The client is safe to use from many threads, but requests to the peer are
+ * serialized on its one connection. Its socket is non-blocking, so a peer
+ * that stops answering fails a request after at most \ref
+ * PAGE_TRANSFER_REPLY_TIMEOUT_MS rather than hold up a caller, which may be
+ * holding its own locks, forever.
+ */
+class PageTransferClient {
+ public:
+  /**
+   * Create a page transfer client.
+   *
+   * The peer is connected to lazily on the first request.
+   *
+   * \param peer The peer to transfer pages with.
+   * \param base The start of the local region.
+   * \param pages The number of pages in the region.
+   * \param prefetch_window The number of pages after a faulting page to fetch
+   * with it.
+   */
+  PageTransferClient(const gallocy::common::Peer &peer, void *base, uint64_t pages,
+                     uint64_t prefetch_window = PAGE_PREFETCH_WINDOW_DEFAULT);
+  ~PageTransferClient();
+  PageTransferClient(const PageTransferClient &) = delete;
+  PageTransferClient &operator=(const PageTransferClient &) = delete;
+  /**
+   * Fetch pages from the peer into the region.
+   *
+   * \param page_numbers Page numbers in ascending order.
+   * \param count The number of page numbers.
+   * \return True if every page was fetched. Fetched pages are marked
+   * present.
+   */
+  bool fetch(const uint64_t *page_numbers, size_t count);
+  /**
+   * Fetch the pages that are not already present from the peer.
+   *
+   * Pages that become present while a batch is waiting to be fetched, e.g.,
+   * because a thread faulted on them, are never fetched again, so a late
+   * batch cannot overwrite them.
+   *
+   * \param page_numbers Page numbers in ascending order, which are compacted
+   * in place to the page numbers that were fetched.
+   * \param count The number of page numbers.
+   * \return The number of pages fetched, or 0 if the fetch failed.
+   */
+  size_t fetch_missing(uint64_t *page_numbers, size_t count);
+  /**
+   * Make a coherence request of the peer.
+   *
+   * READ and OWN requests read the pages straight into the region, which
+   * must be writable, but do not mark them present, since the coherence
+   * protocol tracks their state.
+   *
+   * \param op \ref PAGE_TRANSFER_READ, \ref PAGE_TRANSFER_OWN, or \ref
+   * PAGE_TRANSFER_INVALIDATE.
+   * \param page_numbers Page numbers in ascending order.
+   * \param count The number of page numbers.
+   * \param hint Set to the node to ask instead when the peer replies with
+   * \ref PAGE_TRANSFER_ENOTOWNER.
+   * \param readers If not ``nullptr``, set for OWN to the nodes the new
+   * owner must invalidate.
+   * \return The peer's ``PAGE_TRANSFER_*`` status, or -1 if the peer could
+   * not be reached.
+   */
+  int request(uint16_t op, const uint64_t *page_numbers, size_t count, uint32_t *hint,
+              uint64_t *readers = nullptr);
+  /**
+   * Send a DIFF, NOTICES, LOCK, DIRECTORY, or BLOCKS message to the peer and
+   * read its reply.
+   *
+   * \param op \ref PAGE_TRANSFER_DIFF, \ref PAGE_TRANSFER_NOTICES, \ref
+   * PAGE_TRANSFER_LOCK, \ref PAGE_TRANSFER_DIRECTORY, or \ref
+   * PAGE_TRANSFER_BLOCKS.
+   * \param message The message.
+   * \param length The length of the message, at most \ref
+   * PAGE_TRANSFER_MAX_MESSAGE.
+   * \param reply The buffer to read the reply's message into.
+   * \param reply_length Set to the length of the reply's message.
+   * \param capacity The capacity of ``reply``.
+   * \return The peer's ``PAGE_TRANSFER_*`` status, or -1 if the peer could
+   * not be reached or the reply does not fit.
+   */
+  int exchange(uint16_t op, const uint8_t *message, size_t length, uint8_t *reply, size_t *reply_length,
+               size_t capacity);
+  /**
+   * Push pages from the region to the peer.
+   *
+   * \param page_numbers Page numbers in ascending order.
+   * \param count The number of page numbers.
+   * \return True if every page was pushed.
+   */
+  bool push(const uint64_t *page_numbers, size_t count);
+  /**
+   * Handle a fault on a page that may not be present.
+   *
+   * If the page is not present, it is fetched along with any pages in the
+   * prefetch window after it that are not present either, in one round trip.
+   *
+   * \param page The faulting page number.
+   * \return True if the page is present.
+   */
+  bool fault(uint64_t page);
+  /**
+   * Check if a page is present locally.
+   */
+  bool is_present(uint64_t page) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    return present_bit(page);
+  }
+  /**
+   * Mark a page present or not present.
+   */
+  void set_present(uint64_t page, bool value);
+  /**
+   * Get the peer pages are transferred with.
+   */
+  const gallocy::common::Peer &get_peer() const {
+    return peer;
+  }
+  /**
+   * Get the number of pages in the region.
+   */
+  uint64_t get_page_count() const {
+    return pages;
+  }
+  /**
+   * Set the node identifier sent with requests.
+   */
+  void set_node(uint32_t id) {
+    node = id;
+  }
+  /**
+   * Set the number of pages after a faulting page to fetch with it.
+   */
+  void set_prefetch_window(uint64_t window) {
+    prefetch_window = window;
+  }
+  /**
+   * The number of requests sent to the peer.
+   */
+  uint64_t round_trips;
+  /**
+   * The number of pages fetched from the peer.
+   */
+  uint64_t pages_fetched;
+  /**
+   * The number of pages fetched from the peer that were not faulted on.
+   */
+  uint64_t pages_prefetched;
+
+ private:
+  bool present_bit(uint64_t page) const {
+    return present[page / 64] & (1ULL << (page % 64));
+  }
+  bool connect_peer();
+  void disconnect_peer();
+  /**
+   * Send one message of at most \ref PAGE_TRANSFER_MAX_PAGES pages and read
+   * the reply.
+   */
+  int transfer(uint16_t op, const PageTransferRun *runs, size_t run_count, uint32_t *hint, uint64_t *readers);
+  int transfer_all(uint16_t op, const uint64_t *page_numbers, size_t count, uint32_t *hint,
+                   uint64_t *readers = nullptr);
+
+  gallocy::common::Peer peer;
+  uint8_t *base;
+  uint64_t pages;
+  uint64_t prefetch_window;
+  uint64_t *present;
+  uint32_t node;
+  int sock;
+  std::mutex access_lock;
+};
+
+}  // namespace memory
+
+}  // namespace gallocy
+
+#endif  // GALLOCY_MEMORY_TRANSFER_H_
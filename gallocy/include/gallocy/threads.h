@@ -44,6 +44,83 @@ typedef
 typedef
   int (*pthread_mutex_trylock_function)(pthread_mutex_t *mutex);
 
+typedef
+  int (*pthread_cond_wait_function)(pthread_cond_t *cond,
+    pthread_mutex_t *mutex);
+
+typedef
+  int (*pthread_cond_timedwait_function)(pthread_cond_t *cond,
+    pthread_mutex_t *mutex,
+    const struct timespec *abstime);
+
+typedef
+  int (*pthread_cond_signal_function)(pthread_cond_t *cond);
+
+typedef
+  int (*pthread_barrier_wait_function)(pthread_barrier_t *barrier);
+
+//
+// synchronization hooks
+//
+
+// The kinds of synchronization point passed to a hook. A condition variable
+// wait is a point on its mutex.
+#define SYNC_MUTEX 0
+#define SYNC_BARRIER 1
+#define SYNC_JOIN 2
+#define SYNC_COND 3
+
+typedef
+  void (*sync_hook_function)(void *arg, void *object, int kind);
+
+typedef
+  void *(*sync_translate_function)(void *arg, void *object, int kind);
+
+typedef
+  bool (*sync_try_function)(void *arg, void *object, int kind);
+
+/**
+ * Set the hooks run at the application's synchronization points.
+ *
+ * The acquire hook runs after a thread locks a mutex, wakes from a condition
+ * variable, passes a barrier, or joins a thread. The release hook runs before
+ * a thread unlocks a mutex, waits on a condition variable, or waits at a
+ * barrier, and after it joins a thread, since the joined thread's writes are
+ * the joiner's to publish.
+ *
+ * Hooks are passed the mutex, barrier, or ``nullptr`` for a join, and the
+ * kind of synchronization point.
+ *
+ * The translate hook, if any, is passed every mutex and condition variable
+ * before it is used, and returns the object to really use. This lets
+ * objects that live in shared memory, whose bytes other nodes can see, be
+ * backed by node-local objects.
+ *
+ * The try hook, if any, runs instead of the acquire hook after a thread
+ * locks a mutex with ``pthread_mutex_trylock``, and must not wait. If it
+ * returns false the mutex is unlocked again and the trylock fails with
+ * ``EBUSY``.
+ *
+ * Pass ``nullptr`` hooks to stop running them.
+ */
+void set_sync_hooks(sync_hook_function acquire, sync_hook_function release, void *arg,
+                    sync_translate_function translate = nullptr, sync_try_function try_acquire = nullptr);
+
+/**
+ * Suspend the synchronization hooks on the calling thread while in scope.
+ *
+ * Gallocy's own threads hold a guard for their whole life, and a hook is
+ * guarded while it runs, so that gallocy's own locking is never mistaken for
+ * the application's.
+ */
+class SyncHookGuard {
+ public:
+  SyncHookGuard();
+  ~SyncHookGuard();
+  SyncHookGuard(const SyncHookGuard &) = delete;
+  SyncHookGuard &operator=(const SyncHookGuard &) = delete;
+};
+
 //
 // pthread replacements for external applications
 //
@@ -62,6 +139,16 @@ extern "C" int pthread_create(pthread_t *thread,
 
 extern "C" int pthread_join(pthread_t thread, void **value_ptr);
 
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex) throw();
+extern "C" int pthread_mutex_trylock(pthread_mutex_t *mutex) throw();
+extern "C" int pthread_mutex_unlock(pthread_mutex_t *mutex) throw();
+extern "C" int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+extern "C" int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+  const struct timespec *abstime);
+extern "C" int pthread_cond_signal(pthread_cond_t *cond) throw();
+extern "C" int pthread_cond_broadcast(pthread_cond_t *cond) throw();
+extern "C" int pthread_barrier_wait(pthread_barrier_t *barrier) throw();
+
 //
 // pthread references for internal library
 //
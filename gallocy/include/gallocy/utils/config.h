@@ -8,6 +8,10 @@
 
 #include "gallocy/allocators/internal.h"
 #include "gallocy/common/peer.h"
+#include "gallocy/heaplayers/affinityheap.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/transfer.h"
+#include "gallocy/utils/logging.h"
 
 
 /**
@@ -30,12 +34,21 @@ class GallocyConfig {
                 uint16_t port)
     : address(address),
       peer_list(peer_list),
-      port(port) {}
+      port(port),
+      page_port(port + 1),
+      prefetch_window(PAGE_PREFETCH_WINDOW_DEFAULT),
+      placement(PLACEMENT_THREAD),
+      coherence(COHERENCY_NONE),
+      chunk_leases(false),
+      server_shards(1) {}
 
   /**
    * Create a configuration.
    *
-   * \param config_json A JSON object with keys for "self", "port", and "peers".
+   * \param config_json A JSON object with keys for "self", "port", and "peers",
+   * and optionally "page_port", "prefetch_window", "placement", which is
+   * "thread" or "node", "coherence", which is "none", "mrsw", or "lrc",
+   * "chunk_leases", "profile_path", "heap_backing", and "server_shards".
    */
   explicit GallocyConfig(gallocy::json config_json) {
     port = config_json["port"];
@@ -48,12 +61,109 @@ class GallocyConfig {
     for (gallocy::json::string_t peer_ip_string : config_json["peers"]) {
       peer_list.push_back(gallocy::common::Peer(peer_ip_string.c_str(), port));
     }
+
+    page_port = port + 1;
+    if (config_json.find("page_port") != config_json.end())
+      page_port = config_json["page_port"];
+
+    prefetch_window = PAGE_PREFETCH_WINDOW_DEFAULT;
+    if (config_json.find("prefetch_window") != config_json.end())
+      prefetch_window = config_json["prefetch_window"];
+
+    placement = PLACEMENT_THREAD;
+    if (config_json.find("placement") != config_json.end()) {
+      gallocy::json::string_t _placement = config_json["placement"];
+      if (_placement == "node")
+        placement = PLACEMENT_NODE;
+    }
+
+    coherence = COHERENCY_NONE;
+    if (config_json.find("coherence") != config_json.end()) {
+      gallocy::json::string_t _coherence = config_json["coherence"];
+      if (_coherence == "mrsw") {
+        coherence = COHERENCY_MRSW;
+      } else if (_coherence == "lrc") {
+        coherence = COHERENCY_LRC;
+      } else if (_coherence != "none") {
+        LOG_ERROR("Unknown coherence protocol \"" << _coherence.c_str() << "\"");
+        abort();
+      }
+    }
+
+    chunk_leases = false;
+    if (config_json.find("chunk_leases") != config_json.end())
+      chunk_leases = config_json["chunk_leases"];
+
+    if (config_json.find("profile_path") != config_json.end()) {
+      gallocy::json::string_t _profile_path = config_json["profile_path"];
+      profile_path = _profile_path.c_str();
+    }
+
+    if (config_json.find("heap_backing") != config_json.end()) {
+      gallocy::json::string_t _heap_backing = config_json["heap_backing"];
+      heap_backing = _heap_backing.c_str();
+    }
+
+    server_shards = 1;
+    if (config_json.find("server_shards") != config_json.end())
+      server_shards = config_json["server_shards"];
+    // CHECK that there is a shard to run the server's event loop on.
+    if (server_shards < 1)
+      server_shards = 1;
   }
 
  public:
   gallocy::string address;
   gallocy::vector<gallocy::common::Peer> peer_list;
   uint16_t port;
+  /**
+   * The port pages are transferred on, which defaults to the port after
+   * ``port``.
+   *
+   * Every node transfers pages on the same port, so nodes that share a host
+   * must not use consecutive ports unless ``page_port`` is set, or one node's
+   * page port is the next node's Raft port.
+   */
+  uint16_t page_port;
+  /**
+   * The number of pages after a faulting page to fetch with it. Zero also
+   * turns off the stride prefetcher.
+   */
+  uint64_t prefetch_window;
+  /**
+   * The application heap's placement policy, one of ``PLACEMENT_*``.
+   */
+  int placement;
+  /**
+   * The application heap's coherence protocol, ``COHERENCY_NONE`` to leave
+   * each node's copy of the heap its own, ``COHERENCY_MRSW``, or
+   * ``COHERENCY_LRC``. A protocol requires ``chunk_leases``, so that no two
+   * nodes allocate the same bytes.
+   */
+  int coherence;
+  /**
+   * Allocate the application heap only from chunks leased through the Raft
+   * log. Off by default, since an allocation then waits for the cluster to
+   * elect a leader and commit its lease.
+   */
+  bool chunk_leases;
+  /**
+   * Where the false sharing profile is dumped at teardown, which turns on
+   * attributing it to allocations, or empty. Only a heap with a coherence
+   * protocol is profiled.
+   */
+  gallocy::string profile_path;
+  /**
+   * The shared memory object or file that backs the application heap, which
+   * nodes on one host that give the same one share the pages of, or empty.
+   * Requires ``chunk_leases``, so that no two nodes allocate the same bytes.
+   */
+  gallocy::string heap_backing;
+  /**
+   * The number of listening sockets, each with an event loop of its own, the
+   * HTTP server shares its port among, at least one.
+   */
+  uint64_t server_shards;
 };
 
 
@@ -0,0 +1,53 @@
+#ifndef GALLOCY_UTILS_LZ_H_
+#define GALLOCY_UTILS_LZ_H_
+
+#include <stdint.h>
+
+#include <cstdlib>
+
+namespace utils {
+
+/**
+ * Get the worst case compressed size of a buffer.
+ *
+ * \param len The uncompressed length.
+ * \return The largest length \ref lz_compress can produce.
+ */
+inline size_t lz_compress_bound(size_t len) {
+  return len + len / 255 + 16;
+}
+
+/**
+ * Compress a buffer.
+ *
+ * Output uses the LZ4 block format: a sequence of literal runs and back
+ * references within a 64 KiB window. The compressor uses a single hash probe
+ * per position, which trades ratio for speed, since it is meant to run on the
+ * sync path.
+ *
+ * \param src The buffer to compress.
+ * \param len The length of the buffer to compress.
+ * \param dst The buffer to compress into.
+ * \param cap The capacity of ``dst``.
+ * \return The compressed length, or 0 if it does not fit in ``cap``.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * Decompress a buffer produced by \ref lz_compress.
+ *
+ * The decompressor never reads or writes out of bounds, even given a
+ * malformed buffer.
+ *
+ * \param src The buffer to decompress.
+ * \param len The length of the buffer to decompress.
+ * \param dst The buffer to decompress into.
+ * \param cap The capacity of ``dst``.
+ * \return The decompressed length, or -1 if the buffer is malformed or does
+ * not fit in ``cap``.
+ */
+int64_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+}  // namespace utils
+
+#endif  // GALLOCY_UTILS_LZ_H_
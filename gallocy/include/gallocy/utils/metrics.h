@@ -0,0 +1,101 @@
+#ifndef GALLOCY_UTILS_METRICS_H_
+#define GALLOCY_UTILS_METRICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include "gallocy/allocators/internal.h"
+
+// A histogram has a bucket for zero and one for each power of two, so bucket
+// ``i`` counts values in ``[2^(i-1), 2^i)``.
+#define HISTOGRAM_BUCKETS 65
+
+namespace utils {
+
+/**
+ * A histogram of non-negative values with power of two buckets.
+ *
+ * Recording is lock free so that it can sit on fast paths. Percentiles are
+ * reported as the upper bound of the bucket they fall in, so they are never
+ * more than twice the true value.
+ */
+class Histogram {
+ public:
+  Histogram();
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+  /**
+   * Record a value.
+   */
+  void record(uint64_t value);
+  /**
+   * Get the number of values recorded.
+   */
+  uint64_t get_count() const {
+    return count.load(std::memory_order_relaxed);
+  }
+  /**
+   * Get the largest value recorded.
+   */
+  uint64_t get_max() const {
+    return max.load(std::memory_order_relaxed);
+  }
+  /**
+   * Get a percentile of the recorded values.
+   *
+   * \param fraction The percentile as a fraction, e.g., 0.99.
+   * \return The upper bound of the bucket the percentile falls in, or 0 if
+   * nothing was recorded.
+   */
+  uint64_t get_percentile(double fraction) const;
+  /**
+   * Get the histogram as JSON.
+   *
+   * \return A JSON object with the count, sum, max, common percentiles, and
+   * the count of every non-empty bucket keyed by its upper bound.
+   */
+  gallocy::json to_json() const;
+
+ private:
+  std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+/**
+ * A source of metrics.
+ *
+ * A source is called each time metrics are collected and returns a JSON
+ * object of its current values.
+ */
+using MetricsSource = std::function<gallocy::json()>;
+
+/**
+ * Register a source of metrics.
+ *
+ * \param name The name the source's metrics are collected under. Registering
+ * a name again replaces its source.
+ * \param source The source.
+ */
+void register_metrics(const gallocy::string &name, MetricsSource source);
+
+/**
+ * Unregister a source of metrics.
+ *
+ * \param name The name the source was registered with.
+ */
+void unregister_metrics(const gallocy::string &name);
+
+/**
+ * Collect metrics from every registered source.
+ *
+ * \return A JSON object with a key for each source.
+ */
+gallocy::json collect_metrics();
+
+}  // namespace utils
+
+#endif  // GALLOCY_UTILS_METRICS_H_
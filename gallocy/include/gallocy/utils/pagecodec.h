@@ -0,0 +1,129 @@
+#ifndef GALLOCY_UTILS_PAGECODEC_H_
+#define GALLOCY_UTILS_PAGECODEC_H_
+
+#include <stdint.h>
+
+#include <cstdlib>
+
+#include "gallocy/utils/constants.h"
+#include "gallocy/utils/pagediff.h"
+
+// An encoded page diff starts with a one byte tag that says how the rest of
+// it is encoded:
+//
+//   PAGE_CODEC_RUNS     An op stream.
+//   PAGE_CODEC_RUNS_LZ  The op stream's length as a varint, then the op
+//                       stream compressed with \ref utils::lz_compress.
+//
+// An op stream is a sequence of ops that are applied to a page from its first
+// byte onward. Each op starts with a varint that holds ``length << 2 | kind``:
+//
+//   PAGE_CODEC_OP_SKIP  Leave the next ``length`` bytes alone.
+//   PAGE_CODEC_OP_COPY  Copy the ``length`` literal bytes that follow the op.
+//   PAGE_CODEC_OP_ZERO  Set the next ``length`` bytes to zero.
+//
+// Only bytes that changed are ever written, so diffs of disjoint writes to the
+// same page from different nodes can be applied in any order.
+#define PAGE_CODEC_RUNS 0
+#define PAGE_CODEC_RUNS_LZ 1
+
+#define PAGE_CODEC_OP_SKIP 0
+#define PAGE_CODEC_OP_COPY 1
+#define PAGE_CODEC_OP_ZERO 2
+
+// The largest encoded page diff, which is a page where every other byte
+// changed, plus slack for the tag.
+#define PAGE_CODEC_MAX_SZ (2 * PAGE_SZ)
+
+// Changed zero bytes are only coded as a ZERO op when at least this many are
+// adjacent, otherwise they are cheaper as literals.
+#define PAGE_CODEC_MIN_ZERO_RUN 4
+
+// Compression is only attempted when at least this fraction of a page
+// changed. Sparse diffs are already small and rarely compress.
+#define PAGE_CODEC_COMPRESS_DENSITY 0.125
+
+namespace utils {
+
+/**
+ * Write an unsigned LEB128 varint.
+ *
+ * \return The number of bytes written, or 0 if it does not fit in ``cap``.
+ */
+inline size_t varint_encode(uint64_t value, uint8_t *out, size_t cap) {
+  size_t n = 0;
+  do {
+    if (n >= cap)
+      return 0;
+    uint8_t b = value & 0x7F;
+    value >>= 7;
+    out[n++] = value ? (b | 0x80) : b;
+  } while (value);
+  return n;
+}
+
+/**
+ * Read an unsigned LEB128 varint.
+ *
+ * \return The number of bytes read, or 0 if the varint is truncated or too
+ * long.
+ */
+inline size_t varint_decode(const uint8_t *in, size_t len, uint64_t *value) {
+  uint64_t v = 0;
+  for (size_t n = 0; n < len && n < 10; n++) {
+    v |= static_cast<uint64_t>(in[n] & 0x7F) << (7 * n);
+    if (!(in[n] & 0x80)) {
+      *value = v;
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Encode the difference between a page and its twin.
+ *
+ * The diff is written straight into ``out``, which is usually a transport
+ * buffer. Compression only runs when the changed fraction of the page is at
+ * least ``compress_density`` and is only kept if it saves at least an eighth
+ * of the op stream, so the receiver never pays to decompress a diff that
+ * barely shrank.
+ *
+ * \param page The page.
+ * \param twin The page's twin.
+ * \param out The buffer to encode into.
+ * \param cap The capacity of ``out``.
+ * \param compress_density The changed fraction that enables compression. Pass
+ * a value above 1 to never compress.
+ * \return The encoded length, or 0 if it does not fit in ``cap``. A clean page
+ * encodes to a single tag byte.
+ */
+size_t page_encode(const void *page, const void *twin, uint8_t *out, size_t cap,
+                   double compress_density = PAGE_CODEC_COMPRESS_DENSITY);
+
+/**
+ * Encode already extracted runs of a page.
+ *
+ * See \ref page_encode.
+ */
+size_t page_encode_runs(const void *page, const PageDiffRun *runs, size_t run_count,
+                        uint8_t *out, size_t cap,
+                        double compress_density = PAGE_CODEC_COMPRESS_DENSITY);
+
+/**
+ * Apply an encoded diff to a page.
+ *
+ * The diff is read straight out of ``in``, which is usually a transport
+ * buffer.
+ *
+ * \param in The encoded diff.
+ * \param len The length of the encoded diff.
+ * \param page The page to apply the diff to.
+ * \return True if the diff was well formed and applied. A malformed diff may
+ * have been partially applied.
+ */
+bool page_decode(const uint8_t *in, size_t len, void *page);
+
+}  // namespace utils
+
+#endif  // GALLOCY_UTILS_PAGECODEC_H_
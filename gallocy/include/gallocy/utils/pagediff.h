@@ -0,0 +1,108 @@
+#ifndef GALLOCY_UTILS_PAGEDIFF_H_
+#define GALLOCY_UTILS_PAGEDIFF_H_
+
+#include <stdint.h>
+
+#include <cstdlib>
+
+#include "gallocy/utils/constants.h"
+
+// A page is compared against its twin one cache line at a time, so a 4 KiB
+// page has exactly 64 lines and the set of dirty lines fits in a uint64_t.
+#define PAGE_LINE_SZ 64
+#define PAGE_LINES (PAGE_SZ / PAGE_LINE_SZ)
+
+namespace utils {
+
+/**
+ * Instruction sets that a page diff kernel can be built for.
+ */
+enum PageDiffIsa {
+  PAGE_DIFF_SCALAR,
+  PAGE_DIFF_SSE2,
+  PAGE_DIFF_AVX2,
+  PAGE_DIFF_AVX512,
+};
+
+
+/**
+ * A run of changed bytes within a page.
+ */
+struct PageDiffRun {
+  uint16_t offset;
+  uint16_t length;
+};
+
+
+/**
+ * A set of page compare kernels built for one instruction set.
+ */
+struct PageDiffKernel {
+  PageDiffIsa isa;
+  const char *name;
+  /**
+   * Find the changed lines of a page.
+   *
+   * \param page The page.
+   * \param twin The page's twin.
+   * \return A mask with bit ``i`` set if line ``i`` differs.
+   */
+  uint64_t (*dirty_lines)(const uint8_t *page, const uint8_t *twin);
+  /**
+   * Find the changed bytes of a single line.
+   *
+   * \param line The line.
+   * \param twin The line's twin.
+   * \return A mask with bit ``i`` set if byte ``i`` differs.
+   */
+  uint64_t (*line_mask)(const uint8_t *line, const uint8_t *twin);
+};
+
+
+/**
+ * Get the kernel in use.
+ *
+ * The first call picks the widest instruction set that both the processor and
+ * the operating system support, as reported by ``cpuid``.
+ */
+const PageDiffKernel &page_diff_kernel();
+/**
+ * Get the kernel built for a specific instruction set.
+ *
+ * \return The kernel, or ``nullptr`` if it can't run on this processor.
+ */
+const PageDiffKernel *page_diff_kernel(PageDiffIsa isa);
+/**
+ * Override the kernel picked by \ref page_diff_kernel.
+ *
+ * \return True if the instruction set is supported and now in use.
+ */
+bool page_diff_select(PageDiffIsa isa);
+/**
+ * Find the changed lines of a page using the kernel in use.
+ */
+uint64_t page_dirty_lines(const void *page, const void *twin);
+/**
+ * Extract the changed runs of a page using the kernel in use.
+ *
+ * Runs are reported in address order and runs that touch across a line
+ * boundary are merged. Like ``snprintf``, at most ``max_runs`` runs are
+ * written but the total is always returned, so a caller can detect a short
+ * buffer. A page never has more than ``PAGE_SZ / 2`` runs.
+ *
+ * \param page The page.
+ * \param twin The page's twin.
+ * \param runs The buffer to write runs into.
+ * \param max_runs The capacity of ``runs``.
+ * \return The number of changed runs in the page.
+ */
+size_t page_diff_runs(const void *page, const void *twin, PageDiffRun *runs, size_t max_runs);
+/**
+ * Extract the changed runs of a page using a specific kernel.
+ */
+size_t page_diff_runs(const PageDiffKernel &kernel, const void *page, const void *twin,
+                      PageDiffRun *runs, size_t max_runs);
+
+}  // namespace utils
+
+#endif  // GALLOCY_UTILS_PAGEDIFF_H_
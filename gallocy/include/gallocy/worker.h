@@ -17,6 +17,7 @@
  */
 class ThreadedDaemon {
  public:
+  virtual ~ThreadedDaemon() {}
   /**
    * Start the daemon.
    */
@@ -40,6 +41,8 @@ class ThreadedDaemon {
    */
   static void *handle_work(void *arg) {
     ThreadedDaemon *self = reinterpret_cast<ThreadedDaemon *>(arg);
+    // IGNORE the application's synchronization hooks in gallocy's threads.
+    SyncHookGuard guard;
     void *ret = self->work();
     return ret;
   }
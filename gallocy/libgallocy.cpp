@@ -16,6 +16,11 @@ volatile int anyThreadCreated = 1;
 ApplicationHeapType heap;
 
 
+// Observes the application heap's allocations, e.g., for profiling.
+static AllocationHook allocation_hook = NULL;
+static void *allocation_hook_arg = NULL;
+
+
 /**
  * Application memory allocators.
  *
@@ -29,21 +34,48 @@ extern "C" {
   }
 
   void* custom_malloc(size_t sz) {
-    return heap.malloc(sz);
+    void *ptr = heap.malloc(sz);
+    if (allocation_hook)
+      allocation_hook(allocation_hook_arg, ptr, sz, __builtin_return_address(0));
+    return ptr;
   }
 
   void custom_free(void* ptr) {
+    if (allocation_hook && ptr)
+      allocation_hook(allocation_hook_arg, ptr, 0, NULL);
     heap.free(ptr);
   }
 
   void* custom_realloc(void* ptr, size_t sz) {
-    return heap.realloc(ptr, sz);
+    if (allocation_hook && ptr)
+      allocation_hook(allocation_hook_arg, ptr, 0, NULL);
+    void *moved = heap.realloc(ptr, sz);
+    if (allocation_hook)
+      allocation_hook(allocation_hook_arg, moved, sz, __builtin_return_address(0));
+    return moved;
   }
 
   size_t custom_malloc_usable_size(void* ptr) {
     return heap.getSize(ptr);
   }
 
+  void custom_set_placement(int placement) {
+    heap.set_placement(placement);
+  }
+
+  uint64_t custom_get_placement_domains() {
+    return heap.get_domains_in_use();
+  }
+
+  uint64_t custom_get_placement_overflows() {
+    return heap.get_overflows();
+  }
+
+  void custom_set_allocation_hook(AllocationHook hook, void *arg) {
+    allocation_hook_arg = arg;
+    allocation_hook = hook;
+  }
+
 #ifdef __APPLE__
 
   void custom_malloc_lock() {
@@ -0,0 +1,672 @@
+#include "gallocy/memory/coherence.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gallocy/memory/directory.h"
+#include "gallocy/memory/fault.h"
+#include "gallocy/memory/prefetch.h"
+#include "gallocy/memory/profiler.h"
+#include "gallocy/threads.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+
+
+static bool coherence_fault(void *arg, void *address, bool write) {
+  return reinterpret_cast<gallocy::memory::MRSWCoherence *>(arg)->fault(address, write);
+}
+
+
+/**
+ * Nothing is pulled at an acquire, since readers' copies are invalidated by
+ * the writer.
+ */
+static void coherence_acquire_hook(void *arg, void *object, int kind) {
+}
+
+
+/**
+ * End the sync epoch at a release of the application's shared
+ * synchronization objects, so that every reader of a page written since the
+ * last one drops its copy. A join has no object and always ends the epoch.
+ */
+static void coherence_release_hook(void *arg, void *object, int kind) {
+  gallocy::memory::MRSWCoherence *coherence = reinterpret_cast<gallocy::memory::MRSWCoherence *>(arg);
+  if (object && !coherence->contains(object))
+    return;
+  coherence->sync();
+}
+
+
+gallocy::memory::MRSWCoherence::MRSWCoherence(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes,
+                                              void *base, uint64_t pages, uint32_t initial_owner,
+                                              uint64_t granularity, uint64_t prefetch_window)
+  : read_faults(0),
+    write_faults(0),
+    pages_prefetched(0),
+    invalidation_messages(0),
+    pages_invalidated(0),
+    epochs(0),
+    self(self),
+    node_count(nodes.size()),
+    base(reinterpret_cast<uint8_t *>(base)),
+    pages(pages),
+    prefetch_window(prefetch_window),
+    directory(nullptr),
+    profiler(nullptr),
+    prefetcher(nullptr),
+    intercepting(false) {
+  if (node_count > COHERENCE_MAX_NODES) {
+    LOG_ERROR("Coherence supports at most " << COHERENCE_MAX_NODES << " nodes, not " << node_count);
+    abort();
+  }
+  int log2 = granularity_log2(granularity);
+  if (log2 < PAGE_SZ_LOG2) {
+    LOG_ERROR("Coherence units must be at least a page, not " << granularity << " bytes");
+    abort();
+  }
+
+  state = reinterpret_cast<CoherencePage *>(internal_malloc(pages * sizeof(CoherencePage)));
+  for (uint64_t page = 0; page < pages; page++) {
+    state[page].owner = initial_owner;
+    state[page].permissions = self == initial_owner ? PAGE_PERM_WRITE : PAGE_PERM_NONE;
+    state[page].busy = 0;
+    state[page].invalidated = 0;
+    state[page].prefetched = 0;
+    state[page].unit_log2 = log2 - PAGE_SZ_LOG2;
+    state[page].copyset = 0;
+  }
+
+  // ALIAS the region, so that pages are filled through a view that is always
+  // writable while the application's view of them stays protected.
+  fill = reinterpret_cast<uint8_t *>(mremap(base, 0, pages * PAGE_SZ, MREMAP_MAYMOVE));
+  if (fill == MAP_FAILED || mprotect(fill, pages * PAGE_SZ, PROT_READ | PROT_WRITE) == -1) {
+    LOG_ERROR("Coherence needs a shared mapping to alias: " << strerror(errno));
+    abort();
+  }
+
+  size_t words = (pages + 63) / 64;
+  memset(owed, 0, sizeof(owed));
+  memset(clients, 0, sizeof(clients));
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    owed[node] = reinterpret_cast<uint64_t *>(internal_malloc(words * sizeof(uint64_t)));
+    memset(owed[node], 0, words * sizeof(uint64_t));
+    clients[node] = new (internal_malloc(sizeof(PageTransferClient))) PageTransferClient(nodes[node], fill, pages,
+                                                                                        prefetch_window);
+    clients[node]->set_node(self);
+  }
+
+  if (mprotect(base, pages * PAGE_SZ, self == initial_owner ? PROT_READ | PROT_WRITE : PROT_NONE) == -1)
+    perror("coherence mprotect");
+  register_fault_region(base, pages * PAGE_SZ, coherence_fault, this);
+
+  metrics_name = "coherence " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::MRSWCoherence::~MRSWCoherence() {
+  if (intercepting)
+    set_sync_hooks(nullptr, nullptr, nullptr);
+  utils::unregister_metrics(metrics_name);
+  unregister_fault_region(base);
+  mprotect(base, pages * PAGE_SZ, PROT_READ | PROT_WRITE);
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    clients[node]->~PageTransferClient();
+    internal_free(clients[node]);
+    internal_free(owed[node]);
+  }
+  munmap(fill, pages * PAGE_SZ);
+  internal_free(state);
+}
+
+
+void gallocy::memory::MRSWCoherence::protect(uint64_t page, uint8_t permissions, uint64_t count) {
+  int prot = PROT_NONE;
+  if (permissions == PAGE_PERM_READ)
+    prot = PROT_READ;
+  else if (permissions == PAGE_PERM_WRITE)
+    prot = PROT_READ | PROT_WRITE;
+  if (mprotect(base + page * PAGE_SZ, count * PAGE_SZ, prot) == -1)
+    perror("coherence mprotect");
+}
+
+
+void gallocy::memory::MRSWCoherence::unit(uint64_t page, uint64_t *first, uint64_t *count) {
+  uint64_t size = 1ULL << state[page].unit_log2;
+  *first = page & ~(size - 1);
+  *count = std::min(size, pages - *first);
+}
+
+
+void gallocy::memory::MRSWCoherence::owe_invalidations(uint64_t page, uint64_t copyset, uint32_t except) {
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self || node == except || !(copyset & (1ULL << node)))
+      continue;
+    owed[node][page / 64] |= 1ULL << (page % 64);
+  }
+}
+
+
+bool gallocy::memory::MRSWCoherence::fault(void *address, bool write) {
+  SyncHookGuard guard;
+  uint64_t offset = reinterpret_cast<uint8_t *>(address) - base;
+  uint64_t page = offset / PAGE_SZ;
+  if (reinterpret_cast<uint8_t *>(address) < base || page >= pages)
+    return false;
+  {
+    // A read fault on a readable page can only have been a write, unless the
+    // page was prefetched and this is its first touch.
+    std::lock_guard<std::mutex> lock(access_lock);
+    if (state[page].permissions == PAGE_PERM_READ && !state[page].prefetched)
+      write = true;
+  }
+  return write ? write_fault(page) : read_fault(page);
+}
+
+
+void gallocy::memory::MRSWCoherence::set_directory(PageDirectory *directory) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  this->directory = directory;
+}
+
+
+void gallocy::memory::MRSWCoherence::set_profiler(FalseSharingProfiler *profiler) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  this->profiler = profiler;
+}
+
+
+void gallocy::memory::MRSWCoherence::set_prefetch_window(uint64_t window) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  prefetch_window = window;
+}
+
+
+void gallocy::memory::MRSWCoherence::set_prefetcher(PagePrefetcher *prefetcher) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  this->prefetcher = prefetcher;
+}
+
+
+bool gallocy::memory::MRSWCoherence::set_granularity(void *address, size_t length, uint64_t granularity) {
+  SyncHookGuard guard;
+  uint64_t offset = reinterpret_cast<uint8_t *>(address) - base;
+  int log2 = granularity_log2(granularity);
+  if (log2 < PAGE_SZ_LOG2 || reinterpret_cast<uint8_t *>(address) < base || offset % granularity
+      || length % granularity || offset + length > pages * PAGE_SZ) {
+    LOG_ERROR("Invalid coherence granularity of " << granularity << " bytes for " << length << " bytes");
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(access_lock);
+  for (uint64_t page = offset / PAGE_SZ; page < (offset + length) / PAGE_SZ; page++)
+    state[page].unit_log2 = log2 - PAGE_SZ_LOG2;
+  return true;
+}
+
+
+uint64_t gallocy::memory::MRSWCoherence::get_granularity(uint64_t page) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  return static_cast<uint64_t>(PAGE_SZ) << state[page].unit_log2;
+}
+
+
+bool gallocy::memory::MRSWCoherence::request(uint16_t op, uint64_t first, uint64_t count,
+                                             std::unique_lock<std::mutex> &lock, uint32_t *served, uint64_t *readers,
+                                             bool follow) {
+  uint64_t unit_pages[PAGE_TRANSFER_MAX_PAGES];
+  uint64_t units[PAGE_TRANSFER_MAX_PAGES];
+  size_t unit_count = 0;
+  for (uint64_t i = 0; i < count; i++)
+    unit_pages[i] = first + i;
+  for (uint64_t p = first; p < first + count; p += 1ULL << state[p].unit_log2)
+    units[unit_count++] = p;
+  uint64_t page = first;
+  uint32_t target = state[page].owner;
+  bool asked_home = false;
+  for (uint32_t hops = 0; hops < (follow ? 4 * node_count : 1); hops++) {
+    // A stale chain of owners can lead back here, so ask the next node.
+    if (target == self || target >= node_count)
+      target = (self + 1 + hops) % node_count;
+    if (target == self)
+      continue;
+    lock.unlock();
+    uint32_t hint = target;
+    int status = clients[target]->request(op, unit_pages, count, &hint, readers);
+    if (status == PAGE_TRANSFER_OK) {
+      // TELL the page's home while the page is busy here, so no later owner's
+      // update can reach the home first.
+      for (size_t u = 0; directory && u < unit_count; u++) {
+        if (op == PAGE_TRANSFER_OWN)
+          directory->set_owner(units[u], self);
+        else
+          directory->add_copy(units[u], self);
+      }
+      lock.lock();
+      for (uint64_t p = first; p < first + count; p++)
+        state[p].owner = op == PAGE_TRANSFER_OWN ? self : target;
+      *served = target;
+      return true;
+    }
+    lock.lock();
+    if (!follow)
+      return false;
+    if (status != PAGE_TRANSFER_ENOTOWNER) {
+      LOG_ERROR("Failed to get page " << page << " from node " << target << " with status " << status);
+      return false;
+    }
+    DirectoryEntry entry;
+    if (directory && !asked_home) {
+      // ASK the page's home rather than follow a chain of stale hints.
+      asked_home = true;
+      lock.unlock();
+      bool found = directory->lookup(page, &entry);
+      lock.lock();
+      if (found && entry.owner != target && entry.owner < node_count) {
+        target = entry.owner;
+        continue;
+      }
+    }
+    if (hint == target) {
+      // The owner is busy handing the page over, so give it a moment.
+      lock.unlock();
+      sched_yield();
+      lock.lock();
+    }
+    target = hint;
+  }
+  if (follow)
+    LOG_ERROR("Failed to find the owner of page " << page);
+  return false;
+}
+
+
+uint64_t gallocy::memory::MRSWCoherence::gather_window(uint64_t first, uint64_t count) {
+  uint64_t end = first + count;
+  while (end < pages) {
+    uint64_t next, next_count;
+    unit(end, &next, &next_count);
+    // STOP at the first unit that is present, moving, or owned elsewhere,
+    // so the window is one run from one owner.
+    if (end + next_count - first - count > prefetch_window
+        || end + next_count - first > PAGE_TRANSFER_MAX_PAGES || state[next].busy
+        || state[next].permissions != PAGE_PERM_NONE || state[next].owner != state[first].owner)
+      break;
+    end += next_count;
+  }
+  for (uint64_t p = first + count; p < end; p++) {
+    state[p].busy = 1;
+    state[p].invalidated = 0;
+  }
+  return end - first - count;
+}
+
+
+bool gallocy::memory::MRSWCoherence::read_fault(uint64_t page) {
+  SyncHookGuard guard;
+  std::unique_lock<std::mutex> lock(access_lock);
+  uint64_t first, count;
+  unit(page, &first, &count);
+  busy_cv.wait(lock, [&]() { return !state[first].busy; });
+  PagePrefetcher *prefetcher = this->prefetcher;
+  if (state[first].prefetched) {
+    // REVEAL a prefetched copy at its first touch, which tells the
+    // prefetcher it was right.
+    for (uint64_t p = first; p < first + count; p++)
+      state[p].prefetched = 0;
+    protect(first, PAGE_PERM_READ, count);
+    lock.unlock();
+    if (prefetcher)
+      prefetcher->touch(first);
+    return true;
+  }
+  if (state[first].permissions != PAGE_PERM_NONE)
+    return true;
+
+  for (uint64_t p = first; p < first + count; p++) {
+    state[p].busy = 1;
+    state[p].invalidated = 0;
+  }
+  uint32_t served = 0;
+  bool ok = false;
+  // READ the units in the prefetch window along with the faulting one, but
+  // only from the owner all of them are thought to be at. If any of them
+  // has moved, fall back to the faulting unit alone.
+  uint64_t window = gather_window(first, count);
+  if (window > 0 && request(PAGE_TRANSFER_READ, first, count + window, lock, &served, nullptr, false)) {
+    ok = true;
+    pages_prefetched += window;
+  } else {
+    if (window > 0) {
+      for (uint64_t p = first + count; p < first + count + window; p++) {
+        state[p].invalidated = 0;
+        state[p].busy = 0;
+      }
+      busy_cv.notify_all();
+      window = 0;
+    }
+    ok = request(PAGE_TRANSFER_READ, first, count, lock, &served, nullptr);
+  }
+  for (uint64_t p = first; p < first + count + window; p++) {
+    // DROP a copy that was invalidated while it was on its way, so the next
+    // access fetches it again.
+    if (ok && !state[p].invalidated) {
+      state[p].permissions = PAGE_PERM_READ;
+      protect(p, PAGE_PERM_READ);
+    }
+    state[p].invalidated = 0;
+    state[p].busy = 0;
+  }
+  if (ok)
+    read_faults++;
+  busy_cv.notify_all();
+  lock.unlock();
+  // TRAIN the prefetcher on the miss, which may queue the units ahead of it.
+  if (ok && prefetcher)
+    prefetcher->touch(first);
+  return ok;
+}
+
+
+size_t gallocy::memory::MRSWCoherence::prefetch(uint64_t *page_numbers, size_t count) {
+  SyncHookGuard guard;
+  std::unique_lock<std::mutex> lock(access_lock);
+  size_t fetched = 0;
+  size_t i = 0;
+  while (i < count) {
+    uint64_t first, unit_count;
+    if (page_numbers[i] >= pages) {
+      i++;
+      continue;
+    }
+    unit(page_numbers[i++], &first, &unit_count);
+    if (state[first].busy || state[first].permissions != PAGE_PERM_NONE || state[first].owner == self)
+      continue;
+    // EXTEND the run over the next predicted units while they follow on from
+    // it and are missing at the same owner.
+    uint64_t end = first + unit_count;
+    uint64_t units[PAGE_TRANSFER_MAX_PAGES];
+    size_t unit_total = 0;
+    units[unit_total++] = first;
+    while (i < count && page_numbers[i] < pages) {
+      uint64_t next, next_count;
+      unit(page_numbers[i], &next, &next_count);
+      if (next < end) {
+        i++;
+        continue;
+      }
+      if (next != end || end + next_count - first > PAGE_TRANSFER_MAX_PAGES || state[next].busy
+          || state[next].permissions != PAGE_PERM_NONE || state[next].owner != state[first].owner)
+        break;
+      units[unit_total++] = next;
+      end += next_count;
+      i++;
+    }
+    for (uint64_t p = first; p < end; p++) {
+      state[p].busy = 1;
+      state[p].invalidated = 0;
+    }
+    uint32_t served = 0;
+    bool ok = request(PAGE_TRANSFER_READ, first, end - first, lock, &served, nullptr, false);
+    for (size_t u = 0; u < unit_total; u++) {
+      uint64_t next, next_count;
+      unit(units[u], &next, &next_count);
+      // KEEP the copy hidden until it is touched, and drop it if it was
+      // invalidated on its way.
+      bool kept = ok && !state[next].invalidated;
+      for (uint64_t p = next; p < next + next_count; p++) {
+        if (kept) {
+          state[p].permissions = PAGE_PERM_READ;
+          state[p].prefetched = 1;
+        }
+        state[p].invalidated = 0;
+        state[p].busy = 0;
+      }
+      if (kept) {
+        page_numbers[fetched++] = next;
+        pages_prefetched += next_count;
+      }
+    }
+    busy_cv.notify_all();
+  }
+  return fetched;
+}
+
+
+bool gallocy::memory::MRSWCoherence::write_fault(uint64_t page) {
+  SyncHookGuard guard;
+  std::unique_lock<std::mutex> lock(access_lock);
+  uint64_t first, count;
+  unit(page, &first, &count);
+  busy_cv.wait(lock, [&]() { return !state[first].busy; });
+  if (state[first].permissions == PAGE_PERM_WRITE)
+    return true;
+
+  if (state[first].owner == self) {
+    // UPGRADE in place, and owe the readers an invalidation.
+    for (uint64_t p = first; p < first + count; p++) {
+      owe_invalidations(p, state[p].copyset, self);
+      state[p].copyset = 0;
+      state[p].permissions = PAGE_PERM_WRITE;
+      state[p].prefetched = 0;
+    }
+    protect(first, PAGE_PERM_WRITE, count);
+    return true;
+  }
+
+  // HIDE a read-only copy while it is overwritten.
+  for (uint64_t p = first; p < first + count; p++)
+    state[p].busy = 1;
+  protect(first, PAGE_PERM_NONE, count);
+  uint32_t served = 0;
+  uint64_t readers = 0;
+  bool ok = request(PAGE_TRANSFER_OWN, first, count, lock, &served, &readers);
+  for (uint64_t p = first; p < first + count; p++) {
+    if (ok) {
+      // OWE the old owner's readers an invalidation, since this node's
+      // writes are published at its own sync.
+      owe_invalidations(p, readers, self);
+      state[p].permissions = PAGE_PERM_WRITE;
+      state[p].copyset = 0;
+      if (profiler)
+        profiler->acquired(p, served, fill + p * PAGE_SZ);
+    }
+    state[p].invalidated = 0;
+    if (state[p].prefetched && prefetcher)
+      prefetcher->invalidate(p);
+    state[p].prefetched = 0;
+    state[p].busy = 0;
+  }
+  if (ok)
+    write_faults++;
+  protect(first, state[first].permissions, count);
+  busy_cv.notify_all();
+  return ok;
+}
+
+
+void gallocy::memory::MRSWCoherence::sync() {
+  SyncHookGuard guard;
+  uint64_t batch[PAGE_TRANSFER_MAX_PAGES];
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    // SEND the owed invalidations a message's worth at a time.
+    uint64_t word = 0;
+    while (true) {
+      size_t count = 0;
+      {
+        std::lock_guard<std::mutex> lock(access_lock);
+        for (; word < (pages + 63) / 64 && count + 64 <= PAGE_TRANSFER_MAX_PAGES; word++) {
+          uint64_t bits = owed[node][word];
+          owed[node][word] = 0;
+          while (bits) {
+            batch[count++] = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+          }
+        }
+      }
+      if (count == 0 && word >= (pages + 63) / 64)
+        break;
+      if (count == 0)
+        continue;
+      if (clients[node]->request(PAGE_TRANSFER_INVALIDATE, batch, count, nullptr) != PAGE_TRANSFER_OK)
+        LOG_WARNING("Failed to invalidate " << count << " pages on node " << node);
+      std::lock_guard<std::mutex> lock(access_lock);
+      invalidation_messages++;
+      pages_invalidated += count;
+    }
+  }
+  std::lock_guard<std::mutex> lock(access_lock);
+  epochs++;
+}
+
+
+uint16_t gallocy::memory::MRSWCoherence::prepare(uint16_t op, uint32_t node, const PageTransferRun *runs,
+                                                 size_t run_count, uint32_t *hint, uint64_t *readers) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (node >= node_count || node == self)
+    return PAGE_TRANSFER_EINVAL;
+
+  if (op == PAGE_TRANSFER_INVALIDATE) {
+    for (size_t r = 0; r < run_count; r++) {
+      for (uint64_t page = runs[r].page; page < runs[r].page + runs[r].count; page++) {
+        // INVALIDATE the whole unit, even if its pages were split across
+        // messages.
+        uint64_t first, count;
+        unit(page, &first, &count);
+        for (uint64_t p = first; p < first + count; p++) {
+          // IGNORE invalidations that crossed with this node taking the page,
+          // and defer those that crossed with a copy on its way here.
+          if (state[p].owner == self)
+            continue;
+          if (state[p].busy) {
+            state[p].invalidated = 1;
+            continue;
+          }
+          state[p].owner = node;
+          if (state[p].prefetched && prefetcher)
+            prefetcher->invalidate(p);
+          state[p].prefetched = 0;
+          if (state[p].permissions != PAGE_PERM_NONE) {
+            state[p].permissions = PAGE_PERM_NONE;
+            protect(p, PAGE_PERM_NONE);
+          }
+        }
+      }
+    }
+    return PAGE_TRANSFER_OK;
+  }
+
+  for (size_t r = 0; r < run_count; r++) {
+    for (uint64_t page = runs[r].page; page < runs[r].page + runs[r].count; page++) {
+      if (state[page].owner != self || state[page].busy) {
+        *hint = state[page].owner;
+        return PAGE_TRANSFER_ENOTOWNER;
+      }
+    }
+  }
+
+  for (size_t r = 0; r < run_count; r++) {
+    for (uint64_t page = runs[r].page; page < runs[r].page + runs[r].count; page++) {
+      CoherencePage &s = state[page];
+      owed[node][page / 64] &= ~(1ULL << (page % 64));
+      if (op == PAGE_TRANSFER_OWN) {
+        // HAND the readers to the new owner, along with any this node still
+        // owes for its own writes, since their copies must go at the new
+        // owner's next sync too. This node still owes its own.
+        *readers |= s.copyset;
+        for (uint32_t other = 0; other < node_count; other++) {
+          if (other != self && other != node && (owed[other][page / 64] & (1ULL << (page % 64))))
+            *readers |= 1ULL << other;
+        }
+        *readers &= ~(1ULL << node);
+        s.copyset = 0;
+        // HOLD local writers off until the page has been handed over.
+        s.busy = 1;
+      } else {
+        s.copyset |= 1ULL << node;
+      }
+      if (s.permissions == PAGE_PERM_WRITE) {
+        s.permissions = PAGE_PERM_READ;
+        protect(page, PAGE_PERM_READ);
+      }
+    }
+  }
+  return PAGE_TRANSFER_OK;
+}
+
+
+void gallocy::memory::MRSWCoherence::complete(uint16_t op, uint32_t node, const PageTransferRun *runs,
+                                              size_t run_count, bool sent) {
+  SyncHookGuard guard;
+  if (op != PAGE_TRANSFER_OWN)
+    return;
+  std::lock_guard<std::mutex> lock(access_lock);
+  for (size_t r = 0; r < run_count; r++) {
+    for (uint64_t page = runs[r].page; page < runs[r].page + runs[r].count; page++) {
+      if (sent) {
+        // SAMPLE the page as sent, while it is still readable.
+        if (profiler)
+          profiler->handed_off(page, node, base + page * PAGE_SZ);
+        state[page].owner = node;
+        state[page].permissions = PAGE_PERM_NONE;
+        protect(page, PAGE_PERM_NONE);
+      }
+      state[page].busy = 0;
+    }
+  }
+  busy_cv.notify_all();
+}
+
+
+void gallocy::memory::MRSWCoherence::intercept_synchronization() {
+  set_sync_hooks(coherence_acquire_hook, coherence_release_hook, this);
+  intercepting = true;
+}
+
+
+uint8_t gallocy::memory::MRSWCoherence::get_permissions(uint64_t page) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  return state[page].permissions;
+}
+
+
+uint32_t gallocy::memory::MRSWCoherence::get_owner(uint64_t page) {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  return state[page].owner;
+}
+
+
+gallocy::json gallocy::memory::MRSWCoherence::get_metrics() {
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "model", "mrsw" },
+    { "read_faults", read_faults },
+    { "write_faults", write_faults },
+    { "pages_prefetched", pages_prefetched },
+    { "invalidation_messages", invalidation_messages },
+    { "pages_invalidated", pages_invalidated },
+    { "epochs", epochs },
+  };
+  return metrics;
+}
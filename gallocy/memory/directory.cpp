@@ -0,0 +1,362 @@
+#include "gallocy/memory/directory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+
+
+/**
+ * Mix the bits of a key, so that nearby pages and addresses spread out.
+ */
+static inline uint64_t directory_mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  key *= 0xC4CEB9FE1A85EC53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+
+static inline uint64_t directory_bucket(uint64_t page) {
+  return directory_mix(page) % DIRECTORY_BUCKETS;
+}
+
+
+/**
+ * Identify a peer by its address and port, since peers compare by address.
+ */
+static inline uint64_t directory_peer_key(const gallocy::common::Peer &peer) {
+  return (peer.get_canonical_id() << 16) | peer.get_port();
+}
+
+
+gallocy::memory::PageDirectory::PageDirectory(uint32_t self, const gallocy::vector<gallocy::common::Peer> &nodes,
+                                              uint32_t initial_owner)
+  : local_lookups(0),
+    remote_lookups(0),
+    remote_updates(0),
+    migrated(0),
+    rebuilds(0),
+    self(self),
+    initial_owner(initial_owner),
+    members(nodes) {
+  if (nodes.size() > COHERENCE_MAX_NODES || self >= nodes.size()) {
+    LOG_ERROR("The directory supports at most " << COHERENCE_MAX_NODES << " nodes, and needs this node among them");
+    abort();
+  }
+  self_peer = nodes[self];
+  assign_homes();
+
+  metrics_name = "directory " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::PageDirectory::~PageDirectory() {
+  utils::unregister_metrics(metrics_name);
+  for (auto &it : clients) {
+    it.second->~PageTransferClient();
+    internal_free(it.second);
+  }
+}
+
+
+void gallocy::memory::PageDirectory::assign_homes() {
+  uint64_t weights[COHERENCE_MAX_NODES];
+  for (uint32_t node = 0; node < members.size(); node++)
+    weights[node] = directory_mix(directory_peer_key(members[node]));
+  for (uint64_t bucket = 0; bucket < DIRECTORY_BUCKETS; bucket++) {
+    // THE member with the highest score for a bucket is its home.
+    uint32_t home = DIRECTORY_NO_NODE;
+    uint64_t best = 0;
+    for (uint32_t node = 0; node < members.size(); node++) {
+      uint64_t score = directory_mix(weights[node] ^ (bucket * 0x9E3779B97F4A7C15ULL));
+      if (home == DIRECTORY_NO_NODE || score > best) {
+        home = node;
+        best = score;
+      }
+    }
+    homes[bucket] = home;
+  }
+}
+
+
+gallocy::memory::PageTransferClient *gallocy::memory::PageDirectory::get_client(uint32_t node) {
+  uint64_t key = directory_peer_key(members[node]);
+  auto it = clients.find(key);
+  if (it != clients.end())
+    return it->second;
+  PageTransferClient *client = new (internal_malloc(sizeof(PageTransferClient)))
+    PageTransferClient(members[node], nullptr, 0, 0);
+  client->set_node(self);
+  clients[key] = client;
+  return client;
+}
+
+
+void gallocy::memory::PageDirectory::rebuild(const gallocy::vector<gallocy::common::Peer> &nodes) {
+  if (nodes.size() > COHERENCE_MAX_NODES) {
+    LOG_ERROR("The directory supports at most " << COHERENCE_MAX_NODES << " nodes, not " << nodes.size());
+    return;
+  }
+
+  gallocy::map<PageTransferClient *, gallocy::vector<DirectoryRecord>> moving;
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    // RENUMBER every node that stayed, and forget every node that left.
+    uint32_t renumber[COHERENCE_MAX_NODES];
+    for (uint32_t node = 0; node < members.size(); node++) {
+      renumber[node] = DIRECTORY_NO_NODE;
+      for (uint32_t other = 0; other < nodes.size(); other++) {
+        if (nodes[other] == members[node])
+          renumber[node] = other;
+      }
+    }
+    auto renumbered = [&](uint32_t node) {
+      return node < members.size() ? renumber[node] : DIRECTORY_NO_NODE;
+    };
+
+    self = DIRECTORY_NO_NODE;
+    for (uint32_t node = 0; node < nodes.size(); node++) {
+      if (nodes[node] == self_peer)
+        self = node;
+    }
+    initial_owner = renumbered(initial_owner);
+
+    for (auto &it : entries) {
+      DirectoryEntry &entry = it.second;
+      uint64_t copyset = 0;
+      for (uint64_t bits = entry.copyset; bits; bits &= bits - 1) {
+        uint32_t node = renumbered(__builtin_ctzll(bits));
+        if (node != DIRECTORY_NO_NODE)
+          copyset |= 1ULL << node;
+      }
+      entry.owner = renumbered(entry.owner);
+      entry.copyset = copyset;
+    }
+
+    members = nodes;
+    assign_homes();
+
+    // HAND every entry whose home moved to its new home.
+    for (auto it = entries.begin(); it != entries.end();) {
+      uint32_t home = homes[directory_bucket(it->first)];
+      if (home == self) {
+        ++it;
+        continue;
+      }
+      if (home != DIRECTORY_NO_NODE) {
+        DirectoryRecord record;
+        record.page = it->first;
+        record.entry = it->second;
+        moving[get_client(home)].push_back(record);
+      }
+      it = entries.erase(it);
+    }
+    rebuilds++;
+  }
+
+  // SEND migrations without the lock, since the new home may be migrating
+  // entries here at the same time.
+  size_t per_message = (PAGE_TRANSFER_MAX_MESSAGE - sizeof(DirectoryMessage)) / sizeof(DirectoryRecord);
+  uint8_t *message = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_TRANSFER_MAX_MESSAGE));
+  for (auto &it : moving) {
+    const gallocy::vector<DirectoryRecord> &records = it.second;
+    for (size_t first = 0; first < records.size(); first += per_message) {
+      size_t count = std::min(per_message, records.size() - first);
+      DirectoryMessage request;
+      memset(&request, 0, sizeof(request));
+      request.kind = DIRECTORY_MIGRATE;
+      memcpy(message, &request, sizeof(request));
+      memcpy(message + sizeof(request), &records[first], count * sizeof(DirectoryRecord));
+      size_t reply_length = 0;
+      if (it.first->exchange(PAGE_TRANSFER_DIRECTORY, message, sizeof(request) + count * sizeof(DirectoryRecord),
+                             nullptr, &reply_length, 0) != PAGE_TRANSFER_OK) {
+        LOG_WARNING("Failed to migrate " << count << " directory entries to "
+                    << it.first->get_peer().get_string());
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(access_lock);
+      migrated += count;
+    }
+  }
+  internal_free(message);
+}
+
+
+uint32_t gallocy::memory::PageDirectory::get_home(uint64_t page) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return homes[directory_bucket(page)];
+}
+
+
+uint32_t gallocy::memory::PageDirectory::get_self() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return self;
+}
+
+
+uint16_t gallocy::memory::PageDirectory::apply(const DirectoryMessage &request, DirectoryEntry *reply) {
+  if (self == DIRECTORY_NO_NODE || homes[directory_bucket(request.page)] != self)
+    return PAGE_TRANSFER_ENOTOWNER;
+
+  // PAGES without an entry are still with their initial owner.
+  DirectoryEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.owner = initial_owner;
+  auto it = entries.find(request.page);
+  if (it != entries.end())
+    entry = it->second;
+
+  if (request.kind == DIRECTORY_LOOKUP) {
+    local_lookups++;
+    *reply = entry;
+    return PAGE_TRANSFER_OK;
+  } else if (request.kind == DIRECTORY_SET_OWNER && request.node < members.size()) {
+    entry.owner = request.node;
+    entry.flags |= DIRECTORY_OWNER_SET;
+    entry.copyset = 0;
+  } else if (request.kind == DIRECTORY_ADD_COPY && request.node < members.size()) {
+    entry.copyset |= 1ULL << request.node;
+  } else {
+    return PAGE_TRANSFER_EINVAL;
+  }
+
+  if (entry.owner == initial_owner && entry.copyset == 0 && !(entry.flags & DIRECTORY_OWNER_SET)) {
+    if (it != entries.end())
+      entries.erase(it);
+  } else {
+    entries[request.page] = entry;
+  }
+  return PAGE_TRANSFER_OK;
+}
+
+
+bool gallocy::memory::PageDirectory::send(uint8_t kind, uint64_t page, uint32_t node, DirectoryEntry *reply) {
+  DirectoryMessage request;
+  memset(&request, 0, sizeof(request));
+  request.kind = kind;
+  request.node = node;
+  request.page = page;
+
+  DirectoryEntry entry;
+  PageTransferClient *client = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    uint32_t home = homes[directory_bucket(page)];
+    if (home == DIRECTORY_NO_NODE)
+      return false;
+    if (home == self) {
+      if (apply(request, &entry) != PAGE_TRANSFER_OK)
+        return false;
+      if (reply)
+        *reply = entry;
+      return true;
+    }
+    client = get_client(home);
+    if (kind == DIRECTORY_LOOKUP)
+      remote_lookups++;
+    else
+      remote_updates++;
+  }
+
+  size_t reply_length = 0;
+  int status = client->exchange(PAGE_TRANSFER_DIRECTORY, reinterpret_cast<uint8_t *>(&request), sizeof(request),
+                                reinterpret_cast<uint8_t *>(&entry), &reply_length, sizeof(entry));
+  if (status != PAGE_TRANSFER_OK) {
+    LOG_WARNING("Failed to send directory request " << static_cast<int>(kind) << " for page " << page
+                << " with status " << status);
+    return false;
+  }
+  if (kind == DIRECTORY_LOOKUP) {
+    if (reply_length != sizeof(entry))
+      return false;
+    if (reply)
+      *reply = entry;
+  }
+  return true;
+}
+
+
+bool gallocy::memory::PageDirectory::lookup(uint64_t page, DirectoryEntry *entry) {
+  return send(DIRECTORY_LOOKUP, page, 0, entry);
+}
+
+
+bool gallocy::memory::PageDirectory::set_owner(uint64_t page, uint32_t node) {
+  return send(DIRECTORY_SET_OWNER, page, node, nullptr);
+}
+
+
+bool gallocy::memory::PageDirectory::add_copy(uint64_t page, uint32_t node) {
+  return send(DIRECTORY_ADD_COPY, page, node, nullptr);
+}
+
+
+uint16_t gallocy::memory::PageDirectory::exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                                                  size_t *reply_length, size_t capacity) {
+  DirectoryMessage request;
+  *reply_length = 0;
+  if (op != PAGE_TRANSFER_DIRECTORY || length < sizeof(request))
+    return PAGE_TRANSFER_EINVAL;
+  memcpy(&request, message, sizeof(request));
+  length -= sizeof(request);
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (request.kind == DIRECTORY_MIGRATE) {
+    // KEEP the entries even if this node has yet to see the new membership,
+    // since it migrates whatever is not its own when it does.
+    if (length % sizeof(DirectoryRecord) != 0)
+      return PAGE_TRANSFER_EINVAL;
+    for (size_t offset = 0; offset < length; offset += sizeof(DirectoryRecord)) {
+      DirectoryRecord record;
+      memcpy(&record, message + sizeof(request) + offset, sizeof(record));
+      auto it = entries.find(record.page);
+      if (it == entries.end()) {
+        entries[record.page] = record.entry;
+        continue;
+      }
+      // MERGE with an entry updated here since the membership changed, which
+      // is newer: an owner set here wins, and every reader is kept.
+      DirectoryEntry &entry = it->second;
+      if (!(entry.flags & DIRECTORY_OWNER_SET)) {
+        entry.owner = record.entry.owner;
+        entry.flags |= record.entry.flags & DIRECTORY_OWNER_SET;
+      }
+      entry.copyset |= record.entry.copyset;
+    }
+    return PAGE_TRANSFER_OK;
+  }
+
+  DirectoryEntry entry;
+  if (length != 0 || capacity < sizeof(entry))
+    return PAGE_TRANSFER_EINVAL;
+  uint16_t status = apply(request, &entry);
+  if (status == PAGE_TRANSFER_OK && request.kind == DIRECTORY_LOOKUP) {
+    memcpy(message, &entry, sizeof(entry));
+    *reply_length = sizeof(entry);
+  }
+  return status;
+}
+
+
+gallocy::json gallocy::memory::PageDirectory::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "members", members.size() },
+    { "entries", entries.size() },
+    { "local_lookups", local_lookups },
+    { "remote_lookups", remote_lookups },
+    { "remote_updates", remote_updates },
+    { "migrated", migrated },
+    { "rebuilds", rebuilds },
+  };
+  return metrics;
+}
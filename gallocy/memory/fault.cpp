@@ -0,0 +1,91 @@
+#include "gallocy/memory/fault.h"
+
+#include <signal.h>
+#include <ucontext.h>
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+#include "gallocy/utils/logging.h"
+
+
+struct FaultRegion {
+  std::atomic<uint64_t> base;
+  uint64_t length;
+  gallocy::memory::FaultHandler handler;
+  void *arg;
+};
+
+static FaultRegion regions[FAULT_MAX_REGIONS];
+static std::mutex regions_lock;
+static bool installed = false;
+static struct sigaction previous_action;
+
+
+/**
+ * Dispatch a SIGSEGV to the handler of the region it hit.
+ */
+static void handle_sigsegv(int signum, siginfo_t *info, void *context) {
+  uint64_t address = reinterpret_cast<uint64_t>(info->si_addr);
+  bool write = false;
+#if defined(__x86_64__) && defined(REG_ERR)
+  // BIT 1 of the page fault error code is set for writes.
+  write = reinterpret_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_ERR] & 0x2;
+#endif
+
+  for (int i = 0; i < FAULT_MAX_REGIONS; i++) {
+    uint64_t base = regions[i].base.load(std::memory_order_acquire);
+    if (base == 0 || address < base || address >= base + regions[i].length)
+      continue;
+    if (regions[i].handler(regions[i].arg, info->si_addr, write))
+      return;
+    break;
+  }
+
+  // PASS the fault on, and if nothing else handles it, die of it.
+  if (previous_action.sa_flags & SA_SIGINFO) {
+    previous_action.sa_sigaction(signum, info, context);
+  } else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN) {
+    previous_action.sa_handler(signum);
+  } else {
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+
+
+bool gallocy::memory::register_fault_region(void *base, uint64_t length, FaultHandler handler, void *arg) {
+  std::lock_guard<std::mutex> lock(regions_lock);
+  if (!installed) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_sigsegv;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) == -1) {
+      perror("sigaction");
+      return false;
+    }
+    installed = true;
+  }
+  for (int i = 0; i < FAULT_MAX_REGIONS; i++) {
+    if (regions[i].base.load() != 0)
+      continue;
+    regions[i].length = length;
+    regions[i].handler = handler;
+    regions[i].arg = arg;
+    regions[i].base.store(reinterpret_cast<uint64_t>(base), std::memory_order_release);
+    return true;
+  }
+  LOG_ERROR("No room to handle faults in another region");
+  return false;
+}
+
+
+void gallocy::memory::unregister_fault_region(void *base) {
+  std::lock_guard<std::mutex> lock(regions_lock);
+  for (int i = 0; i < FAULT_MAX_REGIONS; i++) {
+    if (regions[i].base.load() == reinterpret_cast<uint64_t>(base))
+      regions[i].base.store(0, std::memory_order_release);
+  }
+}
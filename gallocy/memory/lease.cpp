@@ -0,0 +1,310 @@
+#include "gallocy/memory/lease.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+#include "gallocy/utils/stringutils.h"
+
+
+gallocy::memory::ChunkLeases::ChunkLeases(uint64_t self, Proposer propose)
+  : lease_requests(0),
+    chunks_leased(0),
+    chunks_returned(0),
+    waits(0),
+    self(self),
+    propose(propose),
+    pending(0) {
+  for (uint64_t chunk = 0; chunk < LEASE_CHUNKS; chunk++)
+    owners[chunk] = LEASE_FREE;
+  memset(usage, CHUNK_UNUSED, sizeof(usage));
+
+  metrics_name = "leases " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::ChunkLeases::~ChunkLeases() {
+  utils::unregister_metrics(metrics_name);
+}
+
+
+bool gallocy::memory::ChunkLeases::apply(const gallocy::string &command) {
+  gallocy::vector<gallocy::string> parts;
+  utils::split(command, ' ', parts);
+  if (parts.size() < 3)
+    return false;
+  uint64_t node = strtoull(parts[1].c_str(), nullptr, 10);
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (parts[0] == LEASE_COMMAND && parts.size() == 4) {
+    uint64_t count = strtoull(parts[2].c_str(), nullptr, 10);
+    uint64_t granted = 0;
+    if (parts[3] == "1") {
+      // GRANT the lowest run of free chunks, or nothing.
+      uint64_t chunk = LEASE_BOOTSTRAP_CHUNKS;
+      uint64_t run = 0;
+      for (; chunk < LEASE_CHUNKS && run < count; chunk++)
+        run = owners[chunk] == LEASE_FREE ? run + 1 : 0;
+      if (count > 0 && run == count) {
+        for (uint64_t leased = chunk - count; leased < chunk; leased++)
+          owners[leased] = node;
+        granted = count;
+      }
+    } else {
+      // GRANT the lowest free chunks, as many as are left.
+      for (uint64_t chunk = LEASE_BOOTSTRAP_CHUNKS; chunk < LEASE_CHUNKS && granted < count; chunk++) {
+        if (owners[chunk] == LEASE_FREE) {
+          owners[chunk] = node;
+          granted++;
+        }
+      }
+    }
+    if (node == self) {
+      // FORGET the oldest pending lease of the size, unless it was given up
+      // on already.
+      for (auto lease = pending_leases.begin(); lease != pending_leases.end(); ++lease) {
+        if (lease->count == count) {
+          pending -= lease->count;
+          pending_leases.erase(lease);
+          break;
+        }
+      }
+      chunks_leased += granted;
+      granted_cv.notify_all();
+    }
+    return true;
+  }
+
+  if (parts[0] == RETURN_COMMAND) {
+    for (size_t i = 2; i < parts.size(); i++) {
+      uint64_t chunk = strtoull(parts[i].c_str(), nullptr, 10);
+      if (chunk >= LEASE_CHUNKS || owners[chunk] != node)
+        continue;
+      owners[chunk] = LEASE_FREE;
+      if (node == self) {
+        usage[chunk] = CHUNK_UNUSED;
+        chunks_returned++;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+
+uint64_t gallocy::memory::ChunkLeases::find_unused(size_t count) {
+  uint64_t run = 0;
+  for (uint64_t chunk = LEASE_BOOTSTRAP_CHUNKS; chunk < LEASE_CHUNKS; chunk++) {
+    run = owners[chunk] == self && usage[chunk] == CHUNK_UNUSED ? run + 1 : 0;
+    if (run == count)
+      return chunk + 1 - count;
+  }
+  return LEASE_CHUNKS;
+}
+
+
+bool gallocy::memory::ChunkLeases::has_free(size_t count) {
+  uint64_t run = 0;
+  for (uint64_t chunk = LEASE_BOOTSTRAP_CHUNKS; chunk < LEASE_CHUNKS; chunk++) {
+    run = owners[chunk] == LEASE_FREE ? run + 1 : 0;
+    if (run == count)
+      return true;
+  }
+  return false;
+}
+
+
+size_t gallocy::memory::ChunkLeases::count_unused() {
+  size_t unused = 0;
+  for (uint64_t chunk = LEASE_BOOTSTRAP_CHUNKS; chunk < LEASE_CHUNKS; chunk++) {
+    if (owners[chunk] == self && usage[chunk] == CHUNK_UNUSED)
+      unused++;
+  }
+  return unused;
+}
+
+
+void gallocy::memory::ChunkLeases::expire_pending() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto lease = pending_leases.begin(); lease != pending_leases.end();) {
+    if (lease->deadline > now) {
+      ++lease;
+      continue;
+    }
+    LOG_WARNING("Lease of " << lease->count << " chunks did not commit in time, proposing it again");
+    pending -= lease->count;
+    lease = pending_leases.erase(lease);
+  }
+}
+
+
+void gallocy::memory::ChunkLeases::request(size_t count, bool contiguous, std::unique_lock<std::mutex> &lock) {
+  expire_pending();
+  if (pending >= count)
+    return;
+  PendingLease lease = { count, std::chrono::steady_clock::now() + std::chrono::milliseconds(LEASE_PENDING_MS) };
+  pending_leases.push_back(lease);
+  pending += count;
+  lease_requests++;
+  gallocy::string command = LEASE_COMMAND " " + gallocy::string(std::to_string(self).c_str()) + " "
+    + gallocy::string(std::to_string(count).c_str()) + (contiguous ? " 1" : " 0");
+  // PROPOSE without the lock, since the command may be applied before the
+  // proposal returns.
+  lock.unlock();
+  bool ok = propose(command);
+  lock.lock();
+  if (!ok) {
+    LOG_WARNING("Failed to propose a lease of " << count << " chunks");
+    for (auto pending_lease = pending_leases.begin(); pending_lease != pending_leases.end(); ++pending_lease) {
+      if (pending_lease->count == count && pending_lease->deadline == lease.deadline) {
+        pending -= count;
+        pending_leases.erase(pending_lease);
+        break;
+      }
+    }
+  }
+}
+
+
+bool gallocy::memory::ChunkLeases::allocate(size_t size, uint64_t *offset, size_t *length) {
+  size_t count = std::max<size_t>(1, (size + LEASE_CHUNK_SZ - 1) / LEASE_CHUNK_SZ);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(LEASE_TIMEOUT_MS);
+  bool waited = false;
+  std::unique_lock<std::mutex> lock(access_lock);
+  while (true) {
+    uint64_t first = find_unused(count);
+    if (first != LEASE_CHUNKS) {
+      for (uint64_t chunk = first; chunk < first + count; chunk++)
+        usage[chunk] = CHUNK_USED;
+      *offset = first * LEASE_CHUNK_SZ;
+      *length = count * LEASE_CHUNK_SZ;
+      // WAKE the worker to top the supply back up.
+      demand_cv.notify_one();
+      return true;
+    }
+    if (pending == 0 && !has_free(count)) {
+      LOG_ERROR("No run of " << count << " free chunks is left to lease");
+      return false;
+    }
+    if (!waited) {
+      waits++;
+      waited = true;
+    }
+    request(count > 1 ? count : LEASE_BATCH, count > 1, lock);
+    if (find_unused(count) == LEASE_CHUNKS) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        LOG_ERROR("Timed out waiting for a lease of " << count << " chunks");
+        return false;
+      }
+      // WAKE up now and then to propose again a lease that did not commit.
+      granted_cv.wait_until(lock, std::min(deadline, now + std::chrono::milliseconds(LEASE_POLL_MS)));
+    }
+  }
+}
+
+
+size_t gallocy::memory::ChunkLeases::return_unused(size_t keep) {
+  gallocy::vector<uint64_t> chunks;
+  gallocy::string command = RETURN_COMMAND " " + gallocy::string(std::to_string(self).c_str());
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    size_t unused = count_unused();
+    // RETURN the highest chunks, so that leases stay packed at the start.
+    for (uint64_t chunk = LEASE_CHUNKS; chunk-- > LEASE_BOOTSTRAP_CHUNKS && unused > keep;) {
+      if (owners[chunk] != self || usage[chunk] != CHUNK_UNUSED)
+        continue;
+      usage[chunk] = CHUNK_RETURNING;
+      chunks.push_back(chunk);
+      command += " " + gallocy::string(std::to_string(chunk).c_str());
+      unused--;
+    }
+  }
+  if (chunks.empty())
+    return 0;
+
+  if (!propose(command)) {
+    LOG_WARNING("Failed to propose returning " << chunks.size() << " chunks");
+    std::lock_guard<std::mutex> lock(access_lock);
+    for (auto chunk : chunks) {
+      if (owners[chunk] == self && usage[chunk] == CHUNK_RETURNING)
+        usage[chunk] = CHUNK_UNUSED;
+    }
+    return 0;
+  }
+  return chunks.size();
+}
+
+
+uint64_t gallocy::memory::ChunkLeases::get_owner(uint64_t chunk) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return chunk < LEASE_CHUNKS ? owners[chunk] : LEASE_FREE;
+}
+
+
+size_t gallocy::memory::ChunkLeases::get_leased() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  size_t leased = 0;
+  for (uint64_t chunk = 0; chunk < LEASE_CHUNKS; chunk++) {
+    if (owners[chunk] == self)
+      leased++;
+  }
+  return leased;
+}
+
+
+size_t gallocy::memory::ChunkLeases::get_unused() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return count_unused();
+}
+
+
+bool gallocy::memory::ChunkLeases::chunk_source(void *arg, size_t size, uint64_t *offset, size_t *length) {
+  return reinterpret_cast<ChunkLeases *>(arg)->allocate(size, offset, length);
+}
+
+
+void *gallocy::memory::ChunkLeases::work() {
+  while (alive) {
+    bool surplus = false;
+    {
+      std::unique_lock<std::mutex> lock(access_lock);
+      demand_cv.wait_for(lock, std::chrono::milliseconds(LEASE_POLL_MS));
+      size_t unused = count_unused();
+      expire_pending();
+      // LEASE ahead of demand, so allocations do not wait on the log.
+      if (unused + pending < LEASE_LOW_WATER && has_free(1))
+        request(LEASE_BATCH, false, lock);
+      surplus = unused > LEASE_HIGH_WATER;
+    }
+    if (surplus)
+      return_unused(LEASE_HIGH_WATER);
+  }
+  return nullptr;
+}
+
+
+gallocy::json gallocy::memory::ChunkLeases::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  size_t leased = 0;
+  for (uint64_t chunk = 0; chunk < LEASE_CHUNKS; chunk++) {
+    if (owners[chunk] == self)
+      leased++;
+  }
+  gallocy::json metrics = {
+    { "leased", leased },
+    { "unused", count_unused() },
+    { "pending", pending },
+    { "lease_requests", lease_requests },
+    { "chunks_leased", chunks_leased },
+    { "chunks_returned", chunks_returned },
+    { "waits", waits },
+  };
+  return metrics;
+}
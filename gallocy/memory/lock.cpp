@@ -0,0 +1,376 @@
+#include "gallocy/memory/lock.h"
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gallocy/threads.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+
+
+static uint64_t lock_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static void lock_acquire_hook(void *arg, void *object, int kind) {
+  reinterpret_cast<gallocy::memory::DistributedLockManager *>(arg)->lock(kind == SYNC_MUTEX ? object : nullptr);
+}
+
+
+static void lock_release_hook(void *arg, void *object, int kind) {
+  reinterpret_cast<gallocy::memory::DistributedLockManager *>(arg)->unlock(kind == SYNC_MUTEX ? object : nullptr);
+}
+
+
+static bool lock_try_hook(void *arg, void *object, int kind) {
+  return reinterpret_cast<gallocy::memory::DistributedLockManager *>(arg)->try_lock(
+    kind == SYNC_MUTEX ? object : nullptr);
+}
+
+
+static void *lock_translate_hook(void *arg, void *object, int kind) {
+  return reinterpret_cast<gallocy::memory::DistributedLockManager *>(arg)->translate(object, kind);
+}
+
+
+gallocy::memory::DistributedLockManager::DistributedLockManager(uint32_t self,
+                                                                const gallocy::vector<gallocy::common::Peer> &nodes,
+                                                                LazyReleaseCoherence &coherence)
+  : local_acquires(0),
+    remote_acquires(0),
+    transfers_out(0),
+    forwards(0),
+    self(self),
+    node_count(nodes.size()),
+    coherence(coherence),
+    intercepting(false) {
+  if (node_count > COHERENCE_MAX_NODES) {
+    LOG_ERROR("Locks support at most " << COHERENCE_MAX_NODES << " nodes, not " << node_count);
+    abort();
+  }
+
+  memset(clients, 0, sizeof(clients));
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    clients[node] = new (internal_malloc(sizeof(PageTransferClient))) PageTransferClient(nodes[node], nullptr, 0, 0);
+    clients[node]->set_node(self);
+  }
+  message = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_TRANSFER_MAX_MESSAGE));
+
+  metrics_name = "locks " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::DistributedLockManager::~DistributedLockManager() {
+  if (intercepting)
+    set_sync_hooks(nullptr, nullptr, nullptr);
+  utils::unregister_metrics(metrics_name);
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    clients[node]->~PageTransferClient();
+    internal_free(clients[node]);
+  }
+  internal_free(message);
+}
+
+
+gallocy::memory::DistributedLock &gallocy::memory::DistributedLockManager::get_lock(uint64_t id) {
+  auto it = locks.find(id);
+  if (it != locks.end())
+    return it->second;
+  DistributedLock &state = locks[id];
+  pthread_mutex_t initializer = PTHREAD_MUTEX_INITIALIZER;
+  state.shadow = initializer;
+  // THE manager holds every lock's token until someone asks for it.
+  state.token = get_manager(id) == self;
+  state.held = false;
+  state.requested = false;
+  state.asked = false;
+  state.next = LOCK_NO_NODE;
+  state.more_from = LOCK_NO_NODE;
+  state.window_start = 0;
+  state.window_transfers = 0;
+  return state;
+}
+
+
+void gallocy::memory::DistributedLockManager::send(uint32_t node, uint8_t kind, uint32_t requester, uint64_t id,
+                                                   const uint32_t *clock) {
+  LockOutgoing outgoing;
+  outgoing.node = node;
+  memset(&outgoing.header, 0, sizeof(outgoing.header));
+  outgoing.header.kind = kind;
+  outgoing.header.requester = requester;
+  outgoing.header.id = id;
+  memcpy(outgoing.clock, clock, node_count * sizeof(uint32_t));
+  outgoing.more_from = LOCK_NO_NODE;
+  outbox.push_back(outgoing);
+  outbox_cv.notify_one();
+}
+
+
+void gallocy::memory::DistributedLockManager::handle_request(uint64_t id, uint32_t requester, const uint32_t *clock) {
+  // QUEUE the requester behind the last node to ask.
+  uint32_t tail = self;
+  auto it = tails.find(id);
+  if (it != tails.end())
+    tail = it->second;
+  tails[id] = requester;
+  if (tail == self) {
+    handle_forward(id, requester, clock);
+  } else {
+    forwards++;
+    send(tail, LOCK_FORWARD, requester, id, clock);
+  }
+}
+
+
+void gallocy::memory::DistributedLockManager::handle_forward(uint64_t id, uint32_t requester, const uint32_t *clock) {
+  DistributedLock &state = get_lock(id);
+  state.next = requester;
+  memcpy(state.next_clock, clock, node_count * sizeof(uint32_t));
+  // A token that was just granted belongs to the thread waiting for it.
+  if (state.token && !state.held && !state.requested)
+    hand_off(id, state);
+}
+
+
+void gallocy::memory::DistributedLockManager::hand_off(uint64_t id, DistributedLock &state) {
+  send(state.next, LOCK_GRANT, state.next, id, state.next_clock);
+  outbox.back().more_from = state.more_from;
+  state.more_from = LOCK_NO_NODE;
+  state.token = false;
+  state.next = LOCK_NO_NODE;
+  transfers_out++;
+
+  uint64_t now = lock_now_ns();
+  if (state.window_start == 0)
+    state.window_start = now;
+  state.window_transfers++;
+  if (now - state.window_start >= LOCK_RATE_WINDOW_NS) {
+    transfer_rate.record(state.window_transfers * LOCK_RATE_WINDOW_NS / (now - state.window_start));
+    state.window_start = now;
+    state.window_transfers = 0;
+  }
+}
+
+
+void gallocy::memory::DistributedLockManager::ask(uint64_t id, DistributedLock &state) {
+  // ASK the manager for the token, with the notices this node has seen.
+  uint32_t clock[COHERENCE_MAX_NODES];
+  coherence.get_clock(clock);
+  state.asked = true;
+  uint32_t manager = get_manager(id);
+  if (manager == self)
+    handle_request(id, self, clock);
+  else
+    send(manager, LOCK_REQUEST, self, id, clock);
+}
+
+
+void gallocy::memory::DistributedLockManager::lock(void *mutex) {
+  if (mutex == nullptr || !coherence.contains(mutex)) {
+    coherence.acquire();
+    return;
+  }
+
+  uint64_t start = lock_now_ns();
+  uint64_t id = coherence.get_offset(mutex);
+  uint32_t more_from = LOCK_NO_NODE;
+  {
+    std::unique_lock<std::mutex> lock(access_lock);
+    DistributedLock &state = get_lock(id);
+    if (state.token) {
+      local_acquires++;
+    } else {
+      // WAIT for the token, asking for it unless a failed trylock already did.
+      if (!state.asked)
+        ask(id, state);
+      state.requested = true;
+      token_cv.wait(lock, [&]() { return state.token; });
+      state.requested = false;
+      remote_acquires++;
+    }
+    state.held = true;
+    more_from = state.more_from;
+    state.more_from = LOCK_NO_NODE;
+  }
+
+  if (more_from != LOCK_NO_NODE)
+    coherence.acquire_from(more_from);
+  coherence.acquire();
+  acquire_latency.record(lock_now_ns() - start);
+}
+
+
+bool gallocy::memory::DistributedLockManager::try_lock(void *mutex) {
+  if (mutex == nullptr || !coherence.contains(mutex)) {
+    coherence.acquire();
+    return true;
+  }
+
+  uint64_t start = lock_now_ns();
+  uint64_t id = coherence.get_offset(mutex);
+  uint32_t more_from = LOCK_NO_NODE;
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    DistributedLock &state = get_lock(id);
+    if (!state.token) {
+      if (!state.asked)
+        ask(id, state);
+      return false;
+    }
+    local_acquires++;
+    state.held = true;
+    more_from = state.more_from;
+    state.more_from = LOCK_NO_NODE;
+  }
+
+  if (more_from != LOCK_NO_NODE)
+    coherence.acquire_from(more_from);
+  coherence.acquire();
+  acquire_latency.record(lock_now_ns() - start);
+  return true;
+}
+
+
+void gallocy::memory::DistributedLockManager::unlock(void *mutex) {
+  coherence.release();
+  if (mutex == nullptr || !coherence.contains(mutex))
+    return;
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  DistributedLock &state = get_lock(coherence.get_offset(mutex));
+  state.held = false;
+  if (state.token && state.next != LOCK_NO_NODE)
+    hand_off(coherence.get_offset(mutex), state);
+}
+
+
+void *gallocy::memory::DistributedLockManager::translate(void *object, int kind) {
+  if (!coherence.contains(object))
+    return object;
+  uint64_t id = coherence.get_offset(object);
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (kind == SYNC_COND) {
+    auto it = conds.find(id);
+    if (it == conds.end()) {
+      pthread_cond_t initializer = PTHREAD_COND_INITIALIZER;
+      it = conds.insert(std::make_pair(id, initializer)).first;
+    }
+    return &it->second;
+  }
+  return &get_lock(id).shadow;
+}
+
+
+void gallocy::memory::DistributedLockManager::intercept_synchronization() {
+  set_sync_hooks(lock_acquire_hook, lock_release_hook, this, lock_translate_hook, lock_try_hook);
+  intercepting = true;
+}
+
+
+bool gallocy::memory::DistributedLockManager::has_token(void *mutex) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return get_lock(coherence.get_offset(mutex)).token;
+}
+
+
+void *gallocy::memory::DistributedLockManager::work() {
+  gallocy::vector<LockOutgoing> batch;
+  uint8_t reply[sizeof(LockMessage)];
+  while (alive) {
+    {
+      std::unique_lock<std::mutex> lock(access_lock);
+      outbox_cv.wait_for(lock, std::chrono::milliseconds(LOCK_POLL_MS), [this]() { return !outbox.empty(); });
+      batch.swap(outbox);
+    }
+    for (auto &outgoing : batch) {
+      size_t length = sizeof(LockMessage);
+      memcpy(message, &outgoing.header, sizeof(LockMessage));
+      if (outgoing.header.kind == LOCK_GRANT) {
+        // PULL the notices that did not fit when the token was granted here,
+        // if no thread here took it since, so the next holder gets them.
+        if (outgoing.more_from != LOCK_NO_NODE)
+          coherence.acquire_from(outgoing.more_from);
+        // PIGGYBACK the notices the next holder has not seen on the token.
+        length += coherence.encode_notices(outgoing.node, outgoing.clock, message + length,
+                                           PAGE_TRANSFER_MAX_MESSAGE - length);
+      } else {
+        memcpy(message + length, outgoing.clock, node_count * sizeof(uint32_t));
+        length += node_count * sizeof(uint32_t);
+      }
+      size_t reply_length = 0;
+      if (clients[outgoing.node]->exchange(PAGE_TRANSFER_LOCK, message, length, reply, &reply_length,
+                                           sizeof(reply)) != PAGE_TRANSFER_OK)
+        LOG_ERROR("Failed to send lock message " << static_cast<int>(outgoing.header.kind)
+                  << " for lock " << outgoing.header.id << " to node " << outgoing.node);
+    }
+    batch.clear();
+  }
+  return nullptr;
+}
+
+
+uint16_t gallocy::memory::DistributedLockManager::exchange(uint16_t op, uint32_t node, uint8_t *message, size_t length,
+                                                           size_t *reply_length, size_t capacity) {
+  LockMessage header;
+  *reply_length = 0;
+  if (op != PAGE_TRANSFER_LOCK || node >= node_count || node == self || length < sizeof(header))
+    return PAGE_TRANSFER_EINVAL;
+  memcpy(&header, message, sizeof(header));
+  uint8_t *payload = message + sizeof(header);
+  length -= sizeof(header);
+
+  if (header.kind == LOCK_GRANT) {
+    bool more = false;
+    if (!coherence.receive_notices(payload, length, &more))
+      return PAGE_TRANSFER_EINVAL;
+    std::lock_guard<std::mutex> lock(access_lock);
+    DistributedLock &state = get_lock(header.id);
+    state.token = true;
+    state.asked = false;
+    state.more_from = more ? node : LOCK_NO_NODE;
+    token_cv.notify_all();
+    // HAND on a token that a trylock asked for, and no thread waits for, if
+    // another node asked for it meanwhile.
+    if (!state.requested && !state.held && state.next != LOCK_NO_NODE)
+      hand_off(header.id, state);
+    return PAGE_TRANSFER_OK;
+  }
+
+  uint32_t clock[COHERENCE_MAX_NODES];
+  if (header.requester >= node_count || length != node_count * sizeof(uint32_t))
+    return PAGE_TRANSFER_EINVAL;
+  memcpy(clock, payload, length);
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (header.kind == LOCK_REQUEST && get_manager(header.id) == self)
+    handle_request(header.id, header.requester, clock);
+  else if (header.kind == LOCK_FORWARD)
+    handle_forward(header.id, header.requester, clock);
+  else
+    return PAGE_TRANSFER_EINVAL;
+  return PAGE_TRANSFER_OK;
+}
+
+
+gallocy::json gallocy::memory::DistributedLockManager::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "local_acquires", local_acquires },
+    { "remote_acquires", remote_acquires },
+    { "transfers_out", transfers_out },
+    { "forwards", forwards },
+    { "acquire_latency_ns", acquire_latency.to_json() },
+    { "transfer_rate_per_s", transfer_rate.to_json() },
+  };
+  return metrics;
+}
@@ -0,0 +1,350 @@
+#include "gallocy/memory/mesh.h"
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gallocy/memory/fault.h"
+#include "gallocy/utils/metrics.h"
+
+
+static bool mesh_fault(void *arg, void *address, bool write) {
+  return reinterpret_cast<gallocy::memory::MeshHeap *>(arg)->fault(address, write);
+}
+
+
+gallocy::memory::MeshHeap::MeshHeap(uint64_t pages, double threshold)
+  : meshed(0),
+    passes(0),
+    pages(pages),
+    threshold(threshold),
+    free_virtual_count(0),
+    free_physical_count(0),
+    fresh(0),
+    live_bytes(0),
+    resident_pages(0) {
+  if (pages >= MESH_NO_PAGE) {
+    LOG_ERROR("A mesh heap holds fewer than " << MESH_NO_PAGE << " pages, not " << pages);
+    abort();
+  }
+  if ((fd = memfd_create("gallocy-mesh", MFD_CLOEXEC)) == -1) {
+    perror("mesh memfd_create");
+    abort();
+  }
+  if (ftruncate(fd, pages * PAGE_SZ) == -1) {
+    perror("mesh ftruncate");
+    abort();
+  }
+  void *mem = mmap(nullptr, pages * PAGE_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    perror("mesh mmap");
+    abort();
+  }
+  base = reinterpret_cast<uint8_t *>(mem);
+
+  spans = reinterpret_cast<MeshSpan *>(internal_malloc(pages * sizeof(MeshSpan)));
+  memset(spans, 0, pages * sizeof(MeshSpan));
+  physical = reinterpret_cast<uint32_t *>(internal_malloc(pages * sizeof(uint32_t)));
+  aliases = reinterpret_cast<uint32_t *>(internal_malloc(pages * sizeof(uint32_t)));
+  free_virtual = reinterpret_cast<uint32_t *>(internal_malloc(pages * sizeof(uint32_t)));
+  free_physical = reinterpret_cast<uint32_t *>(internal_malloc(pages * sizeof(uint32_t)));
+  for (uint64_t page = 0; page < pages; page++) {
+    physical[page] = page;
+    aliases[page] = MESH_NO_PAGE;
+  }
+  for (int size_class = 0; size_class < MESH_SIZE_CLASSES; size_class++)
+    partial[size_class] = MESH_NO_PAGE;
+
+  register_fault_region(base, pages * PAGE_SZ, mesh_fault, this);
+  metrics_name = "mesh " + gallocy::string(std::to_string(fd).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::MeshHeap::~MeshHeap() {
+  utils::unregister_metrics(metrics_name);
+  unregister_fault_region(base);
+  munmap(base, pages * PAGE_SZ);
+  close(fd);
+  internal_free(spans);
+  internal_free(physical);
+  internal_free(aliases);
+  internal_free(free_virtual);
+  internal_free(free_physical);
+}
+
+
+void gallocy::memory::MeshHeap::map(uint32_t virtual_page, uint32_t physical_page) {
+  // REPLACE the old mapping in one step, so the page is never unmapped.
+  if (mmap(base + static_cast<uint64_t>(virtual_page) * PAGE_SZ, PAGE_SZ, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, static_cast<uint64_t>(physical_page) * PAGE_SZ) == MAP_FAILED) {
+    perror("mesh mmap");
+    abort();
+  }
+  physical[virtual_page] = physical_page;
+}
+
+
+void gallocy::memory::MeshHeap::push_partial(uint32_t page) {
+  MeshSpan &span = spans[page];
+  span.partial = 1;
+  span.prev = MESH_NO_PAGE;
+  span.next = partial[span.size_class];
+  if (span.next != MESH_NO_PAGE)
+    spans[span.next].prev = page;
+  partial[span.size_class] = page;
+}
+
+
+void gallocy::memory::MeshHeap::remove_partial(uint32_t page) {
+  MeshSpan &span = spans[page];
+  if (!span.partial)
+    return;
+  if (span.prev != MESH_NO_PAGE)
+    spans[span.prev].next = span.next;
+  else
+    partial[span.size_class] = span.next;
+  if (span.next != MESH_NO_PAGE)
+    spans[span.next].prev = span.prev;
+  span.partial = 0;
+}
+
+
+uint32_t gallocy::memory::MeshHeap::new_span(uint8_t size_class) {
+  uint32_t virtual_page, physical_page;
+  if (free_virtual_count > 0) {
+    // THERE are never fewer free physical pages than virtual ones, since
+    // meshing only ever frees physical pages.
+    virtual_page = free_virtual[--free_virtual_count];
+    physical_page = free_physical[--free_physical_count];
+    if (physical[virtual_page] != physical_page)
+      map(virtual_page, physical_page);
+  } else if (fresh < pages) {
+    virtual_page = physical_page = fresh++;
+  } else {
+    return MESH_NO_PAGE;
+  }
+  MeshSpan &span = spans[physical_page];
+  memset(&span, 0, sizeof(span));
+  span.in_use = 1;
+  span.size_class = size_class;
+  span.first_virtual = virtual_page;
+  aliases[virtual_page] = MESH_NO_PAGE;
+  push_partial(physical_page);
+  resident_pages++;
+  return physical_page;
+}
+
+
+void gallocy::memory::MeshHeap::release_span(uint32_t page) {
+  MeshSpan &span = spans[page];
+  remove_partial(page);
+  for (uint32_t v = span.first_virtual; v != MESH_NO_PAGE; v = aliases[v])
+    free_virtual[free_virtual_count++] = v;
+  // RETURN the page's memory to the kernel, which reads back as zeros.
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<uint64_t>(page) * PAGE_SZ, PAGE_SZ)
+      == -1)
+    perror("mesh fallocate");
+  free_physical[free_physical_count++] = page;
+  span.in_use = 0;
+  resident_pages--;
+}
+
+
+void *gallocy::memory::MeshHeap::malloc(size_t sz) {
+  if (sz > MESH_MAX_OBJECT)
+    return nullptr;
+  uint8_t size_class = 0;
+  while (object_size(size_class) < sz)
+    size_class++;
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  uint32_t page = partial[size_class];
+  if (page == MESH_NO_PAGE && (page = new_span(size_class)) == MESH_NO_PAGE)
+    return nullptr;
+  MeshSpan &span = spans[page];
+  uint64_t size = object_size(size_class);
+  uint64_t slots = PAGE_SZ / size;
+  uint64_t slot = 0;
+  for (uint64_t word = 0; word < MESH_SLOTS / 64; word++) {
+    if (~span.bitmap[word]) {
+      slot = word * 64 + __builtin_ctzll(~span.bitmap[word]);
+      break;
+    }
+  }
+  span.bitmap[slot / 64] |= 1ULL << (slot % 64);
+  span.live++;
+  live_bytes += size;
+  if (span.live == slots)
+    remove_partial(page);
+  return base + static_cast<uint64_t>(span.first_virtual) * PAGE_SZ + slot * size;
+}
+
+
+void gallocy::memory::MeshHeap::free(void *ptr) {
+  if (!ptr || !contains(ptr))
+    return;
+  uint64_t offset = reinterpret_cast<uint8_t *>(ptr) - base;
+  std::lock_guard<std::mutex> lock(access_lock);
+  uint32_t page = physical[offset / PAGE_SZ];
+  MeshSpan &span = spans[page];
+  uint64_t size = object_size(span.size_class);
+  uint64_t slot = offset % PAGE_SZ / size;
+  if (!span.in_use || !(span.bitmap[slot / 64] & (1ULL << (slot % 64)))) {
+    LOG_WARNING("Ignoring a free of " << ptr << ", which is not allocated");
+    return;
+  }
+  bool full = span.live == PAGE_SZ / size;
+  span.bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+  span.live--;
+  live_bytes -= size;
+  if (span.live == 0)
+    release_span(page);
+  else if (full)
+    push_partial(page);
+}
+
+
+size_t gallocy::memory::MeshHeap::getSize(void *ptr) {
+  uint64_t offset = reinterpret_cast<uint8_t *>(ptr) - base;
+  std::lock_guard<std::mutex> lock(access_lock);
+  return object_size(spans[physical[offset / PAGE_SZ]].size_class);
+}
+
+
+void gallocy::memory::MeshHeap::merge(uint32_t into, uint32_t from) {
+  MeshSpan &target = spans[into];
+  MeshSpan &source = spans[from];
+  uint64_t size = object_size(source.size_class);
+  uint8_t *to = base + static_cast<uint64_t>(target.first_virtual) * PAGE_SZ;
+  uint8_t *in = base + static_cast<uint64_t>(source.first_virtual) * PAGE_SZ;
+
+  // PROTECT the source while its objects are copied, so no write is lost.
+  // Writers wait in the fault handler, for ``access_lock``, until the source
+  // is remapped.
+  for (uint32_t v = source.first_virtual; v != MESH_NO_PAGE; v = aliases[v]) {
+    if (mprotect(base + static_cast<uint64_t>(v) * PAGE_SZ, PAGE_SZ, PROT_READ) == -1)
+      perror("mesh mprotect");
+  }
+  for (uint64_t word = 0; word < MESH_SLOTS / 64; word++) {
+    uint64_t bits = source.bitmap[word];
+    while (bits) {
+      uint64_t slot = word * 64 + __builtin_ctzll(bits);
+      memcpy(to + slot * size, in + slot * size, size);
+      bits &= bits - 1;
+    }
+    target.bitmap[word] |= source.bitmap[word];
+  }
+  target.live += source.live;
+
+  // MOVE the source's virtual pages onto the target's physical page.
+  uint32_t last = target.first_virtual;
+  while (aliases[last] != MESH_NO_PAGE)
+    last = aliases[last];
+  aliases[last] = source.first_virtual;
+  for (uint32_t v = source.first_virtual; v != MESH_NO_PAGE; v = aliases[v])
+    map(v, into);
+  source.first_virtual = MESH_NO_PAGE;
+  source.live = 0;
+  release_span(from);
+  if (target.live == PAGE_SZ / size)
+    remove_partial(into);
+  meshed++;
+}
+
+
+uint64_t gallocy::memory::MeshHeap::mesh() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  uint64_t released = 0;
+  for (int size_class = 0; size_class < MESH_SIZE_CLASSES; size_class++) {
+    uint64_t slots = PAGE_SZ / object_size(size_class);
+    // GATHER the spans at most half full, which are the ones worth meshing.
+    gallocy::vector<uint32_t> candidates;
+    for (uint32_t page = partial[size_class]; page != MESH_NO_PAGE; page = spans[page].next) {
+      if (2 * spans[page].live <= slots)
+        candidates.push_back(page);
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+      uint32_t into = candidates[i];
+      if (!spans[into].in_use)
+        continue;
+      uint64_t probes = 0;
+      for (size_t j = i + 1; j < candidates.size() && probes < MESH_MAX_PROBES; j++) {
+        uint32_t from = candidates[j];
+        if (!spans[from].in_use)
+          continue;
+        probes++;
+        bool disjoint = true;
+        for (uint64_t word = 0; word < MESH_SLOTS / 64 && disjoint; word++)
+          disjoint = !(spans[into].bitmap[word] & spans[from].bitmap[word]);
+        if (!disjoint)
+          continue;
+        merge(into, from);
+        released++;
+        if (2 * spans[into].live > slots)
+          break;
+      }
+    }
+  }
+  return released;
+}
+
+
+uint64_t gallocy::memory::MeshHeap::scavenge() {
+  if (get_fragmentation() <= threshold)
+    return 0;
+  uint64_t released = mesh();
+  std::lock_guard<std::mutex> lock(access_lock);
+  passes++;
+  return released;
+}
+
+
+void *gallocy::memory::MeshHeap::work() {
+  while (alive) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(MESH_POLL_MS));
+    scavenge();
+  }
+  return nullptr;
+}
+
+
+bool gallocy::memory::MeshHeap::fault(void *address, bool write) {
+  // EVERY page of the heap is writable except while a span is meshed, and
+  // the mesh holds ``access_lock`` until the span is writable again.
+  std::lock_guard<std::mutex> lock(access_lock);
+  return true;
+}
+
+
+uint64_t gallocy::memory::MeshHeap::get_resident_pages() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return resident_pages;
+}
+
+
+double gallocy::memory::MeshHeap::get_fragmentation() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (resident_pages == 0)
+    return 0;
+  return 1.0 - static_cast<double>(live_bytes) / (resident_pages * PAGE_SZ);
+}
+
+
+gallocy::json gallocy::memory::MeshHeap::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "resident_pages", resident_pages },
+    { "live_bytes", live_bytes },
+    { "meshed", meshed },
+    { "passes", passes },
+  };
+  return metrics;
+}
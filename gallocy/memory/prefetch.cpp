@@ -0,0 +1,211 @@
+#include "gallocy/memory/prefetch.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "gallocy/utils/metrics.h"
+
+
+gallocy::memory::PagePrefetcher::PagePrefetcher(PageTransferClient &client)
+  : PagePrefetcher(client.get_page_count(), "prefetch " + client.get_peer().get_string(),
+                   [&client](uint64_t *page_numbers, size_t count) {
+                     return client.fetch_missing(page_numbers, count);
+                   }) {
+  this->client = &client;
+}
+
+
+gallocy::memory::PagePrefetcher::PagePrefetcher(uint64_t pages, const gallocy::string &name, FetchFunction fetch)
+  : issued(0),
+    useful(0),
+    late(0),
+    dropped(0),
+    client(nullptr),
+    fetch(fetch),
+    metrics_name(name),
+    pages(pages),
+    degree(PREFETCH_DEFAULT_DEGREE),
+    epoch_issued(0),
+    epoch_useful(0),
+    queue_length(0) {
+  memset(streams, 0, sizeof(streams));
+  size_t words = (pages + 63) / 64;
+  prefetched = reinterpret_cast<uint64_t *>(internal_malloc(words * sizeof(uint64_t)));
+  in_flight = reinterpret_cast<uint64_t *>(internal_malloc(words * sizeof(uint64_t)));
+  memset(prefetched, 0, words * sizeof(uint64_t));
+  memset(in_flight, 0, words * sizeof(uint64_t));
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::PagePrefetcher::~PagePrefetcher() {
+  utils::unregister_metrics(metrics_name);
+  internal_free(prefetched);
+  internal_free(in_flight);
+}
+
+
+bool gallocy::memory::PagePrefetcher::fault(uint64_t page) {
+  if (page >= pages)
+    return false;
+  if (touch(page))
+    return true;
+  return client && client->fault(page);
+}
+
+
+bool gallocy::memory::PagePrefetcher::touch(uint64_t page) {
+  bool hit = false;
+  if (page >= pages)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    if (test_bit(prefetched, page)) {
+      set_bit(prefetched, page, false);
+      useful++;
+      epoch_useful++;
+      hit = true;
+    } else if (test_bit(in_flight, page)) {
+      // The prediction was right but the fault beat the worker to it.
+      set_bit(in_flight, page, false);
+      late++;
+    }
+
+    // FIND the calling thread's stream, taking it over if another thread had
+    // it.
+    uint64_t thread = static_cast<uint64_t>(pthread_self());
+    PrefetchStream *stream = &streams[((thread * 0x9E3779B97F4A7C15ULL) >> 32) % PREFETCH_STREAMS];
+    if (stream->thread != thread) {
+      stream->thread = thread;
+      stream->stride = 0;
+      stream->confidence = 0;
+    } else {
+      int64_t delta = static_cast<int64_t>(page - stream->last_page);
+      if (delta != 0 && delta == stream->stride) {
+        if (stream->confidence < PREFETCH_CONFIRM)
+          stream->confidence++;
+      } else if (delta != 0) {
+        stream->stride = delta;
+        stream->confidence = 1;
+      }
+    }
+    stream->last_page = page;
+
+    if (stream->confidence >= PREFETCH_CONFIRM)
+      predict(stream, page);
+  }
+
+  return hit;
+}
+
+
+void gallocy::memory::PagePrefetcher::invalidate(uint64_t page) {
+  if (page >= pages)
+    return;
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (test_bit(prefetched, page)) {
+    set_bit(prefetched, page, false);
+    dropped++;
+  }
+}
+
+
+void gallocy::memory::PagePrefetcher::predict(PrefetchStream *stream, uint64_t page) {
+  bool queued = false;
+  for (uint64_t k = 1; k <= degree && queue_length < PREFETCH_QUEUE_SZ; k++) {
+    int64_t next = static_cast<int64_t>(page) + stream->stride * static_cast<int64_t>(k);
+    if (next < 0 || static_cast<uint64_t>(next) >= pages)
+      break;
+    if (test_bit(prefetched, next) || test_bit(in_flight, next))
+      continue;
+    set_bit(in_flight, next, true);
+    queue[queue_length++] = next;
+    queued = true;
+  }
+  if (queued)
+    queue_cv.notify_one();
+}
+
+
+void gallocy::memory::PagePrefetcher::throttle() {
+  double accuracy = static_cast<double>(epoch_useful) / epoch_issued;
+  if (accuracy >= PREFETCH_HIGH_ACCURACY)
+    degree = std::min<uint64_t>(degree * 2, PREFETCH_MAX_DEGREE);
+  else if (accuracy < PREFETCH_LOW_ACCURACY)
+    degree = std::max<uint64_t>(degree / 2, PREFETCH_MIN_DEGREE);
+  epoch_issued = 0;
+  epoch_useful = 0;
+}
+
+
+void *gallocy::memory::PagePrefetcher::work() {
+  uint64_t batch[PREFETCH_QUEUE_SZ];
+  uint64_t fetched[PREFETCH_QUEUE_SZ];
+
+  while (alive) {
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(access_lock);
+      queue_cv.wait_for(lock, std::chrono::milliseconds(PREFETCH_POLL_MS),
+                        [this]() { return queue_length > 0; });
+      count = queue_length;
+      memcpy(batch, queue, count * sizeof(uint64_t));
+      queue_length = 0;
+    }
+    if (count == 0)
+      continue;
+
+    // FETCH outside the lock so faulting threads are not held up.
+    std::sort(batch, batch + count);
+    memcpy(fetched, batch, count * sizeof(uint64_t));
+    size_t fetched_count = fetch(fetched, count);
+
+    std::lock_guard<std::mutex> lock(access_lock);
+    for (size_t i = 0; i < fetched_count; i++) {
+      // A page whose fault beat the worker is already consumed.
+      if (!test_bit(in_flight, fetched[i]))
+        continue;
+      set_bit(prefetched, fetched[i], true);
+      issued++;
+      epoch_issued++;
+    }
+    for (size_t i = 0; i < count; i++)
+      set_bit(in_flight, batch[i], false);
+    if (epoch_issued >= PREFETCH_EPOCH)
+      throttle();
+  }
+
+  return nullptr;
+}
+
+
+double gallocy::memory::PagePrefetcher::get_accuracy() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (issued == 0)
+    return 0;
+  return static_cast<double>(useful) / issued;
+}
+
+
+uint64_t gallocy::memory::PagePrefetcher::get_degree() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return degree;
+}
+
+
+gallocy::json gallocy::memory::PagePrefetcher::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "issued", issued },
+    { "useful", useful },
+    { "late", late },
+    { "dropped", dropped },
+    { "accuracy", issued ? static_cast<double>(useful) / issued : 0.0 },
+    { "degree", degree },
+  };
+  return metrics;
+}
@@ -0,0 +1,285 @@
+#include "gallocy/memory/profiler.h"
+
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+#include "gallocy/utils/pagediff.h"
+
+
+gallocy::memory::FalseSharingProfiler::FalseSharingProfiler(uint32_t self, void *base, uint64_t pages)
+  : transfers(0),
+    samples(0),
+    dropped(0),
+    self(self),
+    base(reinterpret_cast<uint8_t *>(base)),
+    pages(pages) {
+  metrics_name = "profiler " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::FalseSharingProfiler::~FalseSharingProfiler() {
+  utils::unregister_metrics(metrics_name);
+  reset();
+}
+
+
+void gallocy::memory::FalseSharingProfiler::record_allocation(const void *ptr, size_t size, const void *site) {
+  const uint8_t *address = reinterpret_cast<const uint8_t *>(ptr);
+  if (address < base || address >= base + pages * PAGE_SZ)
+    return;
+  ProfiledAllocation allocation;
+  allocation.size = size;
+  allocation.site = reinterpret_cast<uint64_t>(site);
+  allocation.thread = syscall(SYS_gettid);
+  std::lock_guard<std::mutex> lock(access_lock);
+  allocations[address - base] = allocation;
+}
+
+
+void gallocy::memory::FalseSharingProfiler::record_free(const void *ptr) {
+  const uint8_t *address = reinterpret_cast<const uint8_t *>(ptr);
+  if (address < base || address >= base + pages * PAGE_SZ)
+    return;
+  std::lock_guard<std::mutex> lock(access_lock);
+  allocations.erase(address - base);
+}
+
+
+gallocy::memory::ProfiledPage *gallocy::memory::FalseSharingProfiler::get_page(uint64_t page) {
+  auto it = profiles.find(page);
+  if (it != profiles.end())
+    return &it->second;
+  if (page >= pages || profiles.size() >= PROFILER_MAX_PAGES) {
+    dropped++;
+    return nullptr;
+  }
+  ProfiledPage &profile = profiles[page];
+  profile.transfers = 0;
+  profile.twin = nullptr;
+  return &profile;
+}
+
+
+void gallocy::memory::FalseSharingProfiler::mark(ProfiledPage *profile, uint32_t node,
+                                                 const void *before, const void *after) {
+  utils::PageDiffRun runs[PAGE_SZ / 2];
+  size_t count = utils::page_diff_runs(after, before, runs, PAGE_SZ / 2);
+  if (count == 0)
+    return;
+  auto it = profile->writers.find(node);
+  if (it == profile->writers.end()) {
+    it = profile->writers.insert(std::make_pair(node, ProfiledWrites())).first;
+    memset(&it->second, 0, sizeof(ProfiledWrites));
+  }
+  for (size_t r = 0; r < count; r++) {
+    for (uint64_t byte = runs[r].offset; byte < runs[r].offset + runs[r].length; byte++)
+      it->second.bytes[byte / 64] |= 1ULL << (byte % 64);
+  }
+  it->second.samples++;
+  samples++;
+}
+
+
+void gallocy::memory::FalseSharingProfiler::retwin(ProfiledPage *profile, uint32_t node, const void *contents) {
+  profile->transfers++;
+  transfers++;
+  if (profile->twin == nullptr) {
+    // START diffing from the next transfer.
+    profile->twin = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_SZ));
+  } else {
+    mark(profile, node, profile->twin, contents);
+  }
+  memcpy(profile->twin, contents, PAGE_SZ);
+}
+
+
+void gallocy::memory::FalseSharingProfiler::record_writes(uint32_t node, uint64_t page,
+                                                          const void *before, const void *after) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  ProfiledPage *profile = get_page(page);
+  if (profile)
+    mark(profile, node, before, after);
+}
+
+
+void gallocy::memory::FalseSharingProfiler::acquired(uint64_t page, uint32_t node, const void *contents) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  ProfiledPage *profile = get_page(page);
+  // WHAT changed since this node handed the page off was written elsewhere,
+  // and is blamed on the node it came back from.
+  if (profile)
+    retwin(profile, node, contents);
+}
+
+
+void gallocy::memory::FalseSharingProfiler::handed_off(uint64_t page, uint32_t node, const void *contents) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  ProfiledPage *profile = get_page(page);
+  if (profile)
+    retwin(profile, self, contents);
+}
+
+
+void gallocy::memory::FalseSharingProfiler::reset() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  for (auto &it : profiles) {
+    if (it.second.twin)
+      internal_free(it.second.twin);
+  }
+  profiles.clear();
+}
+
+
+gallocy::json gallocy::memory::FalseSharingProfiler::attribute(uint64_t offset, uint64_t length) {
+  gallocy::json owners = gallocy::json::array();
+  // START at the allocation that holds the run's first byte, if any.
+  auto it = allocations.upper_bound(offset);
+  if (it != allocations.begin())
+    it--;
+  for (; it != allocations.end() && it->first < offset + length; it++) {
+    if (it->first + it->second.size <= offset)
+      continue;
+    if (owners.size() >= PROFILER_REPORT_ALLOCATIONS)
+      break;
+    gallocy::json owner = {
+      { "offset", it->first },
+      { "size", it->second.size },
+      { "site", it->second.site },
+      { "thread", it->second.thread },
+    };
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(it->second.site), &info) && info.dli_sname)
+      owner["symbol"] = info.dli_sname;
+    owners.push_back(owner);
+  }
+  return owners;
+}
+
+
+gallocy::json gallocy::memory::FalseSharingProfiler::report() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  struct Ranked {
+    uint64_t page;
+    bool false_shared;
+    uint64_t overlap;
+    ProfiledPage *profile;
+  };
+  gallocy::vector<Ranked> ranked;
+  uint64_t false_shared = 0;
+  for (auto &it : profiles) {
+    // COUNT the bytes more than one node wrote.
+    uint64_t seen[PAGE_SZ / 64] = { 0 };
+    uint64_t overlap = 0;
+    for (auto &writer : it.second.writers) {
+      for (uint64_t word = 0; word < PAGE_SZ / 64; word++) {
+        overlap += __builtin_popcountll(seen[word] & writer.second.bytes[word]);
+        seen[word] |= writer.second.bytes[word];
+      }
+    }
+    bool is_false = it.second.writers.size() > 1 && overlap == 0;
+    false_shared += is_false;
+    ranked.push_back({ it.first, is_false, overlap, &it.second });
+  }
+  std::sort(ranked.begin(), ranked.end(), [](const Ranked &a, const Ranked &b) {
+    if (a.false_shared != b.false_shared)
+      return a.false_shared;
+    return a.profile->transfers > b.profile->transfers;
+  });
+
+  gallocy::json reported = gallocy::json::array();
+  for (size_t i = 0; i < ranked.size() && i < PROFILER_REPORT_PAGES; i++) {
+    ProfiledPage *profile = ranked[i].profile;
+    gallocy::json writers = gallocy::json::array();
+    for (auto &writer : profile->writers) {
+      gallocy::json runs = gallocy::json::array();
+      uint64_t bytes = 0;
+      for (uint64_t byte = 0; byte < PAGE_SZ;) {
+        if (!(writer.second.bytes[byte / 64] & (1ULL << (byte % 64)))) {
+          byte++;
+          continue;
+        }
+        uint64_t start = byte;
+        while (byte < PAGE_SZ && (writer.second.bytes[byte / 64] & (1ULL << (byte % 64))))
+          byte++;
+        bytes += byte - start;
+        if (runs.size() >= PROFILER_REPORT_RUNS)
+          continue;
+        uint64_t offset = ranked[i].page * PAGE_SZ + start;
+        gallocy::json run = {
+          { "offset", offset },
+          { "length", byte - start },
+          { "allocations", attribute(offset, byte - start) },
+        };
+        runs.push_back(run);
+      }
+      gallocy::json entry = {
+        { "node", writer.first },
+        { "samples", writer.second.samples },
+        { "bytes", bytes },
+        { "runs", runs },
+      };
+      writers.push_back(entry);
+    }
+    const char *sharing = PROFILER_SHARING_NONE;
+    if (ranked[i].false_shared)
+      sharing = PROFILER_SHARING_FALSE;
+    else if (ranked[i].overlap)
+      sharing = PROFILER_SHARING_TRUE;
+    gallocy::json page = {
+      { "page", ranked[i].page },
+      { "transfers", profile->transfers },
+      { "sharing", sharing },
+      { "overlap_bytes", ranked[i].overlap },
+      { "writers", writers },
+    };
+    reported.push_back(page);
+  }
+
+  gallocy::json report = {
+    { "node", self },
+    { "profiled_pages", profiles.size() },
+    { "falsely_shared_pages", false_shared },
+    { "pages", reported },
+  };
+  return report;
+}
+
+
+bool gallocy::memory::FalseSharingProfiler::dump(const char *path) {
+  auto contents = report().dump(2);
+  FILE *file = fopen(path, "w");
+  if (file == nullptr) {
+    perror("profiler fopen");
+    return false;
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  if (fclose(file) != 0 || !ok) {
+    LOG_ERROR("Failed to write the false sharing profile to " << path);
+    return false;
+  }
+  return true;
+}
+
+
+gallocy::json gallocy::memory::FalseSharingProfiler::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "allocations", allocations.size() },
+    { "profiled_pages", profiles.size() },
+    { "transfers", transfers },
+    { "samples", samples },
+    { "dropped", dropped },
+  };
+  return metrics;
+}
@@ -0,0 +1,727 @@
+#include "gallocy/memory/release.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gallocy/memory/fault.h"
+#include "gallocy/memory/profiler.h"
+#include "gallocy/threads.h"
+#include "gallocy/utils/logging.h"
+#include "gallocy/utils/metrics.h"
+#include "gallocy/utils/pagecodec.h"
+#include "gallocy/utils/pagediff.h"
+
+
+static bool release_fault(void *arg, void *address, bool write) {
+  return reinterpret_cast<gallocy::memory::LazyReleaseCoherence *>(arg)->fault(address, write);
+}
+
+
+static void release_acquire_hook(void *arg, void *object, int kind) {
+  reinterpret_cast<gallocy::memory::LazyReleaseCoherence *>(arg)->acquire();
+}
+
+
+static void release_release_hook(void *arg, void *object, int kind) {
+  reinterpret_cast<gallocy::memory::LazyReleaseCoherence *>(arg)->release();
+}
+
+
+gallocy::memory::LazyReleaseCoherence::LazyReleaseCoherence(uint32_t self,
+                                                            const gallocy::vector<gallocy::common::Peer> &nodes,
+                                                            void *base, uint64_t pages, uint64_t granularity,
+                                                            uint64_t prefetch_window)
+  : read_faults(0),
+    write_faults(0),
+    intervals(0),
+    diffs_sent(0),
+    diff_bytes(0),
+    diff_messages(0),
+    pages_invalidated(0),
+    blocks_fetched(0),
+    blocks_skipped(0),
+    pages_prefetched(0),
+    self(self),
+    node_count(nodes.size()),
+    base(reinterpret_cast<uint8_t *>(base)),
+    pages(pages),
+    prefetch_window(prefetch_window),
+    dirty_count(0),
+    pending_count(0),
+    profiler(nullptr),
+    intercepting(false) {
+  if (node_count > COHERENCE_MAX_NODES) {
+    LOG_ERROR("Coherence supports at most " << COHERENCE_MAX_NODES << " nodes, not " << node_count);
+    abort();
+  }
+  int log2 = granularity_log2(granularity);
+  if (log2 < 0) {
+    LOG_ERROR("Invalid coherence granularity of " << granularity << " bytes");
+    abort();
+  }
+
+  state = reinterpret_cast<ReleasePage *>(internal_malloc(pages * sizeof(ReleasePage)));
+  for (uint64_t page = 0; page < pages; page++) {
+    state[page].permissions = PAGE_PERM_READ;
+    state[page].dirty = 0;
+    state[page].busy = 0;
+    state[page].invalidated = 0;
+    state[page].granularity_log2 = PAGE_SZ_LOG2;
+    state[page].twin = nullptr;
+    state[page].versions = nullptr;
+  }
+  set_granularity(base, pages * PAGE_SZ, granularity);
+
+  // ALIAS the region, so that pages are filled and diffs merged through a
+  // view that is always writable while the application's view of them stays
+  // protected.
+  fill = reinterpret_cast<uint8_t *>(mremap(base, 0, pages * PAGE_SZ, MREMAP_MAYMOVE));
+  if (fill == MAP_FAILED || mprotect(fill, pages * PAGE_SZ, PROT_READ | PROT_WRITE) == -1) {
+    LOG_ERROR("Coherence needs a shared mapping to alias: " << strerror(errno));
+    abort();
+  }
+
+  memset(clients, 0, sizeof(clients));
+  memset(clock, 0, sizeof(clock));
+  memset(seen, 0, sizeof(seen));
+  memset(covered, 0, sizeof(covered));
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    clients[node] = new (internal_malloc(sizeof(PageTransferClient))) PageTransferClient(nodes[node], fill, pages,
+                                                                                        prefetch_window);
+    clients[node]->set_node(self);
+  }
+  message = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_TRANSFER_MAX_MESSAGE));
+
+  // WRITE protect every page, so that writes are noticed.
+  if (mprotect(base, pages * PAGE_SZ, PROT_READ) == -1)
+    perror("release mprotect");
+  register_fault_region(base, pages * PAGE_SZ, release_fault, this);
+
+  metrics_name = "lrc " + gallocy::string(std::to_string(self).c_str());
+  utils::register_metrics(metrics_name, [this]() { return get_metrics(); });
+}
+
+
+gallocy::memory::LazyReleaseCoherence::~LazyReleaseCoherence() {
+  if (intercepting)
+    set_sync_hooks(nullptr, nullptr, nullptr);
+  utils::unregister_metrics(metrics_name);
+  unregister_fault_region(base);
+  mprotect(base, pages * PAGE_SZ, PROT_READ | PROT_WRITE);
+  for (uint32_t node = 0; node < node_count; node++) {
+    if (node == self)
+      continue;
+    clients[node]->~PageTransferClient();
+    internal_free(clients[node]);
+  }
+  for (uint64_t page = 0; page < pages; page++) {
+    if (state[page].twin)
+      internal_free(state[page].twin);
+    if (state[page].versions)
+      internal_free(state[page].versions);
+  }
+  munmap(fill, pages * PAGE_SZ);
+  internal_free(state);
+  internal_free(message);
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::protect(uint64_t page, uint8_t permissions, uint64_t count) {
+  int prot = PROT_NONE;
+  if (permissions == PAGE_PERM_READ)
+    prot = PROT_READ;
+  else if (permissions == PAGE_PERM_WRITE)
+    prot = PROT_READ | PROT_WRITE;
+  if (mprotect(base + page * PAGE_SZ, count * PAGE_SZ, prot) == -1)
+    perror("release mprotect");
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::fetch(uint64_t page, std::unique_lock<std::mutex> &lock) {
+  if (state[page].versions)
+    return fetch_blocks(page, lock);
+
+  // GATHER the unit's other invalidated pages, which share the page's home.
+  uint64_t unit_pages[PAGE_TRANSFER_MAX_PAGES];
+  size_t count = 0;
+  uint64_t size = 1;
+  if (state[page].granularity_log2 > PAGE_SZ_LOG2)
+    size = 1ULL << (state[page].granularity_log2 - PAGE_SZ_LOG2);
+  uint64_t first = page & ~(size - 1);
+  for (uint64_t p = first; p < first + size && p < pages; p++) {
+    if (p == page || (state[p].permissions == PAGE_PERM_NONE && !state[p].busy))
+      unit_pages[count++] = p;
+  }
+  // PREFETCH the invalidated pages after the unit that the same home serves
+  // whole, in the same round trip.
+  uint32_t home = get_home(page);
+  size_t unit_count = count;
+  for (uint64_t p = first + size; p < first + size + prefetch_window && p < pages
+       && count < PAGE_TRANSFER_MAX_PAGES; p++) {
+    if (get_home(p) == home && state[p].permissions == PAGE_PERM_NONE && !state[p].busy && !state[p].versions)
+      unit_pages[count++] = p;
+  }
+  for (size_t i = 0; i < count; i++)
+    state[unit_pages[i]].busy = 1;
+  lock.unlock();
+  int status = clients[home]->request(PAGE_TRANSFER_FETCH, unit_pages, count, nullptr);
+  lock.lock();
+  for (size_t i = 0; i < count; i++) {
+    ReleasePage &s = state[unit_pages[i]];
+    s.busy = 0;
+    // DROP a copy that write notices made stale while it was in flight.
+    if (status == PAGE_TRANSFER_OK && !s.invalidated) {
+      s.permissions = PAGE_PERM_READ;
+      protect(unit_pages[i], PAGE_PERM_READ);
+    }
+    s.invalidated = 0;
+  }
+  busy_cv.notify_all();
+  if (status != PAGE_TRANSFER_OK) {
+    LOG_ERROR("Failed to fetch page " << page << " from its home " << home);
+    return false;
+  }
+  read_faults++;
+  pages_prefetched += count - unit_count;
+  return true;
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::fetch_blocks(uint64_t page, std::unique_lock<std::mutex> &lock) {
+  ReleasePage &s = state[page];
+  uint64_t block_sz = 1ULL << s.granularity_log2;
+  uint64_t blocks = PAGE_SZ / block_sz;
+  uint8_t request[10 + RELEASE_MAX_BLOCKS * sizeof(uint32_t)];
+  uint8_t reply[sizeof(uint64_t) + RELEASE_MAX_BLOCKS * sizeof(uint32_t) + PAGE_SZ];
+  size_t length = utils::varint_encode(page, request, 10);
+  memcpy(request + length, s.versions, blocks * sizeof(uint32_t));
+  length += blocks * sizeof(uint32_t);
+  s.busy = 1;
+  lock.unlock();
+
+  // FILL the stale blocks through the alias, so the page stays protected
+  // until they are full.
+  size_t reply_length = 0;
+  uint32_t fresh[RELEASE_MAX_BLOCKS];
+  uint64_t stale = 0;
+  int status = clients[get_home(page)]->exchange(PAGE_TRANSFER_BLOCKS, request, length, reply, &reply_length,
+                                                 sizeof(reply));
+  if (status == PAGE_TRANSFER_OK && reply_length >= sizeof(stale)) {
+    memcpy(&stale, reply, sizeof(stale));
+    size_t pos = sizeof(stale);
+    for (uint64_t block = 0; block < blocks && status == PAGE_TRANSFER_OK; block++) {
+      if (!(stale & (1ULL << block)))
+        continue;
+      if (reply_length - pos < sizeof(uint32_t) + block_sz) {
+        status = PAGE_TRANSFER_EINVAL;
+        break;
+      }
+      memcpy(&fresh[block], reply + pos, sizeof(uint32_t));
+      memcpy(fill + page * PAGE_SZ + block * block_sz, reply + pos + sizeof(uint32_t), block_sz);
+      pos += sizeof(uint32_t) + block_sz;
+    }
+  } else if (status == PAGE_TRANSFER_OK) {
+    status = PAGE_TRANSFER_EINVAL;
+  }
+
+  lock.lock();
+  s.busy = 0;
+  busy_cv.notify_all();
+  bool invalidated = s.invalidated;
+  s.invalidated = 0;
+  if (status != PAGE_TRANSFER_OK) {
+    LOG_ERROR("Failed to fetch the blocks of page " << page << " from its home " << get_home(page));
+    return false;
+  }
+  for (uint64_t block = 0; block < blocks; block++) {
+    if (stale & (1ULL << block)) {
+      s.versions[block] = fresh[block];
+      blocks_fetched++;
+    } else {
+      blocks_skipped++;
+    }
+  }
+  read_faults++;
+  // KEEP the fresh versions of a page that write notices made stale while
+  // it was in flight, but leave it invalid so its next fetch only asks for
+  // the blocks that changed since.
+  if (invalidated)
+    return true;
+  s.permissions = PAGE_PERM_READ;
+  protect(page, PAGE_PERM_READ);
+  return true;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::bump_versions(uint64_t page, const uint8_t *before,
+                                                          const uint8_t *after) {
+  ReleasePage &s = state[page];
+  uint64_t lines = utils::page_dirty_lines(after, before);
+  uint64_t per_block = (1ULL << s.granularity_log2) / 64;
+  uint64_t mask = (1ULL << per_block) - 1;
+  for (uint64_t block = 0; lines; block++, lines >>= per_block) {
+    if (lines & mask)
+      s.versions[block]++;
+  }
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::fault(void *address, bool write) {
+  uint64_t offset = reinterpret_cast<uint8_t *>(address) - base;
+  uint64_t page = offset / PAGE_SZ;
+  if (reinterpret_cast<uint8_t *>(address) < base || page >= pages)
+    return false;
+
+  SyncHookGuard guard;
+  std::unique_lock<std::mutex> lock(access_lock);
+  busy_cv.wait(lock, [&]() { return !state[page].busy; });
+  ReleasePage &s = state[page];
+  // A read fault on a readable page can only have been a write.
+  if (!write && s.permissions != PAGE_PERM_NONE)
+    write = true;
+  // REFETCH a page whose copy was dropped as stale on arrival.
+  while (s.permissions == PAGE_PERM_NONE) {
+    if (!fetch(page, lock))
+      return false;
+  }
+  if (!write || s.permissions == PAGE_PERM_WRITE)
+    return true;
+
+  // TWIN the page so its diff can be taken at the next release. A page's
+  // home writes it in place and has no diff to send, but twins a page split
+  // into blocks to find which blocks it wrote.
+  if (get_home(page) != self || s.versions) {
+    s.twin = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_SZ));
+    memcpy(s.twin, base + page * PAGE_SZ, PAGE_SZ);
+  }
+  s.dirty = 1;
+  dirty.push_back(page);
+  dirty_count.store(dirty.size());
+  s.permissions = PAGE_PERM_WRITE;
+  protect(page, PAGE_PERM_WRITE);
+  write_faults++;
+  return true;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::send_diffs(const gallocy::vector<uint64_t> &twinned,
+                                                       const gallocy::vector<uint8_t *> &twins) {
+  uint8_t diff[PAGE_CODEC_MAX_SZ];
+  for (uint32_t home = 0; home < node_count; home++) {
+    if (home == self)
+      continue;
+    size_t length = 0;
+    for (size_t i = 0; i <= twinned.size(); i++) {
+      bool last = i == twinned.size();
+      // SEND the message when it is full or there are no more diffs.
+      if (length > 0 && (last || length + sizeof(diff) + 20 > PAGE_TRANSFER_MAX_MESSAGE)) {
+        size_t reply_length = 0;
+        if (clients[home]->exchange(PAGE_TRANSFER_DIFF, message, length, nullptr, &reply_length, 0)
+            != PAGE_TRANSFER_OK)
+          LOG_ERROR("Failed to send diffs to node " << home);
+        diff_messages++;
+        length = 0;
+      }
+      if (last)
+        break;
+      uint64_t page = twinned[i];
+      if (get_home(page) != home)
+        continue;
+      size_t n = utils::page_encode(base + page * PAGE_SZ, twins[i], diff, sizeof(diff));
+      if (n == 0) {
+        LOG_ERROR("Failed to encode the diff of page " << page);
+        continue;
+      }
+      length += utils::varint_encode(page, message + length, 10);
+      length += utils::varint_encode(n, message + length, 10);
+      memcpy(message + length, diff, n);
+      length += n;
+      diffs_sent++;
+      diff_bytes += n;
+    }
+  }
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::release() {
+  if (dirty_count.load() == 0)
+    return;
+
+  SyncHookGuard guard;
+  std::lock_guard<std::mutex> serial(release_lock);
+  gallocy::vector<uint64_t> twinned;
+  gallocy::vector<uint8_t *> twins;
+  WriteInterval interval;
+  {
+    // WRITE protect the dirty pages, so later writes are noticed and twinned
+    // anew, and take their twins.
+    std::lock_guard<std::mutex> lock(access_lock);
+    for (auto page : dirty) {
+      ReleasePage &s = state[page];
+      s.dirty = 0;
+      s.permissions = PAGE_PERM_READ;
+      protect(page, PAGE_PERM_READ);
+      interval.pages.push_back(page);
+      if (s.twin && get_home(page) == self) {
+        bump_versions(page, s.twin, base + page * PAGE_SZ);
+        internal_free(s.twin);
+        s.twin = nullptr;
+      } else if (s.twin) {
+        twinned.push_back(page);
+        twins.push_back(s.twin);
+        s.twin = nullptr;
+      }
+    }
+    dirty.clear();
+    dirty_count.store(0);
+  }
+  if (interval.pages.empty())
+    return;
+
+  // DIFF against the twins without holding ``access_lock``, so this node
+  // can serve other nodes' diffs meanwhile. A page rewritten since it was
+  // protected may send some of its newer bytes early, which is harmless.
+  send_diffs(twinned, twins);
+  for (auto twin : twins)
+    internal_free(twin);
+
+  // PUBLISH the interval only once its diffs are at their homes.
+  std::sort(interval.pages.begin(), interval.pages.end());
+  std::lock_guard<std::mutex> lock(access_lock);
+  interval.node = self;
+  interval.sequence = ++clock[self];
+  log.push_back(interval);
+  intervals++;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::acquire() {
+  if (pending_count.load() == 0)
+    return;
+
+  SyncHookGuard guard;
+  bool written = false;
+  {
+    std::lock_guard<std::mutex> lock(access_lock);
+    for (auto &interval : pending) {
+      for (auto page : interval.pages)
+        written = written || state[page].dirty;
+    }
+  }
+  if (written)
+    release();
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  for (auto &interval : pending) {
+    for (auto page : interval.pages) {
+      ReleasePage &s = state[page];
+      // A page's home is always up to date, and a page that was written again
+      // since the release above keeps its copy. A page that is being fetched
+      // drops its copy when it arrives.
+      if (get_home(page) == self || s.dirty)
+        continue;
+      if (s.busy) {
+        s.invalidated = 1;
+        pages_invalidated++;
+        continue;
+      }
+      if (s.permissions == PAGE_PERM_NONE)
+        continue;
+      s.permissions = PAGE_PERM_NONE;
+      protect(page, PAGE_PERM_NONE);
+      pages_invalidated++;
+    }
+  }
+  pending.clear();
+  pending_count.store(0);
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::acquire_from(uint32_t node) {
+  if (node == self || node >= node_count)
+    return false;
+
+  SyncHookGuard guard;
+  {
+    std::lock_guard<std::mutex> serial(release_lock);
+    bool more = true;
+    while (more) {
+      uint32_t requester[COHERENCE_MAX_NODES];
+      size_t length = 0;
+      get_clock(requester);
+      int status = clients[node]->exchange(PAGE_TRANSFER_NOTICES, reinterpret_cast<uint8_t *>(requester),
+                                           node_count * sizeof(uint32_t), message, &length,
+                                           PAGE_TRANSFER_MAX_MESSAGE);
+      if (status != PAGE_TRANSFER_OK || !receive_notices(message, length, &more)) {
+        LOG_ERROR("Failed to get write notices from node " << node);
+        return false;
+      }
+    }
+  }
+  acquire();
+  return true;
+}
+
+
+size_t gallocy::memory::LazyReleaseCoherence::encode_notices(uint32_t node, const uint32_t *requester, uint8_t *out,
+                                                              size_t cap) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (node < node_count && node != self)
+    trim(node, requester);
+  if (cap == 0)
+    return 0;
+  size_t length = 1;
+  auto put = [&](uint64_t value) {
+    size_t n = utils::varint_encode(value, out + length, cap - length);
+    length += n;
+    return n != 0;
+  };
+
+  out[0] = 0;
+  for (auto &interval : log) {
+    if (interval.sequence <= requester[interval.node])
+      continue;
+    size_t start = length;
+    bool fits = put(interval.node) && put(interval.sequence) && put(interval.pages.size());
+    uint32_t previous = 0;
+    for (size_t i = 0; fits && i < interval.pages.size(); i++) {
+      fits = put(interval.pages[i] - previous);
+      previous = interval.pages[i];
+    }
+    // ROLL back an interval that does not fit, and say there is more.
+    if (!fits) {
+      out[0] = RELEASE_NOTICES_MORE;
+      return start;
+    }
+  }
+  return length;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::trim(uint32_t node, const uint32_t *requester) {
+  // CLOCKS only grow, but one may arrive late, e.g., with a lock request
+  // that waited in a queue.
+  for (uint32_t other = 0; other < node_count; other++)
+    seen[node][other] = std::max(seen[node][other], requester[other]);
+
+  // FIND the intervals every other node has seen, which none will ask for.
+  bool advanced = false;
+  uint32_t floor[COHERENCE_MAX_NODES];
+  for (uint32_t other = 0; other < node_count; other++) {
+    floor[other] = clock[other];
+    for (uint32_t n = 0; n < node_count; n++) {
+      if (n != self)
+        floor[other] = std::min(floor[other], seen[n][other]);
+    }
+    advanced = advanced || floor[other] > covered[other];
+  }
+  if (!advanced)
+    return;
+  memcpy(covered, floor, sizeof(floor));
+  log.erase(std::remove_if(log.begin(), log.end(), [this](const WriteInterval &interval) {
+    return interval.sequence <= covered[interval.node];
+  }), log.end());
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::receive_notices(const uint8_t *in, size_t len, bool *more) {
+  if (len < 1)
+    return false;
+  *more = in[0] & RELEASE_NOTICES_MORE;
+  size_t pos = 1;
+  auto get = [&](uint64_t *value) {
+    size_t n = utils::varint_decode(in + pos, len - pos, value);
+    pos += n;
+    return n != 0;
+  };
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  while (pos < len) {
+    uint64_t node, sequence, count, page = 0, delta;
+    if (!get(&node) || !get(&sequence) || !get(&count) || node >= node_count || count > pages)
+      return false;
+    WriteInterval interval;
+    interval.node = node;
+    interval.sequence = sequence;
+    for (uint64_t i = 0; i < count; i++) {
+      if (!get(&delta) || (page += delta) >= pages)
+        return false;
+      interval.pages.push_back(page);
+    }
+    // SKIP intervals that arrived by another path first.
+    if (sequence <= clock[node])
+      continue;
+    clock[node] = sequence;
+    log.push_back(interval);
+    pending.push_back(interval);
+  }
+  pending_count.store(pending.size());
+  return true;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::get_clock(uint32_t *out) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  memcpy(out, clock, node_count * sizeof(uint32_t));
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::intercept_synchronization() {
+  set_sync_hooks(release_acquire_hook, release_release_hook, this);
+  intercepting = true;
+}
+
+
+void gallocy::memory::LazyReleaseCoherence::set_profiler(FalseSharingProfiler *profiler) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  this->profiler = profiler;
+}
+
+
+uint16_t gallocy::memory::LazyReleaseCoherence::exchange(uint16_t op, uint32_t node, uint8_t *in, size_t length,
+                                                         size_t *reply_length, size_t capacity) {
+  if (node >= node_count || node == self)
+    return PAGE_TRANSFER_EINVAL;
+
+  if (op == PAGE_TRANSFER_NOTICES) {
+    uint32_t requester[COHERENCE_MAX_NODES];
+    if (length != node_count * sizeof(uint32_t))
+      return PAGE_TRANSFER_EINVAL;
+    memcpy(requester, in, length);
+    *reply_length = encode_notices(node, requester, in, capacity);
+    return PAGE_TRANSFER_OK;
+  }
+
+  if (op == PAGE_TRANSFER_BLOCKS) {
+    std::lock_guard<std::mutex> lock(access_lock);
+    return serve_blocks(in, length, reply_length, capacity);
+  }
+
+  if (op != PAGE_TRANSFER_DIFF)
+    return PAGE_TRANSFER_EINVAL;
+
+  // MERGE every diff into this node's copy, which is its home's copy, through
+  // the alias so the page's protection never changes.
+  std::lock_guard<std::mutex> lock(access_lock);
+  size_t pos = 0;
+  auto get = [&](uint64_t *value) {
+    size_t n = utils::varint_decode(in + pos, length - pos, value);
+    pos += n;
+    return n != 0;
+  };
+
+  *reply_length = 0;
+  uint8_t before[PAGE_SZ];
+  while (pos < length) {
+    uint64_t page, n;
+    if (!get(&page) || !get(&n) || n > length - pos || page >= pages || get_home(page) != self)
+      return PAGE_TRANSFER_EINVAL;
+    if (profiler || state[page].versions)
+      memcpy(before, fill + page * PAGE_SZ, PAGE_SZ);
+    bool ok = utils::page_decode(in + pos, n, fill + page * PAGE_SZ);
+    if (ok && profiler)
+      profiler->record_writes(node, page, before, fill + page * PAGE_SZ);
+    if (ok && state[page].versions)
+      bump_versions(page, before, fill + page * PAGE_SZ);
+    if (!ok)
+      return PAGE_TRANSFER_EINVAL;
+    pos += n;
+  }
+  return PAGE_TRANSFER_OK;
+}
+
+
+uint16_t gallocy::memory::LazyReleaseCoherence::serve_blocks(uint8_t *in, size_t length, size_t *reply_length,
+                                                             size_t capacity) {
+  uint64_t page;
+  size_t pos = utils::varint_decode(in, length, &page);
+  if (pos == 0 || page >= pages || get_home(page) != self || !state[page].versions)
+    return PAGE_TRANSFER_EINVAL;
+  ReleasePage &s = state[page];
+  uint64_t block_sz = 1ULL << s.granularity_log2;
+  uint64_t blocks = PAGE_SZ / block_sz;
+  uint32_t requester[RELEASE_MAX_BLOCKS];
+  if (length - pos != blocks * sizeof(uint32_t))
+    return PAGE_TRANSFER_EINVAL;
+  memcpy(requester, in + pos, blocks * sizeof(uint32_t));
+
+  // REPLY with every block the requester's copy is behind on.
+  uint64_t stale = 0;
+  size_t out = sizeof(stale);
+  for (uint64_t block = 0; block < blocks; block++) {
+    if (requester[block] == s.versions[block])
+      continue;
+    if (out + sizeof(uint32_t) + block_sz > capacity)
+      return PAGE_TRANSFER_EINVAL;
+    stale |= 1ULL << block;
+    memcpy(in + out, &s.versions[block], sizeof(uint32_t));
+    memcpy(in + out + sizeof(uint32_t), base + page * PAGE_SZ + block * block_sz, block_sz);
+    out += sizeof(uint32_t) + block_sz;
+  }
+  memcpy(in, &stale, sizeof(stale));
+  *reply_length = out;
+  return PAGE_TRANSFER_OK;
+}
+
+
+bool gallocy::memory::LazyReleaseCoherence::set_granularity(void *address, size_t length, uint64_t granularity) {
+  uint64_t offset = reinterpret_cast<uint8_t *>(address) - base;
+  int log2 = granularity_log2(granularity);
+  if (log2 < 0 || reinterpret_cast<uint8_t *>(address) < base || offset % granularity || offset % PAGE_SZ
+      || length % granularity || length % PAGE_SZ || offset + length > pages * PAGE_SZ) {
+    LOG_ERROR("Invalid coherence granularity of " << granularity << " bytes for " << length << " bytes");
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(access_lock);
+  for (uint64_t page = offset / PAGE_SZ; page < (offset + length) / PAGE_SZ; page++) {
+    ReleasePage &s = state[page];
+    s.granularity_log2 = log2;
+    if (log2 < PAGE_SZ_LOG2 && !s.versions) {
+      s.versions = reinterpret_cast<uint32_t *>(internal_malloc(RELEASE_MAX_BLOCKS * sizeof(uint32_t)));
+      memset(s.versions, 0, RELEASE_MAX_BLOCKS * sizeof(uint32_t));
+    } else if (log2 >= PAGE_SZ_LOG2 && s.versions) {
+      internal_free(s.versions);
+      s.versions = nullptr;
+    }
+  }
+  return true;
+}
+
+
+uint64_t gallocy::memory::LazyReleaseCoherence::get_granularity(uint64_t page) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return 1ULL << state[page].granularity_log2;
+}
+
+
+uint8_t gallocy::memory::LazyReleaseCoherence::get_permissions(uint64_t page) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return state[page].permissions;
+}
+
+
+gallocy::json gallocy::memory::LazyReleaseCoherence::get_metrics() {
+  std::lock_guard<std::mutex> lock(access_lock);
+  gallocy::json metrics = {
+    { "model", "lrc" },
+    { "read_faults", read_faults },
+    { "write_faults", write_faults },
+    { "intervals", intervals },
+    { "logged_intervals", log.size() },
+    { "diffs_sent", diffs_sent },
+    { "diff_bytes", diff_bytes },
+    { "diff_messages", diff_messages },
+    { "pages_invalidated", pages_invalidated },
+    { "blocks_fetched", blocks_fetched },
+    { "blocks_skipped", blocks_skipped },
+    { "pages_prefetched", pages_prefetched },
+  };
+  return metrics;
+}
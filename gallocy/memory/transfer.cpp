@@ -0,0 +1,626 @@
+#include "gallocy/memory/transfer.h"
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "gallocy/utils/logging.h"
+
+
+/**
+ * The time on a monotonic clock, in milliseconds.
+ */
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Wait until a socket is ready or a deadline passes.
+ *
+ * \param deadline_ms The deadline on the monotonic clock, or 0 to wait
+ * forever.
+ */
+static bool wait_ready(int fd, int16_t events, uint64_t deadline_ms) {
+  while (true) {
+    int timeout = -1;
+    if (deadline_ms) {
+      uint64_t now = now_ms();
+      if (now >= deadline_ms)
+        return false;
+      timeout = static_cast<int>(deadline_ms - now);
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    return ready > 0;
+  }
+}
+
+
+/**
+ * Advance an iovec list past ``n`` bytes.
+ */
+static void advance_iov(struct iovec **iov, int *iovcnt, size_t n) {
+  while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+    n -= (*iov)->iov_len;
+    (*iov)++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt > 0) {
+    (*iov)->iov_base = reinterpret_cast<uint8_t *>((*iov)->iov_base) + n;
+    (*iov)->iov_len -= n;
+  }
+}
+
+
+/**
+ * Read exactly the bytes described by an iovec list.
+ *
+ * The list is advanced in place as bytes arrive, and the socket, which must
+ * be non-blocking, is waited on until the deadline.
+ */
+static bool readv_all(int fd, struct iovec *iov, int iovcnt, uint64_t deadline_ms) {
+  while (iovcnt > 0) {
+    ssize_t n = readv(fd, iov, iovcnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(fd, POLLIN, deadline_ms))
+      continue;
+    if (n <= 0)
+      return false;
+    advance_iov(&iov, &iovcnt, n);
+  }
+  return true;
+}
+
+
+/**
+ * Write exactly the bytes described by an iovec list.
+ *
+ * This is ``writev`` by way of ``sendmsg`` so that a closed peer is an error
+ * rather than a SIGPIPE. The socket, which must be non-blocking, is waited on
+ * until the deadline.
+ */
+static bool writev_all(int fd, struct iovec *iov, int iovcnt, uint64_t deadline_ms) {
+  while (iovcnt > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(fd, POLLOUT, deadline_ms))
+      continue;
+    if (n <= 0)
+      return false;
+    advance_iov(&iov, &iovcnt, n);
+  }
+  return true;
+}
+
+
+size_t gallocy::memory::page_transfer_runs(const uint64_t *page_numbers, size_t count, PageTransferRun *runs) {
+  size_t run_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (run_count > 0) {
+      PageTransferRun &last = runs[run_count - 1];
+      if (page_numbers[i] < last.page + last.count)
+        continue;
+      if (page_numbers[i] == last.page + last.count) {
+        last.count++;
+        continue;
+      }
+    }
+    runs[run_count].page = page_numbers[i];
+    runs[run_count].count = 1;
+    run_count++;
+  }
+  return run_count;
+}
+
+
+//
+// The server
+//
+
+
+void gallocy::memory::PageTransferServer::start() {
+  LOG_DEBUG("Starting page transfer server on " << address << ":" << port);
+
+  struct sockaddr_in name;
+  int optval = 1;
+
+  server_socket = socket(PF_INET, SOCK_STREAM, 0);
+  if (server_socket == -1) {
+    perror("page transfer socket");
+    exit(1);
+  }
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+  memset(&name, 0, sizeof(name));
+  name.sin_family = AF_INET;
+  name.sin_port = htons(port);
+  name.sin_addr.s_addr = inet_addr(address.c_str());
+
+  if (bind(server_socket, reinterpret_cast<struct sockaddr *>(&name), sizeof(name)) < 0) {
+    perror("page transfer bind");
+    exit(1);
+  }
+
+  if (listen(server_socket, PAGE_TRANSFER_MAX_CONNECTIONS) < 0) {
+    perror("page transfer listen");
+    exit(1);
+  }
+
+  ThreadedDaemon::start();
+}
+
+
+void *gallocy::memory::PageTransferServer::work() {
+  int optval = 1;
+  message = reinterpret_cast<uint8_t *>(internal_malloc(PAGE_TRANSFER_MAX_MESSAGE));
+
+  // POLL the listening socket in slot 0 and connections after it, with a
+  // timeout so that the server notices when it is stopped.
+  struct pollfd fds[PAGE_TRANSFER_MAX_CONNECTIONS + 1];
+  nfds_t nfds = 1;
+  fds[0].fd = server_socket;
+  fds[0].events = POLLIN;
+
+  while (alive) {
+    int ready = poll(fds, nfds, PAGE_TRANSFER_POLL_MS);
+    if (ready < 0 && errno != EINTR) {
+      perror("page transfer poll");
+      break;
+    }
+    if (ready <= 0)
+      continue;
+
+    for (nfds_t i = nfds - 1; i > 0; i--) {
+      if (!fds[i].revents)
+        continue;
+      if ((fds[i].revents & POLLIN) && handle(fds[i].fd))
+        continue;
+      // CLOSE the connection and fill its slot with the last one.
+      close(fds[i].fd);
+      fds[i] = fds[--nfds];
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int client_socket = accept(server_socket, nullptr, nullptr);
+      if (client_socket == -1) {
+        perror("page transfer accept");
+      } else if (nfds > PAGE_TRANSFER_MAX_CONNECTIONS) {
+        LOG_WARNING("Refusing page transfer connection, " << nfds - 1 << " already open");
+        close(client_socket);
+      } else {
+        // SERVE connections without blocking, so a peer that stalls mid
+        // message costs at most PAGE_TRANSFER_IO_TIMEOUT_MS.
+        fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        fds[nfds].fd = client_socket;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+    }
+  }
+
+  for (nfds_t i = 1; i < nfds; i++)
+    close(fds[i].fd);
+  close(server_socket);
+  internal_free(message);
+  message = nullptr;
+
+  return nullptr;
+}
+
+
+bool gallocy::memory::PageTransferServer::handle(int client_socket) {
+  PageTransferHeader header;
+  PageTransferRun runs[PAGE_TRANSFER_MAX_RUNS];
+  struct iovec iov[PAGE_TRANSFER_MAX_RUNS + 2];
+  uint64_t deadline = now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  if (!readv_all(client_socket, iov, 1, deadline)) {
+    if (now_ms() >= deadline)
+      LOG_WARNING("Dropping page transfer connection that stalled mid request");
+    return false;
+  }
+  if (header.magic != PAGE_TRANSFER_MAGIC || header.run_count > PAGE_TRANSFER_MAX_RUNS
+      || header.op < PAGE_TRANSFER_FETCH || header.op > PAGE_TRANSFER_MAX_OP) {
+    LOG_WARNING("Dropping malformed page transfer request");
+    return false;
+  }
+
+  PageCoherence *handler = handlers[header.op];
+  if (header.op >= PAGE_TRANSFER_DIFF) {
+    if (header.length > PAGE_TRANSFER_MAX_MESSAGE) {
+      LOG_WARNING("Dropping page transfer message of " << header.length << " bytes");
+      return false;
+    }
+    iov[0].iov_base = message;
+    iov[0].iov_len = header.length;
+    if (header.length > 0 && !readv_all(client_socket, iov, 1, deadline))
+      return false;
+    size_t reply_length = 0;
+    header.status = handler ? handler->exchange(header.op, header.node, message, header.length,
+                                                &reply_length, PAGE_TRANSFER_MAX_MESSAGE)
+                            : PAGE_TRANSFER_EINVAL;
+    header.length = header.status == PAGE_TRANSFER_OK ? reply_length : 0;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = message;
+    iov[1].iov_len = header.length;
+    return writev_all(client_socket, iov, 2, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS);
+  }
+
+  iov[0].iov_base = runs;
+  iov[0].iov_len = header.run_count * sizeof(PageTransferRun);
+  if (!readv_all(client_socket, iov, 1, deadline))
+    return false;
+
+  // CHECK every run lies within the region.
+  uint64_t page_count = 0;
+  bool valid = true;
+  for (uint32_t r = 0; r < header.run_count; r++) {
+    if (runs[r].count == 0 || runs[r].page >= pages || runs[r].count > pages - runs[r].page)
+      valid = false;
+    page_count += runs[r].count;
+  }
+  if (page_count != header.page_count || page_count > PAGE_TRANSFER_MAX_PAGES)
+    valid = false;
+
+  for (uint32_t r = 0; valid && r < header.run_count; r++) {
+    iov[r + 1].iov_base = base + static_cast<uint64_t>(runs[r].page) * PAGE_SZ;
+    iov[r + 1].iov_len = static_cast<uint64_t>(runs[r].count) * PAGE_SZ;
+  }
+
+  if (header.op == PAGE_TRANSFER_PUSH) {
+    // A PUSH with bad runs leaves its pages in the stream, so the connection
+    // cannot be used again.
+    if (valid && !readv_all(client_socket, iov + 1, header.run_count, deadline))
+      return false;
+    header.status = valid ? PAGE_TRANSFER_OK : PAGE_TRANSFER_EINVAL;
+    header.run_count = 0;
+    header.page_count = 0;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    return writev_all(client_socket, iov, 1, deadline) && valid;
+  }
+
+  uint16_t op = header.op;
+  uint32_t node = header.node;
+  uint32_t hint = 0;
+  uint64_t readers = 0;
+  bool coherent = op != PAGE_TRANSFER_FETCH;
+  header.status = valid ? PAGE_TRANSFER_OK : PAGE_TRANSFER_EINVAL;
+  if (valid && coherent)
+    header.status = handler ? handler->prepare(op, node, runs, header.run_count, &hint, &readers)
+                            : PAGE_TRANSFER_EINVAL;
+
+  // REPLY with the pages themselves unless the request was refused or only
+  // invalidates, and hand an OWN's readers over after them.
+  size_t reply_count = 1;
+  if (header.status == PAGE_TRANSFER_OK && op != PAGE_TRANSFER_INVALIDATE)
+    reply_count += header.run_count;
+  header.node = hint;
+  header.page_count = reply_count > 1 ? page_count : 0;
+  header.length = 0;
+  if (reply_count > 1 && op == PAGE_TRANSFER_OWN) {
+    iov[reply_count].iov_base = &readers;
+    iov[reply_count].iov_len = sizeof(readers);
+    header.length = sizeof(readers);
+    reply_count++;
+  }
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  bool sent = writev_all(client_socket, iov, reply_count, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS);
+  if (coherent && header.status == PAGE_TRANSFER_OK)
+    handler->complete(op, node, runs, header.run_count, sent);
+  return sent;
+}
+
+
+//
+// The client
+//
+
+
+gallocy::memory::PageTransferClient::PageTransferClient(const gallocy::common::Peer &peer, void *base,
+                                                        uint64_t pages, uint64_t prefetch_window)
+  : round_trips(0),
+    pages_fetched(0),
+    pages_prefetched(0),
+    peer(peer),
+    base(reinterpret_cast<uint8_t *>(base)),
+    pages(pages),
+    prefetch_window(prefetch_window),
+    node(0),
+    sock(-1) {
+  size_t words = (pages + 63) / 64;
+  present = reinterpret_cast<uint64_t *>(internal_malloc(words * sizeof(uint64_t)));
+  memset(present, 0, words * sizeof(uint64_t));
+}
+
+
+gallocy::memory::PageTransferClient::~PageTransferClient() {
+  disconnect_peer();
+  internal_free(present);
+}
+
+
+bool gallocy::memory::PageTransferClient::connect_peer() {
+  if (sock != -1)
+    return true;
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    perror("page transfer socket");
+    return false;
+  }
+  int optval = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in peer_sockaddr = peer.get_socket();
+  int error = 0;
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&peer_sockaddr), sizeof(peer_sockaddr)) < 0) {
+    error = errno;
+    // WAIT for the handshake, but no longer than for any other message.
+    if (error == EINPROGRESS) {
+      socklen_t length = sizeof(error);
+      if (!wait_ready(sock, POLLOUT, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS))
+        error = ETIMEDOUT;
+      else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        error = errno;
+    }
+  }
+  if (error) {
+    LOG_WARNING("Failed to connect to page transfer peer " << peer.get_string() << ": " << strerror(error));
+    close(sock);
+    sock = -1;
+    return false;
+  }
+  return true;
+}
+
+
+void gallocy::memory::PageTransferClient::disconnect_peer() {
+  if (sock == -1)
+    return;
+  close(sock);
+  sock = -1;
+}
+
+
+void gallocy::memory::PageTransferClient::set_present(uint64_t page, bool value) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (value)
+    present[page / 64] |= 1ULL << (page % 64);
+  else
+    present[page / 64] &= ~(1ULL << (page % 64));
+}
+
+
+int gallocy::memory::PageTransferClient::transfer(uint16_t op, const PageTransferRun *runs, size_t run_count,
+                                                  uint32_t *hint, uint64_t *readers) {
+  PageTransferHeader header;
+  struct iovec iov[PAGE_TRANSFER_MAX_RUNS + 2];
+  uint32_t page_count = 0;
+
+  if (!connect_peer())
+    return -1;
+
+  for (size_t r = 0; r < run_count; r++) {
+    iov[r + 2].iov_base = base + static_cast<uint64_t>(runs[r].page) * PAGE_SZ;
+    iov[r + 2].iov_len = static_cast<uint64_t>(runs[r].count) * PAGE_SZ;
+    page_count += runs[r].count;
+  }
+
+  header.magic = PAGE_TRANSFER_MAGIC;
+  header.op = op;
+  header.status = PAGE_TRANSFER_OK;
+  header.node = node;
+  header.run_count = run_count;
+  header.page_count = page_count;
+  header.length = 0;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<PageTransferRun *>(runs);
+  iov[1].iov_len = run_count * sizeof(PageTransferRun);
+
+  // SEND the request, with the pages themselves when pushing.
+  struct iovec reply[2 + PAGE_TRANSFER_MAX_RUNS];
+  memcpy(reply + 1, iov + 2, run_count * sizeof(struct iovec));
+  if (!writev_all(sock, iov, op == PAGE_TRANSFER_PUSH ? run_count + 2 : 2,
+                  now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS)) {
+    LOG_WARNING("Failed to send a page transfer request to " << peer.get_string());
+    disconnect_peer();
+    return -1;
+  }
+  round_trips++;
+
+  // READ the reply header, then the pages straight into the region.
+  reply[0].iov_base = &header;
+  reply[0].iov_len = sizeof(header);
+  if (!readv_all(sock, reply, 1, now_ms() + PAGE_TRANSFER_REPLY_TIMEOUT_MS)
+      || header.magic != PAGE_TRANSFER_MAGIC) {
+    LOG_WARNING("Page transfer peer " << peer.get_string() << " did not reply");
+    disconnect_peer();
+    return -1;
+  }
+  if (header.status != PAGE_TRANSFER_OK) {
+    if (header.status == PAGE_TRANSFER_ENOTOWNER && hint)
+      *hint = header.node;
+    else
+      LOG_WARNING("Page transfer to " << peer.get_string() << " failed with status " << header.status);
+    if (op == PAGE_TRANSFER_PUSH)
+      disconnect_peer();
+    return header.status;
+  }
+  // REJECT a reply that does not carry exactly the pages asked for, since
+  // its pages would be read into the wrong part of the region.
+  uint32_t expected = op == PAGE_TRANSFER_PUSH || op == PAGE_TRANSFER_INVALIDATE ? 0 : page_count;
+  uint32_t expected_length = op == PAGE_TRANSFER_OWN ? sizeof(uint64_t) : 0;
+  if (header.page_count != expected || header.run_count > run_count || header.length != expected_length) {
+    LOG_WARNING("Page transfer to " << peer.get_string() << " replied with " << header.page_count
+                << " pages in " << header.run_count << " runs, not " << expected);
+    disconnect_peer();
+    return -1;
+  }
+  uint64_t handed = 0;
+  size_t reply_count = header.page_count > 0 ? run_count : 0;
+  if (header.length > 0) {
+    reply[1 + reply_count].iov_base = &handed;
+    reply[1 + reply_count].iov_len = sizeof(handed);
+    reply_count++;
+  }
+  if (reply_count > 0 && !readv_all(sock, reply + 1, reply_count, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS)) {
+    disconnect_peer();
+    return -1;
+  }
+  if (readers)
+    *readers |= handed;
+  return PAGE_TRANSFER_OK;
+}
+
+
+int gallocy::memory::PageTransferClient::transfer_all(uint16_t op, const uint64_t *page_numbers, size_t count,
+                                                      uint32_t *hint, uint64_t *readers) {
+  PageTransferRun runs[PAGE_TRANSFER_MAX_PAGES];
+  for (size_t i = 0; i < count; i += PAGE_TRANSFER_MAX_PAGES) {
+    size_t batch = count - i < PAGE_TRANSFER_MAX_PAGES ? count - i : PAGE_TRANSFER_MAX_PAGES;
+    for (size_t j = i; j < i + batch; j++) {
+      if (page_numbers[j] >= pages)
+        return PAGE_TRANSFER_EINVAL;
+    }
+    size_t run_count = page_transfer_runs(page_numbers + i, batch, runs);
+    int status = transfer(op, runs, run_count, hint, readers);
+    if (status != PAGE_TRANSFER_OK)
+      return status;
+    if (op != PAGE_TRANSFER_FETCH)
+      continue;
+    for (size_t j = i; j < i + batch; j++)
+      present[page_numbers[j] / 64] |= 1ULL << (page_numbers[j] % 64);
+    pages_fetched += batch;
+  }
+  return PAGE_TRANSFER_OK;
+}
+
+
+bool gallocy::memory::PageTransferClient::fetch(const uint64_t *page_numbers, size_t count) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return transfer_all(PAGE_TRANSFER_FETCH, page_numbers, count, nullptr) == PAGE_TRANSFER_OK;
+}
+
+
+size_t gallocy::memory::PageTransferClient::fetch_missing(uint64_t *page_numbers, size_t count) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  size_t missing = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (page_numbers[i] < pages && !present_bit(page_numbers[i]))
+      page_numbers[missing++] = page_numbers[i];
+  }
+  if (missing == 0 || transfer_all(PAGE_TRANSFER_FETCH, page_numbers, missing, nullptr) != PAGE_TRANSFER_OK)
+    return 0;
+  return missing;
+}
+
+
+bool gallocy::memory::PageTransferClient::push(const uint64_t *page_numbers, size_t count) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return transfer_all(PAGE_TRANSFER_PUSH, page_numbers, count, nullptr) == PAGE_TRANSFER_OK;
+}
+
+
+int gallocy::memory::PageTransferClient::request(uint16_t op, const uint64_t *page_numbers, size_t count,
+                                                 uint32_t *hint, uint64_t *readers) {
+  std::lock_guard<std::mutex> lock(access_lock);
+  return transfer_all(op, page_numbers, count, hint, readers);
+}
+
+
+int gallocy::memory::PageTransferClient::exchange(uint16_t op, const uint8_t *message, size_t length,
+                                                  uint8_t *reply, size_t *reply_length, size_t capacity) {
+  PageTransferHeader header;
+  struct iovec iov[2];
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (length > PAGE_TRANSFER_MAX_MESSAGE)
+    return PAGE_TRANSFER_EINVAL;
+  if (!connect_peer())
+    return -1;
+
+  header.magic = PAGE_TRANSFER_MAGIC;
+  header.op = op;
+  header.status = PAGE_TRANSFER_OK;
+  header.node = node;
+  header.run_count = 0;
+  header.page_count = 0;
+  header.length = length;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<uint8_t *>(message);
+  iov[1].iov_len = length;
+  if (!writev_all(sock, iov, 2, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS)) {
+    LOG_WARNING("Failed to send a page transfer message to " << peer.get_string());
+    disconnect_peer();
+    return -1;
+  }
+  round_trips++;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  if (!readv_all(sock, iov, 1, now_ms() + PAGE_TRANSFER_REPLY_TIMEOUT_MS) || header.magic != PAGE_TRANSFER_MAGIC
+      || header.length > capacity) {
+    LOG_WARNING("Page transfer peer " << peer.get_string() << " did not reply");
+    disconnect_peer();
+    return -1;
+  }
+  iov[0].iov_base = reply;
+  iov[0].iov_len = header.length;
+  if (header.length > 0 && !readv_all(sock, iov, 1, now_ms() + PAGE_TRANSFER_IO_TIMEOUT_MS)) {
+    disconnect_peer();
+    return -1;
+  }
+  *reply_length = header.length;
+  return header.status;
+}
+
+
+bool gallocy::memory::PageTransferClient::fault(uint64_t page) {
+  uint64_t batch[PAGE_TRANSFER_MAX_PAGES];
+  size_t count = 0;
+
+  std::lock_guard<std::mutex> lock(access_lock);
+  if (page >= pages)
+    return false;
+  if (present_bit(page))
+    return true;
+
+  // GATHER the faulting page and any missing neighbours after it.
+  batch[count++] = page;
+  for (uint64_t p = page + 1; p <= page + prefetch_window && p < pages && count < PAGE_TRANSFER_MAX_PAGES; p++) {
+    if (!present_bit(p))
+      batch[count++] = p;
+  }
+  if (transfer_all(PAGE_TRANSFER_FETCH, batch, count, nullptr) != PAGE_TRANSFER_OK)
+    return false;
+  pages_prefetched += count - 1;
+  return true;
+}
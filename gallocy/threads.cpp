@@ -2,10 +2,13 @@
 
 #include <dlfcn.h>
 
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <atomic>
+
 #include "gallocy/utils/logging.h"
 
 
@@ -13,6 +16,99 @@ extern "C" pthread_create_function __gallocy_pthread_create = nullptr;
 extern "C" pthread_join_function __gallocy_pthread_join = nullptr;
 
 
+static std::atomic<bool> sync_hooks_enabled(false);
+static sync_hook_function sync_acquire_hook = nullptr;
+static sync_hook_function sync_release_hook = nullptr;
+static sync_translate_function sync_translate_hook = nullptr;
+static sync_try_function sync_try_hook = nullptr;
+static void *sync_hook_arg = nullptr;
+static __thread uint64_t sync_hook_depth = 0;
+
+
+/**
+ * Look up the next definition of a symbol that gallocy interposes.
+ *
+ * The lookup is cached by the caller, since mutexes are locked far too often
+ * to pay for ``dlsym`` every time.
+ */
+#define LIBRARY_FUNCTION(type, name)                                          \
+  static type __library_##name = nullptr;                                     \
+  if (__library_##name == nullptr)                                            \
+    __library_##name = reinterpret_cast<type>                                 \
+      (reinterpret_cast<uint64_t *>(dlsym(RTLD_NEXT, #name)));
+
+
+/**
+ * Run a synchronization hook, unless the calling thread is gallocy's own.
+ */
+static inline void run_sync_hook(sync_hook_function *hook, void *object, int kind) {
+  if (!sync_hooks_enabled.load(std::memory_order_acquire) || sync_hook_depth)
+    return;
+  sync_hook_depth++;
+  (*hook)(sync_hook_arg, object, kind);
+  sync_hook_depth--;
+}
+
+
+/**
+ * Run the try hook, or the acquire hook if there is none, unless the calling
+ * thread is gallocy's own.
+ *
+ * \return False if the try hook refused the acquire.
+ */
+static inline bool run_sync_try_hook(void *object, int kind) {
+  if (!sync_hooks_enabled.load(std::memory_order_acquire) || sync_hook_depth)
+    return true;
+  if (!sync_try_hook) {
+    run_sync_hook(&sync_acquire_hook, object, kind);
+    return true;
+  }
+  sync_hook_depth++;
+  bool acquired = sync_try_hook(sync_hook_arg, object, kind);
+  sync_hook_depth--;
+  return acquired;
+}
+
+
+/**
+ * Translate a synchronization object, unless the calling thread is gallocy's
+ * own.
+ */
+template <typename T>
+static inline T *translate_sync_object(T *object, int kind) {
+  if (!sync_hooks_enabled.load(std::memory_order_acquire) || sync_hook_depth || !sync_translate_hook)
+    return object;
+  sync_hook_depth++;
+  T *translated = reinterpret_cast<T *>(sync_translate_hook(sync_hook_arg, object, kind));
+  sync_hook_depth--;
+  return translated;
+}
+
+
+void set_sync_hooks(sync_hook_function acquire, sync_hook_function release, void *arg,
+                    sync_translate_function translate, sync_try_function try_acquire) {
+  sync_hooks_enabled.store(false, std::memory_order_release);
+  if (acquire == nullptr || release == nullptr)
+    return;
+  sync_acquire_hook = acquire;
+  sync_release_hook = release;
+  sync_translate_hook = translate;
+  sync_try_hook = try_acquire;
+  sync_hook_arg = arg;
+  sync_hooks_enabled.store(true, std::memory_order_release);
+}
+
+
+SyncHookGuard::SyncHookGuard() {
+  sync_hook_depth++;
+}
+
+
+SyncHookGuard::~SyncHookGuard() {
+  sync_hook_depth--;
+}
+
+
 /**
  * Page align a pointer.
  *
@@ -101,5 +197,82 @@ extern "C" int pthread_join(pthread_t thread, void **value_ptr) {
       << reinterpret_cast<uint64_t *>(pthread_join)
       << ")");
 #endif
-  return __library_pthread_join(thread, value_ptr);
+  int ret = __library_pthread_join(thread, value_ptr);
+  if (ret == 0) {
+    run_sync_hook(&sync_release_hook, nullptr, SYNC_JOIN);
+    run_sync_hook(&sync_acquire_hook, nullptr, SYNC_JOIN);
+  }
+  return ret;
+}
+
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex) throw() {
+  LIBRARY_FUNCTION(pthread_mutex_lock_function, pthread_mutex_lock);
+  int ret = __library_pthread_mutex_lock(translate_sync_object(mutex, SYNC_MUTEX));
+  if (ret == 0)
+    run_sync_hook(&sync_acquire_hook, mutex, SYNC_MUTEX);
+  return ret;
+}
+
+
+extern "C" int pthread_mutex_trylock(pthread_mutex_t *mutex) throw() {
+  LIBRARY_FUNCTION(pthread_mutex_trylock_function, pthread_mutex_trylock);
+  LIBRARY_FUNCTION(pthread_mutex_unlock_function, pthread_mutex_unlock);
+  pthread_mutex_t *translated = translate_sync_object(mutex, SYNC_MUTEX);
+  int ret = __library_pthread_mutex_trylock(translated);
+  // GIVE the mutex back if the hook could not acquire it without waiting.
+  if (ret == 0 && !run_sync_try_hook(mutex, SYNC_MUTEX)) {
+    __library_pthread_mutex_unlock(translated);
+    return EBUSY;
+  }
+  return ret;
+}
+
+
+extern "C" int pthread_mutex_unlock(pthread_mutex_t *mutex) throw() {
+  LIBRARY_FUNCTION(pthread_mutex_unlock_function, pthread_mutex_unlock);
+  run_sync_hook(&sync_release_hook, mutex, SYNC_MUTEX);
+  return __library_pthread_mutex_unlock(translate_sync_object(mutex, SYNC_MUTEX));
+}
+
+
+extern "C" int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  LIBRARY_FUNCTION(pthread_cond_wait_function, pthread_cond_wait);
+  run_sync_hook(&sync_release_hook, mutex, SYNC_MUTEX);
+  int ret = __library_pthread_cond_wait(translate_sync_object(cond, SYNC_COND),
+                                        translate_sync_object(mutex, SYNC_MUTEX));
+  run_sync_hook(&sync_acquire_hook, mutex, SYNC_MUTEX);
+  return ret;
+}
+
+
+extern "C" int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+    const struct timespec *abstime) {
+  LIBRARY_FUNCTION(pthread_cond_timedwait_function, pthread_cond_timedwait);
+  run_sync_hook(&sync_release_hook, mutex, SYNC_MUTEX);
+  int ret = __library_pthread_cond_timedwait(translate_sync_object(cond, SYNC_COND),
+                                             translate_sync_object(mutex, SYNC_MUTEX), abstime);
+  run_sync_hook(&sync_acquire_hook, mutex, SYNC_MUTEX);
+  return ret;
+}
+
+
+extern "C" int pthread_cond_signal(pthread_cond_t *cond) throw() {
+  LIBRARY_FUNCTION(pthread_cond_signal_function, pthread_cond_signal);
+  return __library_pthread_cond_signal(translate_sync_object(cond, SYNC_COND));
+}
+
+
+extern "C" int pthread_cond_broadcast(pthread_cond_t *cond) throw() {
+  LIBRARY_FUNCTION(pthread_cond_signal_function, pthread_cond_broadcast);
+  return __library_pthread_cond_broadcast(translate_sync_object(cond, SYNC_COND));
+}
+
+
+extern "C" int pthread_barrier_wait(pthread_barrier_t *barrier) throw() {
+  LIBRARY_FUNCTION(pthread_barrier_wait_function, pthread_barrier_wait);
+  run_sync_hook(&sync_release_hook, barrier, SYNC_BARRIER);
+  int ret = __library_pthread_barrier_wait(barrier);
+  run_sync_hook(&sync_acquire_hook, barrier, SYNC_BARRIER);
+  return ret;
 }
@@ -132,8 +132,8 @@ int diff(
   }
 
   // Now we can proceed with building the output
-  mem1_alignment = reinterpret_cast<char *>(internal_malloc(sizeof(char) * longest));
-  mem2_alignment = reinterpret_cast<char *>(internal_malloc(sizeof(char) * longest));
+  mem1_alignment = reinterpret_cast<char *>(internal_malloc(sizeof(char) * (longest + 1)));
+  mem2_alignment = reinterpret_cast<char *>(internal_malloc(sizeof(char) * (longest + 1)));
   memset(mem1_alignment, 0, longest);
   memset(mem2_alignment, 0, longest);
   mem1_alignment[longest] = 0;
@@ -142,7 +142,7 @@ int diff(
   int _alignment_idx = longest - 1;
 
   cur = &_matrix[y_matrix_len-1][x_matrix_len-1];
-  while (cur != NULL) {
+  while (cur->traceback != NULL) {
     if (_matrix[cur->y][cur->x].traceback == &_matrix[cur->y-1][cur->x-1]) {
       mem1_alignment[_alignment_idx] = mem1[cur->y-1];
       mem2_alignment[_alignment_idx] = mem2[cur->x-1];
@@ -0,0 +1,158 @@
+#include "gallocy/utils/lz.h"
+
+#include <stdint.h>
+
+#include <cstring>
+
+// The smallest match worth encoding.
+#define LZ_MIN_MATCH 4
+// The format requires the last bytes of a block to be literals.
+#define LZ_LAST_LITERALS 5
+// A match may not start within this many bytes of the end of a block.
+#define LZ_MATCH_LIMIT 12
+// Back references are encoded in two bytes.
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static inline uint32_t hash32(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+/**
+ * Write a length that overflowed its token nibble.
+ */
+static inline bool write_length(uint8_t *dst, size_t cap, size_t &op, size_t len) {
+  while (len >= 255) {
+    if (op >= cap)
+      return false;
+    dst[op++] = 255;
+    len -= 255;
+  }
+  if (op >= cap)
+    return false;
+  dst[op++] = static_cast<uint8_t>(len);
+  return true;
+}
+
+
+/**
+ * Write one sequence: a literal run optionally followed by a back reference.
+ */
+static inline bool write_sequence(uint8_t *dst, size_t cap, size_t &op,
+                                  const uint8_t *literals, size_t literal_len,
+                                  size_t offset, size_t match_len) {
+  if (op >= cap)
+    return false;
+  size_t token = op++;
+  dst[token] = static_cast<uint8_t>((literal_len < 15 ? literal_len : 15) << 4);
+  if (literal_len >= 15 && !write_length(dst, cap, op, literal_len - 15))
+    return false;
+  if (op + literal_len > cap)
+    return false;
+  memcpy(dst + op, literals, literal_len);
+  op += literal_len;
+  if (match_len == 0)
+    return true;
+  if (op + 2 > cap)
+    return false;
+  dst[op++] = offset & 0xFF;
+  dst[op++] = (offset >> 8) & 0xFF;
+  match_len -= LZ_MIN_MATCH;
+  dst[token] |= static_cast<uint8_t>(match_len < 15 ? match_len : 15);
+  if (match_len >= 15 && !write_length(dst, cap, op, match_len - 15))
+    return false;
+  return true;
+}
+
+
+size_t utils::lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  // Positions are stored off by one so that zero means empty.
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  size_t op = 0;
+  size_t anchor = 0;
+  if (len > LZ_MATCH_LIMIT) {
+    size_t ip = 0;
+    size_t limit = len - LZ_MATCH_LIMIT;
+    while (ip < limit) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = hash32(seq);
+      size_t ref = table[h];
+      table[h] = static_cast<uint32_t>(ip + 1);
+      if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+        ip++;
+        continue;
+      }
+      ref--;
+      size_t match_len = LZ_MIN_MATCH;
+      while (ip + match_len < len - LZ_LAST_LITERALS && src[ip + match_len] == src[ref + match_len])
+        match_len++;
+      if (!write_sequence(dst, cap, op, src + anchor, ip - anchor, ip - ref, match_len))
+        return 0;
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+  if (!write_sequence(dst, cap, op, src + anchor, len - anchor, 0, 0))
+    return 0;
+  return op;
+}
+
+
+int64_t utils::lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    size_t literal_len = token >> 4;
+    if (literal_len == 15) {
+      uint8_t b;
+      do {
+        if (ip >= len)
+          return -1;
+        b = src[ip++];
+        literal_len += b;
+      } while (b == 255);
+    }
+    if (literal_len > len - ip || literal_len > cap - op)
+      return -1;
+    memcpy(dst + op, src + ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    // The last sequence has no back reference.
+    if (ip == len)
+      break;
+    if (ip + 2 > len)
+      return -1;
+    size_t offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+    size_t match_len = token & 0xF;
+    if (match_len == 15) {
+      uint8_t b;
+      do {
+        if (ip >= len)
+          return -1;
+        b = src[ip++];
+        match_len += b;
+      } while (b == 255);
+    }
+    match_len += LZ_MIN_MATCH;
+    if (match_len > cap - op)
+      return -1;
+    // COPY byte by byte since a match may overlap its own output.
+    for (size_t i = 0; i < match_len; i++, op++)
+      dst[op] = dst[op - offset];
+  }
+  return op;
+}
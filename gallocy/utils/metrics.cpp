@@ -0,0 +1,116 @@
+#include "gallocy/utils/metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "gallocy/allocators/internal.h"
+
+
+static std::mutex metrics_lock;
+
+
+/**
+ * Get the registered sources.
+ *
+ * The map lives in internal memory and is never destroyed, so sources can
+ * unregister from static destructors in any order.
+ */
+static gallocy::map<gallocy::string, utils::MetricsSource> &sources() {
+  static gallocy::map<gallocy::string, utils::MetricsSource> *map = nullptr;
+  if (map == nullptr)
+    map = new (internal_malloc(sizeof(gallocy::map<gallocy::string, utils::MetricsSource>)))
+      gallocy::map<gallocy::string, utils::MetricsSource>();
+  return *map;
+}
+
+
+void utils::register_metrics(const gallocy::string &name, MetricsSource source) {
+  std::lock_guard<std::mutex> lock(metrics_lock);
+  sources()[name] = source;
+}
+
+
+void utils::unregister_metrics(const gallocy::string &name) {
+  std::lock_guard<std::mutex> lock(metrics_lock);
+  sources().erase(name);
+}
+
+
+gallocy::json utils::collect_metrics() {
+  gallocy::json metrics = gallocy::json::object();
+  std::lock_guard<std::mutex> lock(metrics_lock);
+  for (auto &it : sources())
+    metrics[it.first.c_str()] = it.second();
+  return metrics;
+}
+
+
+/**
+ * Get the bucket a value falls in.
+ */
+static inline uint64_t histogram_bucket(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+
+/**
+ * Get the largest value a bucket holds.
+ */
+static inline uint64_t histogram_upper(uint64_t bucket) {
+  return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : (1ULL << bucket) - 1;
+}
+
+
+utils::Histogram::Histogram()
+  : count(0),
+    sum(0),
+    max(0) {
+  for (uint64_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    buckets[i].store(0, std::memory_order_relaxed);
+}
+
+
+void utils::Histogram::record(uint64_t value) {
+  buckets[histogram_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+  uint64_t previous = max.load(std::memory_order_relaxed);
+  while (value > previous && !max.compare_exchange_weak(previous, value, std::memory_order_relaxed)) {}
+}
+
+
+uint64_t utils::Histogram::get_percentile(double fraction) const {
+  uint64_t total = get_count();
+  if (total == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(fraction * total);
+  uint64_t seen = 0;
+  for (uint64_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen > rank)
+      return std::min(histogram_upper(i), get_max());
+  }
+  return get_max();
+}
+
+
+gallocy::json utils::Histogram::to_json() const {
+  gallocy::json histogram = {
+    { "count", get_count() },
+    { "sum", sum.load(std::memory_order_relaxed) },
+    { "max", get_max() },
+    { "p50", get_percentile(0.50) },
+    { "p90", get_percentile(0.90) },
+    { "p99", get_percentile(0.99) },
+  };
+  gallocy::json counts = gallocy::json::object();
+  for (uint64_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t n = buckets[i].load(std::memory_order_relaxed);
+    if (n)
+      counts[std::to_string(histogram_upper(i)).c_str()] = n;
+  }
+  histogram["buckets"] = counts;
+  return histogram;
+}
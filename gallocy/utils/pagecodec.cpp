@@ -0,0 +1,176 @@
+#include "gallocy/utils/pagecodec.h"
+
+#include <stdint.h>
+
+#include <cstring>
+
+#include "gallocy/utils/lz.h"
+#include "gallocy/utils/pagediff.h"
+
+
+static inline bool write_op(uint8_t *out, size_t cap, size_t &op, uint64_t kind, uint64_t length) {
+  size_t n = utils::varint_encode(length << 2 | kind, out + op, cap - op);
+  op += n;
+  return n != 0;
+}
+
+
+static inline bool write_copy(const uint8_t *page, uint8_t *out, size_t cap, size_t &op,
+                              uint32_t start, uint32_t end) {
+  if (!write_op(out, cap, op, PAGE_CODEC_OP_COPY, end - start))
+    return false;
+  if (end - start > cap - op)
+    return false;
+  memcpy(out + op, page + start, end - start);
+  op += end - start;
+  return true;
+}
+
+
+/**
+ * Write the op stream for a set of runs.
+ */
+static bool encode_ops(const uint8_t *page, const utils::PageDiffRun *runs, size_t run_count,
+                       uint8_t *out, size_t cap, size_t *len) {
+  size_t op = 0;
+  uint32_t cursor = 0;
+  for (size_t r = 0; r < run_count; r++) {
+    uint32_t start = runs[r].offset;
+    uint32_t end = start + runs[r].length;
+    if (start > cursor && !write_op(out, cap, op, PAGE_CODEC_OP_SKIP, start - cursor))
+      return false;
+    // SPLIT the run into literals and runs of zeros.
+    uint32_t literal_start = start;
+    uint32_t i = start;
+    while (i < end) {
+      if (page[i] != 0) {
+        i++;
+        continue;
+      }
+      uint32_t j = i;
+      while (j < end && page[j] == 0)
+        j++;
+      if (j - i >= PAGE_CODEC_MIN_ZERO_RUN) {
+        if (i > literal_start && !write_copy(page, out, cap, op, literal_start, i))
+          return false;
+        if (!write_op(out, cap, op, PAGE_CODEC_OP_ZERO, j - i))
+          return false;
+        literal_start = j;
+      }
+      i = j;
+    }
+    if (end > literal_start && !write_copy(page, out, cap, op, literal_start, end))
+      return false;
+    cursor = end;
+  }
+  *len = op;
+  return true;
+}
+
+
+/**
+ * Apply an op stream to a page.
+ */
+static bool apply_ops(const uint8_t *in, size_t len, uint8_t *page) {
+  size_t ip = 0;
+  uint64_t cursor = 0;
+  while (ip < len) {
+    uint64_t header;
+    size_t n = utils::varint_decode(in + ip, len - ip, &header);
+    if (n == 0)
+      return false;
+    ip += n;
+    uint64_t length = header >> 2;
+    if (length > PAGE_SZ - cursor)
+      return false;
+    switch (header & 0x3) {
+      case PAGE_CODEC_OP_SKIP:
+        break;
+      case PAGE_CODEC_OP_COPY:
+        if (length > len - ip)
+          return false;
+        memcpy(page + cursor, in + ip, length);
+        ip += length;
+        break;
+      case PAGE_CODEC_OP_ZERO:
+        memset(page + cursor, 0, length);
+        break;
+      default:
+        return false;
+    }
+    cursor += length;
+  }
+  return true;
+}
+
+
+size_t utils::page_encode(const void *page, const void *twin, uint8_t *out, size_t cap, double compress_density) {
+  utils::PageDiffRun runs[PAGE_SZ / 2];
+  size_t run_count = utils::page_diff_runs(page, twin, runs, PAGE_SZ / 2);
+  return page_encode_runs(page, runs, run_count, out, cap, compress_density);
+}
+
+
+size_t utils::page_encode_runs(const void *page, const utils::PageDiffRun *runs, size_t run_count,
+                               uint8_t *out, size_t cap, double compress_density) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(page);
+  size_t len = 0;
+  if (cap < 1)
+    return 0;
+
+  uint64_t changed = 0;
+  for (size_t r = 0; r < run_count; r++)
+    changed += runs[r].length;
+
+  if (changed == 0 || changed < compress_density * PAGE_SZ) {
+    // SPARSE diffs are encoded straight into the output.
+    out[0] = PAGE_CODEC_RUNS;
+    if (!encode_ops(p, runs, run_count, out + 1, cap - 1, &len))
+      return 0;
+    return len + 1;
+  }
+
+  // DENSE diffs are encoded to the side and compressed into the output.
+  uint8_t scratch[PAGE_CODEC_MAX_SZ];
+  if (!encode_ops(p, runs, run_count, scratch, sizeof(scratch), &len))
+    return 0;
+  uint8_t header[10];
+  size_t header_len = utils::varint_encode(len, header, sizeof(header));
+  size_t overhead = 1 + header_len;
+  if (len > len / 8 + overhead && cap > overhead) {
+    // ONLY keep the compressed form if it saves an eighth.
+    size_t budget = len - len / 8 - overhead;
+    if (budget > cap - overhead)
+      budget = cap - overhead;
+    size_t compressed = utils::lz_compress(scratch, len, out + overhead, budget);
+    if (compressed) {
+      out[0] = PAGE_CODEC_RUNS_LZ;
+      memcpy(out + 1, header, header_len);
+      return overhead + compressed;
+    }
+  }
+  if (len + 1 > cap)
+    return 0;
+  out[0] = PAGE_CODEC_RUNS;
+  memcpy(out + 1, scratch, len);
+  return len + 1;
+}
+
+
+bool utils::page_decode(const uint8_t *in, size_t len, void *page) {
+  uint8_t *p = reinterpret_cast<uint8_t *>(page);
+  if (len < 1)
+    return false;
+  if (in[0] == PAGE_CODEC_RUNS)
+    return apply_ops(in + 1, len - 1, p);
+  if (in[0] != PAGE_CODEC_RUNS_LZ)
+    return false;
+  uint64_t raw_len;
+  size_t n = utils::varint_decode(in + 1, len - 1, &raw_len);
+  if (n == 0 || raw_len > PAGE_CODEC_MAX_SZ)
+    return false;
+  uint8_t scratch[PAGE_CODEC_MAX_SZ];
+  if (utils::lz_decompress(in + 1 + n, len - 1 - n, scratch, raw_len) != static_cast<int64_t>(raw_len))
+    return false;
+  return apply_ops(scratch, raw_len, p);
+}
@@ -0,0 +1,287 @@
+#include "gallocy/utils/pagediff.h"
+
+#include <stdint.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PAGE_DIFF_X86 1
+#endif
+
+
+//
+// Scalar kernels, which are always available.
+//
+
+
+static uint64_t scalar_dirty_lines(const uint8_t *page, const uint8_t *twin) {
+  uint64_t mask = 0;
+  for (uint64_t line = 0; line < PAGE_LINES; line++) {
+    const uint8_t *a = page + line * PAGE_LINE_SZ;
+    const uint8_t *b = twin + line * PAGE_LINE_SZ;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < PAGE_LINE_SZ; i += sizeof(uint64_t)) {
+      uint64_t x;
+      uint64_t y;
+      memcpy(&x, a + i, sizeof(x));
+      memcpy(&y, b + i, sizeof(y));
+      acc |= x ^ y;
+    }
+    if (acc)
+      mask |= 1ULL << line;
+  }
+  return mask;
+}
+
+
+static uint64_t scalar_line_mask(const uint8_t *line, const uint8_t *twin) {
+  uint64_t mask = 0;
+  for (uint64_t i = 0; i < PAGE_LINE_SZ; i++) {
+    if (line[i] != twin[i])
+      mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+
+#ifdef PAGE_DIFF_X86
+
+//
+// SSE2 kernels.
+//
+
+
+__attribute__((target("sse2")))
+static uint64_t sse2_dirty_lines(const uint8_t *page, const uint8_t *twin) {
+  uint64_t mask = 0;
+  for (uint64_t line = 0; line < PAGE_LINES; line++) {
+    const __m128i *a = reinterpret_cast<const __m128i *>(page + line * PAGE_LINE_SZ);
+    const __m128i *b = reinterpret_cast<const __m128i *>(twin + line * PAGE_LINE_SZ);
+    __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128(a + 0), _mm_loadu_si128(b + 0));
+    __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128(a + 1), _mm_loadu_si128(b + 1));
+    __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128(a + 2), _mm_loadu_si128(b + 2));
+    __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128(a + 3), _mm_loadu_si128(b + 3));
+    __m128i e = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+    if (_mm_movemask_epi8(e) != 0xFFFF)
+      mask |= 1ULL << line;
+  }
+  return mask;
+}
+
+
+__attribute__((target("sse2")))
+static uint64_t sse2_line_mask(const uint8_t *line, const uint8_t *twin) {
+  const __m128i *a = reinterpret_cast<const __m128i *>(line);
+  const __m128i *b = reinterpret_cast<const __m128i *>(twin);
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(a + i), _mm_loadu_si128(b + i)));
+    mask |= static_cast<uint64_t>(~eq & 0xFFFF) << (16 * i);
+  }
+  return mask;
+}
+
+
+//
+// AVX2 kernels.
+//
+
+
+__attribute__((target("avx2")))
+static uint64_t avx2_dirty_lines(const uint8_t *page, const uint8_t *twin) {
+  uint64_t mask = 0;
+  for (uint64_t line = 0; line < PAGE_LINES; line++) {
+    const __m256i *a = reinterpret_cast<const __m256i *>(page + line * PAGE_LINE_SZ);
+    const __m256i *b = reinterpret_cast<const __m256i *>(twin + line * PAGE_LINE_SZ);
+    __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256(a + 0), _mm256_loadu_si256(b + 0));
+    __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256(a + 1), _mm256_loadu_si256(b + 1));
+    __m256i x = _mm256_or_si256(x0, x1);
+    if (!_mm256_testz_si256(x, x))
+      mask |= 1ULL << line;
+  }
+  return mask;
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t avx2_line_mask(const uint8_t *line, const uint8_t *twin) {
+  const __m256i *a = reinterpret_cast<const __m256i *>(line);
+  const __m256i *b = reinterpret_cast<const __m256i *>(twin);
+  uint32_t eq0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(a + 0), _mm256_loadu_si256(b + 0)));
+  uint32_t eq1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(a + 1), _mm256_loadu_si256(b + 1)));
+  return static_cast<uint64_t>(~eq0) | (static_cast<uint64_t>(~eq1) << 32);
+}
+
+
+//
+// AVX-512 kernels.
+//
+
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t avx512_dirty_lines(const uint8_t *page, const uint8_t *twin) {
+  uint64_t mask = 0;
+  for (uint64_t line = 0; line < PAGE_LINES; line++) {
+    __m512i a = _mm512_loadu_si512(page + line * PAGE_LINE_SZ);
+    __m512i b = _mm512_loadu_si512(twin + line * PAGE_LINE_SZ);
+    if (_mm512_cmpneq_epi64_mask(a, b))
+      mask |= 1ULL << line;
+  }
+  return mask;
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t avx512_line_mask(const uint8_t *line, const uint8_t *twin) {
+  return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(line), _mm512_loadu_si512(twin));
+}
+
+
+/**
+ * Read an extended control register.
+ *
+ * The processor advertising an instruction set isn't enough: the operating
+ * system must also save the wider registers on a context switch.
+ */
+static uint64_t read_xcr0() {
+  uint32_t eax;
+  uint32_t edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<uint64_t>(edx) << 32) | eax;
+}
+
+#endif  // PAGE_DIFF_X86
+
+
+static const utils::PageDiffKernel kernels[] = {
+  { utils::PAGE_DIFF_SCALAR, "scalar", scalar_dirty_lines, scalar_line_mask },
+#ifdef PAGE_DIFF_X86
+  { utils::PAGE_DIFF_SSE2, "sse2", sse2_dirty_lines, sse2_line_mask },
+  { utils::PAGE_DIFF_AVX2, "avx2", avx2_dirty_lines, avx2_line_mask },
+  { utils::PAGE_DIFF_AVX512, "avx512", avx512_dirty_lines, avx512_line_mask },
+#endif
+};
+
+
+static bool isa_supported(utils::PageDiffIsa isa) {
+  if (isa == utils::PAGE_DIFF_SCALAR)
+    return true;
+#ifdef PAGE_DIFF_X86
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  if (isa == utils::PAGE_DIFF_SSE2)
+    return edx & bit_SSE2;
+  // Everything wider than SSE2 needs the operating system to save YMM state.
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return false;
+  uint64_t xcr0 = read_xcr0();
+  if ((xcr0 & 0x6) != 0x6)
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  if (isa == utils::PAGE_DIFF_AVX2)
+    return ebx & bit_AVX2;
+  if (isa == utils::PAGE_DIFF_AVX512)
+    return (xcr0 & 0xE6) == 0xE6 && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW);
+#endif
+  return false;
+}
+
+
+static const utils::PageDiffKernel *detect_kernel() {
+  const utils::PageDiffKernel *best = &kernels[0];
+  for (auto &kernel : kernels) {
+    if (kernel.isa > best->isa && isa_supported(kernel.isa))
+      best = &kernel;
+  }
+  return best;
+}
+
+
+static const utils::PageDiffKernel *&current_kernel() {
+  static const utils::PageDiffKernel *kernel = detect_kernel();
+  return kernel;
+}
+
+
+const utils::PageDiffKernel &utils::page_diff_kernel() {
+  return *current_kernel();
+}
+
+
+const utils::PageDiffKernel *utils::page_diff_kernel(utils::PageDiffIsa isa) {
+  for (auto &kernel : kernels) {
+    if (kernel.isa == isa)
+      return isa_supported(isa) ? &kernel : nullptr;
+  }
+  return nullptr;
+}
+
+
+bool utils::page_diff_select(utils::PageDiffIsa isa) {
+  const utils::PageDiffKernel *kernel = page_diff_kernel(isa);
+  if (kernel == nullptr)
+    return false;
+  current_kernel() = kernel;
+  return true;
+}
+
+
+uint64_t utils::page_dirty_lines(const void *page, const void *twin) {
+  return page_diff_kernel().dirty_lines(
+      reinterpret_cast<const uint8_t *>(page),
+      reinterpret_cast<const uint8_t *>(twin));
+}
+
+
+size_t utils::page_diff_runs(const void *page, const void *twin, utils::PageDiffRun *runs, size_t max_runs) {
+  return page_diff_runs(page_diff_kernel(), page, twin, runs, max_runs);
+}
+
+
+size_t utils::page_diff_runs(const utils::PageDiffKernel &kernel, const void *page, const void *twin,
+                             utils::PageDiffRun *runs, size_t max_runs) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(page);
+  const uint8_t *t = reinterpret_cast<const uint8_t *>(twin);
+  size_t count = 0;
+  uint32_t run_offset = 0;
+  uint32_t run_length = 0;
+  uint64_t lines = kernel.dirty_lines(p, t);
+  while (lines) {
+    uint32_t line = __builtin_ctzll(lines);
+    lines &= lines - 1;
+    uint32_t base = line * PAGE_LINE_SZ;
+    uint64_t bytes = kernel.line_mask(p + base, t + base);
+    while (bytes) {
+      uint32_t start = __builtin_ctzll(bytes);
+      uint64_t rest = ~(bytes >> start);
+      uint32_t length = rest ? __builtin_ctzll(rest) : PAGE_LINE_SZ - start;
+      if (start + length == PAGE_LINE_SZ)
+        bytes = 0;
+      else
+        bytes &= ~(((1ULL << length) - 1) << start);
+      // EXTEND the open run if this one picks up where it left off,
+      // otherwise CLOSE it and open a new one.
+      if (run_length && run_offset + run_length == base + start) {
+        run_length += length;
+        continue;
+      }
+      if (run_length) {
+        if (count < max_runs)
+          runs[count] = { static_cast<uint16_t>(run_offset), static_cast<uint16_t>(run_length) };
+        count++;
+      }
+      run_offset = base + start;
+      run_length = length;
+    }
+  }
+  if (run_length) {
+    if (count < max_runs)
+      runs[count] = { static_cast<uint16_t>(run_offset), static_cast<uint16_t>(run_length) };
+    count++;
+  }
+  return count;
+}
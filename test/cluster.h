@@ -0,0 +1,89 @@
+#ifndef TEST_CLUSTER_H_
+#define TEST_CLUSTER_H_
+
+#include <sys/mman.h>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/transfer.h"
+
+
+/**
+ * Nodes of a coherence protocol in this process, each over its own shared
+ * region and with its own page transfer server, on consecutive ports.
+ *
+ * Servers listen before they start, so the nodes may talk to each other as
+ * soon as SetUp returns. A fixture adds its own parts to each node with
+ * \ref ClusterTest::start_node, \ref ClusterTest::stop_node, and \ref
+ * ClusterTest::destroy_node.
+ */
+template <typename Protocol, int Nodes, uint64_t Pages>
+class ClusterTest: public ::testing::Test {
+ protected:
+  /**
+   * \param port The first node's port, which is moved past the cluster's
+   * ports once the test is done, so the next test need not wait for the
+   * kernel to release them.
+   */
+  explicit ClusterTest(uint16_t *port) : port(port) {}
+
+  virtual void SetUp() {
+    for (int i = 0; i < Nodes; i++)
+      nodes.push_back(gallocy::common::Peer("127.0.0.1", *port + i));
+    for (int i = 0; i < Nodes; i++) {
+      regions[i] = reinterpret_cast<uint8_t *>(mmap(nullptr, Pages * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+      ASSERT_NE(regions[i], MAP_FAILED);
+      servers[i] = new gallocy::memory::PageTransferServer("127.0.0.1", *port + i, regions[i], Pages);
+      coherence[i] = new Protocol(i, nodes, regions[i], Pages);
+      servers[i]->set_coherence(coherence[i]);
+      start_node(i);
+      servers[i]->start();
+    }
+  }
+
+  virtual void TearDown() {
+    for (int i = 0; i < Nodes; i++)
+      stop_node(i);
+    for (int i = 0; i < Nodes; i++)
+      servers[i]->stop();
+    for (int i = 0; i < Nodes; i++) {
+      delete servers[i];
+      destroy_node(i);
+      delete coherence[i];
+      munmap(regions[i], Pages * PAGE_SZ);
+    }
+    *port += Nodes;
+  }
+
+  /**
+   * Add to a node once its protocol exists, before its server starts.
+   */
+  virtual void start_node(int node) {}
+  /**
+   * Stop a node's own threads, before any server stops.
+   */
+  virtual void stop_node(int node) {}
+  /**
+   * Free what \ref ClusterTest::start_node added to a node, once every
+   * server has stopped and before the node's protocol is freed.
+   */
+  virtual void destroy_node(int node) {}
+
+  uint8_t read(int node, uint64_t page, uint64_t offset = 0) {
+    return *reinterpret_cast<volatile uint8_t *>(regions[node] + page * PAGE_SZ + offset);
+  }
+
+  void write(int node, uint64_t page, uint8_t value, uint64_t offset = 0) {
+    *reinterpret_cast<volatile uint8_t *>(regions[node] + page * PAGE_SZ + offset) = value;
+  }
+
+  uint16_t *port;
+  gallocy::vector<gallocy::common::Peer> nodes;
+  uint8_t *regions[Nodes];
+  gallocy::memory::PageTransferServer *servers[Nodes];
+  Protocol *coherence[Nodes];
+};
+
+#endif  // TEST_CLUSTER_H_
@@ -0,0 +1,112 @@
+#include <stdint.h>
+
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/utils/constants.h"
+#include "gallocy/libgallocy.h"
+
+#define TEST_OBJECTS 16
+
+
+class AffinityTests: public ::testing::Test {
+ protected:
+  virtual void TearDown() {
+    custom_set_placement(PLACEMENT_THREAD);
+    __reset_memory_allocator();
+  }
+
+  /**
+   * Allocate small objects, and collect the pages they are on.
+   */
+  static void allocate_pages(std::set<uint64_t> *pages) {
+    for (int i = 0; i < TEST_OBJECTS; i++)
+      pages->insert(reinterpret_cast<uint64_t>(custom_malloc(48)) / PAGE_SZ);
+  }
+
+  /**
+   * Allocate small objects, and hold the thread's domain until every thread
+   * has allocated.
+   */
+  static void allocate_pages_together(std::set<uint64_t> *pages, std::atomic<int> *waiting) {
+    allocate_pages(pages);
+    (*waiting)--;
+    while (*waiting > 0)
+      std::this_thread::yield();
+  }
+};
+
+
+TEST_F(AffinityTests, ThreadSharesItsPages) {
+  char *first = reinterpret_cast<char *>(custom_malloc(48));
+  char *second = reinterpret_cast<char *>(custom_malloc(48));
+  ASSERT_EQ(reinterpret_cast<uint64_t>(first) / PAGE_SZ, reinterpret_cast<uint64_t>(second) / PAGE_SZ);
+}
+
+
+TEST_F(AffinityTests, ThreadsNeverSharePages) {
+  std::set<uint64_t> pages[2];
+  std::atomic<int> waiting(2);
+  std::thread first(allocate_pages_together, &pages[0], &waiting);
+  std::thread second(allocate_pages_together, &pages[1], &waiting);
+  first.join();
+  second.join();
+  for (auto page : pages[0])
+    ASSERT_EQ(pages[1].count(page), static_cast<size_t>(0));
+}
+
+
+TEST_F(AffinityTests, ExitedThreadsDomainIsReused) {
+  std::set<uint64_t> pages[2];
+  std::thread first(allocate_pages, &pages[0]);
+  first.join();
+  uint64_t domains = custom_get_placement_domains();
+  // THE next thread picks up the partly used spans the first one left.
+  std::thread second(allocate_pages, &pages[1]);
+  second.join();
+  ASSERT_EQ(custom_get_placement_domains(), domains);
+  ASSERT_NE(pages[0].count(*pages[1].begin()), static_cast<size_t>(0));
+}
+
+
+TEST_F(AffinityTests, ThreadsShareWhenDomainsRunOut) {
+  uint64_t overflows = custom_get_placement_overflows();
+  std::vector<std::set<uint64_t> > pages(AFFINITY_DOMAINS);
+  std::atomic<int> waiting(AFFINITY_DOMAINS);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < AFFINITY_DOMAINS; i++)
+    threads.push_back(std::thread(allocate_pages_together, &pages[i], &waiting));
+  for (auto &thread : threads)
+    thread.join();
+  // MORE threads than domains are alive, so at least one had to share.
+  ASSERT_GT(custom_get_placement_overflows(), overflows);
+}
+
+
+TEST_F(AffinityTests, NodePlacementPacksThreads) {
+  custom_set_placement(PLACEMENT_NODE);
+  std::set<uint64_t> pages[2];
+  std::thread first(allocate_pages, &pages[0]);
+  first.join();
+  std::thread second(allocate_pages, &pages[1]);
+  second.join();
+  // BOTH threads fit on the page the first one started.
+  ASSERT_EQ(pages[0].size(), static_cast<size_t>(1));
+  ASSERT_EQ(pages[0], pages[1]);
+}
+
+
+TEST_F(AffinityTests, FreeReturnsToOwner) {
+  void *object = custom_malloc(48);
+  std::thread other([object]() {
+    custom_free(object);
+    // THE freed object belongs to the thread that allocated it.
+    ASSERT_NE(custom_malloc(48), object);
+  });
+  other.join();
+  ASSERT_EQ(custom_malloc(48), object);
+}
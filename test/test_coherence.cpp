@@ -0,0 +1,307 @@
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/prefetch.h"
+#include "gallocy/memory/transfer.h"
+#include "cluster.h"
+
+#define TEST_NODES 3
+#define TEST_REGION_PAGES 256
+
+
+uint16_t COHERENCE_TEST_PORT = 25000;
+
+
+class MRSWCoherenceTests: public ClusterTest<gallocy::memory::MRSWCoherence, TEST_NODES, TEST_REGION_PAGES> {
+ protected:
+  MRSWCoherenceTests() : ClusterTest(&COHERENCE_TEST_PORT) {}
+
+  /**
+   * Start three nodes in this process, each over its own region, with node 0
+   * owning every page.
+   */
+  virtual void SetUp() {
+    ClusterTest::SetUp();
+    for (uint64_t page = 0; page < TEST_REGION_PAGES; page++)
+      memset(regions[0] + page * PAGE_SZ, static_cast<int>(page), PAGE_SZ);
+  }
+
+  /**
+   * Wait for an old owner to finish handing a page over, which it does on
+   * its server thread after the new owner has its reply.
+   */
+  uint8_t handed_over(int node, uint64_t page) {
+    for (int i = 0; i < 100 && coherence[node]->get_permissions(page) != PAGE_PERM_NONE; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return coherence[node]->get_permissions(page);
+  }
+};
+
+
+TEST_F(MRSWCoherenceTests, InitialState) {
+  ASSERT_EQ(coherence[0]->get_permissions(7), PAGE_PERM_WRITE);
+  ASSERT_EQ(coherence[1]->get_permissions(7), PAGE_PERM_NONE);
+  ASSERT_EQ(coherence[2]->get_owner(7), 0);
+}
+
+
+TEST_F(MRSWCoherenceTests, ReadReplicates) {
+  ASSERT_EQ(read(1, 7), 7);
+  ASSERT_EQ(read(2, 7), 7);
+  ASSERT_EQ(coherence[1]->get_permissions(7), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[2]->get_permissions(7), PAGE_PERM_READ);
+  // THE owner keeps the page, but may only read it until it writes again.
+  ASSERT_EQ(coherence[0]->get_permissions(7), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[0]->get_owner(7), 0);
+  ASSERT_EQ(coherence[1]->read_faults, 1);
+  // READING it again does not fault.
+  ASSERT_EQ(read(1, 7), 7);
+  ASSERT_EQ(coherence[1]->read_faults, 1);
+}
+
+
+TEST_F(MRSWCoherenceTests, WriteInvalidatesAtSync) {
+  ASSERT_EQ(read(1, 3), 3);
+  ASSERT_EQ(read(2, 3), 3);
+  write(0, 3, 42);
+  ASSERT_EQ(coherence[0]->get_permissions(3), PAGE_PERM_WRITE);
+  // READERS see the old contents until the writer ends its epoch.
+  ASSERT_EQ(read(1, 3), 3);
+  ASSERT_EQ(coherence[1]->get_permissions(3), PAGE_PERM_READ);
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[0]->invalidation_messages, 2);
+  ASSERT_EQ(coherence[0]->pages_invalidated, 2);
+  ASSERT_EQ(coherence[0]->epochs, 1);
+  ASSERT_EQ(coherence[1]->get_permissions(3), PAGE_PERM_NONE);
+  ASSERT_EQ(coherence[2]->get_permissions(3), PAGE_PERM_NONE);
+  ASSERT_EQ(read(1, 3), 42);
+  ASSERT_EQ(read(2, 3), 42);
+}
+
+
+TEST_F(MRSWCoherenceTests, OwnershipMoves) {
+  write(1, 5, 99);
+  ASSERT_EQ(coherence[1]->get_owner(5), 1);
+  ASSERT_EQ(coherence[1]->get_permissions(5), PAGE_PERM_WRITE);
+  ASSERT_EQ(coherence[1]->write_faults, 1);
+  ASSERT_EQ(handed_over(0, 5), PAGE_PERM_NONE);
+  ASSERT_EQ(coherence[0]->get_owner(5), 1);
+  // NODE 2 still thinks node 0 owns the page, and is sent on to node 1.
+  ASSERT_EQ(coherence[2]->get_owner(5), 0);
+  ASSERT_EQ(read(2, 5), 99);
+  ASSERT_EQ(coherence[2]->get_owner(5), 1);
+  // THE rest of the page came along with the write.
+  ASSERT_EQ(regions[2][5 * PAGE_SZ + 1], 5);
+  // AND node 0 can take it back, along with node 1's reader, which the
+  // writer alone invalidates when it ends its epoch.
+  write(0, 5, 100);
+  ASSERT_EQ(coherence[0]->get_owner(5), 0);
+  ASSERT_EQ(handed_over(1, 5), PAGE_PERM_NONE);
+  ASSERT_EQ(coherence[2]->get_permissions(5), PAGE_PERM_READ);
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[0]->pages_invalidated, 1);
+  ASSERT_EQ(coherence[1]->pages_invalidated, 0);
+  ASSERT_EQ(coherence[2]->get_permissions(5), PAGE_PERM_NONE);
+  ASSERT_EQ(read(2, 5), 100);
+}
+
+
+TEST_F(MRSWCoherenceTests, ReadPrefetchesWindow) {
+  // PAGE 12 is already read, so the window stops short of it.
+  ASSERT_EQ(read(1, 12), 12);
+  coherence[1]->set_prefetch_window(4);
+  ASSERT_EQ(read(1, 9), 9);
+  ASSERT_EQ(coherence[1]->read_faults, 2);
+  ASSERT_EQ(coherence[1]->pages_prefetched, 2);
+  ASSERT_EQ(coherence[1]->get_permissions(10), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[1]->get_permissions(11), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[1]->get_permissions(13), PAGE_PERM_NONE);
+  ASSERT_EQ(read(1, 11), 11);
+  ASSERT_EQ(coherence[1]->read_faults, 2);
+  // THE owner counts the prefetched pages as read.
+  write(0, 10, 1);
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[1]->get_permissions(10), PAGE_PERM_NONE);
+  // A window whose pages moved falls back to the faulting page alone.
+  write(2, 14, 14);
+  ASSERT_EQ(read(1, 13), 13);
+  ASSERT_EQ(coherence[1]->get_permissions(13), PAGE_PERM_READ);
+}
+
+
+TEST_F(MRSWCoherenceTests, PrefetcherReadsAlongStride) {
+  gallocy::memory::PagePrefetcher prefetcher(TEST_REGION_PAGES, "prefetch coherence test",
+                                             [this](uint64_t *page_numbers, size_t count) {
+                                               return coherence[1]->prefetch(page_numbers, count);
+                                             });
+  coherence[1]->set_prefetcher(&prefetcher);
+  prefetcher.start();
+  // THREE read faults with one stride confirm it, and the units after them
+  // along it are read ahead, but stay hidden until touched.
+  ASSERT_EQ(read(1, 20), 20);
+  ASSERT_EQ(read(1, 22), 22);
+  ASSERT_EQ(read(1, 24), 24);
+  for (int i = 0; i < 200 && prefetcher.issued < 2; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_GE(prefetcher.issued, 2);
+  ASSERT_EQ(coherence[1]->get_permissions(26), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[1]->get_permissions(25), PAGE_PERM_NONE);
+  ASSERT_EQ(read(1, 26), 26);
+  ASSERT_EQ(coherence[1]->read_faults, 3);
+  ASSERT_EQ(prefetcher.useful, 1);
+  // A prefetched copy is invalidated like any other, and the prefetcher
+  // counts it as dropped rather than useful when it is next read.
+  for (int i = 0; i < 200 && coherence[1]->get_permissions(28) != PAGE_PERM_READ; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  write(0, 28, 1);
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[1]->get_permissions(28), PAGE_PERM_NONE);
+  ASSERT_EQ(prefetcher.dropped, 1);
+  ASSERT_EQ(read(1, 28), 1);
+  ASSERT_EQ(prefetcher.useful, 1);
+  prefetcher.stop();
+  coherence[1]->set_prefetcher(nullptr);
+}
+
+
+TEST_F(MRSWCoherenceTests, InterceptedMutexSyncs) {
+  // THE shared mutex lives in the region, where other nodes could see it.
+  pthread_mutex_t *mutex = reinterpret_cast<pthread_mutex_t *>(regions[0] + 200 * PAGE_SZ);
+  pthread_mutex_t local = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_init(mutex, nullptr);
+  ASSERT_EQ(read(1, 3), 3);
+  coherence[0]->intercept_synchronization();
+  pthread_mutex_lock(mutex);
+  write(0, 3, 42);
+  // THE protocol's own locking, and a mutex outside the region, end no
+  // epoch, and the protocol never syncs under its own lock.
+  ASSERT_EQ(coherence[0]->get_permissions(3), PAGE_PERM_WRITE);
+  pthread_mutex_lock(&local);
+  pthread_mutex_unlock(&local);
+  ASSERT_EQ(coherence[0]->epochs, 0);
+  pthread_mutex_unlock(mutex);
+  ASSERT_EQ(coherence[0]->epochs, 1);
+  ASSERT_EQ(coherence[1]->get_permissions(3), PAGE_PERM_NONE);
+  ASSERT_EQ(read(1, 3), 42);
+}
+
+
+TEST_F(MRSWCoherenceTests, InvalidationDuringReadIsDeferred) {
+  // STAND in for node 0, so that node 2 can invalidate page 7 on node 1
+  // while node 1's read of it is on its way.
+  servers[0]->stop();
+  delete servers[0];
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int optval = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  struct sockaddr_in name = gallocy::common::Peer("127.0.0.1", COHERENCE_TEST_PORT).get_socket();
+  ASSERT_EQ(bind(listener, reinterpret_cast<struct sockaddr *>(&name), sizeof(name)), 0);
+  ASSERT_EQ(listen(listener, 1), 0);
+  std::thread owner([this, listener]() {
+    int connection = accept(listener, nullptr, nullptr);
+    for (uint8_t value = 1; value <= 2; value++) {
+      gallocy::memory::PageTransferHeader header;
+      gallocy::memory::PageTransferRun run;
+      if (::read(connection, &header, sizeof(header)) != sizeof(header)
+          || ::read(connection, &run, sizeof(run)) != sizeof(run))
+        break;
+      if (value == 1) {
+        gallocy::memory::PageTransferClient writer(gallocy::common::Peer("127.0.0.1", COHERENCE_TEST_PORT + 1),
+                                                   regions[2], TEST_REGION_PAGES);
+        writer.set_node(2);
+        uint64_t page = 7;
+        writer.request(PAGE_TRANSFER_INVALIDATE, &page, 1, nullptr);
+      }
+      uint8_t contents[PAGE_SZ];
+      memset(contents, value, PAGE_SZ);
+      ::write(connection, &header, sizeof(header));
+      ::write(connection, contents, PAGE_SZ);
+    }
+    close(connection);
+  });
+
+  // THE copy that crossed with the invalidation is dropped, not read.
+  ASSERT_TRUE(coherence[1]->read_fault(7));
+  ASSERT_EQ(coherence[1]->get_permissions(7), PAGE_PERM_NONE);
+  ASSERT_TRUE(coherence[1]->read_fault(7));
+  ASSERT_EQ(coherence[1]->get_permissions(7), PAGE_PERM_READ);
+  ASSERT_EQ(read(1, 7), 2);
+  owner.join();
+  close(listener);
+
+  servers[0] = new gallocy::memory::PageTransferServer("127.0.0.1", COHERENCE_TEST_PORT, regions[0],
+                                                       TEST_REGION_PAGES);
+  servers[0]->set_coherence(coherence[0]);
+  servers[0]->start();
+}
+
+
+TEST_F(MRSWCoherenceTests, BatchedInvalidation) {
+  for (uint64_t page = 0; page < 100; page++)
+    ASSERT_EQ(read(1, page), page);
+  for (uint64_t page = 0; page < 100; page++)
+    write(0, page, 1);
+  ASSERT_EQ(coherence[0]->invalidation_messages, 0);
+  coherence[0]->sync();
+  // ONE message carries the whole epoch's invalidations for a reader.
+  ASSERT_EQ(coherence[0]->invalidation_messages, 1);
+  ASSERT_EQ(coherence[0]->pages_invalidated, 100);
+  for (uint64_t page = 0; page < 100; page++)
+    ASSERT_EQ(coherence[1]->get_permissions(page), PAGE_PERM_NONE);
+  // AN empty epoch sends nothing.
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[0]->invalidation_messages, 1);
+  ASSERT_EQ(coherence[0]->epochs, 2);
+}
+
+
+TEST_F(MRSWCoherenceTests, UnitMovesTogether) {
+  // PAGES 16 to 19 are one 16 KiB unit.
+  for (int i = 0; i < TEST_NODES; i++)
+    ASSERT_TRUE(coherence[i]->set_granularity(regions[i] + 16 * PAGE_SZ, 4 * PAGE_SZ, 4 * PAGE_SZ));
+  ASSERT_EQ(coherence[1]->get_granularity(18), 4 * PAGE_SZ);
+  ASSERT_EQ(coherence[1]->get_granularity(20), PAGE_SZ);
+  ASSERT_EQ(read(1, 17), 17);
+  ASSERT_EQ(coherence[1]->read_faults, 1);
+  for (uint64_t page = 16; page < 20; page++)
+    ASSERT_EQ(coherence[1]->get_permissions(page), PAGE_PERM_READ);
+  // ONE write fault takes the whole unit.
+  write(2, 19, 42);
+  ASSERT_EQ(coherence[2]->write_faults, 1);
+  for (uint64_t page = 16; page < 20; page++) {
+    ASSERT_EQ(coherence[2]->get_owner(page), 2);
+    ASSERT_EQ(coherence[2]->get_permissions(page), PAGE_PERM_WRITE);
+    ASSERT_EQ(handed_over(0, page), PAGE_PERM_NONE);
+  }
+  ASSERT_EQ(regions[2][16 * PAGE_SZ], 16);
+  // THE writer owes the reader one invalidation per page of the unit.
+  coherence[0]->sync();
+  ASSERT_EQ(coherence[0]->pages_invalidated, 0);
+  ASSERT_EQ(coherence[1]->get_permissions(16), PAGE_PERM_READ);
+  coherence[2]->sync();
+  ASSERT_EQ(coherence[2]->pages_invalidated, 4);
+  for (uint64_t page = 16; page < 20; page++)
+    ASSERT_EQ(coherence[1]->get_permissions(page), PAGE_PERM_NONE);
+  ASSERT_EQ(read(1, 19), 42);
+  ASSERT_EQ(coherence[1]->read_faults, 2);
+}
+
+
+TEST_F(MRSWCoherenceTests, InvalidGranularity) {
+  // BLOCKS smaller than a page are only kept by release consistency.
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], PAGE_SZ, 256));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0] + PAGE_SZ, 2 * PAGE_SZ, 2 * PAGE_SZ));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], 2 * PAGE_SZ, 3 * PAGE_SZ));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], 2 * COHERENCE_MAX_GRANULARITY,
+                                             2 * COHERENCE_MAX_GRANULARITY));
+}
@@ -10,6 +10,36 @@ TEST(ConfigTests, LoadConfig) {
   GallocyConfig *config = load_config("test/data/config.json");
   // TODO(sholsapp): Free memory.
   ASSERT_NE(config, nullptr);
+  ASSERT_EQ(config->page_port, 8090);
+  ASSERT_EQ(config->prefetch_window, static_cast<uint64_t>(32));
+  ASSERT_EQ(config->placement, PLACEMENT_NODE);
+  ASSERT_EQ(config->coherence, COHERENCY_MRSW);
+  ASSERT_FALSE(config->chunk_leases);
+  ASSERT_TRUE(config->heap_backing.empty());
+  ASSERT_EQ(config->server_shards, static_cast<uint64_t>(4));
+}
+
+
+TEST(ConfigTests, LoadConfigHeapBacking) {
+  GallocyConfig *config = load_config("test/data/config-heap-backing.json");
+  // TODO(sholsapp): Free memory.
+  ASSERT_NE(config, nullptr);
+  ASSERT_TRUE(config->chunk_leases);
+  ASSERT_EQ(config->heap_backing, "/gallocy-test");
+}
+
+
+TEST(ConfigTests, LoadConfigLRC) {
+  GallocyConfig *config = load_config("test/data/config-lrc.json");
+  // TODO(sholsapp): Free memory.
+  ASSERT_NE(config, nullptr);
+  ASSERT_EQ(config->coherence, COHERENCY_LRC);
+  ASSERT_TRUE(config->chunk_leases);
+}
+
+
+TEST(ConfigTests, LoadConfigBadCoherence) {
+  ASSERT_DEATH({ load_config("test/data/config-bad-coherence.json"); }, ".*");
 }
 
 
@@ -18,4 +48,19 @@ TEST(ConfigTests, LoadConfigNoPeers) {
   ASSERT_EQ(config->peer_list.size(), static_cast<uint64_t>(0));
   // TODO(sholsapp): Free memory.
   ASSERT_NE(config, nullptr);
+  ASSERT_EQ(config->page_port, 8081);
+  ASSERT_EQ(config->prefetch_window, static_cast<uint64_t>(PAGE_PREFETCH_WINDOW_DEFAULT));
+  ASSERT_EQ(config->placement, PLACEMENT_THREAD);
+  ASSERT_EQ(config->coherence, COHERENCY_NONE);
+  ASSERT_FALSE(config->chunk_leases);
+  ASSERT_TRUE(config->heap_backing.empty());
+  ASSERT_EQ(config->server_shards, static_cast<uint64_t>(1));
+}
+
+
+TEST(ConfigTests, LoadConfigZeroShards) {
+  GallocyConfig *config = load_config("test/data/config-zero-shards.json");
+  // TODO(sholsapp): Free memory.
+  ASSERT_NE(config, nullptr);
+  ASSERT_EQ(config->server_shards, static_cast<uint64_t>(1));
 }
@@ -8,6 +8,7 @@
 #include "gallocy/allocators/internal.h"
 #include "gallocy/common/peer.h"
 #include "gallocy/consensus/client.h"
+#include "gallocy/consensus/log.h"
 #include "gallocy/consensus/server.h"
 #include "gallocy/consensus/state.h"
 #include "gallocy/http/client.h"
@@ -90,7 +91,7 @@ class ConsensusServerTests: public ::testing::Test {
 
 TEST_F(ConsensusServerTests, StartStop) {
   gallocy::vector<gallocy::http::Request> requests;
-  gallocy::map<gallocy::string, gallocy::string> headers;
+  gallocy::http::Headers headers;
   requests.push_back(gallocy::http::Request("POST", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin", "", headers));
   uint64_t rsp = gallocy::http::CurlClient().multirequest(requests,
       [](const gallocy::http::Response &rsp) {
@@ -100,6 +101,68 @@ TEST_F(ConsensusServerTests, StartStop) {
 }
 
 
+TEST_F(ConsensusServerTests, MultirequestReusesConnections) {
+  gallocy::vector<gallocy::http::Request> requests;
+  requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+  for (int i = 0; i < 5; i++) {
+    uint64_t rsp = gallocy::http::CurlClient().multirequest(requests,
+        [](const gallocy::http::Response &rsp) {
+          return rsp.status_code == 200 && rsp.body == "GOOD";
+        }, nullptr, nullptr);
+    ASSERT_EQ(rsp, static_cast<uint64_t>(1));
+  }
+  // EVERY round reused the first round's connection.
+  gallocy::json metrics = gallocy_server->get_metrics();
+  ASSERT_EQ(metrics["shards"][0]["accepted"], 1);
+  ASSERT_EQ(metrics["shards"][0]["requests"], 5);
+}
+
+
+TEST_F(ConsensusServerTests, MultirequestReturnsAtMajority) {
+  // LISTEN on a socket that never answers, standing in for a slow peer.
+  int slow = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in slow_sockaddr = gallocy::common::Peer("127.0.0.1", 0).get_socket();
+  ASSERT_EQ(bind(slow, reinterpret_cast<struct sockaddr *>(&slow_sockaddr), sizeof(slow_sockaddr)), 0);
+  ASSERT_EQ(listen(slow, 4), 0);
+  socklen_t slow_sockaddr_len = sizeof(slow_sockaddr);
+  getsockname(slow, reinterpret_cast<struct sockaddr *>(&slow_sockaddr), &slow_sockaddr_len);
+
+  gallocy::vector<gallocy::http::Request> requests;
+  requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+  requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+  requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", ntohs(slow_sockaddr.sin_port)), "/admin"));
+  auto start = std::chrono::steady_clock::now();
+  uint64_t rsp = gallocy::http::CurlClient().multirequest(requests,
+      [](const gallocy::http::Response &rsp) {
+        return rsp.status_code == 200;
+      }, nullptr, nullptr);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(rsp, static_cast<uint64_t>(2));
+  ASSERT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), CLIENT_ROUND_MS);
+  close(slow);
+}
+
+
+TEST_F(ConsensusServerTests, UDPRequests) {
+  gallocy::http::Response *rsp = gallocy::http::UDPClient().request(
+    gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+  ASSERT_EQ(rsp->status_code, static_cast<uint64_t>(200));
+  ASSERT_EQ(rsp->body, "GOOD");
+  ASSERT_TRUE(rsp->headers.has("X-Request-Id"));
+  rsp->~Response();
+  internal_free(rsp);
+
+  gallocy::vector<gallocy::http::Request> requests;
+  for (int i = 0; i < 4; i++)
+    requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+  uint64_t successes = gallocy::http::UDPClient().multirequest(requests,
+      [](const gallocy::http::Response &rsp) {
+        return rsp.status_code == 200 && rsp.body == "GOOD";
+      }, nullptr, nullptr);
+  ASSERT_GE(successes, static_cast<uint64_t>(2));
+}
+
+
 TEST_F(ConsensusServerTests, RequestVote) {
   uint64_t votes = gallocy_client->send_request_vote();
   ASSERT_EQ(votes, static_cast<uint64_t>(1));
@@ -110,3 +173,264 @@ TEST_F(ConsensusServerTests, AppendEntries) {
   uint64_t successes = gallocy_client->send_append_entries();
   ASSERT_EQ(successes, static_cast<uint64_t>(1));
 }
+
+
+TEST_F(ConsensusServerTests, ConcurrentRequests) {
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> status_codes(32, 0);
+  for (uint64_t i = 0; i < status_codes.size(); i++) {
+    threads.push_back(std::thread([&status_codes, i]() {
+      gallocy::http::Response *rsp = gallocy::http::CurlClient().request(
+        gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+      status_codes[i] = rsp->status_code;
+      rsp->~Response();
+      internal_free(rsp);
+    }));
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (auto status_code : status_codes)
+    ASSERT_EQ(status_code, static_cast<uint64_t>(200));
+}
+
+
+TEST_F(ConsensusServerTests, LargeBody) {
+  // A body this large arrives in pieces, after cURL is asked to continue.
+  gallocy::json j = {
+    { "entries", gallocy::json::array() },
+    { "leader_commit", 0 },
+    { "previous_log_index", 0 },
+    { "previous_log_term", 0 },
+    { "term", gallocy_state->get_current_term() },
+  };
+  for (int i = 0; i < 64; i++) {
+    gallocy::consensus::LogEntry entry(gallocy::consensus::Command(gallocy::string(1024, 'a')), 0);
+    j["entries"].push_back(entry.to_json());
+  }
+  gallocy::http::Headers headers;
+  headers.set("Content-Type", "application/json");
+  gallocy::http::Response *rsp = gallocy::http::CurlClient().request(
+    gallocy::http::Request("POST", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/raft/append_entries", j.dump(), headers));
+  ASSERT_EQ(rsp->status_code, static_cast<uint64_t>(200));
+  ASSERT_EQ(gallocy::json::parse(rsp->body.c_str())["success"], true);
+  rsp->~Response();
+  internal_free(rsp);
+}
+
+
+TEST(ConsensusShardTests, ConnectionsSpreadAcrossShards) {
+  uint16_t port = 10500;
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config("127.0.0.1", peer_list, port);
+  config.server_shards = 4;
+  gallocy::consensus::GallocyServer server(config);
+  server.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+  // EACH request is a new connection, which the kernel hands to one shard.
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> status_codes(64, 0);
+  for (uint64_t i = 0; i < status_codes.size(); i++) {
+    threads.push_back(std::thread([&status_codes, i, port]() {
+      gallocy::http::Response *rsp = gallocy::http::CurlClient().request(
+        gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", port), "/admin"));
+      status_codes[i] = rsp->status_code;
+      rsp->~Response();
+      internal_free(rsp);
+    }));
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (auto status_code : status_codes)
+    ASSERT_EQ(status_code, static_cast<uint64_t>(200));
+
+  gallocy::json metrics = server.get_metrics();
+  server.stop();
+  ASSERT_EQ(metrics["shards"].size(), static_cast<uint64_t>(4));
+  uint64_t requests = 0;
+  uint64_t busy_shards = 0;
+  for (auto shard : metrics["shards"]) {
+    uint64_t shard_requests = shard["requests"];
+    requests += shard_requests;
+    busy_shards += shard_requests > 0;
+  }
+  ASSERT_EQ(requests, status_codes.size());
+  ASSERT_GT(busy_shards, static_cast<uint64_t>(1));
+}
+
+
+TEST(ConsensusShardTests, EpollFallback) {
+  uint16_t port = 10600;
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config("127.0.0.1", peer_list, port);
+  gallocy::consensus::GallocyServer server(config);
+  server.use_uring = false;
+  server.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+  gallocy::http::Response *rsp = gallocy::http::CurlClient().request(
+    gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", port), "/admin"));
+  ASSERT_EQ(rsp->status_code, static_cast<uint64_t>(200));
+  rsp->~Response();
+  internal_free(rsp);
+
+  gallocy::json metrics = server.get_metrics();
+  server.stop();
+  ASSERT_EQ(metrics["shards"][0]["backend"], "epoll");
+  ASSERT_EQ(metrics["shards"][0]["requests"], static_cast<uint64_t>(1));
+}
+
+
+TEST_F(ConsensusServerTests, Backend) {
+  gallocy::json metrics = gallocy_server->get_metrics();
+  ASSERT_EQ(metrics["shards"][0]["backend"], gallocy::http::Uring::supported() ? "io_uring" : "epoll");
+}
+
+
+/**
+ * Connect a raw socket to the test server.
+ */
+static int connect_raw(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in peer_sockaddr = gallocy::common::Peer("127.0.0.1", port).get_socket();
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&peer_sockaddr), sizeof(peer_sockaddr)) < 0) {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+
+TEST_F(ConsensusServerTests, KeepAlive) {
+  for (int i = 0; i < 10; i++) {
+    gallocy::http::Response *rsp = gallocy::http::CurlClient().request(
+      gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", TEST_PORT), "/admin"));
+    ASSERT_EQ(rsp->status_code, static_cast<uint64_t>(200));
+    ASSERT_EQ(rsp->headers.get("Connection"), "keep-alive");
+    rsp->~Response();
+    internal_free(rsp);
+  }
+  // EVERY request reused the first connection.
+  gallocy::json metrics = gallocy_server->get_metrics();
+  ASSERT_EQ(metrics["shards"][0]["accepted"], 1);
+  ASSERT_EQ(metrics["shards"][0]["requests"], 10);
+}
+
+
+TEST_F(ConsensusServerTests, Pipelining) {
+  int sock = connect_raw(TEST_PORT);
+  ASSERT_NE(sock, -1);
+  gallocy::string requests =
+    "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+    "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+    "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+  ASSERT_EQ(send(sock, requests.c_str(), requests.length(), 0), static_cast<ssize_t>(requests.length()));
+
+  // READ until the server closes the connection after the last response.
+  gallocy::string responses;
+  char buf[512];
+  ssize_t n;
+  while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
+    responses.append(buf, n);
+  close(sock);
+
+  uint64_t count = 0;
+  for (size_t pos = responses.find("HTTP/1.1 200"); pos != gallocy::string::npos;
+       pos = responses.find("HTTP/1.1 200", pos + 1))
+    count++;
+  ASSERT_EQ(count, static_cast<uint64_t>(3));
+  ASSERT_NE(responses.find("Connection: close"), gallocy::string::npos);
+  ASSERT_EQ(responses.substr(responses.length() - 4), "GOOD");
+}
+
+
+TEST_F(ConsensusServerTests, IdleTimeout) {
+  gallocy_server->idle_ms = 200;
+  int sock = connect_raw(TEST_PORT);
+  ASSERT_NE(sock, -1);
+  struct timeval tv = { 2, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  char buf[16];
+  // THE server closes the connection, which never sent anything.
+  ASSERT_EQ(recv(sock, buf, sizeof(buf), 0), 0);
+  close(sock);
+  gallocy::json metrics = gallocy_server->get_metrics();
+  ASSERT_EQ(metrics["shards"][0]["idle_closed"], 1);
+}
+
+
+TEST_F(ConsensusServerTests, OversizedRequest) {
+  int sock = connect_raw(TEST_PORT);
+  ASSERT_NE(sock, -1);
+  struct timeval tv = { 2, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  gallocy::string post = "POST /admin HTTP/1.1\r\nContent-Length: 200000000\r\n\r\n";
+  ASSERT_EQ(send(sock, post.c_str(), post.length(), 0), static_cast<ssize_t>(post.length()));
+
+  // THE server refuses the body without buffering it, and closes.
+  gallocy::string responses;
+  char buf[512];
+  ssize_t n;
+  while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
+    responses.append(buf, n);
+  close(sock);
+  ASSERT_EQ(n, 0);
+  ASSERT_EQ(responses.find("HTTP/1.1 413"), static_cast<size_t>(0));
+  ASSERT_NE(responses.find("Connection: close"), gallocy::string::npos);
+}
+
+
+/**
+ * Send a request on a raw socket, close the socket's sending end, and read
+ * the responses until the server closes it.
+ */
+static gallocy::string send_and_shutdown(uint16_t port, const gallocy::string &request) {
+  int sock = connect_raw(port);
+  if (sock == -1)
+    return "";
+  struct timeval tv = { 2, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  send(sock, request.c_str(), request.length(), 0);
+  shutdown(sock, SHUT_WR);
+  gallocy::string responses;
+  char buf[512];
+  ssize_t n;
+  while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
+    responses.append(buf, n);
+  close(sock);
+  return responses;
+}
+
+
+TEST(ConsensusShardTests, EpollHalfClose) {
+  uint16_t port = 10610;
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config("127.0.0.1", peer_list, port);
+  gallocy::consensus::GallocyServer server(config);
+  server.use_uring = false;
+  server.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+  // A CLIENT that closes its end after sending is still answered, for every
+  // request it sent.
+  gallocy::string responses = send_and_shutdown(port,
+    "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+    "GET /admin HTTP/1.0\r\n\r\n");
+  server.stop();
+  ASSERT_EQ(responses.find("HTTP/1.1 200"), static_cast<size_t>(0));
+  ASSERT_NE(responses.find("HTTP/1.1 200", 1), gallocy::string::npos);
+}
+
+
+TEST_F(ConsensusServerTests, HalfClose) {
+  // THE same as on epoll, on whichever backend the server runs.
+  gallocy::string responses = send_and_shutdown(TEST_PORT,
+    "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+    "GET /admin HTTP/1.0\r\n\r\n");
+  ASSERT_EQ(responses.find("HTTP/1.1 200"), static_cast<size_t>(0));
+  ASSERT_NE(responses.find("HTTP/1.1 200", 1), gallocy::string::npos);
+
+  responses = send_and_shutdown(TEST_PORT, "GET /admin HTTP/1.0\r\n\r\n");
+  ASSERT_EQ(responses.find("HTTP/1.1 200"), static_cast<size_t>(0));
+}
@@ -65,3 +65,170 @@ TEST(ConsensusStateTests, AppendLogEntry) {
   uint64_t index = state.get_log()->append_entry(entry);
   ASSERT_EQ(index, static_cast<uint64_t>(0));
 }
+
+
+TEST(ConsensusStateTests, Membership) {
+  gallocy::string address = "10.0.0.2";
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  peer_list.push_back(gallocy::common::Peer("10.0.0.3", 1234));
+  peer_list.push_back(gallocy::common::Peer("10.0.0.1", 1234));
+  GallocyConfig config(address, peer_list, 1234);
+  gallocy::consensus::GallocyState state(config);
+  gallocy::vector<gallocy::common::Peer> members = state.get_membership();
+  ASSERT_EQ(members.size(), static_cast<size_t>(3));
+  ASSERT_EQ(members[0], gallocy::common::Peer("10.0.0.1", 1234));
+  ASSERT_EQ(members[1], gallocy::common::Peer("10.0.0.2", 1234));
+  ASSERT_EQ(members[2], gallocy::common::Peer("10.0.0.3", 1234));
+
+  size_t notified = 0;
+  state.add_membership_listener([&](const gallocy::vector<gallocy::common::Peer> &value) {
+    notified = value.size();
+  });
+  members.pop_back();
+  state.set_membership(members);
+  ASSERT_EQ(notified, static_cast<size_t>(2));
+  ASSERT_EQ(state.get_membership().size(), static_cast<size_t>(2));
+}
+
+
+TEST(ConsensusStateTests, CommandsApplyOnCommit) {
+  gallocy::string address = "127.0.0.1";
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config(address, peer_list, 1234);
+  gallocy::consensus::GallocyState state(config);
+  gallocy::vector<gallocy::string> applied;
+  state.add_command_listener([&](const gallocy::consensus::Command &command) {
+    applied.push_back(command.command);
+  });
+
+  // APPENDED commands wait for the log to commit them.
+  ASSERT_EQ(state.append_command(gallocy::consensus::Command("one")), static_cast<uint64_t>(0));
+  ASSERT_EQ(state.append_command(gallocy::consensus::Command("two")), static_cast<uint64_t>(1));
+  ASSERT_EQ(state.append_command(gallocy::consensus::Command("three")), static_cast<uint64_t>(2));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(0));
+
+  state.set_commit_index(2);
+  ASSERT_EQ(applied.size(), static_cast<size_t>(2));
+  ASSERT_EQ(applied[0], "one");
+  ASSERT_EQ(applied[1], "two");
+  ASSERT_EQ(state.get_last_applied(), static_cast<uint64_t>(2));
+
+  // THE commit index never passes the end of the log, and nothing is applied
+  // twice.
+  state.set_commit_index(10);
+  ASSERT_EQ(state.get_commit_index(), static_cast<uint64_t>(3));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(3));
+  ASSERT_EQ(applied[2], "three");
+  state.set_commit_index(3);
+  ASSERT_EQ(applied.size(), static_cast<size_t>(3));
+}
+
+
+TEST(ConsensusStateTests, FollowerAppliesLeaderEntries) {
+  gallocy::string address = "127.0.0.1";
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config(address, peer_list, 1234);
+  gallocy::consensus::GallocyState state(config);
+  gallocy::vector<gallocy::string> applied;
+  state.add_command_listener([&](const gallocy::consensus::Command &command) {
+    applied.push_back(command.command);
+  });
+  gallocy::vector<gallocy::consensus::LogEntry> entries;
+  entries.push_back(gallocy::consensus::LogEntry(gallocy::consensus::Command("one"), 1));
+  entries.push_back(gallocy::consensus::LogEntry(gallocy::consensus::Command("two"), 1));
+  uint64_t match_index = 0;
+
+  // ENTRIES that do not follow on from the log are rejected.
+  ASSERT_FALSE(state.append_entries(1, 1, entries, 0, &match_index));
+  ASSERT_EQ(state.get_log()->log.size(), static_cast<size_t>(0));
+
+  // THE leader's commit index applies no more than the entries it sent.
+  ASSERT_TRUE(state.append_entries(0, 0, entries, 5, &match_index));
+  ASSERT_EQ(match_index, static_cast<uint64_t>(2));
+  ASSERT_EQ(state.get_commit_index(), static_cast<uint64_t>(2));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(2));
+  ASSERT_EQ(applied[1], "two");
+
+  // AN uncommitted entry that conflicts with the leader's is replaced.
+  entries.clear();
+  entries.push_back(gallocy::consensus::LogEntry(gallocy::consensus::Command("three"), 1));
+  ASSERT_TRUE(state.append_entries(2, 1, entries, 2, &match_index));
+  entries.clear();
+  entries.push_back(gallocy::consensus::LogEntry(gallocy::consensus::Command("other"), 2));
+  ASSERT_FALSE(state.append_entries(3, 2, entries, 2, &match_index));
+  ASSERT_TRUE(state.append_entries(2, 1, entries, 3, &match_index));
+  ASSERT_EQ(match_index, static_cast<uint64_t>(3));
+  ASSERT_EQ(state.get_log()->log.size(), static_cast<size_t>(3));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(3));
+  ASSERT_EQ(applied[2], "other");
+}
+
+
+TEST(ConsensusStateTests, VotesFollowLogFreshness) {
+  gallocy::string address = "127.0.0.1";
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  GallocyConfig config(address, peer_list, 1234);
+  gallocy::consensus::GallocyState state(config);
+  uint64_t last_log_index = 1;
+  uint64_t last_log_term = 1;
+  state.get_last_log(&last_log_index, &last_log_term);
+  ASSERT_EQ(last_log_index, static_cast<uint64_t>(0));
+  ASSERT_EQ(last_log_term, static_cast<uint64_t>(0));
+  ASSERT_TRUE(state.is_log_up_to_date(0, 0));
+
+  state.set_current_term(2);
+  state.append_command(gallocy::consensus::Command("one"));
+  state.append_command(gallocy::consensus::Command("two"));
+  state.get_last_log(&last_log_index, &last_log_term);
+  ASSERT_EQ(last_log_index, static_cast<uint64_t>(2));
+  ASSERT_EQ(last_log_term, static_cast<uint64_t>(2));
+
+  // A later last term wins however short the log, and the same last term
+  // needs a log at least as long.
+  ASSERT_TRUE(state.is_log_up_to_date(1, 3));
+  ASSERT_TRUE(state.is_log_up_to_date(2, 2));
+  ASSERT_TRUE(state.is_log_up_to_date(3, 2));
+  ASSERT_FALSE(state.is_log_up_to_date(1, 2));
+  ASSERT_FALSE(state.is_log_up_to_date(5, 1));
+}
+
+
+TEST(ConsensusStateTests, LeaderCommitsFromMajority) {
+  gallocy::string address = "127.0.0.1";
+  gallocy::vector<gallocy::common::Peer> peer_list;
+  peer_list.push_back(gallocy::common::Peer("127.0.0.2", 1234));
+  peer_list.push_back(gallocy::common::Peer("127.0.0.3", 1234));
+  GallocyConfig config(address, peer_list, 1234);
+  gallocy::consensus::GallocyState state(config);
+  gallocy::vector<gallocy::string> applied;
+  state.add_command_listener([&](const gallocy::consensus::Command &command) {
+    applied.push_back(command.command);
+  });
+  state.set_current_term(1);
+  state.append_command(gallocy::consensus::Command("old"));
+  state.set_current_term(2);
+  state.set_state(gallocy::consensus::RaftState::LEADER);
+  ASSERT_EQ(state.get_leader(), gallocy::common::Peer(address, 1234));
+  ASSERT_EQ(state.get_next_index(peer_list[0]), static_cast<uint64_t>(2));
+
+  // AN entry from an earlier term is not committed by counting replicas.
+  state.set_match_index(peer_list[0], 1);
+  ASSERT_EQ(state.advance_commit_index(), static_cast<uint64_t>(0));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(0));
+
+  // BUT committing one from this term commits the entries before it.
+  state.append_command(gallocy::consensus::Command("new"));
+  ASSERT_EQ(state.advance_commit_index(), static_cast<uint64_t>(0));
+  state.set_match_index(peer_list[1], 2);
+  ASSERT_EQ(state.advance_commit_index(), static_cast<uint64_t>(2));
+  ASSERT_EQ(applied.size(), static_cast<size_t>(2));
+  ASSERT_EQ(applied[0], "old");
+  ASSERT_EQ(applied[1], "new");
+
+  uint64_t previous_log_index = 1;
+  uint64_t previous_log_term = 0;
+  gallocy::vector<gallocy::consensus::LogEntry> entries = state.get_entries(&previous_log_index, &previous_log_term);
+  ASSERT_EQ(previous_log_term, static_cast<uint64_t>(1));
+  ASSERT_EQ(entries.size(), static_cast<size_t>(1));
+  ASSERT_EQ(entries[0].command.command, "new");
+}
@@ -4,6 +4,7 @@
 #include "gtest/gtest.h"
 
 #include "gallocy/allocators/internal.h"
+#include "gallocy/libgallocy.h"
 #include "gallocy/utils/diff.h"
 
 
@@ -55,3 +56,33 @@ TEST(DiffTests, DiffGeneral_2) {
   int ret = diff(str1, mem_sz, str1align, str2, mem_sz, str2align);
   ASSERT_EQ(ret, 0);
 }
+
+
+TEST(DiffTests, DiffIdentical) {
+  // CHECK usable sizes on a fresh heap, so no larger free block gets reused.
+  __reset_memory_allocator();
+  const char* str = "GATTACAGATTACAGA";
+  char* align_str1 = NULL;
+  char* align_str2 = NULL;
+  int ret = diff(str, strlen(str), align_str1, str, strlen(str), align_str2);
+  ASSERT_EQ(ret, 0);
+  // The alignment fills the whole buffer, so the terminator must land in
+  // space that belongs to it.
+  ASSERT_GE(internal_malloc_usable_size(align_str1), strlen(str) + 1);
+  ASSERT_GE(internal_malloc_usable_size(align_str2), strlen(str) + 1);
+  ASSERT_STREQ(align_str1, str);
+  ASSERT_STREQ(align_str2, str);
+  internal_free(align_str1);
+  internal_free(align_str2);
+}
+
+
+TEST(DiffTests, DiffSingleCharacter) {
+  char* align_str1 = NULL;
+  char* align_str2 = NULL;
+  int ret = diff("A", 1, align_str1, "B", 1, align_str2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(strlen(align_str1), strlen(align_str2));
+  internal_free(align_str1);
+  internal_free(align_str2);
+}
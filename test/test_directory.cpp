@@ -0,0 +1,190 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/directory.h"
+#include "gallocy/memory/transfer.h"
+#include "cluster.h"
+
+#define TEST_NODES 3
+#define TEST_REGION_PAGES 64
+#define TEST_PAGES 4096
+
+
+uint16_t DIRECTORY_TEST_PORT = 28000;
+
+
+class PageDirectoryTests: public ClusterTest<gallocy::memory::MRSWCoherence, TEST_NODES, TEST_REGION_PAGES> {
+ protected:
+  /**
+   * Three nodes in this process, each over its own region, with node 0
+   * owning every page, and a directory.
+   */
+  PageDirectoryTests() : ClusterTest(&DIRECTORY_TEST_PORT) {}
+
+  virtual void start_node(int node) {
+    directories[node] = new gallocy::memory::PageDirectory(node, nodes);
+    coherence[node]->set_directory(directories[node]);
+    servers[node]->set_handler(PAGE_TRANSFER_DIRECTORY, directories[node]);
+  }
+
+  virtual void destroy_node(int node) {
+    delete directories[node];
+  }
+
+  /**
+   * Find a page homed on a node.
+   */
+  uint64_t homed_on(uint32_t node, uint64_t after = 0) {
+    uint64_t page = after;
+    while (directories[0]->get_home(page) != node)
+      page++;
+    return page;
+  }
+
+  gallocy::memory::PageDirectory *directories[TEST_NODES];
+};
+
+
+TEST_F(PageDirectoryTests, HomesAgreeAndSpread) {
+  uint64_t homed[TEST_NODES] = { 0 };
+  for (uint64_t page = 0; page < TEST_PAGES; page++) {
+    uint32_t home = directories[0]->get_home(page);
+    ASSERT_LT(home, TEST_NODES);
+    ASSERT_EQ(directories[1]->get_home(page), home);
+    ASSERT_EQ(directories[2]->get_home(page), home);
+    homed[home]++;
+  }
+  for (int i = 0; i < TEST_NODES; i++)
+    ASSERT_GT(homed[i], TEST_PAGES / TEST_NODES / 2);
+}
+
+
+TEST_F(PageDirectoryTests, MembershipChangeMovesFewHomes) {
+  gallocy::vector<gallocy::common::Peer> more = nodes;
+  more.push_back(gallocy::common::Peer("127.0.0.1", DIRECTORY_TEST_PORT + TEST_NODES));
+  gallocy::memory::PageDirectory grown(0, more);
+  gallocy::vector<gallocy::common::Peer> fewer(nodes.begin(), nodes.end() - 1);
+  gallocy::memory::PageDirectory shrunk(0, fewer);
+  for (uint64_t page = 0; page < TEST_PAGES; page++) {
+    uint32_t home = directories[0]->get_home(page);
+    // ONLY pages homed on the node that joined or left change homes.
+    if (grown.get_home(page) != TEST_NODES) {
+      ASSERT_EQ(grown.get_home(page), home);
+    }
+    if (home != TEST_NODES - 1) {
+      ASSERT_EQ(shrunk.get_home(page), home);
+    }
+  }
+}
+
+
+TEST_F(PageDirectoryTests, RemoteLookup) {
+  uint64_t page = homed_on(2);
+  gallocy::memory::DirectoryEntry entry;
+  ASSERT_TRUE(directories[0]->lookup(page, &entry));
+  ASSERT_EQ(entry.owner, 0);
+  ASSERT_EQ(entry.copyset, 0);
+  ASSERT_TRUE(directories[1]->set_owner(page, 1));
+  ASSERT_TRUE(directories[0]->lookup(page, &entry));
+  ASSERT_EQ(entry.owner, 1);
+  ASSERT_EQ(directories[0]->remote_lookups, 2);
+  ASSERT_EQ(directories[1]->remote_updates, 1);
+  ASSERT_EQ(directories[2]->local_lookups, 2);
+  // THE home answers its own lookups without a round trip.
+  ASSERT_TRUE(directories[2]->lookup(page, &entry));
+  ASSERT_EQ(entry.owner, 1);
+  ASSERT_EQ(directories[2]->remote_lookups, 0);
+}
+
+
+TEST_F(PageDirectoryTests, NewOwnerClearsCopyset) {
+  uint64_t page = homed_on(1);
+  gallocy::memory::DirectoryEntry entry;
+  ASSERT_TRUE(directories[0]->add_copy(page, 1));
+  ASSERT_TRUE(directories[2]->add_copy(page, 2));
+  ASSERT_TRUE(directories[0]->lookup(page, &entry));
+  ASSERT_EQ(entry.owner, 0);
+  ASSERT_EQ(entry.copyset, (1ULL << 1) | (1ULL << 2));
+  ASSERT_TRUE(directories[2]->set_owner(page, 2));
+  ASSERT_TRUE(directories[0]->lookup(page, &entry));
+  ASSERT_EQ(entry.owner, 2);
+  ASSERT_EQ(entry.copyset, 0);
+}
+
+
+TEST_F(PageDirectoryTests, RebuildMigratesEntries) {
+  uint64_t first = homed_on(2);
+  uint64_t second = homed_on(2, first + 1);
+  ASSERT_TRUE(directories[0]->set_owner(first, 1));
+  ASSERT_TRUE(directories[0]->add_copy(second, 1));
+  ASSERT_EQ(directories[2]->get_metrics()["entries"], 2);
+
+  // NODE 2 leaves, and hands its entries to the new homes.
+  gallocy::vector<gallocy::common::Peer> fewer(nodes.begin(), nodes.end() - 1);
+  directories[0]->rebuild(fewer);
+  directories[1]->rebuild(fewer);
+  directories[2]->rebuild(fewer);
+  ASSERT_EQ(directories[2]->get_self(), DIRECTORY_NO_NODE);
+  ASSERT_EQ(directories[2]->migrated, 2);
+  ASSERT_EQ(directories[2]->get_metrics()["entries"], 0);
+
+  gallocy::memory::DirectoryEntry entry;
+  ASSERT_TRUE(directories[0]->lookup(first, &entry));
+  ASSERT_EQ(entry.owner, 1);
+  ASSERT_TRUE(directories[1]->lookup(second, &entry));
+  ASSERT_EQ(entry.owner, 0);
+  ASSERT_EQ(entry.copyset, 1ULL << 1);
+  ASSERT_EQ(directories[0]->rebuilds, 1);
+}
+
+
+TEST_F(PageDirectoryTests, MigrationKeepsNewerEntries) {
+  uint64_t first = homed_on(2);
+  uint64_t second = homed_on(2, first + 1);
+  ASSERT_TRUE(directories[0]->set_owner(first, 1));
+  ASSERT_TRUE(directories[0]->set_owner(second, 1));
+  ASSERT_TRUE(directories[0]->add_copy(second, 0));
+
+  // THE new homes see the membership change first, and are told of a new
+  // owner and a new reader before node 2's entries reach them.
+  gallocy::vector<gallocy::common::Peer> fewer(nodes.begin(), nodes.end() - 1);
+  directories[0]->rebuild(fewer);
+  directories[1]->rebuild(fewer);
+  ASSERT_TRUE(directories[0]->set_owner(first, 0));
+  ASSERT_TRUE(directories[0]->add_copy(second, 1));
+  directories[2]->rebuild(fewer);
+
+  gallocy::memory::DirectoryEntry entry;
+  ASSERT_TRUE(directories[0]->lookup(first, &entry));
+  ASSERT_EQ(entry.owner, 0);
+  ASSERT_EQ(entry.copyset, 0);
+  ASSERT_TRUE(directories[1]->lookup(second, &entry));
+  ASSERT_EQ(entry.owner, 1);
+  ASSERT_EQ(entry.copyset, (1ULL << 0) | (1ULL << 1));
+}
+
+
+TEST_F(PageDirectoryTests, CoherenceAsksHome) {
+  write(2, 5, 7);
+  gallocy::memory::DirectoryEntry entry;
+  ASSERT_TRUE(directories[0]->lookup(5, &entry));
+  ASSERT_EQ(entry.owner, 2);
+  ASSERT_EQ(entry.copyset, 0);
+
+  // NODE 1 last saw node 0 own the page, which refers it to the home.
+  uint64_t lookups = 0;
+  for (int i = 0; i < TEST_NODES; i++)
+    lookups += directories[i]->local_lookups;
+  write(1, 5, read(1, 5) + 1);
+  uint64_t after = 0;
+  for (int i = 0; i < TEST_NODES; i++)
+    after += directories[i]->local_lookups;
+  ASSERT_EQ(after, lookups + 1);
+  ASSERT_EQ(coherence[1]->get_owner(5), 1);
+  ASSERT_TRUE(directories[2]->lookup(5, &entry));
+  ASSERT_EQ(entry.owner, 1);
+  ASSERT_EQ(read(0, 5), 8);
+}
@@ -1,6 +1,10 @@
 #include "gtest/gtest.h"
 
 #include <stdio.h>
+
+#include <chrono>
+#include <thread>
+
 #include "gallocy/http/client.h"
 
 gallocy::string UDPCLIENT_GET_REQUEST(
@@ -31,8 +35,68 @@ TEST(UDPClientTests, GetRequest) {
   udp_client.request(get);
   gallocy::string http = udp.read();
 
-  // UDPTransport will not respond should have 3x the get request
+  // UDPTransport will not respond, so the client sent the request three
+  // times, with the same request ID each time.
   // TODO(rverdon): How to handle this case on the server, What to do with multiple repeated requests
-  ASSERT_EQ(http.length()/3, UDPCLIENT_GET_REQUEST.length());
+  uint64_t id_start = http.find("X-Request-Id: ");
+  ASSERT_NE(id_start, gallocy::string::npos);
+  gallocy::string id = http.substr(id_start, http.find("\r\n", id_start) + 2 - id_start);
+  gallocy::string tagged = UDPCLIENT_GET_REQUEST;
+  tagged.replace(tagged.find("12345"), 5, "32345");
+  tagged.insert(tagged.find("\r\n") + 2, id);
+  ASSERT_EQ(http, tagged + tagged + tagged);
+}
+
+TEST(UDPClientTests, RequestIdsAreUnique) {
+  uint16_t server_port = 32346;
+  gallocy::common::Peer peer("127.0.0.1", server_port);
+  gallocy::http::Request get(UDPCLIENT_GET_REQUEST);
+  get.peer = peer;
+  gallocy::http::UDPClient udp_client;
+  udp_client.retry_limit = 1;
+  gallocy::http::UDPTransport udp(peer, server_port);
+
+  udp_client.request(get);
+  udp_client.request(get);
+  gallocy::string http = udp.read();
+  uint64_t first = http.find("X-Request-Id: ");
+  uint64_t second = http.find("X-Request-Id: ", first + 1);
+  ASSERT_NE(second, gallocy::string::npos);
+  ASSERT_NE(http.substr(first, http.find("\r\n", first) - first),
+            http.substr(second, http.find("\r\n", second) - second));
 }
 
+TEST(UDPClientTests, ConcurrentRounds) {
+  uint16_t silent_port = 32347;
+  uint16_t server_port = 32348;
+  gallocy::http::UDPTransport silent(gallocy::common::Peer("127.0.0.1", silent_port), silent_port);
+  gallocy::http::UDPListener listener("127.0.0.1", server_port, [](const gallocy::string &raw) {
+    gallocy::http::Request request(raw);
+    return "HTTP/1.1 200 OK\r\nX-Request-Id: " + request.headers.get("X-Request-Id") + "\r\n\r\nGOOD";
+  });
+  ASSERT_TRUE(listener.is_open());
+  listener.start();
+
+  // A ROUND waiting on a peer that never answers does not hold up a round
+  // to one that does.
+  std::thread slow([silent_port]() {
+    gallocy::http::Request get(UDPCLIENT_GET_REQUEST);
+    get.peer = gallocy::common::Peer("127.0.0.1", silent_port);
+    gallocy::http::Response *rsp = gallocy::http::UDPClient().request(get);
+    rsp->~Response();
+    internal_free(rsp);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  gallocy::http::Request get(UDPCLIENT_GET_REQUEST);
+  get.peer = gallocy::common::Peer("127.0.0.1", server_port);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  gallocy::http::Response *rsp = gallocy::http::UDPClient().request(get);
+  std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+  slow.join();
+  listener.stop();
+  ASSERT_EQ(rsp->status_code, static_cast<uint64_t>(200));
+  ASSERT_EQ(rsp->body, "GOOD");
+  ASSERT_LT(elapsed, std::chrono::milliseconds(UDP_RTO_INITIAL_MS));
+  rsp->~Response();
+  internal_free(rsp);
+}
@@ -1,7 +1,14 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "gtest/gtest.h"
 
 
 #include "gallocy/consensus/server.h"
+#include "gallocy/http/headers.h"
+#include "gallocy/http/parser.h"
+#include "gallocy/http/reader.h"
 #include "gallocy/http/request.h"
 #include "gallocy/http/response.h"
 #include "gallocy/http/router.h"
@@ -42,7 +49,7 @@ std::string POST_REQUEST(
   "POST /post HTTP/1.1\r\n"
   "Host: 127.0.0.1:8000\r\n"
   "Connection: Keep-Alive\r\n"
-  "Content-Length: 14\r\n"
+  "Content-Length: 13\r\n"
   "Content-Type: application/json\r\n"
   "User-Agent: gallocy\r\n"
   "\r\n"
@@ -51,12 +58,12 @@ std::string POST_REQUEST(
 );
 
 std::string RESPONSE(
-  "HTTP/1.0 200 OK\r\n"
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Length: 13\r\n"
   "Content-Type: application/json\r\n"
   "Server: Gallocy-Httpd\r\n"
   "\r\n"
-  "{\"foo\":\"bar\"}\r\n"
-  "\r\n"
+  "{\"foo\":\"bar\"}"
 );
 
 
@@ -91,8 +98,8 @@ TEST(RequestTests, SimpleGetRequest) {
   ASSERT_EQ(request.uri, "/get");
   ASSERT_EQ(request.protocol, "HTTP/1.1");
   ASSERT_EQ(request.headers.size(), static_cast<uint64_t>(2));
-  ASSERT_EQ(request.headers["Host"], "127.0.0.1");
-  ASSERT_EQ(request.headers["User-Agent"], "gallocy");
+  ASSERT_EQ(request.headers.get("Host"), "127.0.0.1");
+  ASSERT_EQ(request.headers.get("User-Agent"), "gallocy");
 }
 
 
@@ -102,8 +109,8 @@ TEST(RequestTests, SimpleGetRequestQuery) {
   ASSERT_EQ(request.uri, "/get?query=1");
   ASSERT_EQ(request.protocol, "HTTP/1.1");
   ASSERT_EQ(request.headers.size(), static_cast<uint64_t>(2));
-  ASSERT_EQ(request.headers["Host"], "127.0.0.1");
-  ASSERT_EQ(request.headers["User-Agent"], "gallocy");
+  ASSERT_EQ(request.headers.get("Host"), "127.0.0.1");
+  ASSERT_EQ(request.headers.get("User-Agent"), "gallocy");
   ASSERT_EQ(request.get_params()["query"], "1");
 }
 
@@ -114,29 +121,53 @@ TEST(RequestTests, SimplePostRequest) {
   ASSERT_EQ(request.uri, "/post");
   ASSERT_EQ(request.protocol, "HTTP/1.1");
   ASSERT_EQ(request.headers.size(), static_cast<uint64_t>(5));
-  ASSERT_EQ(request.headers["Host"], "127.0.0.1");
-  ASSERT_EQ(request.headers["Connection"], "Keep-Alive");
-  ASSERT_EQ(request.headers["Content-Length"], "14");
-  ASSERT_EQ(request.headers["Content-Type"], "application/json");
-  ASSERT_EQ(request.headers["User-Agent"], "gallocy");
+  // THE colon before the port is part of the value.
+  ASSERT_EQ(request.headers.get("Host"), "127.0.0.1:8000");
+  ASSERT_EQ(request.headers.get("Connection"), "Keep-Alive");
+  ASSERT_EQ(request.headers.get("Content-Length"), "13");
+  ASSERT_EQ(request.headers.get("Content-Type"), "application/json");
+  ASSERT_EQ(request.headers.get("User-Agent"), "gallocy");
   ASSERT_EQ(request.raw_body, "{\"foo\":\"bar\"}");
   ASSERT_EQ(request.get_json()["foo"], "bar");
 }
 
 
+TEST(RequestTests, ParsedInPlace) {
+  // A request parsed from a buffer refers to its headers and body there.
+  const char *data = POST_REQUEST.c_str();
+  gallocy::http::Request request(data, POST_REQUEST.length());
+  ASSERT_EQ(request.method, "POST");
+  gallocy::http::View host = request.headers.find("Host");
+  ASSERT_GE(host.data, data);
+  ASSERT_LT(host.data, data + POST_REQUEST.length());
+  ASSERT_TRUE(host.equals("127.0.0.1:8000"));
+  ASSERT_TRUE(request.raw_body.empty());
+  ASSERT_EQ(request.get_body().data, data + POST_REQUEST.find("{"));
+  ASSERT_TRUE(request.get_body().equals("{\"foo\":\"bar\"}"));
+  ASSERT_EQ(request.get_json()["foo"], "bar");
+  // SETTING a header copies them all first.
+  request.headers.set("Connection", "close");
+  host = request.headers.find("Host");
+  ASSERT_FALSE(host.data >= data && host.data < data + POST_REQUEST.length());
+  ASSERT_EQ(request.headers.get("Host"), "127.0.0.1:8000");
+  ASSERT_EQ(request.headers.get("Connection"), "close");
+  ASSERT_EQ(request.headers.size(), static_cast<uint64_t>(5));
+}
+
+
 TEST(ResponseTests, Constructors) {
   gallocy::http::Response response1;
   response1.status_code = 200;
-  response1.headers["foo"] = "bar";
+  response1.headers.set("foo", "bar");
   ASSERT_EQ(response1.status_code, static_cast<uint64_t>(200));
-  ASSERT_EQ(response1.headers["foo"], "bar");
+  ASSERT_EQ(response1.headers.get("foo"), "bar");
 #if 0
   gallocy::http::Response response2 = response1;
   ASSERT_EQ(response2.status_code, static_cast<uint64_t>(200));
-  ASSERT_EQ(response2.headers["foo"], "bar");
+  ASSERT_EQ(response2.headers.get("foo"), "bar");
   gallocy::http::Response response3(response1);
   ASSERT_EQ(response3.status_code, static_cast<uint64_t>(200));
-  ASSERT_EQ(response3.headers["foo"], "bar");
+  ASSERT_EQ(response3.headers.get("foo"), "bar");
 #endif
 }
 
@@ -144,8 +175,8 @@ TEST(ResponseTests, Constructors) {
 TEST(ResponseTests, SimpleResponse) {
   gallocy::http::Response response;
   response.status_code = 200;
-  response.headers["Server"] = "Gallocy-Httpd";
-  response.headers["Content-Type"] = "application/json";
+  response.headers.set("Content-Type", "application/json");
+  response.headers.set("Server", "Gallocy-Httpd");
   gallocy::json j = { { "foo", "bar" } };
   // There is no known conversion from std::string to
   // gallocy::string... we should fix this.
@@ -153,6 +184,24 @@ TEST(ResponseTests, SimpleResponse) {
   ASSERT_EQ(response.str().c_str(), RESPONSE);
 }
 
+TEST(ResponseTests, WriteHead) {
+  gallocy::http::Response response;
+  response.status_code = 404;
+  response.headers.set("Server", "Gallocy-Httpd");
+  response.body = "missing";
+  // THE head is appended, and the buffer can be reused.
+  gallocy::string head = "stale";
+  head.clear();
+  response.write_head(&head);
+  ASSERT_EQ(head,
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Length: 7\r\n"
+    "Server: Gallocy-Httpd\r\n"
+    "\r\n");
+  ASSERT_EQ(response.str(), head + "missing");
+  ASSERT_EQ(response.size(), head.length() + 7);
+}
+
 TEST(ResponseTests, FromBufferTest) {
   gallocy::http::Response response;
   gallocy::string raw = "HTTP/1.1 200 OK\r\nHost: TESTHOST\r\n\r\nBest json ever";
@@ -160,32 +209,251 @@ TEST(ResponseTests, FromBufferTest) {
   response.from_buffer(raw);
   
   ASSERT_EQ(response.status_code, 200);
-  ASSERT_EQ(response.headers["Host"], "TESTHOST");
+  ASSERT_EQ(response.headers.get("Host"), "TESTHOST");
   ASSERT_EQ(response.body, "Best json ever");
 }
 
-TEST(RoutingTableTests, Functors) {
-  using ArgList = gallocy::vector<gallocy::string>;
-  RoutingTable<std::function<gallocy::http::Response *(ArgList *, gallocy::http::Request *)> > t;
-  gallocy::http::Response *response =
-    new (internal_malloc(sizeof(gallocy::http::Response))) gallocy::http::Response();
-  auto f = [response](ArgList *a, gallocy::http::Request *request) {
-    gallocy::stringstream s;
-    s << a->size();
-    response->body = s.str();
-    return response;
-  };
-  t.register_handler("/foo", f);
-  t.register_handler("/foo/<x>", f);
-  t.register_handler("/foo/<x>/bar", f);
-  t.register_handler("/foo/<x>/bar/<y>", f);
-  t.register_handler("/foo/<x>/baz", f);
-  t.register_handler("/foo/<x>/baz/<y>", f);
-  ASSERT_EQ(t.match("/foo")(nullptr)->body, "0");
-  ASSERT_EQ(t.match("/foo/arg1")(nullptr)->body, "1");
-  ASSERT_EQ(t.match("/foo/arg1/bar")(nullptr)->body, "1");
-  ASSERT_EQ(t.match("/foo/arg1/bar/arg2")(nullptr)->body, "2");
-  ASSERT_EQ(t.match("/foo/arg1/baz")(nullptr)->body, "1");
-  ASSERT_EQ(t.match("/foo/arg1/baz/arg2")(nullptr)->body, "2");
-  internal_free(response);
+TEST(ParserTests, RequestHead) {
+  gallocy::http::MessageHead head;
+  ASSERT_EQ(gallocy::http::parse_head(POST_REQUEST.c_str(), POST_REQUEST.length(), &head), HTTP_PARSE_OK);
+  ASSERT_TRUE(head.start[0].equals("POST"));
+  ASSERT_TRUE(head.start[1].equals("/post"));
+  ASSERT_TRUE(head.start[2].equals("HTTP/1.1"));
+  ASSERT_EQ(head.header_count, static_cast<uint64_t>(5));
+  ASSERT_EQ(head.length, POST_REQUEST.find("\r\n\r\n") + 4);
+  // EVERY part is a view into the buffer.
+  ASSERT_EQ(head.start[0].data, POST_REQUEST.c_str());
+  ASSERT_TRUE(head.find("host").equals("127.0.0.1:8000"));
+  ASSERT_TRUE(head.find("CONTENT-TYPE").equals("application/json"));
+  ASSERT_EQ(head.content_length(0), static_cast<uint64_t>(13));
+  ASSERT_EQ(head.find("Accept").data, nullptr);
+}
+
+
+TEST(ParserTests, ResponseHead) {
+  gallocy::string raw = "HTTP/1.1 404 Not Found\r\nX-Empty:\r\nX-Spaces: \t a b \t\r\n\r\n";
+  gallocy::http::MessageHead head;
+  ASSERT_EQ(gallocy::http::parse_head(raw.c_str(), raw.length(), &head), HTTP_PARSE_OK);
+  ASSERT_TRUE(head.start[1].equals("404"));
+  ASSERT_TRUE(head.start[2].equals("Not Found"));
+  ASSERT_NE(head.find("X-Empty").data, nullptr);
+  ASSERT_EQ(head.find("X-Empty").length, static_cast<uint64_t>(0));
+  ASSERT_TRUE(head.find("X-Spaces").equals("a b"));
+}
+
+
+TEST(ParserTests, IncompleteAndMalformed) {
+  gallocy::http::MessageHead head;
+  for (uint64_t i = 0; i < GET_REQUEST.find("\r\n\r\n") + 3; i++)
+    ASSERT_EQ(gallocy::http::parse_head(GET_REQUEST.c_str(), i, &head), HTTP_PARSE_INCOMPLETE);
+  gallocy::string no_colon = "GET / HTTP/1.1\r\nHost\r\n\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(no_colon.c_str(), no_colon.length(), &head), HTTP_PARSE_ERROR);
+  gallocy::string no_method = " / HTTP/1.1\r\n\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(no_method.c_str(), no_method.length(), &head), HTTP_PARSE_ERROR);
+  gallocy::string too_many = "GET / HTTP/1.1\r\n";
+  for (int i = 0; i <= HTTP_MAX_HEADERS; i++)
+    too_many += "X: y\r\n";
+  too_many += "\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(too_many.c_str(), too_many.length(), &head), HTTP_PARSE_ERROR);
+}
+
+
+TEST(ParserTests, ContentLength) {
+  gallocy::http::MessageHead head;
+  gallocy::string largest = "POST / HTTP/1.1\r\nContent-Length: 18446744073709551614\r\n\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(largest.c_str(), largest.length(), &head), HTTP_PARSE_OK);
+  ASSERT_EQ(head.content_length(0), static_cast<uint64_t>(18446744073709551614ULL));
+  // A VALUE that overflows must not wrap around to a small length.
+  gallocy::string wraps = "POST / HTTP/1.1\r\nContent-Length: 18446744073709551629\r\n\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(wraps.c_str(), wraps.length(), &head), HTTP_PARSE_OK);
+  ASSERT_EQ(head.content_length(0), static_cast<uint64_t>(HTTP_CONTENT_LENGTH_INVALID));
+  gallocy::string not_a_number = "POST / HTTP/1.1\r\nContent-Length: 12abc\r\n\r\n";
+  ASSERT_EQ(gallocy::http::parse_head(not_a_number.c_str(), not_a_number.length(), &head), HTTP_PARSE_OK);
+  ASSERT_EQ(head.content_length(0), static_cast<uint64_t>(HTTP_CONTENT_LENGTH_INVALID));
+}
+
+
+TEST(HeadersTests, SetAndFind) {
+  gallocy::http::Headers headers;
+  ASSERT_TRUE(headers.set("Content-Type", "text/plain"));
+  ASSERT_TRUE(headers.set("Server", "Gallocy-Httpd"));
+  // SETTING a header again replaces it, whatever the case of its name.
+  ASSERT_TRUE(headers.set("content-type", "application/json"));
+  ASSERT_TRUE(headers.set("SERVER", "Gallocy"));
+  ASSERT_EQ(headers.size(), static_cast<uint64_t>(2));
+  ASSERT_EQ(headers.get("Content-Type"), "application/json");
+  ASSERT_EQ(headers.get("server"), "Gallocy");
+  ASSERT_TRUE(headers.name(0).equals("Content-Type"));
+  ASSERT_FALSE(headers.has("Host"));
+  ASSERT_EQ(headers.get("Host"), "");
+  for (int i = 2; i < HTTP_MAX_HEADERS; i++)
+    ASSERT_TRUE(headers.set("X-" + gallocy::string(std::to_string(i).c_str()), "y"));
+  ASSERT_FALSE(headers.set("X-Full", "y"));
+}
+
+
+TEST(RequestReaderTests, FramesAcrossReads) {
+  gallocy::http::RequestReader reader;
+  // THE request ends after its Content-Length of body, not at a blank line.
+  uint64_t length = POST_REQUEST.find("\r\n\r\n") + 4 + 13;
+  for (uint64_t i = 0; i < POST_REQUEST.length(); i++) {
+    reader.append(POST_REQUEST.c_str() + i, 1);
+    ASSERT_EQ(reader.frame(), i + 1 >= length);
+  }
+  ASSERT_EQ(reader.length(), length);
+  reader.consume();
+  ASSERT_EQ(reader.buffered(), POST_REQUEST.length() - length);
+}
+
+
+TEST(RequestReaderTests, Pipelined) {
+  gallocy::http::RequestReader reader;
+  gallocy::string body = "{\"a\":\"\r\n\r\n\"}";
+  gallocy::string post =
+    "POST /raft/append_entries HTTP/1.1\r\n"
+    "content-length: 12\r\n"
+    "EXPECT: 100-continue\r\n"
+    "\r\n" + body;
+  gallocy::string get = "GET /admin HTTP/1.1\r\n\r\n";
+  gallocy::string both = post + get;
+  reader.append(both.c_str(), both.length());
+
+  ASSERT_TRUE(reader.frame());
+  ASSERT_TRUE(reader.expects_continue());
+  ASSERT_EQ(gallocy::string(reader.data(), reader.length()), post);
+  reader.consume();
+
+  ASSERT_TRUE(reader.frame());
+  ASSERT_FALSE(reader.expects_continue());
+  ASSERT_EQ(gallocy::string(reader.data(), reader.length()), get);
+  reader.consume();
+  ASSERT_EQ(reader.buffered(), static_cast<uint64_t>(0));
+  ASSERT_FALSE(reader.frame());
+}
+
+
+TEST(RequestReaderTests, Rejects) {
+  // A BODY bigger than the reader accepts is rejected before it is read.
+  gallocy::http::RequestReader big;
+  gallocy::string post = "POST /admin HTTP/1.1\r\nContent-Length: 200000000\r\n\r\n";
+  big.append(post.c_str(), post.length());
+  ASSERT_TRUE(big.frame());
+  ASSERT_EQ(big.rejected(), static_cast<uint64_t>(413));
+  ASSERT_EQ(big.length(), post.length());
+
+  gallocy::http::RequestReader wraps;
+  post = "POST /admin HTTP/1.1\r\nContent-Length: 18446744073709551629\r\n\r\n";
+  wraps.append(post.c_str(), post.length());
+  ASSERT_TRUE(wraps.frame());
+  ASSERT_EQ(wraps.rejected(), static_cast<uint64_t>(400));
+
+  // A HEAD without its blank line is rejected once it is too long.
+  gallocy::http::RequestReader endless;
+  gallocy::string line = "X-Header: " + gallocy::string(READER_BUFSIZE, 'x') + "\r\n";
+  endless.append("GET /admin HTTP/1.1\r\n", 21);
+  while (endless.buffered() <= READER_MAX_HEAD) {
+    ASSERT_FALSE(endless.frame());
+    endless.append(line.c_str(), line.length());
+  }
+  ASSERT_TRUE(endless.frame());
+  ASSERT_EQ(endless.rejected(), static_cast<uint64_t>(413));
+
+  gallocy::http::RequestReader fine;
+  fine.append(GET_REQUEST.c_str(), GET_REQUEST.length());
+  ASSERT_TRUE(fine.frame());
+  ASSERT_EQ(fine.rejected(), static_cast<uint64_t>(0));
+}
+
+
+TEST(RequestReaderTests, FillReusesBuffer) {
+  int sockets[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+  fcntl(sockets[1], F_SETFL, O_NONBLOCK);
+  gallocy::http::RequestReader reader;
+
+  // SMALL requests never grow the buffer.
+  gallocy::string get = "GET /admin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(write(sockets[1], get.c_str(), get.length()), static_cast<ssize_t>(get.length()));
+    ASSERT_TRUE(reader.fill(sockets[0]));
+    while (reader.frame())
+      reader.consume();
+  }
+  ASSERT_EQ(reader.get_capacity(), static_cast<uint64_t>(READER_BUFSIZE));
+
+  // A big body is read whole, and the buffer shrinks once it is consumed.
+  uint64_t body_length = 2 * READER_MAX_RETAINED;
+  gallocy::string head = "POST /raft/append_entries HTTP/1.1\r\nContent-Length: "
+    + gallocy::string(std::to_string(body_length).c_str()) + "\r\n\r\n";
+  gallocy::string body(body_length, 'a');
+  gallocy::string post = head + body;
+  uint64_t sent = 0;
+  while (sent < post.length()) {
+    ssize_t n = write(sockets[1], post.c_str() + sent, post.length() - sent);
+    if (n > 0)
+      sent += n;
+    ASSERT_TRUE(reader.fill(sockets[0]));
+  }
+  ASSERT_TRUE(reader.frame());
+  ASSERT_EQ(reader.length(), post.length());
+  ASSERT_EQ(gallocy::string(reader.data() + head.length(), body_length), body);
+  reader.consume();
+  ASSERT_EQ(reader.get_capacity(), static_cast<uint64_t>(READER_BUFSIZE));
+
+  close(sockets[1]);
+  ASSERT_FALSE(reader.fill(sockets[0]));
+  close(sockets[0]);
+}
+
+namespace {
+
+gallocy::http::Response routed;
+
+gallocy::http::Response *count_arguments(RouteArguments *args, gallocy::http::Request *request) {
+  gallocy::stringstream s;
+  s << args->size();
+  for (uint64_t i = 0; i < args->size(); i++)
+    s << " " << args->at(i).str();
+  routed.body = s.str();
+  return &routed;
+}
+
+}  // namespace
+
+TEST(RoutingTableTests, Functions) {
+  RoutingTable<gallocy::http::Response *(*)(RouteArguments *, gallocy::http::Request *)> t;
+  ASSERT_TRUE(t.register_handler("/foo", count_arguments));
+  ASSERT_TRUE(t.register_handler("/foo/<x>", count_arguments));
+  ASSERT_TRUE(t.register_handler("/foo/<x>/bar", count_arguments));
+  ASSERT_TRUE(t.register_handler("/foo/<x>/bar/<y>", count_arguments));
+  ASSERT_TRUE(t.register_handler("/foo/<x>/baz", count_arguments));
+  ASSERT_TRUE(t.register_handler("/foo/<x>/baz/<y>", count_arguments));
+  RouteArguments args;
+  ASSERT_EQ((*t.match("/foo", &args))(&args, nullptr)->body, "0");
+  ASSERT_EQ((*t.match("/foo/arg1", &args))(&args, nullptr)->body, "1 arg1");
+  ASSERT_EQ((*t.match("/foo/arg1/bar", &args))(&args, nullptr)->body, "1 arg1");
+  ASSERT_EQ((*t.match("/foo/arg1/bar/arg2", &args))(&args, nullptr)->body, "2 arg1 arg2");
+  ASSERT_EQ((*t.match("/foo/arg1/baz", &args))(&args, nullptr)->body, "1 arg1");
+  ASSERT_EQ((*t.match("/foo/arg1/baz/arg2?a=b", &args))(&args, nullptr)->body, "2 arg1 arg2");
+}
+
+TEST(RoutingTableTests, NoMatch) {
+  RoutingTable<int> t;
+  ASSERT_TRUE(t.register_handler("/raft/request", 1));
+  ASSERT_TRUE(t.register_handler("/raft/<x>", 2));
+  ASSERT_TRUE(t.register_handler("/admin", 3));
+  RouteArguments args;
+  ASSERT_EQ(*t.match("/raft/request", &args), 1);
+  ASSERT_EQ(args.size(), 0u);
+  // KEEP the path, as the arguments are views into it.
+  gallocy::string path = "/raft/request_vote";
+  ASSERT_EQ(*t.match(path, &args), 2);
+  ASSERT_TRUE(args.at(0).equals("request_vote"));
+  ASSERT_EQ(*t.match("/admin", &args), 3);
+  ASSERT_EQ(t.match("/", &args), nullptr);
+  ASSERT_EQ(t.match("/raft", &args), nullptr);
+  ASSERT_EQ(t.match("/admin/metrics", &args), nullptr);
+  ASSERT_EQ(t.match("/nothing", &args), nullptr);
+  ASSERT_FALSE(t.register_handler("/<a>/<b>/<c>/<d>/<e>/<f>/<g>/<h>/<i>", 4));
 }
@@ -314,6 +314,23 @@ TEST_F(InternalAllocatorTests, GrowingRealloc) {
 }
 
 
+TEST_F(InternalAllocatorTests, ReallocReusedAllocation) {
+  char *big = reinterpret_cast<char *>(internal_malloc(65536));
+  char *small = reinterpret_cast<char *>(internal_malloc(32));
+  char *guard = reinterpret_cast<char *>(internal_malloc(32));
+  memset(guard, 'G', 32);
+  internal_free(big);
+  internal_free(small);
+  // THE first fit for a small object is the big one, so growing it must copy
+  // only what fits into the next fit.
+  char *ptr = reinterpret_cast<char *>(internal_malloc(16));
+  memset(ptr, 'P', 16);
+  ptr = reinterpret_cast<char *>(internal_realloc(ptr, 32));
+  ASSERT_EQ(ptr[15], 'P');
+  for (int i = 0; i < 32; i++)
+    ASSERT_EQ(guard[i], 'G');
+}
+
 TEST_F(InternalAllocatorTests, SimpleCalloc) {
   void *ptr = NULL;
   ptr = internal_calloc(1, 16);
@@ -0,0 +1,181 @@
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/heaplayers/source.h"
+#include "gallocy/memory/lease.h"
+
+#define TEST_NODES 2
+
+
+class ChunkLeasesTests: public ::testing::Test {
+ protected:
+  /**
+   * Create a lease table per node, whose commands are applied to every table
+   * in the order they are proposed, like a Raft log that commits at once.
+   */
+  virtual void SetUp() {
+    for (int i = 0; i < TEST_NODES; i++) {
+      leases[i] = new gallocy::memory::ChunkLeases(i + 1, [this](const gallocy::string &command) {
+        std::lock_guard<std::mutex> lock(log_lock);
+        for (int j = 0; j < TEST_NODES; j++)
+          leases[j]->apply(command);
+        return true;
+      });
+    }
+  }
+
+  virtual void TearDown() {
+    for (int i = 0; i < TEST_NODES; i++)
+      delete leases[i];
+  }
+
+  uint64_t chunk(uint64_t offset) {
+    return offset / LEASE_CHUNK_SZ;
+  }
+
+  std::mutex log_lock;
+  gallocy::memory::ChunkLeases *leases[TEST_NODES];
+};
+
+
+TEST_F(ChunkLeasesTests, LeasesAreDisjoint) {
+  std::vector<uint64_t> chunks[TEST_NODES];
+  auto allocate = [&](int node) {
+    for (int i = 0; i < 6; i++) {
+      uint64_t offset = 0;
+      size_t length = 0;
+      ASSERT_TRUE(leases[node]->allocate(1, &offset, &length));
+      ASSERT_EQ(length, LEASE_CHUNK_SZ);
+      chunks[node].push_back(chunk(offset));
+    }
+  };
+  std::thread first(allocate, 0);
+  std::thread second(allocate, 1);
+  first.join();
+  second.join();
+  for (int node = 0; node < TEST_NODES; node++) {
+    for (auto c : chunks[node]) {
+      ASSERT_GE(c, LEASE_BOOTSTRAP_CHUNKS);
+      ASSERT_EQ(leases[0]->get_owner(c), node + 1);
+      ASSERT_EQ(leases[1]->get_owner(c), node + 1);
+    }
+  }
+  // BATCHES of leases mean most allocations never wait.
+  ASSERT_EQ(leases[0]->lease_requests, 2);
+  ASSERT_EQ(leases[0]->waits, 2);
+  ASSERT_EQ(leases[0]->get_leased(), 2 * LEASE_BATCH);
+}
+
+
+TEST_F(ChunkLeasesTests, LeasesAheadOfDemand) {
+  leases[0]->start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(2 * LEASE_POLL_MS));
+  ASSERT_EQ(leases[0]->get_unused(), LEASE_BATCH);
+  for (int i = 0; i < 3 * LEASE_BATCH; i++) {
+    uint64_t offset = 0;
+    size_t length = 0;
+    ASSERT_TRUE(leases[0]->allocate(1, &offset, &length));
+    std::this_thread::sleep_for(std::chrono::milliseconds(LEASE_POLL_MS / 5));
+  }
+  leases[0]->stop();
+  ASSERT_EQ(leases[0]->waits, 0);
+  ASSERT_GE(leases[0]->get_unused(), LEASE_LOW_WATER);
+}
+
+
+TEST_F(ChunkLeasesTests, ContiguousRun) {
+  uint64_t offset = 0;
+  size_t length = 0;
+  ASSERT_TRUE(leases[1]->allocate(1, &offset, &length));
+  ASSERT_TRUE(leases[0]->allocate(3 * LEASE_CHUNK_SZ - 100, &offset, &length));
+  ASSERT_EQ(length, 3 * LEASE_CHUNK_SZ);
+  for (uint64_t c = chunk(offset); c < chunk(offset) + 3; c++)
+    ASSERT_EQ(leases[1]->get_owner(c), 1);
+}
+
+
+TEST_F(ChunkLeasesTests, ReturnUnused) {
+  uint64_t offset = 0;
+  size_t length = 0;
+  ASSERT_TRUE(leases[0]->allocate(1, &offset, &length));
+  ASSERT_EQ(leases[0]->get_unused(), LEASE_BATCH - 1);
+  ASSERT_EQ(leases[0]->return_unused(1), LEASE_BATCH - 2);
+  ASSERT_EQ(leases[0]->get_leased(), 2);
+  ASSERT_EQ(leases[0]->chunks_returned, LEASE_BATCH - 2);
+  // THE used chunk stays leased, and the others go to the next node to ask.
+  ASSERT_EQ(leases[0]->return_unused(0), 1);
+  ASSERT_EQ(leases[0]->get_owner(chunk(offset)), 1);
+  ASSERT_TRUE(leases[1]->allocate(1, &offset, &length));
+  ASSERT_EQ(chunk(offset), LEASE_BOOTSTRAP_CHUNKS + 1);
+}
+
+
+TEST_F(ChunkLeasesTests, OutOfChunks) {
+  uint64_t offset = 0;
+  size_t length = 0;
+  for (uint64_t i = LEASE_BOOTSTRAP_CHUNKS; i < LEASE_CHUNKS; i++)
+    ASSERT_TRUE(leases[i % TEST_NODES]->allocate(1, &offset, &length));
+  ASSERT_FALSE(leases[0]->allocate(1, &offset, &length));
+  ASSERT_FALSE(leases[1]->allocate(1, &offset, &length));
+}
+
+
+TEST_F(ChunkLeasesTests, IgnoresOtherCommands) {
+  ASSERT_FALSE(leases[0]->apply("hello world"));
+  ASSERT_FALSE(leases[0]->apply(""));
+  ASSERT_TRUE(leases[0]->apply(RETURN_COMMAND " 1 3"));
+  ASSERT_EQ(leases[0]->get_leased(), 0);
+}
+
+
+TEST(ChunkLeasesProposalTests, LostProposalProposedAgain) {
+  // DROP the first proposal, as if its leader lost its term before
+  // committing it, and commit the rest at once.
+  int proposals = 0;
+  gallocy::memory::ChunkLeases *leases = nullptr;
+  leases = new gallocy::memory::ChunkLeases(1, [&](const gallocy::string &command) {
+    if (proposals++ > 0)
+      leases->apply(command);
+    return true;
+  });
+  uint64_t offset = 0;
+  size_t length = 0;
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(leases->allocate(1, &offset, &length));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(proposals, 2);
+  ASSERT_GE(elapsed, std::chrono::milliseconds(LEASE_PENDING_MS));
+  ASSERT_LT(elapsed, std::chrono::milliseconds(LEASE_TIMEOUT_MS));
+  ASSERT_EQ(leases->get_metrics()["pending"], 0);
+  delete leases;
+}
+
+
+/**
+ * Hand out the fifth chunk of the zone.
+ */
+static bool test_chunk_source(void *arg, size_t sz, uint64_t *offset, size_t *length) {
+  *offset = 5 * LEASE_CHUNK_SZ;
+  *length = LEASE_CHUNK_SZ;
+  (*reinterpret_cast<int *>(arg))++;
+  return true;
+}
+
+
+TEST(SourceMmapHeapTests, ChunkSource) {
+  static HL::SourceMmapHeap<PURPOSE_DEVELOPMENT_HEAP> source;
+  int calls = 0;
+  uint8_t *start = reinterpret_cast<uint8_t *>(source.malloc(64));
+  HL::SourceMmapHeap<PURPOSE_DEVELOPMENT_HEAP>::set_chunk_source(test_chunk_source, &calls);
+  uint8_t *first = reinterpret_cast<uint8_t *>(source.malloc(64));
+  uint8_t *second = reinterpret_cast<uint8_t *>(source.malloc(64));
+  HL::SourceMmapHeap<PURPOSE_DEVELOPMENT_HEAP>::set_chunk_source(nullptr, nullptr);
+  source.__reset();
+  ASSERT_EQ(first, start + 5 * LEASE_CHUNK_SZ);
+  ASSERT_EQ(second, first + 64);
+  ASSERT_EQ(calls, 1);
+}
@@ -0,0 +1,223 @@
+#include <pthread.h>
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/lock.h"
+#include "gallocy/memory/release.h"
+#include "gallocy/memory/transfer.h"
+#include "cluster.h"
+
+#define TEST_NODES 3
+#define TEST_REGION_PAGES 64
+#define TEST_ITERATIONS 50
+
+
+uint16_t LOCK_TEST_PORT = 27000;
+
+
+class DistributedLockTests:
+    public ClusterTest<gallocy::memory::LazyReleaseCoherence, TEST_NODES, TEST_REGION_PAGES> {
+ protected:
+  /**
+   * Three nodes in this process, each over its own region, with a release
+   * consistency protocol and a lock manager.
+   */
+  DistributedLockTests() : ClusterTest(&LOCK_TEST_PORT) {}
+
+  virtual void start_node(int node) {
+    locks[node] = new gallocy::memory::DistributedLockManager(node, nodes, *coherence[node]);
+    servers[node]->set_handler(PAGE_TRANSFER_LOCK, locks[node]);
+    locks[node]->start();
+  }
+
+  virtual void stop_node(int node) {
+    locks[node]->stop();
+  }
+
+  virtual void destroy_node(int node) {
+    delete locks[node];
+  }
+
+  void *mutex(int node, uint64_t page, uint64_t offset = 0) {
+    return regions[node] + page * PAGE_SZ + offset;
+  }
+
+  uint32_t manager(uint64_t page, uint64_t offset = 0) {
+    return locks[0]->get_manager(page * PAGE_SZ + offset);
+  }
+
+  gallocy::memory::DistributedLockManager *locks[TEST_NODES];
+};
+
+
+TEST_F(DistributedLockTests, LocalReacquireNoTraffic) {
+  uint32_t m = manager(0);
+  for (int i = 0; i < 10; i++) {
+    locks[m]->lock(mutex(m, 0));
+    locks[m]->unlock(mutex(m, 0));
+  }
+  ASSERT_EQ(locks[m]->local_acquires, 10);
+  ASSERT_EQ(locks[m]->remote_acquires, 0);
+  ASSERT_EQ(locks[m]->transfers_out, 0);
+  ASSERT_TRUE(locks[m]->has_token(mutex(m, 0)));
+}
+
+
+TEST_F(DistributedLockTests, TransferOnRemoteRequest) {
+  uint32_t m = manager(0);
+  uint32_t other = (m + 1) % TEST_NODES;
+  ASSERT_FALSE(locks[other]->has_token(mutex(other, 0)));
+  locks[other]->lock(mutex(other, 0));
+  ASSERT_EQ(locks[other]->remote_acquires, 1);
+  ASSERT_TRUE(locks[other]->has_token(mutex(other, 0)));
+  ASSERT_FALSE(locks[m]->has_token(mutex(m, 0)));
+  ASSERT_EQ(locks[m]->transfers_out, 1);
+  locks[other]->unlock(mutex(other, 0));
+  // THE token stays put once it has moved.
+  locks[other]->lock(mutex(other, 0));
+  locks[other]->unlock(mutex(other, 0));
+  ASSERT_EQ(locks[other]->local_acquires, 1);
+  ASSERT_EQ(locks[other]->remote_acquires, 1);
+  // AND moves back when asked.
+  locks[m]->lock(mutex(m, 0));
+  locks[m]->unlock(mutex(m, 0));
+  ASSERT_EQ(locks[m]->remote_acquires, 1);
+  ASSERT_EQ(locks[other]->transfers_out, 1);
+}
+
+
+TEST_F(DistributedLockTests, TrylockDoesNotWaitForToken) {
+  uint32_t m = manager(0);
+  uint32_t other = (m + 1) % TEST_NODES;
+  // A TRY without the token fails at once, but asks for the token.
+  ASSERT_FALSE(locks[other]->try_lock(mutex(other, 0)));
+  for (int i = 0; i < 100 && !locks[other]->has_token(mutex(other, 0)); i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_TRUE(locks[other]->has_token(mutex(other, 0)));
+  ASSERT_TRUE(locks[other]->try_lock(mutex(other, 0)));
+  locks[other]->unlock(mutex(other, 0));
+  ASSERT_EQ(locks[other]->local_acquires, 1);
+  ASSERT_EQ(locks[other]->remote_acquires, 0);
+  // AND a token nobody here holds goes back as soon as it is asked for.
+  locks[m]->lock(mutex(m, 0));
+  locks[m]->unlock(mutex(m, 0));
+  ASSERT_EQ(locks[other]->transfers_out, 1);
+}
+
+
+TEST_F(DistributedLockTests, InterceptedTrylockFailsWithoutToken) {
+  uint64_t page = 1;
+  while (manager(page) != 1)
+    page++;
+  pthread_mutex_t *shared = reinterpret_cast<pthread_mutex_t *>(mutex(0, page));
+  locks[0]->intercept_synchronization();
+  int first = pthread_mutex_trylock(shared);
+  set_sync_hooks(nullptr, nullptr, nullptr);
+  ASSERT_EQ(first, EBUSY);
+  // THE shadow was given back, so the mutex locks once the token is here.
+  for (int i = 0; i < 100 && !locks[0]->has_token(shared); i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  locks[0]->intercept_synchronization();
+  int second = pthread_mutex_trylock(shared);
+  if (second == 0)
+    pthread_mutex_unlock(shared);
+  set_sync_hooks(nullptr, nullptr, nullptr);
+  ASSERT_EQ(second, 0);
+}
+
+
+TEST_F(DistributedLockTests, ThirdNodeRequestIsForwarded) {
+  uint32_t m = manager(0);
+  uint32_t a = (m + 1) % TEST_NODES;
+  uint32_t b = (m + 2) % TEST_NODES;
+  locks[a]->lock(mutex(a, 0));
+  locks[a]->unlock(mutex(a, 0));
+  locks[b]->lock(mutex(b, 0));
+  locks[b]->unlock(mutex(b, 0));
+  ASSERT_EQ(locks[m]->forwards, 1);
+  ASSERT_EQ(locks[a]->transfers_out, 1);
+  ASSERT_TRUE(locks[b]->has_token(mutex(b, 0)));
+}
+
+
+TEST_F(DistributedLockTests, WriteNoticesPiggybacked) {
+  // PAGE 5's home is node 2, so pick a lock that node 0 and 1 pass between.
+  uint64_t page = 0;
+  while (manager(page) != 0)
+    page++;
+  ASSERT_EQ(read(1, 5), 0);
+  locks[0]->lock(mutex(0, page));
+  write(0, 5, 42);
+  locks[0]->unlock(mutex(0, page));
+  // NODE 1's stale copy is invalidated by the notices on the token.
+  ASSERT_EQ(read(1, 5), 0);
+  locks[1]->lock(mutex(1, page));
+  ASSERT_EQ(coherence[1]->pages_invalidated, 1);
+  ASSERT_EQ(read(1, 5), 42);
+  locks[1]->unlock(mutex(1, page));
+}
+
+
+TEST_F(DistributedLockTests, ContendedHandoff) {
+  // THE counter lives on page 7, whose home is node 1.
+  uint64_t page = 0;
+  while (manager(page) != 2)
+    page++;
+  auto increment = [&](int node) {
+    for (int i = 0; i < TEST_ITERATIONS; i++) {
+      locks[node]->lock(mutex(node, page));
+      write(node, 7, read(node, 7) + 1);
+      locks[node]->unlock(mutex(node, page));
+    }
+  };
+  std::thread first(increment, 0);
+  std::thread second(increment, 2);
+  first.join();
+  second.join();
+  locks[1]->lock(mutex(1, page));
+  ASSERT_EQ(read(1, 7), 2 * TEST_ITERATIONS);
+  locks[1]->unlock(mutex(1, page));
+}
+
+
+TEST_F(DistributedLockTests, Metrics) {
+  uint32_t m = manager(0);
+  uint32_t other = (m + 1) % TEST_NODES;
+  locks[m]->lock(mutex(m, 0));
+  locks[m]->unlock(mutex(m, 0));
+  locks[other]->lock(mutex(other, 0));
+  locks[other]->unlock(mutex(other, 0));
+  gallocy::json metrics = locks[other]->get_metrics();
+  ASSERT_EQ(metrics["remote_acquires"], 1);
+  ASSERT_EQ(metrics["acquire_latency_ns"]["count"], 1);
+  ASSERT_GT(metrics["acquire_latency_ns"]["max"].get<uint64_t>(), 0);
+  metrics = locks[m]->get_metrics();
+  ASSERT_EQ(metrics["local_acquires"], 1);
+  ASSERT_EQ(metrics["transfers_out"], 1);
+  ASSERT_EQ(metrics["transfer_rate_per_s"]["count"], 0);
+}
+
+
+TEST_F(DistributedLockTests, InterceptedMutexUsesShadow) {
+  uint64_t page = 1;
+  while (manager(page) != 1)
+    page++;
+  pthread_mutex_t *shared = reinterpret_cast<pthread_mutex_t *>(mutex(1, page));
+  locks[1]->intercept_synchronization();
+  pthread_mutex_lock(shared);
+  write(1, 0, 9);
+  pthread_mutex_unlock(shared);
+  set_sync_hooks(nullptr, nullptr, nullptr);
+  ASSERT_EQ(locks[1]->local_acquires, 1);
+  // THE mutex's page was never written, only the data it protects.
+  ASSERT_EQ(coherence[1]->write_faults, 1);
+  ASSERT_EQ(coherence[1]->get_permissions(page), PAGE_PERM_READ);
+  ASSERT_EQ(coherence[1]->intervals, 1);
+  ASSERT_EQ(read(0, 0), 9);
+}
@@ -0,0 +1,134 @@
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/memory/mesh.h"
+
+#define TEST_HEAP_PAGES 64
+#define TEST_OBJECT_SZ 256
+#define TEST_SLOTS (PAGE_SZ / TEST_OBJECT_SZ)
+
+
+class MeshHeapTests: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    heap = new gallocy::memory::MeshHeap(TEST_HEAP_PAGES);
+  }
+
+  virtual void TearDown() {
+    delete heap;
+  }
+
+  /**
+   * Fill two spans, then free the even slots of the first and the odd slots
+   * of the second, so that they can be meshed.
+   */
+  void fill_disjoint() {
+    for (int i = 0; i < 2 * TEST_SLOTS; i++) {
+      objects[i] = reinterpret_cast<uint8_t *>(heap->malloc(TEST_OBJECT_SZ));
+      ASSERT_NE(objects[i], nullptr);
+      memset(objects[i], i, TEST_OBJECT_SZ);
+    }
+    for (int i = 0; i < TEST_SLOTS; i += 2) {
+      heap->free(objects[i]);
+      heap->free(objects[TEST_SLOTS + i + 1]);
+      objects[i] = objects[TEST_SLOTS + i + 1] = nullptr;
+    }
+  }
+
+  gallocy::memory::MeshHeap *heap;
+  uint8_t *objects[2 * TEST_SLOTS];
+};
+
+
+TEST_F(MeshHeapTests, SizeClasses) {
+  void *small = heap->malloc(10);
+  void *medium = heap->malloc(100);
+  ASSERT_EQ(heap->getSize(small), 16);
+  ASSERT_EQ(heap->getSize(medium), 128);
+  // EACH size class has spans of its own.
+  ASSERT_EQ(heap->get_resident_pages(), 2);
+  ASSERT_EQ(heap->malloc(MESH_MAX_OBJECT + 1), nullptr);
+  heap->free(small);
+  heap->free(medium);
+  ASSERT_EQ(heap->get_resident_pages(), 0);
+}
+
+
+TEST_F(MeshHeapTests, DisjointSpansMesh) {
+  fill_disjoint();
+  ASSERT_EQ(heap->get_resident_pages(), 2);
+  ASSERT_EQ(heap->mesh(), 1);
+  ASSERT_EQ(heap->meshed, 1);
+  ASSERT_EQ(heap->get_resident_pages(), 1);
+  // NO object moved, and every object kept its contents.
+  for (int i = 0; i < 2 * TEST_SLOTS; i++) {
+    if (!objects[i])
+      continue;
+    for (int byte = 0; byte < TEST_OBJECT_SZ; byte++)
+      ASSERT_EQ(objects[i][byte], i);
+  }
+  // BOTH virtual pages now show the same physical page.
+  uint8_t *first = objects[1] - TEST_OBJECT_SZ;
+  uint8_t *second = objects[TEST_SLOTS];
+  second[0] = 42;
+  ASSERT_EQ(first[0], 42);
+}
+
+
+TEST_F(MeshHeapTests, OverlappingSpansDoNotMesh) {
+  fill_disjoint();
+  // THE first slot of both spans is now taken.
+  objects[0] = reinterpret_cast<uint8_t *>(heap->malloc(TEST_OBJECT_SZ));
+  objects[TEST_SLOTS + 1] = reinterpret_cast<uint8_t *>(heap->malloc(TEST_OBJECT_SZ));
+  ASSERT_EQ(heap->mesh(), 0);
+  ASSERT_EQ(heap->get_resident_pages(), 2);
+}
+
+
+TEST_F(MeshHeapTests, MeshedSpanFreed) {
+  fill_disjoint();
+  ASSERT_EQ(heap->mesh(), 1);
+  for (int i = 0; i < 2 * TEST_SLOTS; i++)
+    heap->free(objects[i]);
+  ASSERT_EQ(heap->get_resident_pages(), 0);
+  // BOTH virtual pages are reused, each on a physical page of its own.
+  uint8_t *a = reinterpret_cast<uint8_t *>(heap->malloc(PAGE_SZ / 2));
+  uint8_t *b = reinterpret_cast<uint8_t *>(heap->malloc(PAGE_SZ / 2));
+  uint8_t *c = reinterpret_cast<uint8_t *>(heap->malloc(PAGE_SZ / 2));
+  uint8_t *d = reinterpret_cast<uint8_t *>(heap->malloc(PAGE_SZ / 2));
+  memset(a, 1, PAGE_SZ / 2);
+  memset(b, 2, PAGE_SZ / 2);
+  memset(c, 3, PAGE_SZ / 2);
+  memset(d, 4, PAGE_SZ / 2);
+  ASSERT_EQ(a[0], 1);
+  ASSERT_EQ(b[0], 2);
+  ASSERT_EQ(c[0], 3);
+  ASSERT_EQ(heap->get_resident_pages(), 2);
+}
+
+
+TEST_F(MeshHeapTests, ScavengeHonorsThreshold) {
+  fill_disjoint();
+  ASSERT_DOUBLE_EQ(heap->get_fragmentation(), 0.5);
+  // HALF of the resident bytes are free, which is not above the threshold.
+  ASSERT_EQ(heap->scavenge(), 0);
+  ASSERT_EQ(heap->passes, 0);
+  heap->free(objects[1]);
+  ASSERT_EQ(heap->scavenge(), 1);
+  ASSERT_EQ(heap->passes, 1);
+  ASSERT_EQ(heap->get_resident_pages(), 1);
+}
+
+
+TEST_F(MeshHeapTests, ScavengerMeshes) {
+  fill_disjoint();
+  heap->free(objects[1]);
+  heap->start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(3 * MESH_POLL_MS));
+  heap->stop();
+  ASSERT_EQ(heap->meshed, 1);
+  ASSERT_EQ(heap->get_resident_pages(), 1);
+}
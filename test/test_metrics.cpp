@@ -0,0 +1,53 @@
+#include "gtest/gtest.h"
+
+#include "gallocy/utils/metrics.h"
+
+
+TEST(MetricsTests, RegisterAndCollect) {
+  utils::register_metrics("test source", []() { return gallocy::json({ { "value", 7 } }); });
+  gallocy::json metrics = utils::collect_metrics();
+  ASSERT_EQ(metrics["test source"]["value"], 7);
+  utils::unregister_metrics("test source");
+  metrics = utils::collect_metrics();
+  ASSERT_EQ(metrics.count("test source"), 0);
+}
+
+
+TEST(MetricsTests, HistogramEmpty) {
+  utils::Histogram histogram;
+  ASSERT_EQ(histogram.get_count(), 0);
+  ASSERT_EQ(histogram.get_max(), 0);
+  ASSERT_EQ(histogram.get_percentile(0.99), 0);
+  gallocy::json json = histogram.to_json();
+  ASSERT_EQ(json["count"], 0);
+  ASSERT_TRUE(json["buckets"].empty());
+}
+
+
+TEST(MetricsTests, HistogramBuckets) {
+  utils::Histogram histogram;
+  histogram.record(0);
+  histogram.record(1);
+  histogram.record(5);
+  histogram.record(6);
+  gallocy::json json = histogram.to_json();
+  ASSERT_EQ(json["count"], 4);
+  ASSERT_EQ(json["sum"], 12);
+  ASSERT_EQ(json["max"], 6);
+  ASSERT_EQ(json["buckets"]["0"], 1);
+  ASSERT_EQ(json["buckets"]["1"], 1);
+  ASSERT_EQ(json["buckets"]["7"], 2);
+}
+
+
+TEST(MetricsTests, HistogramPercentiles) {
+  utils::Histogram histogram;
+  for (uint64_t i = 0; i < 99; i++)
+    histogram.record(10);
+  histogram.record(1000);
+  // PERCENTILES are bucket upper bounds, but never more than the max.
+  ASSERT_EQ(histogram.get_percentile(0.50), 15);
+  ASSERT_EQ(histogram.get_percentile(0.90), 15);
+  ASSERT_EQ(histogram.get_percentile(0.99), 1000);
+  ASSERT_EQ(histogram.get_max(), 1000);
+}
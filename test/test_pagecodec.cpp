@@ -0,0 +1,175 @@
+#include <cstring>
+#include <cstdlib>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/utils/lz.h"
+#include "gallocy/utils/pagecodec.h"
+
+
+class PageCodecTests: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    for (int i = 0; i < PAGE_SZ; i++)
+      twin[i] = rand() % 255 + 1;
+    memcpy(page, twin, PAGE_SZ);
+    memcpy(remote, twin, PAGE_SZ);
+  }
+
+  void assert_round_trip(size_t expected_tag) {
+    size_t len = utils::page_encode(page, twin, buf, sizeof(buf));
+    ASSERT_GT(len, 0);
+    ASSERT_EQ(buf[0], expected_tag);
+    ASSERT_TRUE(utils::page_decode(buf, len, remote));
+    ASSERT_EQ(memcmp(page, remote, PAGE_SZ), 0);
+  }
+
+  uint8_t page[PAGE_SZ];
+  uint8_t twin[PAGE_SZ];
+  uint8_t remote[PAGE_SZ];
+  uint8_t buf[PAGE_CODEC_MAX_SZ];
+};
+
+
+TEST(VarintTests, RoundTrip) {
+  uint8_t buf[10];
+  uint64_t values[] = { 0, 1, 127, 128, 16383, 16384, ~0ULL };
+  for (auto v : values) {
+    uint64_t out = 0;
+    size_t n = utils::varint_encode(v, buf, sizeof(buf));
+    ASSERT_GT(n, 0);
+    ASSERT_EQ(utils::varint_decode(buf, n, &out), n);
+    ASSERT_EQ(out, v);
+  }
+  ASSERT_EQ(utils::varint_encode(128, buf, 1), 0);
+  ASSERT_EQ(utils::varint_decode(buf, 1, &values[0]), 0);
+}
+
+
+TEST(LzTests, RoundTrip) {
+  uint8_t src[3 * PAGE_SZ];
+  uint8_t compressed[3 * PAGE_SZ + 64];
+  uint8_t out[3 * PAGE_SZ];
+  for (size_t i = 0; i < sizeof(src); i++)
+    src[i] = (i % 7 == 0) ? rand() : i % 13;
+  size_t len = utils::lz_compress(src, sizeof(src), compressed, utils::lz_compress_bound(sizeof(src)));
+  ASSERT_GT(len, 0);
+  ASSERT_LT(len, sizeof(src));
+  ASSERT_EQ(utils::lz_decompress(compressed, len, out, sizeof(out)), static_cast<int64_t>(sizeof(src)));
+  ASSERT_EQ(memcmp(src, out, sizeof(src)), 0);
+  // A short output buffer is an error rather than an overrun.
+  ASSERT_EQ(utils::lz_decompress(compressed, len, out, sizeof(src) - 1), -1);
+  ASSERT_EQ(utils::lz_compress(src, sizeof(src), compressed, 8), 0);
+}
+
+
+TEST(LzTests, Incompressible) {
+  uint8_t src[PAGE_SZ];
+  uint8_t compressed[PAGE_SZ + 64];
+  uint8_t out[PAGE_SZ];
+  for (size_t i = 0; i < sizeof(src); i++)
+    src[i] = rand();
+  size_t len = utils::lz_compress(src, sizeof(src), compressed, utils::lz_compress_bound(sizeof(src)));
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(utils::lz_decompress(compressed, len, out, sizeof(out)), static_cast<int64_t>(sizeof(src)));
+  ASSERT_EQ(memcmp(src, out, sizeof(src)), 0);
+}
+
+
+TEST(LzTests, Malformed) {
+  uint8_t out[64];
+  // A back reference before the start of the output.
+  uint8_t bad_offset[] = { 0x10, 'a', 0x05, 0x00 };
+  ASSERT_EQ(utils::lz_decompress(bad_offset, sizeof(bad_offset), out, sizeof(out)), -1);
+  // A literal run longer than the input.
+  uint8_t bad_length[] = { 0xF0, 0x20, 'a' };
+  ASSERT_EQ(utils::lz_decompress(bad_length, sizeof(bad_length), out, sizeof(out)), -1);
+}
+
+
+TEST_F(PageCodecTests, CleanPage) {
+  size_t len = utils::page_encode(page, twin, buf, sizeof(buf));
+  ASSERT_EQ(len, 1);
+  ASSERT_TRUE(utils::page_decode(buf, len, remote));
+  ASSERT_EQ(memcmp(page, remote, PAGE_SZ), 0);
+}
+
+
+TEST_F(PageCodecTests, FewWords) {
+  page[8] = 0;
+  page[9] = twin[9] ^ 0xFF;
+  page[PAGE_SZ - 1] = 0;
+  assert_round_trip(PAGE_CODEC_RUNS);
+  // SKIP 8, COPY 2, SKIP 4084, COPY 1 plus the tag.
+  ASSERT_EQ(utils::page_encode(page, twin, buf, sizeof(buf)), 1 + 1 + 3 + 2 + 2);
+}
+
+
+TEST_F(PageCodecTests, ZeroRun) {
+  memset(page + 100, 0, 200);
+  size_t len = utils::page_encode(page, twin, buf, sizeof(buf), 2.0);
+  // SKIP 100, ZERO 200 plus the tag.
+  ASSERT_EQ(len, 1 + 2 + 2);
+  ASSERT_TRUE(utils::page_decode(buf, len, remote));
+  ASSERT_EQ(memcmp(page, remote, PAGE_SZ), 0);
+}
+
+
+TEST_F(PageCodecTests, DenseCompressible) {
+  for (int i = 0; i < PAGE_SZ; i++)
+    page[i] = (i / 8) % 5 + 1;
+  assert_round_trip(PAGE_CODEC_RUNS_LZ);
+}
+
+
+TEST_F(PageCodecTests, DenseIncompressible) {
+  for (int i = 0; i < PAGE_SZ; i++)
+    page[i] = twin[i] + 1 + rand() % 100;
+  assert_round_trip(PAGE_CODEC_RUNS);
+}
+
+
+TEST_F(PageCodecTests, WorstCase) {
+  for (int i = 0; i < PAGE_SZ; i += 2)
+    page[i] = twin[i] + 1;
+  size_t len = utils::page_encode(page, twin, buf, sizeof(buf), 2.0);
+  ASSERT_GT(len, 0);
+  ASSERT_LE(len, PAGE_CODEC_MAX_SZ);
+  ASSERT_EQ(buf[0], PAGE_CODEC_RUNS);
+  ASSERT_TRUE(utils::page_decode(buf, len, remote));
+  ASSERT_EQ(memcmp(page, remote, PAGE_SZ), 0);
+}
+
+
+TEST_F(PageCodecTests, DisjointWritersCommute) {
+  uint8_t other[PAGE_SZ];
+  uint8_t other_buf[PAGE_CODEC_MAX_SZ];
+  memcpy(other, twin, PAGE_SZ);
+  page[10] = 0xAA;
+  other[11] = 0xBB;
+  size_t len = utils::page_encode(page, twin, buf, sizeof(buf));
+  size_t other_len = utils::page_encode(other, twin, other_buf, sizeof(other_buf));
+  ASSERT_TRUE(utils::page_decode(other_buf, other_len, remote));
+  ASSERT_TRUE(utils::page_decode(buf, len, remote));
+  ASSERT_EQ(remote[10], 0xAA);
+  ASSERT_EQ(remote[11], 0xBB);
+}
+
+
+TEST_F(PageCodecTests, ShortBuffer) {
+  for (int i = 0; i < PAGE_SZ; i += 64)
+    page[i] = twin[i] + 1;
+  ASSERT_EQ(utils::page_encode(page, twin, buf, 16), 0);
+}
+
+
+TEST_F(PageCodecTests, Malformed) {
+  uint8_t bad_tag[] = { 7 };
+  ASSERT_FALSE(utils::page_decode(bad_tag, sizeof(bad_tag), remote));
+  // COPY of 4 bytes with only 1 byte following.
+  uint8_t short_copy[] = { PAGE_CODEC_RUNS, 4 << 2 | PAGE_CODEC_OP_COPY, 'a' };
+  ASSERT_FALSE(utils::page_decode(short_copy, sizeof(short_copy), remote));
+  // ZERO past the end of the page.
+  uint8_t overrun[] = { PAGE_CODEC_RUNS, 0x86, 0x80, 0x01 };
+  ASSERT_FALSE(utils::page_decode(overrun, sizeof(overrun), remote));
+}
@@ -0,0 +1,110 @@
+#include <cstring>
+#include <cstdlib>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/utils/pagediff.h"
+
+
+static const utils::PageDiffIsa ALL_ISAS[] = {
+  utils::PAGE_DIFF_SCALAR,
+  utils::PAGE_DIFF_SSE2,
+  utils::PAGE_DIFF_AVX2,
+  utils::PAGE_DIFF_AVX512,
+};
+
+
+class PageDiffTests: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    for (int i = 0; i < PAGE_SZ; i++)
+      twin[i] = rand() % 255;
+    memcpy(page, twin, PAGE_SZ);
+  }
+
+  uint8_t page[PAGE_SZ];
+  uint8_t twin[PAGE_SZ];
+  utils::PageDiffRun runs[PAGE_SZ / 2];
+};
+
+
+TEST_F(PageDiffTests, ScalarAlwaysSupported) {
+  ASSERT_NE(utils::page_diff_kernel(utils::PAGE_DIFF_SCALAR), (void *) NULL);
+  ASSERT_NE(utils::page_diff_kernel().name, (void *) NULL);
+}
+
+
+TEST_F(PageDiffTests, CleanPage) {
+  ASSERT_EQ(utils::page_dirty_lines(page, twin), 0);
+  ASSERT_EQ(utils::page_diff_runs(page, twin, runs, PAGE_SZ / 2), 0);
+}
+
+
+TEST_F(PageDiffTests, LastByte) {
+  page[PAGE_SZ - 1] ^= 0xFF;
+  ASSERT_EQ(utils::page_dirty_lines(page, twin), 1ULL << (PAGE_LINES - 1));
+  ASSERT_EQ(utils::page_diff_runs(page, twin, runs, PAGE_SZ / 2), 1);
+  ASSERT_EQ(runs[0].offset, PAGE_SZ - 1);
+  ASSERT_EQ(runs[0].length, 1);
+}
+
+
+TEST_F(PageDiffTests, RunAcrossLines) {
+  memset(page + PAGE_LINE_SZ - 4, 0, 8);
+  memset(twin + PAGE_LINE_SZ - 4, 1, 8);
+  ASSERT_EQ(utils::page_dirty_lines(page, twin), 3ULL);
+  ASSERT_EQ(utils::page_diff_runs(page, twin, runs, PAGE_SZ / 2), 1);
+  ASSERT_EQ(runs[0].offset, PAGE_LINE_SZ - 4);
+  ASSERT_EQ(runs[0].length, 8);
+}
+
+
+TEST_F(PageDiffTests, WholePage) {
+  for (int i = 0; i < PAGE_SZ; i++)
+    page[i] = twin[i] + 1;
+  ASSERT_EQ(utils::page_dirty_lines(page, twin), ~0ULL);
+  ASSERT_EQ(utils::page_diff_runs(page, twin, runs, PAGE_SZ / 2), 1);
+  ASSERT_EQ(runs[0].offset, 0);
+  ASSERT_EQ(runs[0].length, PAGE_SZ);
+}
+
+
+TEST_F(PageDiffTests, ShortBuffer) {
+  for (int i = 0; i < PAGE_SZ; i += 2)
+    page[i] = twin[i] + 1;
+  ASSERT_EQ(utils::page_diff_runs(page, twin, runs, 4), PAGE_SZ / 2);
+  ASSERT_EQ(runs[3].offset, 6);
+}
+
+
+TEST_F(PageDiffTests, KernelsAgree) {
+  const utils::PageDiffKernel *scalar = utils::page_diff_kernel(utils::PAGE_DIFF_SCALAR);
+  utils::PageDiffRun expected[PAGE_SZ / 2];
+  for (int density = 1; density <= 64; density *= 2) {
+    memcpy(page, twin, PAGE_SZ);
+    for (int i = 0; i < PAGE_SZ; i++) {
+      if (rand() % 64 < density)
+        page[i] = twin[i] + 1;
+    }
+    size_t n = utils::page_diff_runs(*scalar, page, twin, expected, PAGE_SZ / 2);
+    for (auto isa : ALL_ISAS) {
+      const utils::PageDiffKernel *kernel = utils::page_diff_kernel(isa);
+      if (kernel == nullptr)
+        continue;
+      ASSERT_EQ(kernel->dirty_lines(page, twin), scalar->dirty_lines(page, twin)) << kernel->name;
+      ASSERT_EQ(utils::page_diff_runs(*kernel, page, twin, runs, PAGE_SZ / 2), n) << kernel->name;
+      for (size_t i = 0; i < n; i++) {
+        ASSERT_EQ(runs[i].offset, expected[i].offset) << kernel->name;
+        ASSERT_EQ(runs[i].length, expected[i].length) << kernel->name;
+      }
+    }
+  }
+}
+
+
+TEST_F(PageDiffTests, Select) {
+  utils::PageDiffIsa original = utils::page_diff_kernel().isa;
+  ASSERT_TRUE(utils::page_diff_select(utils::PAGE_DIFF_SCALAR));
+  ASSERT_EQ(utils::page_diff_kernel().isa, utils::PAGE_DIFF_SCALAR);
+  ASSERT_TRUE(utils::page_diff_select(original));
+}
@@ -0,0 +1,146 @@
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/prefetch.h"
+#include "gallocy/memory/transfer.h"
+#include "gallocy/utils/metrics.h"
+
+#define TEST_REGION_PAGES 512
+
+
+uint16_t PREFETCH_TEST_PORT = 24000;
+
+
+class PagePrefetcherTests: public ::testing::Test {
+ protected:
+  /**
+   * Start a server over one region and a prefetcher over another.
+   */
+  virtual void SetUp() {
+    remote = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    local = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(remote, MAP_FAILED);
+    ASSERT_NE(local, MAP_FAILED);
+    server = new gallocy::memory::PageTransferServer("127.0.0.1", PREFETCH_TEST_PORT, remote, TEST_REGION_PAGES);
+    server->start();
+    // DISABLE neighbour prefetch so only the prefetcher fetches ahead.
+    client = new gallocy::memory::PageTransferClient(gallocy::common::Peer("127.0.0.1", PREFETCH_TEST_PORT),
+                                                     local, TEST_REGION_PAGES, 0);
+    prefetcher = new gallocy::memory::PagePrefetcher(*client);
+    prefetcher->start();
+  }
+
+  virtual void TearDown() {
+    prefetcher->stop();
+    delete prefetcher;
+    delete client;
+    server->stop();
+    delete server;
+    munmap(remote, TEST_REGION_PAGES * PAGE_SZ);
+    munmap(local, TEST_REGION_PAGES * PAGE_SZ);
+    PREFETCH_TEST_PORT++;
+  }
+
+  /**
+   * Wait for the prefetcher's worker to catch up.
+   */
+  bool wait_for(std::function<bool()> condition) {
+    for (int i = 0; i < 200; i++) {
+      if (condition())
+        return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  uint8_t *remote;
+  uint8_t *local;
+  gallocy::memory::PageTransferServer *server;
+  gallocy::memory::PageTransferClient *client;
+  gallocy::memory::PagePrefetcher *prefetcher;
+};
+
+
+TEST_F(PagePrefetcherTests, NoPatternNoPrefetch) {
+  uint64_t pages[] = { 5, 40, 41, 300, 7, 100 };
+  for (auto page : pages)
+    ASSERT_TRUE(prefetcher->fault(page));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_EQ(prefetcher->issued, 0);
+  ASSERT_EQ(client->pages_fetched, 6);
+}
+
+
+TEST_F(PagePrefetcherTests, StrideDetected) {
+  ASSERT_TRUE(prefetcher->fault(0));
+  ASSERT_TRUE(prefetcher->fault(10));
+  ASSERT_TRUE(prefetcher->fault(20));
+  ASSERT_TRUE(wait_for([&]() { return client->is_present(20 + 10 * PREFETCH_DEFAULT_DEGREE); }));
+  for (uint64_t page = 30; page <= 20 + 10 * PREFETCH_DEFAULT_DEGREE; page += 10)
+    ASSERT_TRUE(client->is_present(page));
+  ASSERT_FALSE(client->is_present(21));
+  // TOUCHING a prefetched page is a hit and costs no round trip.
+  uint64_t round_trips = client->round_trips;
+  ASSERT_TRUE(prefetcher->fault(30));
+  ASSERT_EQ(prefetcher->useful, 1);
+  ASSERT_TRUE(wait_for([&]() { return client->round_trips > round_trips; }));
+  ASSERT_TRUE(client->is_present(30 + 10 * PREFETCH_DEFAULT_DEGREE));
+}
+
+
+TEST_F(PagePrefetcherTests, NegativeStride) {
+  ASSERT_TRUE(prefetcher->fault(400));
+  ASSERT_TRUE(prefetcher->fault(397));
+  ASSERT_TRUE(prefetcher->fault(394));
+  ASSERT_TRUE(wait_for([&]() { return client->is_present(391); }));
+  ASSERT_FALSE(client->is_present(393));
+}
+
+
+TEST_F(PagePrefetcherTests, MatrixColumnWalk) {
+  // WALK a column of a matrix whose rows each span two pages, like the inner
+  // loop of mm() over the second matrix.
+  uint64_t row_pages = 2;
+  for (uint64_t row = 0; row < 128; row++) {
+    ASSERT_TRUE(prefetcher->fault(row * row_pages));
+    // GIVE the worker time to run ahead, as real work between rows would.
+    if (row % 4 == 3)
+      wait_for([&]() { return client->is_present((row + 1) * row_pages); });
+  }
+  ASSERT_GT(prefetcher->useful, 64);
+  ASSERT_GT(prefetcher->get_accuracy(), PREFETCH_HIGH_ACCURACY);
+  ASSERT_GT(prefetcher->get_degree(), PREFETCH_DEFAULT_DEGREE);
+}
+
+
+TEST_F(PagePrefetcherTests, ThrottleOnUselessPrefetches) {
+  // START many short streams whose prefetches are never touched.
+  for (uint64_t base = 0; base + 3 * 20 < TEST_REGION_PAGES && prefetcher->issued < PREFETCH_EPOCH; base += 30) {
+    uint64_t issued = prefetcher->issued;
+    ASSERT_TRUE(prefetcher->fault(base));
+    ASSERT_TRUE(prefetcher->fault(base + 3));
+    ASSERT_TRUE(prefetcher->fault(base + 6));
+    ASSERT_TRUE(wait_for([&]() { return prefetcher->issued > issued; }));
+  }
+  ASSERT_TRUE(wait_for([&]() { return prefetcher->get_degree() < PREFETCH_DEFAULT_DEGREE; }));
+  ASSERT_EQ(prefetcher->useful, 0);
+  ASSERT_EQ(prefetcher->get_accuracy(), 0);
+}
+
+
+TEST_F(PagePrefetcherTests, Metrics) {
+  gallocy::json metrics = utils::collect_metrics();
+  gallocy::string name = "prefetch 127.0.0.1:" + gallocy::string(std::to_string(PREFETCH_TEST_PORT).c_str());
+  ASSERT_NE(metrics.find(name.c_str()), metrics.end());
+  uint64_t degree = metrics[name.c_str()]["degree"];
+  ASSERT_EQ(degree, PREFETCH_DEFAULT_DEGREE);
+}
@@ -0,0 +1,178 @@
+#include <sys/mman.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/coherence.h"
+#include "gallocy/memory/profiler.h"
+#include "gallocy/memory/transfer.h"
+#include "cluster.h"
+
+#define TEST_NODES 2
+#define TEST_REGION_PAGES 16
+
+
+uint16_t PROFILER_TEST_PORT = 29000;
+
+
+class FalseSharingProfilerTests: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    region = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(region, MAP_FAILED);
+    profiler = new gallocy::memory::FalseSharingProfiler(0, region, TEST_REGION_PAGES);
+    memset(before, 0, PAGE_SZ);
+    memset(after, 0, PAGE_SZ);
+  }
+
+  virtual void TearDown() {
+    delete profiler;
+    munmap(region, TEST_REGION_PAGES * PAGE_SZ);
+  }
+
+  uint8_t *region;
+  uint8_t before[PAGE_SZ];
+  uint8_t after[PAGE_SZ];
+  gallocy::memory::FalseSharingProfiler *profiler;
+};
+
+
+TEST_F(FalseSharingProfilerTests, DisjointWritersAreFalseSharing) {
+  profiler->record_allocation(region + PAGE_SZ, 64, reinterpret_cast<void *>(0x1000));
+  profiler->record_allocation(region + PAGE_SZ + 128, 64, reinterpret_cast<void *>(0x2000));
+  after[8] = 1;
+  profiler->record_writes(0, 1, before, after);
+  memcpy(before, after, PAGE_SZ);
+  after[130] = 1;
+  after[131] = 1;
+  profiler->record_writes(1, 1, before, after);
+
+  gallocy::json report = profiler->report();
+  ASSERT_EQ(report["falsely_shared_pages"], 1);
+  gallocy::json page = report["pages"][0];
+  ASSERT_EQ(page["page"], 1);
+  ASSERT_EQ(page["sharing"], PROFILER_SHARING_FALSE);
+  ASSERT_EQ(page["writers"].size(), static_cast<size_t>(2));
+  gallocy::json run = page["writers"][1]["runs"][0];
+  ASSERT_EQ(run["offset"], PAGE_SZ + 130);
+  ASSERT_EQ(run["length"], 2);
+  // THE run is blamed on the allocation that holds it.
+  ASSERT_EQ(run["allocations"].size(), static_cast<size_t>(1));
+  ASSERT_EQ(run["allocations"][0]["offset"], PAGE_SZ + 128);
+  ASSERT_EQ(run["allocations"][0]["size"], 64);
+  ASSERT_EQ(run["allocations"][0]["site"], 0x2000);
+}
+
+
+TEST_F(FalseSharingProfilerTests, OverlappingWritersAreTrueSharing) {
+  after[8] = 1;
+  profiler->record_writes(0, 2, before, after);
+  after[8] = 2;
+  after[9] = 2;
+  profiler->record_writes(1, 2, before, after);
+  gallocy::json report = profiler->report();
+  ASSERT_EQ(report["falsely_shared_pages"], 0);
+  ASSERT_EQ(report["pages"][0]["sharing"], PROFILER_SHARING_TRUE);
+  ASSERT_EQ(report["pages"][0]["overlap_bytes"], 1);
+}
+
+
+TEST_F(FalseSharingProfilerTests, TransfersDiffAgainstLastHandoff) {
+  // THE first transfer only takes a twin.
+  profiler->handed_off(3, 1, after);
+  after[200] = 7;
+  profiler->acquired(3, 1, after);
+  after[10] = 7;
+  profiler->handed_off(3, 1, after);
+  ASSERT_EQ(profiler->transfers, 3);
+  ASSERT_EQ(profiler->samples, 2);
+  gallocy::json page = profiler->report()["pages"][0];
+  ASSERT_EQ(page["transfers"], 3);
+  ASSERT_EQ(page["sharing"], PROFILER_SHARING_FALSE);
+  ASSERT_EQ(page["writers"][0]["node"], 0);
+  ASSERT_EQ(page["writers"][0]["runs"][0]["offset"], 3 * PAGE_SZ + 10);
+  ASSERT_EQ(page["writers"][1]["node"], 1);
+  ASSERT_EQ(page["writers"][1]["runs"][0]["offset"], 3 * PAGE_SZ + 200);
+}
+
+
+TEST_F(FalseSharingProfilerTests, FreeForgetsAllocation) {
+  profiler->record_allocation(region, 32, reinterpret_cast<void *>(0x1000));
+  profiler->record_free(region);
+  after[0] = 1;
+  profiler->record_writes(0, 0, before, after);
+  gallocy::json run = profiler->report()["pages"][0]["writers"][0]["runs"][0];
+  ASSERT_EQ(run["allocations"].size(), static_cast<size_t>(0));
+}
+
+
+TEST_F(FalseSharingProfilerTests, Dump) {
+  after[0] = 1;
+  profiler->record_writes(0, 0, before, after);
+  char path[] = "/tmp/gallocy-profile-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  close(fd);
+  ASSERT_TRUE(profiler->dump(path));
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  unlink(path);
+  gallocy::json report = gallocy::json::parse(contents.str().c_str());
+  ASSERT_EQ(report["node"], 0);
+  ASSERT_EQ(report["profiled_pages"], 1);
+  ASSERT_FALSE(profiler->dump("/nonexistent/profile.json"));
+}
+
+
+class MRSWProfilerTests: public ClusterTest<gallocy::memory::MRSWCoherence, TEST_NODES, TEST_REGION_PAGES> {
+ protected:
+  /**
+   * Two nodes in this process, each over its own region and with its own
+   * profiler, with node 0 owning every page.
+   */
+  MRSWProfilerTests() : ClusterTest(&PROFILER_TEST_PORT) {}
+
+  virtual void start_node(int node) {
+    profilers[node] = new gallocy::memory::FalseSharingProfiler(node, regions[node], TEST_REGION_PAGES);
+    coherence[node]->set_profiler(profilers[node]);
+  }
+
+  virtual void destroy_node(int node) {
+    delete profilers[node];
+  }
+
+  void write(int node, uint64_t offset, uint8_t value) {
+    *reinterpret_cast<volatile uint8_t *>(regions[node] + offset) = value;
+  }
+
+  gallocy::memory::FalseSharingProfiler *profilers[TEST_NODES];
+};
+
+
+TEST_F(MRSWProfilerTests, BouncingPageIsFalselyShared) {
+  profilers[0]->record_allocation(regions[0] + 5 * PAGE_SZ + 512, 64, reinterpret_cast<void *>(0x1000));
+  // EACH node writes its own object on page 5, and the page bounces.
+  for (int round = 0; round < 3; round++) {
+    write(1, 5 * PAGE_SZ, round + 1);
+    write(0, 5 * PAGE_SZ + 512, round + 1);
+  }
+  ASSERT_EQ(coherence[0]->get_owner(5), 0);
+  ASSERT_EQ(profilers[0]->transfers, 6);
+  gallocy::json report = profilers[0]->report();
+  ASSERT_EQ(report["falsely_shared_pages"], 1);
+  gallocy::json page = report["pages"][0];
+  ASSERT_EQ(page["page"], 5);
+  ASSERT_EQ(page["sharing"], PROFILER_SHARING_FALSE);
+  ASSERT_EQ(page["writers"][0]["runs"][0]["offset"], 5 * PAGE_SZ + 512);
+  ASSERT_EQ(page["writers"][0]["runs"][0]["allocations"][0]["site"], 0x1000);
+  ASSERT_EQ(page["writers"][1]["runs"][0]["offset"], 5 * PAGE_SZ);
+}
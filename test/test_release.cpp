@@ -0,0 +1,214 @@
+#include <pthread.h>
+
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/release.h"
+#include "gallocy/memory/transfer.h"
+#include "cluster.h"
+
+#define TEST_NODES 3
+#define TEST_REGION_PAGES 64
+
+
+uint16_t RELEASE_TEST_PORT = 26000;
+
+
+class LazyReleaseCoherenceTests:
+    public ClusterTest<gallocy::memory::LazyReleaseCoherence, TEST_NODES, TEST_REGION_PAGES> {
+ protected:
+  /**
+   * Three nodes in this process, each over its own region, with page ``p``'s
+   * home on node ``p % 3``.
+   */
+  LazyReleaseCoherenceTests() : ClusterTest(&RELEASE_TEST_PORT) {}
+};
+
+
+TEST_F(LazyReleaseCoherenceTests, WriteVisibleAfterAcquire) {
+  // PAGE 5's home is node 2.
+  ASSERT_EQ(read(0, 5), 0);
+  write(1, 5, 42);
+  ASSERT_EQ(coherence[1]->write_faults, 1);
+  ASSERT_EQ(read(2, 5), 0);
+  coherence[1]->release();
+  ASSERT_EQ(coherence[1]->intervals, 1);
+  ASSERT_EQ(coherence[1]->diff_messages, 1);
+  ASSERT_EQ(read(2, 5), 42);
+  // NODE 0 keeps its old copy until it acquires from node 1.
+  ASSERT_EQ(read(0, 5), 0);
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_EQ(coherence[0]->get_permissions(5), PAGE_PERM_NONE);
+  ASSERT_EQ(coherence[0]->pages_invalidated, 1);
+  ASSERT_EQ(read(0, 5), 42);
+  ASSERT_EQ(coherence[0]->read_faults, 1);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, ConcurrentWritersMerge) {
+  // PAGE 4's home is node 1, and nodes 0 and 2 write different bytes of it.
+  write(0, 4, 10, 0);
+  write(2, 4, 20, 100);
+  coherence[0]->release();
+  coherence[2]->release();
+  ASSERT_EQ(read(1, 4, 0), 10);
+  ASSERT_EQ(read(1, 4, 100), 20);
+  ASSERT_TRUE(coherence[0]->acquire_from(2));
+  ASSERT_EQ(read(0, 4, 0), 10);
+  ASSERT_EQ(read(0, 4, 100), 20);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, HomeSendsNoDiff) {
+  write(2, 2, 7);
+  coherence[2]->release();
+  ASSERT_EQ(coherence[2]->intervals, 1);
+  ASSERT_EQ(coherence[2]->diffs_sent, 0);
+  ASSERT_TRUE(coherence[0]->acquire_from(2));
+  ASSERT_EQ(read(0, 2), 7);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, DiffsBatchedPerHome) {
+  // PAGES 1, 4, ..., 28 all have node 1 as their home.
+  for (uint64_t page = 1; page < 30; page += 3)
+    write(0, page, 1);
+  coherence[0]->release();
+  ASSERT_EQ(coherence[0]->diffs_sent, 10);
+  ASSERT_EQ(coherence[0]->diff_messages, 1);
+  // A release with nothing written does nothing.
+  coherence[0]->release();
+  ASSERT_EQ(coherence[0]->intervals, 1);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, NoticesAreTransitive) {
+  write(1, 3, 9);
+  coherence[1]->release();
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  // NODE 2 learns of node 1's write from node 0.
+  ASSERT_EQ(read(2, 3), 0);
+  ASSERT_TRUE(coherence[2]->acquire_from(0));
+  ASSERT_EQ(read(2, 3), 9);
+  uint32_t clock[TEST_NODES];
+  coherence[2]->get_clock(clock);
+  ASSERT_EQ(clock[1], 1);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, NoticesCarriedByLock) {
+  uint8_t notices[256];
+  uint32_t clock[TEST_NODES];
+  bool more = true;
+  write(1, 8, 5);
+  coherence[1]->release();
+  coherence[0]->get_clock(clock);
+  size_t length = coherence[1]->encode_notices(0, clock, notices, sizeof(notices));
+  ASSERT_TRUE(coherence[0]->receive_notices(notices, length, &more));
+  ASSERT_FALSE(more);
+  // INVALIDATION waits for the acquire.
+  ASSERT_EQ(coherence[0]->get_permissions(8), PAGE_PERM_READ);
+  coherence[0]->acquire();
+  ASSERT_EQ(coherence[0]->get_permissions(8), PAGE_PERM_NONE);
+  ASSERT_EQ(read(0, 8), 5);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, SeenIntervalsTrimmed) {
+  write(1, 8, 5);
+  coherence[1]->release();
+  ASSERT_EQ(coherence[1]->get_metrics()["logged_intervals"], 1);
+  // THE interval is kept until every other node's clock says it was seen.
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_TRUE(coherence[2]->acquire_from(1));
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_EQ(coherence[1]->get_metrics()["logged_intervals"], 1);
+  ASSERT_TRUE(coherence[2]->acquire_from(1));
+  ASSERT_EQ(coherence[1]->get_metrics()["logged_intervals"], 0);
+  // LATER intervals still travel.
+  write(1, 8, 6);
+  coherence[1]->release();
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_EQ(read(0, 8), 6);
+  ASSERT_EQ(coherence[1]->get_metrics()["logged_intervals"], 1);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, AcquireReleasesOwnWritesFirst) {
+  write(0, 7, 1, 0);
+  write(2, 7, 2, 1);
+  coherence[2]->release();
+  ASSERT_TRUE(coherence[0]->acquire_from(2));
+  // NODE 0's own write went to the home before its copy was dropped.
+  ASSERT_EQ(coherence[0]->intervals, 1);
+  ASSERT_EQ(read(0, 7, 0), 1);
+  ASSERT_EQ(read(0, 7, 1), 2);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, InterceptedMutexReleases) {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  coherence[1]->intercept_synchronization();
+  pthread_mutex_lock(&mutex);
+  write(1, 5, 3);
+  ASSERT_EQ(coherence[1]->intervals, 0);
+  pthread_mutex_unlock(&mutex);
+  ASSERT_EQ(coherence[1]->intervals, 1);
+  ASSERT_EQ(read(2, 5), 3);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, OnlyChangedBlocksFetched) {
+  // PAGE 4's home is node 1, and is split into sixteen 256 byte blocks.
+  for (int i = 0; i < TEST_NODES; i++)
+    ASSERT_TRUE(coherence[i]->set_granularity(regions[i] + 4 * PAGE_SZ, PAGE_SZ, 256));
+  ASSERT_EQ(coherence[0]->get_granularity(4), 256);
+  write(0, 4, 10, 0);
+  write(2, 4, 20, 1024);
+  coherence[0]->release();
+  coherence[2]->release();
+  ASSERT_TRUE(coherence[0]->acquire_from(2));
+  ASSERT_EQ(read(0, 4, 1024), 20);
+  ASSERT_EQ(read(0, 4, 0), 10);
+  ASSERT_EQ(coherence[0]->blocks_fetched, 2);
+  ASSERT_EQ(coherence[0]->blocks_skipped, 14);
+  // THE home's own writes bump their blocks too.
+  write(1, 4, 30, 2048);
+  coherence[1]->release();
+  ASSERT_EQ(coherence[1]->diffs_sent, 0);
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_EQ(read(0, 4, 2048), 30);
+  ASSERT_EQ(read(0, 4, 1024), 20);
+  ASSERT_EQ(coherence[0]->blocks_fetched, 3);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, UnitFetchedTogether) {
+  // PAGES 8 to 11 are one 16 KiB unit, the third, whose home is node 2.
+  for (int i = 0; i < TEST_NODES; i++)
+    ASSERT_TRUE(coherence[i]->set_granularity(regions[i] + 8 * PAGE_SZ, 4 * PAGE_SZ, 4 * PAGE_SZ));
+  ASSERT_EQ(coherence[0]->get_home(8), 2);
+  ASSERT_EQ(coherence[0]->get_home(11), 2);
+  ASSERT_EQ(coherence[0]->get_home(12), 0);
+  write(1, 8, 1);
+  write(1, 9, 2);
+  coherence[1]->release();
+  ASSERT_EQ(coherence[1]->diff_messages, 1);
+  ASSERT_TRUE(coherence[0]->acquire_from(1));
+  ASSERT_EQ(read(0, 8), 1);
+  ASSERT_EQ(coherence[0]->read_faults, 1);
+  ASSERT_EQ(coherence[0]->get_permissions(9), PAGE_PERM_READ);
+  ASSERT_EQ(read(0, 9), 2);
+  ASSERT_EQ(coherence[0]->read_faults, 1);
+}
+
+
+TEST_F(LazyReleaseCoherenceTests, InvalidGranularity) {
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], PAGE_SZ, 48));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], PAGE_SZ, 32));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0] + 256, PAGE_SZ, 256));
+  ASSERT_FALSE(coherence[0]->set_granularity(regions[0], 256, 256));
+}
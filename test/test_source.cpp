@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/heaplayers/source.h"
+#include "gallocy/utils/constants.h"
+
+#define TEST_BACKING "/gallocy-test-source"
+
+
+typedef HL::SourceMmapHeap<PURPOSE_DEVELOPMENT_HEAP> TestSourceHeap;
+
+
+/**
+ * Hand every heap the same chunk, which is the second page of the zone.
+ */
+static bool same_chunk(void *arg, size_t sz, uint64_t *offset, size_t *length) {
+  *offset = PAGE_SZ;
+  *length = PAGE_SZ;
+  return true;
+}
+
+
+TEST(SourceTests, BackedZonesSharePages) {
+  // TWO heaps in one process stand in for two processes on one host.
+  static TestSourceHeap first, second;
+  ASSERT_TRUE(TestSourceHeap::set_backing(TEST_BACKING, PAGE_SZ));
+  char *first_private = reinterpret_cast<char *>(first.malloc(64));
+  char *second_private = reinterpret_cast<char *>(second.malloc(64));
+  ASSERT_NE(first.get_zone(), second.get_zone());
+  TestSourceHeap::set_chunk_source(same_chunk, nullptr);
+  char *first_shared = reinterpret_cast<char *>(first.malloc(64));
+  char *second_shared = reinterpret_cast<char *>(second.malloc(64));
+  ASSERT_EQ(first_shared - reinterpret_cast<char *>(first.get_zone()), PAGE_SZ);
+  ASSERT_EQ(second_shared - reinterpret_cast<char *>(second.get_zone()), PAGE_SZ);
+
+  // THE prefix is private to each heap, and the rest is shared.
+  memcpy(first_private, "first", sizeof("first"));
+  memcpy(second_private, "second", sizeof("second"));
+  ASSERT_STREQ(first_private, "first");
+  memcpy(first_shared, "shared", sizeof("shared"));
+  ASSERT_STREQ(second_shared, "shared");
+
+  TestSourceHeap::set_chunk_source(nullptr, nullptr);
+  TestSourceHeap::reset_backing();
+  munmap(first.get_zone(), ZONE_SZ);
+  munmap(second.get_zone(), ZONE_SZ);
+  shm_unlink(TEST_BACKING);
+}
+
+
+TEST(SourceTests, ResetBacking) {
+  static TestSourceHeap first, second;
+  ASSERT_TRUE(TestSourceHeap::set_backing(TEST_BACKING, PAGE_SZ));
+  TestSourceHeap::reset_backing();
+
+  // ZONES mapped after the backing is reset share nothing.
+  first.malloc(64);
+  second.malloc(64);
+  TestSourceHeap::set_chunk_source(same_chunk, nullptr);
+  char *first_shared = reinterpret_cast<char *>(first.malloc(64));
+  char *second_shared = reinterpret_cast<char *>(second.malloc(64));
+  memcpy(first_shared, "first", sizeof("first"));
+  memcpy(second_shared, "second", sizeof("second"));
+  ASSERT_STREQ(first_shared, "first");
+  ASSERT_STREQ(second_shared, "second");
+
+  TestSourceHeap::set_chunk_source(nullptr, nullptr);
+  munmap(first.get_zone(), ZONE_SZ);
+  munmap(second.get_zone(), ZONE_SZ);
+  shm_unlink(TEST_BACKING);
+}
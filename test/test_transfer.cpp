@@ -0,0 +1,235 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/common/peer.h"
+#include "gallocy/memory/transfer.h"
+
+#define TEST_REGION_PAGES 512
+
+
+uint16_t TRANSFER_TEST_PORT = 23000;
+
+
+class PageTransferTests: public ::testing::Test {
+ protected:
+  /**
+   * Start a server over one region and create a client over another.
+   */
+  virtual void SetUp() {
+    remote = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    local = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(remote, MAP_FAILED);
+    ASSERT_NE(local, MAP_FAILED);
+    for (uint64_t i = 0; i < TEST_REGION_PAGES; i++)
+      memset(remote + i * PAGE_SZ, i % 251 + 1, PAGE_SZ);
+    server = new gallocy::memory::PageTransferServer("127.0.0.1", TRANSFER_TEST_PORT, remote, TEST_REGION_PAGES);
+    server->start();
+    client = new gallocy::memory::PageTransferClient(gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT),
+                                                     local, TEST_REGION_PAGES, 4);
+  }
+
+  virtual void TearDown() {
+    delete client;
+    server->stop();
+    delete server;
+    munmap(remote, TEST_REGION_PAGES * PAGE_SZ);
+    munmap(local, TEST_REGION_PAGES * PAGE_SZ);
+    TRANSFER_TEST_PORT++;
+  }
+
+  bool same_page(uint64_t page) {
+    return memcmp(local + page * PAGE_SZ, remote + page * PAGE_SZ, PAGE_SZ) == 0;
+  }
+
+  uint8_t *remote;
+  uint8_t *local;
+  gallocy::memory::PageTransferServer *server;
+  gallocy::memory::PageTransferClient *client;
+};
+
+
+TEST(PageTransferRunTests, Coalesce) {
+  uint64_t pages[] = { 1, 2, 3, 3, 7, 9, 10 };
+  gallocy::memory::PageTransferRun runs[7];
+  ASSERT_EQ(gallocy::memory::page_transfer_runs(pages, 7, runs), 3);
+  ASSERT_EQ(runs[0].page, 1);
+  ASSERT_EQ(runs[0].count, 3);
+  ASSERT_EQ(runs[1].page, 7);
+  ASSERT_EQ(runs[1].count, 1);
+  ASSERT_EQ(runs[2].page, 9);
+  ASSERT_EQ(runs[2].count, 2);
+  ASSERT_EQ(gallocy::memory::page_transfer_runs(pages, 0, runs), 0);
+}
+
+
+TEST_F(PageTransferTests, FetchBatch) {
+  uint64_t pages[] = { 0, 1, 2, 5, 9, TEST_REGION_PAGES - 1 };
+  ASSERT_TRUE(client->fetch(pages, 6));
+  ASSERT_EQ(client->round_trips, 1);
+  ASSERT_EQ(client->pages_fetched, 6);
+  for (auto page : pages) {
+    ASSERT_TRUE(same_page(page));
+    ASSERT_TRUE(client->is_present(page));
+  }
+  ASSERT_FALSE(client->is_present(3));
+  ASSERT_FALSE(same_page(3));
+}
+
+
+TEST_F(PageTransferTests, FetchLargeBatch) {
+  uint64_t pages[TEST_REGION_PAGES];
+  for (uint64_t i = 0; i < TEST_REGION_PAGES; i++)
+    pages[i] = i;
+  ASSERT_TRUE(client->fetch(pages, TEST_REGION_PAGES));
+  ASSERT_EQ(client->round_trips, TEST_REGION_PAGES / PAGE_TRANSFER_MAX_PAGES);
+  ASSERT_EQ(memcmp(local, remote, TEST_REGION_PAGES * PAGE_SZ), 0);
+}
+
+
+TEST_F(PageTransferTests, FetchOutOfRange) {
+  uint64_t pages[] = { TEST_REGION_PAGES };
+  ASSERT_FALSE(client->fetch(pages, 1));
+  // The connection is still usable.
+  pages[0] = 0;
+  ASSERT_TRUE(client->fetch(pages, 1));
+  ASSERT_TRUE(same_page(0));
+}
+
+
+TEST_F(PageTransferTests, Push) {
+  uint64_t pages[] = { 3, 4, 100 };
+  for (auto page : pages)
+    memset(local + page * PAGE_SZ, 0xEE, PAGE_SZ);
+  ASSERT_TRUE(client->push(pages, 3));
+  ASSERT_EQ(client->round_trips, 1);
+  for (auto page : pages)
+    ASSERT_TRUE(same_page(page));
+  ASSERT_FALSE(same_page(5));
+}
+
+
+TEST_F(PageTransferTests, FaultPrefetchesWindow) {
+  ASSERT_TRUE(client->fault(10));
+  ASSERT_EQ(client->round_trips, 1);
+  ASSERT_EQ(client->pages_prefetched, 4);
+  for (uint64_t page = 10; page <= 14; page++)
+    ASSERT_TRUE(same_page(page));
+  ASSERT_FALSE(client->is_present(15));
+  // A page fetched by an earlier fault costs nothing.
+  ASSERT_TRUE(client->fault(12));
+  ASSERT_EQ(client->round_trips, 1);
+}
+
+
+TEST_F(PageTransferTests, FaultSkipsPresentNeighbours) {
+  client->set_present(20, true);
+  ASSERT_TRUE(client->fault(18));
+  ASSERT_EQ(client->pages_fetched, 4);
+  ASSERT_TRUE(same_page(21));
+  ASSERT_TRUE(same_page(22));
+  ASSERT_FALSE(same_page(20));
+}
+
+
+TEST_F(PageTransferTests, FaultWithoutPrefetch) {
+  client->set_prefetch_window(0);
+  ASSERT_TRUE(client->fault(TEST_REGION_PAGES - 1));
+  ASSERT_EQ(client->pages_fetched, 1);
+  ASSERT_TRUE(client->fault(0));
+  ASSERT_EQ(client->pages_fetched, 2);
+  ASSERT_FALSE(client->fault(TEST_REGION_PAGES));
+}
+
+
+TEST_F(PageTransferTests, StalledPeerDoesNotBlockServer) {
+  // A peer that sends part of a header and then stops only holds the server
+  // up until the request times out.
+  int stalled = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in name = gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT).get_socket();
+  ASSERT_EQ(connect(stalled, reinterpret_cast<struct sockaddr *>(&name), sizeof(name)), 0);
+  uint32_t magic = PAGE_TRANSFER_MAGIC;
+  ASSERT_EQ(write(stalled, &magic, sizeof(magic)), static_cast<ssize_t>(sizeof(magic)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  uint64_t pages[] = { 0 };
+  ASSERT_TRUE(client->fetch(pages, 1));
+  ASSERT_TRUE(same_page(0));
+  close(stalled);
+}
+
+
+TEST(PageTransferClientTests, RejectsReplyWithMorePages) {
+  uint8_t *local = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(local, MAP_FAILED);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int optval = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  struct sockaddr_in name = gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT).get_socket();
+  ASSERT_EQ(bind(listener, reinterpret_cast<struct sockaddr *>(&name), sizeof(name)), 0);
+  ASSERT_EQ(listen(listener, 1), 0);
+
+  // A peer that answers a FETCH of one page with a header claiming more.
+  std::thread peer([listener]() {
+    int connection = accept(listener, nullptr, nullptr);
+    gallocy::memory::PageTransferHeader header;
+    gallocy::memory::PageTransferRun run;
+    if (read(connection, &header, sizeof(header)) == sizeof(header)
+        && read(connection, &run, sizeof(run)) == sizeof(run)) {
+      header.page_count = PAGE_TRANSFER_MAX_PAGES;
+      header.run_count = PAGE_TRANSFER_MAX_RUNS;
+      uint8_t page[PAGE_SZ];
+      memset(page, 0xAB, PAGE_SZ);
+      write(connection, &header, sizeof(header));
+      write(connection, page, PAGE_SZ);
+      // WAIT for the client to give up on the connection.
+      while (read(connection, page, PAGE_SZ) > 0) {}
+    }
+    close(connection);
+  });
+
+  gallocy::memory::PageTransferClient client(gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT),
+                                             local, TEST_REGION_PAGES);
+  uint64_t pages[] = { 0 };
+  ASSERT_FALSE(client.fetch(pages, 1));
+  ASSERT_FALSE(client.is_present(0));
+  peer.join();
+  close(listener);
+  munmap(local, TEST_REGION_PAGES * PAGE_SZ);
+  TRANSFER_TEST_PORT++;
+}
+
+
+TEST(PageTransferClientTests, GivesUpOnSilentPeer) {
+  uint8_t *local = reinterpret_cast<uint8_t *>(mmap(nullptr, TEST_REGION_PAGES * PAGE_SZ, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(local, MAP_FAILED);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int optval = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  struct sockaddr_in name = gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT).get_socket();
+  ASSERT_EQ(bind(listener, reinterpret_cast<struct sockaddr *>(&name), sizeof(name)), 0);
+  ASSERT_EQ(listen(listener, 1), 0);
+
+  // A peer that takes the request but never replies fails it after the reply
+  // timeout, rather than hold the caller forever.
+  gallocy::memory::PageTransferClient client(gallocy::common::Peer("127.0.0.1", TRANSFER_TEST_PORT),
+                                             local, TEST_REGION_PAGES);
+  uint64_t pages[] = { 0 };
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(client.fetch(pages, 1));
+  auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  ASSERT_GE(waited.count(), PAGE_TRANSFER_REPLY_TIMEOUT_MS);
+  ASSERT_LT(waited.count(), 2 * PAGE_TRANSFER_REPLY_TIMEOUT_MS);
+  close(listener);
+  munmap(local, TEST_REGION_PAGES * PAGE_SZ);
+  TRANSFER_TEST_PORT++;
+}
@@ -1,6 +1,15 @@
+#include <fcntl.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
+#include "gallocy/http/client.h"
 #include "gallocy/http/transport.h"
+#include "gallocy/http/uring.h"
 
 
 int tcp_sock = -1;
@@ -123,3 +132,277 @@ TEST_F(TCPTransportTests, BigSendReceive) {
   close(client_sock);
   tcp_port++;
 }
+
+
+TEST(SendAllTests, PartialSends) {
+  int sockets[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+  int sndbuf = 4096;
+  setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  // EVERY buffer is much bigger than the socket's, so each is sent in parts.
+  gallocy::string head(1000, 'h');
+  gallocy::string empty;
+  gallocy::string body(1 << 20, 'b');
+  gallocy::string received;
+  std::thread reader([&received, &sockets]() {
+    char buf[8192];
+    ssize_t n;
+    while ((n = recv(sockets[1], buf, sizeof(buf), 0)) > 0)
+      received.append(buf, n);
+  });
+  struct iovec iov[3] = {
+    { const_cast<char *>(head.data()), head.length() },
+    { const_cast<char *>(empty.data()), empty.length() },
+    { const_cast<char *>(body.data()), body.length() },
+  };
+  ASSERT_TRUE(gallocy::http::send_all(sockets[0], iov, 3));
+  close(sockets[0]);
+  reader.join();
+  close(sockets[1]);
+  ASSERT_EQ(received, head + body);
+
+  // A closed peer fails the send, without a signal.
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  close(sockets[1]);
+  struct iovec one = { const_cast<char *>(head.data()), head.length() };
+  ASSERT_FALSE(gallocy::http::send_all(sockets[0], &one, 1));
+  close(sockets[0]);
+}
+
+
+TEST(SendAllTests, Timeout) {
+  int sockets[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+
+  // A receiver that never reads fails the send once the timeout passes.
+  gallocy::string body(1 << 22, 'b');
+  struct iovec one = { const_cast<char *>(body.data()), body.length() };
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(gallocy::http::send_all(sockets[0], &one, 1, 200));
+  ASSERT_EQ(errno, ETIMEDOUT);
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(2000));
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+
+uint16_t shm_port = 30000;
+
+class ShmTransportTests: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    listener = new gallocy::http::ShmListener("127.0.0.1", shm_port,
+      [](const gallocy::string &raw) { return "echo " + raw; });
+    ASSERT_TRUE(listener->is_open());
+    listener->start();
+  }
+
+  virtual void TearDown() {
+    listener->stop();
+    delete listener;
+    shm_port++;
+  }
+
+  gallocy::http::ShmListener *listener;
+};
+
+TEST_F(ShmTransportTests, SendReceive) {
+  gallocy::common::Peer peer("127.0.0.1", shm_port);
+  gallocy::http::ShmTransport shm(peer);
+  ASSERT_TRUE(shm.is_open());
+  shm.write("Best HTTP ever");
+  ASSERT_EQ(shm.read(), "echo Best HTTP ever");
+  ASSERT_FALSE(shm.failed);
+}
+
+TEST_F(ShmTransportTests, BigSendReceive) {
+  gallocy::common::Peer peer("127.0.0.1", shm_port);
+  gallocy::http::ShmTransport shm(peer);
+  // BOTH the request and its response are many times the size of a ring.
+  gallocy::string test_data(6 * SHM_RING_SZ + 7, 'a');
+  shm.write(test_data);
+  gallocy::string data = shm.read();
+  ASSERT_EQ(data.length(), test_data.length() + 5);
+  ASSERT_EQ(data, "echo " + test_data);
+}
+
+TEST_F(ShmTransportTests, ConcurrentClients) {
+  gallocy::common::Peer peer("127.0.0.1", shm_port);
+  std::vector<std::thread> threads;
+  std::vector<int> replies(SHM_CHANNELS / 2, 0);
+  for (uint64_t i = 0; i < replies.size(); i++) {
+    threads.push_back(std::thread([&peer, &replies, i]() {
+      for (int j = 0; j < 50; j++) {
+        gallocy::http::ShmTransport shm(peer);
+        gallocy::string test_data(i * 1000 + j, 'a' + i);
+        shm.write(test_data);
+        if (shm.read() == "echo " + test_data)
+          replies[i]++;
+      }
+    }));
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (auto reply : replies)
+    ASSERT_EQ(reply, 50);
+}
+
+TEST_F(ShmTransportTests, ChannelsAreReused) {
+  gallocy::common::Peer peer("127.0.0.1", shm_port);
+  // EVERY channel is returned once its response is read, even one whose
+  // request was never written.
+  for (int i = 0; i < 4 * SHM_CHANNELS; i++) {
+    gallocy::http::ShmTransport unused(peer);
+    ASSERT_TRUE(unused.is_open());
+    gallocy::http::ShmTransport shm(peer);
+    ASSERT_TRUE(shm.is_open());
+    shm.write("ping");
+    ASSERT_EQ(shm.read(), "echo ping");
+  }
+}
+
+TEST_F(ShmTransportTests, NoListener) {
+  gallocy::common::Peer peer("127.0.0.1", shm_port + 1000);
+  gallocy::http::ShmTransport shm(peer);
+  ASSERT_FALSE(shm.is_open());
+  ASSERT_EQ(shm.read(), "");
+}
+
+TEST(ShmClientTests, LocalPeer) {
+  uint16_t port = 31500;
+  gallocy::http::ShmListener listener("127.0.0.1", port, [](const gallocy::string &raw) {
+    gallocy::http::Request request(raw);
+    gallocy::string body = request.uri == "/admin" ? "GOOD" : "BAD";
+    return "HTTP/1.1 200 OK\r\nServer: Gallocy-Httpd\r\n\r\n" + body;
+  });
+  listener.start();
+  gallocy::http::Response *rsp = gallocy::http::ShmClient().request(
+    gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", port), "/admin"));
+  listener.stop();
+  ASSERT_EQ(rsp->status_code, 200);
+  ASSERT_EQ(rsp->body, "GOOD");
+  ASSERT_EQ(rsp->headers.get("Server"), "Gallocy-Httpd");
+  rsp->~Response();
+  internal_free(rsp);
+}
+
+TEST(ShmClientTests, EveryRequestSentPastMajority) {
+  uint16_t port = 31502;
+  std::atomic<int> served(0);
+  gallocy::http::ShmListener listener("127.0.0.1", port, [&served](const gallocy::string &raw) {
+    served++;
+    return gallocy::string("HTTP/1.1 200 OK\r\n\r\n");
+  });
+  listener.start();
+  gallocy::vector<gallocy::http::Request> requests;
+  for (int i = 0; i < 5; i++)
+    requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", port), "/admin"));
+
+  // A ROUND stops waiting once a majority succeeded, but still sends every
+  // peer its request, e.g., so that every follower hears a heartbeat.
+  uint64_t successes = gallocy::http::ShmClient().multirequest(requests,
+    [](const gallocy::http::Response &response) {
+      return response.status_code == 200;
+    }, nullptr, nullptr);
+  listener.stop();
+  ASSERT_EQ(successes, requests.size());
+  ASSERT_EQ(served.load(), 5);
+}
+
+
+TEST(ShmClientTests, RoundDeadline) {
+  uint16_t port = 31501;
+  gallocy::http::ShmListener listener("127.0.0.1", port, [](const gallocy::string &raw) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return gallocy::string("HTTP/1.1 500 Internal Server Error\r\n\r\n");
+  });
+  listener.start();
+  gallocy::vector<gallocy::http::Request> requests;
+  for (int i = 0; i < 10; i++)
+    requests.push_back(gallocy::http::Request("GET", gallocy::common::Peer("127.0.0.1", port), "/admin"));
+
+  // A ROUND that never gets a majority stops performing local requests once
+  // its time is up, rather than performing every one of them.
+  uint64_t performed = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint64_t successes = gallocy::http::ShmClient().multirequest(requests,
+    [&performed](const gallocy::http::Response &response) {
+      performed++;
+      return response.status_code == 200;
+    }, nullptr, nullptr);
+  std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+  listener.stop();
+  ASSERT_EQ(successes, static_cast<uint64_t>(0));
+  ASSERT_LT(performed, requests.size());
+  ASSERT_LT(elapsed, std::chrono::milliseconds(CLIENT_ROUND_MS + 500));
+}
+
+
+TEST(ShmClientTests, IsLocalAddress) {
+  ASSERT_TRUE(gallocy::http::is_local_address(gallocy::common::Peer("127.0.0.1", 0)));
+  ASSERT_TRUE(gallocy::http::is_local_address(gallocy::common::Peer("127.0.1.1", 0)));
+  ASSERT_FALSE(gallocy::http::is_local_address(gallocy::common::Peer("192.0.2.1", 0)));
+  ASSERT_FALSE(gallocy::http::is_local_address(gallocy::common::Peer("not an address", 0)));
+}
+
+TEST(UringTests, AcceptReceive) {
+  if (!gallocy::http::Uring::supported())
+    return;
+  gallocy::http::Uring uring;
+  ASSERT_TRUE(uring.is_open());
+
+  int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(21500);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(server_sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)), 0);
+  ASSERT_EQ(listen(server_sock, 5), 0);
+  uring.accept_multishot(server_sock, 1);
+
+  // ACCEPT two connections from the one submission.
+  int client_socks[2];
+  for (int i = 0; i < 2; i++) {
+    client_socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client_socks[i], reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)), 0);
+  }
+  std::vector<int> accepted;
+  while (accepted.size() < 2) {
+    ASSERT_GE(uring.submit_and_wait(1000), 0);
+    struct io_uring_cqe *cqe;
+    for (; (cqe = uring.peek()) != nullptr; uring.seen()) {
+      ASSERT_EQ(cqe->user_data, static_cast<uint64_t>(1));
+      ASSERT_GE(cqe->res, 0);
+      ASSERT_TRUE(cqe->flags & IORING_CQE_F_MORE);
+      accepted.push_back(cqe->res);
+    }
+  }
+
+  // RECEIVE into the ring's buffers.
+  uring.recv_multishot(accepted[0], 2);
+  ASSERT_EQ(write(client_socks[0], "hello", 5), 5);
+  gallocy::string received;
+  while (received.length() < 5) {
+    ASSERT_GE(uring.submit_and_wait(1000), 0);
+    struct io_uring_cqe *cqe;
+    for (; (cqe = uring.peek()) != nullptr; uring.seen()) {
+      ASSERT_EQ(cqe->user_data, static_cast<uint64_t>(2));
+      ASSERT_GT(cqe->res, 0);
+      received.append(uring.buffer(cqe), cqe->res);
+      uring.recycle(cqe);
+    }
+  }
+  ASSERT_EQ(received, "hello");
+
+  for (int i = 0; i < 2; i++) {
+    close(client_socks[i]);
+    close(accepted[i]);
+  }
+  close(server_sock);
+}
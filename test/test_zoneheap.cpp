@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+#include "gallocy/heaplayers/zoneheap.h"
+
+
+/**
+ * A heap that counts the arenas a ZoneHeap asks it for.
+ */
+class CountingHeap {
+ public:
+  CountingHeap() : mallocs(0), frees(0) {}
+
+  inline void *malloc(size_t sz) {
+    mallocs++;
+    return ::malloc(sz);
+  }
+
+  inline void free(void *ptr) {
+    frees++;
+    ::free(ptr);
+  }
+
+  inline void __reset() {}
+
+  int mallocs;
+  int frees;
+};
+
+
+TEST(ZoneHeapTests, OversizedArena) {
+  HL::ZoneHeap<CountingHeap, 64> heap;
+  char *big = reinterpret_cast<char *>(heap.malloc(256));
+  ASSERT_NE(big, (void *) NULL);
+  ASSERT_EQ(heap.mallocs, 1);
+  memset(big, 'A', 256);
+  // The oversized arena is full, so the next allocation needs a new arena
+  // rather than running off the end of this one.
+  char *small = reinterpret_cast<char *>(heap.malloc(32));
+  ASSERT_NE(small, (void *) NULL);
+  ASSERT_EQ(heap.mallocs, 2);
+  ASSERT_TRUE(small < big || small >= big + 256);
+}
+
+
+TEST(ZoneHeapTests, ArenaReuse) {
+  HL::ZoneHeap<CountingHeap, 64> heap;
+  char *first = reinterpret_cast<char *>(heap.malloc(16));
+  char *second = reinterpret_cast<char *>(heap.malloc(16));
+  ASSERT_EQ(heap.mallocs, 1);
+  ASSERT_EQ(second, first + 16);
+}
+
+
+TEST(ZoneHeapTests, ResetForgetsArenas) {
+  HL::ZoneHeap<CountingHeap, 64> heap;
+  heap.malloc(16);
+  heap.malloc(128);
+  ASSERT_EQ(heap.mallocs, 2);
+  heap.__reset();
+  ASSERT_EQ(heap.frees, 2);
+  // The freed arenas must not be reused or freed a second time.
+  void *ptr = heap.malloc(16);
+  ASSERT_NE(ptr, (void *) NULL);
+  ASSERT_EQ(heap.mallocs, 3);
+  heap.__reset();
+  ASSERT_EQ(heap.frees, 3);
+}
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""
+Load a gallocy server with many concurrent connections.
+
+Opens every connection at once, sends one request on each, and waits for all
+of the responses, for each of the given connection counts. Reports the
+requests served per second and the latency percentiles of each round.
+
+Both this process and the server need a file descriptor limit above the
+largest connection count, e.g., ``ulimit -n 65536``.
+
+  tools/bench_server.py --port 8080 --connections 1000 10000
+"""
+
+import argparse
+import resource
+import selectors
+import socket
+import time
+
+
+def run(host, port, uri, connections, timeout):
+  request = 'GET {0} HTTP/1.1\r\nHost: {1}:{2}\r\nConnection: close\r\n\r\n'.format(uri, host, port).encode()
+  selector = selectors.DefaultSelector()
+  started = {}
+  latencies = []
+  failures = 0
+
+  begin = time.time()
+  for _ in range(connections):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setblocking(False)
+    sock.connect_ex((host, port))
+    selector.register(sock, selectors.EVENT_WRITE, b'')
+
+  deadline = begin + timeout
+  pending = connections
+  while pending and time.time() < deadline:
+    for key, mask in selector.select(timeout=0.1):
+      sock = key.fileobj
+      if mask & selectors.EVENT_WRITE:
+        try:
+          sock.send(request)
+          started[sock] = time.time()
+          selector.modify(sock, selectors.EVENT_READ, b'')
+        except OSError:
+          failures += 1
+          pending -= 1
+          selector.unregister(sock)
+          sock.close()
+        continue
+      try:
+        chunk = sock.recv(65536)
+      except OSError:
+        chunk = b''
+        failures += 1
+      if chunk:
+        selector.modify(sock, selectors.EVENT_READ, key.data + chunk)
+        continue
+      # THE server closes the connection once the response is sent, as the
+      # request asked it not to keep it alive.
+      if key.data.startswith(b'HTTP/1.') and b' 200 ' in key.data.split(b'\r\n', 1)[0]:
+        latencies.append(time.time() - started[sock])
+      else:
+        failures += 1
+      pending -= 1
+      selector.unregister(sock)
+      sock.close()
+  elapsed = time.time() - begin
+
+  for key in list(selector.get_map().values()):
+    key.fileobj.close()
+  failures += pending
+  latencies.sort()
+
+  def percentile(p):
+    if not latencies:
+      return float('nan')
+    return latencies[min(len(latencies) - 1, int(p * len(latencies)))] * 1000
+
+  print('{0:>6} connections: {1:>6} ok, {2:>5} failed, {3:9.1f} req/s, '
+        'p50 {4:7.2f} ms, p99 {5:7.2f} ms, max {6:7.2f} ms'.format(
+          connections, len(latencies), failures, len(latencies) / elapsed,
+          percentile(0.5), percentile(0.99), percentile(1.0)))
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+  parser.add_argument('--host', default='127.0.0.1')
+  parser.add_argument('--port', type=int, default=8080)
+  parser.add_argument('--uri', default='/admin')
+  parser.add_argument('--connections', type=int, nargs='+', default=[1000, 10000])
+  parser.add_argument('--rounds', type=int, default=3)
+  parser.add_argument('--timeout', type=float, default=30.0)
+  args = parser.parse_args()
+
+  # RAISE our own descriptor limit as far as we are allowed.
+  soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+  wanted = max(args.connections) + 64
+  if soft < wanted:
+    resource.setrlimit(resource.RLIMIT_NOFILE, (min(wanted, hard), hard))
+
+  for connections in args.connections:
+    for _ in range(args.rounds):
+      run(args.host, args.port, args.uri, connections, args.timeout)
+
+
+if __name__ == '__main__':
+  main()